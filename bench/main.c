@@ -0,0 +1,1505 @@
+/* acidnes benchmarks.
+ *
+ *   cpu.nestest                nestest in automation mode, CPU alone
+ *   cpu.nestest.profiled       same, with the guest profiler charging every instruction and counting bus accesses
+ *   cpu.nestest.sampled        same, with the guest profiler sampling every 1000 cycles
+ *   cpu.nrom, cpu.uxrom, cpu.mmc1
+ *                              a loop that switches the $8000 bank every ~18 instructions. Bank switches only swap
+ *                              page pointers, UxROM and MMC1 should be within noise of NROM.
+ *   cpu.nrom.traced            cpu.nrom with a binary trace of every instruction
+ *   bus.get_u8, bus.set_u8     CPU bus decoding over a mix of RAM, RAM mirrors, PRG RAM and PRG ROM addresses
+ *   ram.gather, ram.gather.generic, ram.get_u8
+ *                              32 RAM addresses of 256 consoles into one buffer, with change masks: gather list with
+ *                              SIMD gathers when available, gather list with plain loads, one cpu_get_u8 per value
+ *   luma.84x84, luma.84x84.generic, luma.84x84.pool
+ *                              frames of palette indexes to 84x84 grey observations: SIMD kernel, plain loops, SIMD
+ *                              with max pooling over two frames
+ *   palette.<format>.<isa>     frames of palette indexes and emphasis to rgba, rgb565 and yuyv pixels, with each
+ *                              implementation the CPU supports: generic, sse41, avx2, avx512
+ *   ntsc.frame, ntsc.frame.threads
+ *                              NTSC filter at 602x480, on the calling thread, then on a pool of one thread per CPU
+ *   upscale.scale2x, upscale.scale3x, upscale.scale4x, upscale.hq2x, upscale.hq3x, upscale.hq4x, upscale.xbr2x,
+ *   upscale.xbr3x, upscale.xbr4x
+ *                              frames to 1920x1080 from 960x540, 640x360 and 480x270 ones, palette indexes for the
+ *                              Scale family and RGBA pixels for HQx and xBR, on a pool of one thread per CPU, and
+ *                              .generic: plain loops on one thread
+ *   png.frame.1, png.frame.6    frames of palette indexes to paletted PNGs in memory at zlib levels 1 and 6, one thread
+ *   png.sink                   frames submitted to a PNG sink writing files to /tmp, one encoding thread per CPU, up
+ *                              to the last one written
+ *   ppu.frame.nrom, ppu.frame.mmc5
+ *                              PPU alone, full screen of background and 64 sprites. MMC5 is in extended attribute
+ *                              mode, where every tile picks its own bank and palette.
+ *   ppu.frame.nrom.skipped     ppu.frame.nrom with rendering skipped, only sprite 0 hit and overflow computed
+ *   state.save, state.load     console save states of frame.demo
+ *   frame.demo                 whole console frames of a generated NMI driven demo (scrolling, sprite DMA)
+ *   frame.demo.frameskip4      same, drawing one frame in 4
+ *   frame.nestest              same for tests/nestest.nes from reset, sitting in its menu
+ *   frame.<rom>                same for each ROM given on the command line
+ *
+ * Every workload runs warmup repetitions, then timed ones. Rates (instructions/s, cycles/s, frames/s, ns/frame,
+ * ops/s, ns/op) are reported as mean, standard deviation, min, median and max over the timed repetitions, and
+ * written as JSON with -j. utils/bench_compare.py compares such a file with a baseline.
+ *
+ * -c pins the process to one CPU. A fixed integer loop is timed before and after every workload: if its speed varies
+ * during the run, the clock frequency moved (turbo, frequency scaling, thermal throttling) and the run is flagged
+ * as unstable, along with the turbo and governor settings when they can be read.
+ *
+ *   bench [-w warmup] [-r repetitions] [-f filter] [-c cpu] [-j file|-] [rom...]
+ *
+ * Build with -DCMAKE_BUILD_TYPE=Release for meaningful numbers. */
+#define _GNU_SOURCE
+
+#include <getopt.h>
+#include <math.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cpu.h"
+#include "cartridge.h"
+#include "luma.h"
+#include "mapper.h"
+#include "nes.h"
+#include "ntsc.h"
+#include "palette.h"
+#include "png.h"
+#include "ppu.h"
+#include "profiler.h"
+#include "ram_gather.h"
+#include "threadpool.h"
+#include "trace.h"
+#include "upscale.h"
+
+#define BENCH_DEFAULT_WARMUP 2
+#define BENCH_DEFAULT_REPS 10
+#define BENCH_MAX_REPS 100
+#define BENCH_MAX_RESULTS 64
+
+/* Clock stability: iterations of the calibration loop, and the spread of its timings above which a run is unstable */
+#define BENCH_CALIBRATION_LOOPS 1000000
+#define BENCH_CALIBRATION_RUNS 5
+#define BENCH_MAX_CLOCK_SPREAD 0.05
+
+/* Work done by one repetition of each workload */
+#define BENCH_NESTEST_RUNS 50
+#define BENCH_PROFILER_PERIOD 1000
+#define BENCH_LOOP_INSTRUCTIONS 2000000
+#define BENCH_BUS_ADDRESSES 4096
+#define BENCH_BUS_ROUNDS 256
+#define BENCH_GATHER_CONSOLES 256
+#define BENCH_GATHER_ADDRESSES 32
+#define BENCH_GATHER_ROUNDS 200
+#define BENCH_LUMA_SIZE 84
+#define BENCH_LUMA_FRAMES 200
+#define BENCH_PALETTE_FRAMES 200
+#define BENCH_NTSC_FRAMES 20
+#define BENCH_UPSCALE_FRAMES 50
+#define BENCH_UPSCALE_WIDTH 1920
+#define BENCH_UPSCALE_HEIGHT 1080
+#define BENCH_PNG_FRAMES 50
+#define BENCH_PPU_FRAMES 60
+#define BENCH_STATES 1000
+#define BENCH_FRAMES 60
+
+enum bench_metric {
+    METRIC_INSTRUCTIONS,
+    METRIC_CYCLES,
+    METRIC_FRAMES,
+    METRIC_FRAME_TIME,
+    METRIC_OPS,
+    METRIC_OP_TIME,
+    NB_METRICS
+};
+
+static const struct {
+    const char *name;
+    const char *unit;
+} METRICS[NB_METRICS] = {
+    {"instructions_per_s", "instr/s"},
+    {"cycles_per_s", "cycles/s"},
+    {"frames_per_s", "frames/s"},
+    {"ns_per_frame", "ns/frame"},
+    {"ops_per_s", "ops/s"},
+    {"ns_per_op", "ns/op"},
+};
+
+/* What one repetition did, the rates are derived from it */
+struct bench_counts_s {
+    uint64_t instructions;
+    uint64_t cycles;
+    uint64_t frames;
+    uint64_t ops;
+};
+typedef struct bench_counts_s bench_counts_t;
+
+typedef void (*bench_fn_t)(void *ctx, bench_counts_t *counts);
+
+struct bench_result_s {
+    char name[64];
+    uint32_t nb_samples;
+    bool has[NB_METRICS];
+    double samples[NB_METRICS][BENCH_MAX_REPS];
+};
+typedef struct bench_result_s bench_result_t;
+
+struct bench_stats_s {
+    double mean;
+    double stddev;
+    double min;
+    double median;
+    double max;
+};
+typedef struct bench_stats_s bench_stats_t;
+
+static uint32_t _warmup = BENCH_DEFAULT_WARMUP;
+static uint32_t _reps = BENCH_DEFAULT_REPS;
+static const char *_filter = NULL;
+/* Human readable results, on stderr when the JSON goes to stdout */
+static FILE *_out;
+static bench_result_t _results[BENCH_MAX_RESULTS];
+static uint32_t _nb_results = 0;
+
+static int _cpu = -1;
+static double _calibrations[BENCH_MAX_RESULTS * 2];
+static uint32_t _nb_calibrations = 0;
+
+/* Keeps the bus reads from being optimized out */
+static volatile uint8_t _sink;
+
+static void bench_measure(const char *name, bench_fn_t fn, void *ctx);
+static bool bench_selected(const char *name);
+static void bench_stats(const double *samples, uint32_t count, bench_stats_t *stats);
+static void bench_print(const bench_result_t *result);
+static bool bench_write_json(const char *file);
+static void bench_calibrate(void);
+static double bench_clock_spread(void);
+static void bench_read_setting(const char *file, char *buf, size_t size);
+
+static nes_t *bench_nes(const uint8_t *rom, size_t size);
+static void bench_nes_free(nes_t *nes);
+
+static void bench_cpu_nestest(void);
+static void bench_cpu_loops(void);
+static void bench_bus(void);
+static void bench_ram_gather(void);
+static void bench_luma(void);
+static void bench_palette(void);
+static void bench_ntsc(void);
+static void bench_upscale(void);
+static void bench_png(void);
+static void bench_ppu_frames(void);
+static void bench_states(void);
+static void bench_frames(const char *name, nes_t *nes);
+
+uint8_t *build_bench_rom(uint8_t mapper_type, uint8_t nb_16k_rom_banks, uint8_t inner_loops, size_t *size);
+uint8_t *build_demo_rom(size_t *size);
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-w warmup] [-r repetitions] [-f filter] [-c cpu] [-j file|-] [rom...]\n", name);
+}
+
+int main(int argc, char **argv) {
+    const char *json = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "w:r:f:c:j:h")) != -1) {
+        switch (opt) {
+            case 'w':
+                _warmup = (uint32_t) strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                _reps = (uint32_t) strtoul(optarg, NULL, 10);
+                break;
+            case 'f':
+                _filter = optarg;
+                break;
+            case 'c':
+                _cpu = atoi(optarg);
+                break;
+            case 'j':
+                json = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (_reps == 0 || _reps > BENCH_MAX_REPS) {
+        fprintf(stderr, "Repetitions must be between 1 and %d\n", BENCH_MAX_REPS);
+        return 1;
+    }
+
+    _out = json != NULL && strcmp(json, "-") == 0 ? stderr : stdout;
+
+    if (_cpu >= 0) {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(_cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+            perror("sched_setaffinity");
+            return 1;
+        }
+    }
+
+    bench_cpu_nestest();
+    bench_cpu_loops();
+    bench_bus();
+    bench_ram_gather();
+    bench_luma();
+    bench_palette();
+    bench_ntsc();
+    bench_upscale();
+    bench_png();
+    bench_ppu_frames();
+    bench_states();
+
+    {
+        uint8_t *rom;
+        size_t size;
+
+        nes_t *nes;
+
+        rom = build_demo_rom(&size);
+        bench_frames("frame.demo", bench_nes(rom, size));
+        nes = bench_nes(rom, size);
+        nes->frameskip = 4;
+        bench_frames("frame.demo.frameskip4", nes);
+        free(rom);
+    }
+
+    if (access("tests/nestest.nes", R_OK) == 0) {
+        cartridge_t *cart = cartridge_load("tests/nestest.nes");
+
+        bench_frames("frame.nestest", cart != NULL ? nes_init(cart) : NULL);
+    } else {
+        fprintf(stderr, "tests/nestest.nes not found, skipping frame.nestest\n");
+    }
+
+    for (int i = optind; i < argc; i++) {
+        const char *base = strrchr(argv[i], '/');
+        cartridge_t *cart = cartridge_load(argv[i]);
+        char name[64];
+
+        snprintf(name, sizeof(name), "frame.%s", base != NULL ? base + 1 : argv[i]);
+        for (char *c = name; *c != '\0'; c++) {
+            if (*c == '"' || *c == '\\' || (unsigned char) *c < 0x20) {
+                *c = '_';
+            }
+        }
+        bench_frames(name, cart != NULL ? nes_init(cart) : NULL);
+    }
+
+    if (bench_clock_spread() > BENCH_MAX_CLOCK_SPREAD) {
+        fprintf(stderr, "Unstable run: the CPU clock varied by %.1f%% (turbo or frequency scaling?)\n",
+                bench_clock_spread() * 100);
+    }
+
+    if (json != NULL && !bench_write_json(json)) {
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Runs the warmup and timed repetitions of a workload and records its rates */
+static void bench_measure(const char *name, bench_fn_t fn, void *ctx) {
+    bench_result_t *result;
+    bench_counts_t counts;
+    struct timespec start, end;
+    double elapsed;
+
+    if (_nb_results == BENCH_MAX_RESULTS) {
+        fprintf(stderr, "Too many results, skipping %s\n", name);
+        return;
+    }
+
+    result = &_results[_nb_results++];
+    memset(result, 0, sizeof(bench_result_t));
+    snprintf(result->name, sizeof(result->name), "%s", name);
+
+    bench_calibrate();
+
+    for (uint32_t i = 0; i < _warmup; i++) {
+        memset(&counts, 0, sizeof(counts));
+        fn(ctx, &counts);
+    }
+
+    for (uint32_t i = 0; i < _reps; i++) {
+        memset(&counts, 0, sizeof(counts));
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        fn(ctx, &counts);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        elapsed = (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+
+        result->has[METRIC_INSTRUCTIONS] = counts.instructions > 0;
+        result->has[METRIC_CYCLES] = counts.cycles > 0;
+        result->has[METRIC_FRAMES] = result->has[METRIC_FRAME_TIME] = counts.frames > 0;
+        result->has[METRIC_OPS] = result->has[METRIC_OP_TIME] = counts.ops > 0;
+
+        result->samples[METRIC_INSTRUCTIONS][i] = (double) counts.instructions / elapsed;
+        result->samples[METRIC_CYCLES][i] = (double) counts.cycles / elapsed;
+        result->samples[METRIC_FRAMES][i] = (double) counts.frames / elapsed;
+        result->samples[METRIC_FRAME_TIME][i] = counts.frames > 0 ? elapsed * 1e9 / (double) counts.frames : 0;
+        result->samples[METRIC_OPS][i] = (double) counts.ops / elapsed;
+        result->samples[METRIC_OP_TIME][i] = counts.ops > 0 ? elapsed * 1e9 / (double) counts.ops : 0;
+    }
+
+    result->nb_samples = _reps;
+
+    bench_calibrate();
+    bench_print(result);
+}
+
+static bool bench_selected(const char *name) {
+    return _filter == NULL || strstr(name, _filter) != NULL;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double da = *(const double *) a, db = *(const double *) b;
+
+    return (da > db) - (da < db);
+}
+
+static void bench_stats(const double *samples, uint32_t count, bench_stats_t *stats) {
+    double sorted[BENCH_MAX_REPS];
+    double sum = 0, squares = 0;
+
+    memcpy(sorted, samples, count * sizeof(double));
+    qsort(sorted, count, sizeof(double), compare_doubles);
+
+    for (uint32_t i = 0; i < count; i++) {
+        sum += sorted[i];
+    }
+    stats->mean = sum / count;
+
+    for (uint32_t i = 0; i < count; i++) {
+        squares += (sorted[i] - stats->mean) * (sorted[i] - stats->mean);
+    }
+    stats->stddev = count > 1 ? sqrt(squares / (count - 1)) : 0;
+
+    stats->min = sorted[0];
+    stats->max = sorted[count - 1];
+    stats->median = count % 2 ? sorted[count / 2] : (sorted[count / 2 - 1] + sorted[count / 2]) / 2;
+}
+
+/* Rates: 1234567 -> "1.23 M", times are left in ns */
+static const char *format_value(int metric, double value, char *buf, size_t size) {
+    static const char *prefixes[] = {"", "k", "M", "G"};
+    int p = 0;
+
+    if (metric == METRIC_FRAME_TIME || metric == METRIC_OP_TIME) {
+        snprintf(buf, size, "%.1f ", value);
+        return buf;
+    }
+
+    while (value >= 1000 && p < 3) {
+        value /= 1000;
+        p++;
+    }
+
+    snprintf(buf, size, "%.2f %s", value, prefixes[p]);
+
+    return buf;
+}
+
+static void bench_print(const bench_result_t *result) {
+    bench_stats_t stats;
+    char mean[24], min[24], max[24];
+
+    fprintf(_out, "%s\n", result->name);
+
+    for (int m = 0; m < NB_METRICS; m++) {
+        if (!result->has[m]) {
+            continue;
+        }
+
+        bench_stats(result->samples[m], result->nb_samples, &stats);
+
+        fprintf(_out, "  %-20s %10s%-8s +/- %5.1f%%  [%s .. %s]\n", METRICS[m].name, format_value(m, stats.mean, mean, sizeof(mean)),
+               METRICS[m].unit, stats.mean > 0 ? stats.stddev / stats.mean * 100 : 0,
+               format_value(m, stats.min, min, sizeof(min)), format_value(m, stats.max, max, sizeof(max)));
+    }
+
+    fflush(_out);
+}
+
+/* {"version": 1, "warmup": 2, "reps": 10, "environment": {...}, "results": [{"name": "cpu.nestest", "metrics": {"instructions_per_s":
+ *  {"unit": "instr/s", "mean": ..., "stddev": ..., "min": ..., "median": ..., "max": ..., "samples": [...]}}}]} */
+static bool bench_write_json(const char *file) {
+    FILE *fp = strcmp(file, "-") == 0 ? stdout : fopen(file, "w");
+    bench_stats_t stats;
+    char path[128], governor[32], no_turbo[32], boost[32];
+
+    if (fp == NULL) {
+        perror(file);
+        return FALSE;
+    }
+
+    bench_read_setting("/sys/devices/system/cpu/intel_pstate/no_turbo", no_turbo, sizeof(no_turbo));
+    bench_read_setting("/sys/devices/system/cpu/cpufreq/boost", boost, sizeof(boost));
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_governor", _cpu >= 0 ? _cpu : 0);
+    bench_read_setting(path, governor, sizeof(governor));
+
+    fprintf(fp, "{\n  \"version\": 1,\n  \"warmup\": %u,\n  \"reps\": %u,\n", _warmup, _reps);
+    fprintf(fp, "  \"environment\": {\"cpu\": %d, \"governor\": \"%s\", \"no_turbo\": \"%s\", \"boost\": \"%s\", "
+                "\"clock_spread\": %.4f, \"stable\": %s},\n", _cpu, governor, no_turbo, boost, bench_clock_spread(),
+            bench_clock_spread() > BENCH_MAX_CLOCK_SPREAD ? "false" : "true");
+    fprintf(fp, "  \"results\": [");
+
+    for (uint32_t r = 0; r < _nb_results; r++) {
+        const bench_result_t *result = &_results[r];
+        bool first = TRUE;
+
+        fprintf(fp, "%s\n    {\n      \"name\": \"%s\",\n      \"metrics\": {", r > 0 ? "," : "", result->name);
+
+        for (int m = 0; m < NB_METRICS; m++) {
+            if (!result->has[m]) {
+                continue;
+            }
+
+            bench_stats(result->samples[m], result->nb_samples, &stats);
+
+            fprintf(fp, "%s\n        \"%s\": {\"unit\": \"%s\", \"mean\": %.6g, \"stddev\": %.6g, \"min\": %.6g, "
+                        "\"median\": %.6g, \"max\": %.6g, \"samples\": [", first ? "" : ",", METRICS[m].name,
+                    METRICS[m].unit, stats.mean, stats.stddev, stats.min, stats.median, stats.max);
+
+            for (uint32_t i = 0; i < result->nb_samples; i++) {
+                fprintf(fp, "%s%.6g", i > 0 ? ", " : "", result->samples[m][i]);
+            }
+
+            fprintf(fp, "]}");
+            first = FALSE;
+        }
+
+        fprintf(fp, "\n      }\n    }");
+    }
+
+    fprintf(fp, "\n  ]\n}\n");
+
+    if (fp != stdout && fclose(fp) != 0) {
+        perror(file);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Times a loop of dependent integer operations, its speed only depends on the clock frequency. The best of a few
+ * runs is kept, so that being preempted doesn't look like a clock change. */
+static void bench_calibrate(void) {
+    struct timespec start, end;
+    double best = 0;
+    uint32_t x = 1;
+
+    if (_nb_calibrations == sizeof(_calibrations) / sizeof(_calibrations[0])) {
+        return;
+    }
+
+    for (int run = 0; run < BENCH_CALIBRATION_RUNS; run++) {
+        double elapsed;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for (int i = 0; i < BENCH_CALIBRATION_LOOPS; i++) {
+            x ^= x << 13u;
+            x ^= x >> 17u;
+            x ^= x << 5u;
+            __asm__ volatile("" : "+r"(x));
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        elapsed = (double) (end.tv_sec - start.tv_sec) * 1e9 + (double) (end.tv_nsec - start.tv_nsec);
+        best = run == 0 || elapsed < best ? elapsed : best;
+    }
+
+    _sink = (uint8_t) x;
+    _calibrations[_nb_calibrations++] = best;
+}
+
+/* (slowest - fastest) / fastest calibration */
+static double bench_clock_spread(void) {
+    double min, max;
+
+    if (_nb_calibrations == 0) {
+        return 0;
+    }
+
+    min = max = _calibrations[0];
+    for (uint32_t i = 1; i < _nb_calibrations; i++) {
+        min = _calibrations[i] < min ? _calibrations[i] : min;
+        max = _calibrations[i] > max ? _calibrations[i] : max;
+    }
+
+    return (max - min) / min;
+}
+
+/* First word of a sysfs file, "unknown" when it can't be read */
+static void bench_read_setting(const char *file, char *buf, size_t size) {
+    FILE *fp = fopen(file, "r");
+
+    snprintf(buf, size, "unknown");
+
+    if (fp != NULL) {
+        if (fscanf(fp, "%31s", buf) != 1) {
+            snprintf(buf, size, "unknown");
+        }
+        fclose(fp);
+    }
+}
+
+static nes_t *bench_nes(const uint8_t *rom, size_t size) {
+    cartridge_t *cart = cartridge_load_mem(rom, size);
+    nes_t *nes;
+
+    if (cart == NULL || (nes = nes_init(cart)) == NULL) {
+        exit(1);
+    }
+
+    return nes;
+}
+
+static void bench_nes_free(nes_t *nes) {
+    cartridge_t *cart = nes->cart;
+
+    nes_free(nes);
+    cartridge_free(cart);
+}
+
+/* CPU */
+static void run_nestest(void *ctx, bench_counts_t *counts) {
+    cpu_t *cpu = ctx;
+    uint64_t clock = cpu->clock;
+
+    for (int i = 0; i < BENCH_NESTEST_RUNS; i++) {
+        /* Automation mode: starts at $C000, returns to $0001 when done */
+        cpu->PC = 0xc000;
+        cpu->SP = 0xfd;
+        cpu->P = 0x24;
+
+        while (cpu->PC != 0x0001) {
+            cpu_tick(cpu);
+            counts->instructions++;
+        }
+    }
+
+    counts->cycles = cpu->clock - clock;
+}
+
+static void bench_cpu_nestest(void) {
+    static const struct {
+        const char *name;
+        bool profiled;
+        uint32_t period;
+    } variants[] = {
+        {"cpu.nestest", FALSE, 0},
+        {"cpu.nestest.profiled", TRUE, 0},
+        {"cpu.nestest.sampled", TRUE, BENCH_PROFILER_PERIOD},
+    };
+    cartridge_t *cart;
+    nes_t *nes;
+
+    if (!bench_selected("cpu.nestest")) {
+        return;
+    }
+
+    cart = cartridge_load("tests/nestest.nes");
+    if (cart == NULL || (nes = nes_init(cart)) == NULL) {
+        fprintf(stderr, "tests/nestest.nes not found, skipping cpu.nestest\n");
+        return;
+    }
+
+    for (size_t v = 0; v < sizeof(variants) / sizeof(variants[0]); v++) {
+        if (!bench_selected(variants[v].name)) {
+            continue;
+        }
+
+        if (variants[v].profiled) {
+            nes->cpu->profiler = profiler_init(variants[v].period, variants[v].period == 0 ? PROFILER_HEATMAP : 0);
+        }
+
+        bench_measure(variants[v].name, run_nestest, nes->cpu);
+
+        if (nes->cpu->profiler != NULL) {
+            profiler_free(nes->cpu->profiler);
+            nes->cpu->profiler = NULL;
+        }
+    }
+
+    bench_nes_free(nes);
+}
+
+static void run_loop(void *ctx, bench_counts_t *counts) {
+    cpu_t *cpu = ctx;
+    uint64_t clock = cpu->clock;
+
+    for (int i = 0; i < BENCH_LOOP_INSTRUCTIONS; i++) {
+        cpu_tick(cpu);
+    }
+
+    counts->instructions = BENCH_LOOP_INSTRUCTIONS;
+    counts->cycles = cpu->clock - clock;
+}
+
+static void bench_cpu_loops(void) {
+    static const struct {
+        const char *name;
+        uint8_t mapper_type;
+        uint8_t nb_16k_rom_banks;
+        bool traced;
+    } boards[] = {
+        {"cpu.nrom", 0, 2, FALSE},
+        {"cpu.uxrom", 2, 8, FALSE},
+        {"cpu.mmc1", 1, 8, FALSE},
+        {"cpu.nrom.traced", 0, 2, TRUE},
+    };
+
+    for (size_t b = 0; b < sizeof(boards) / sizeof(boards[0]); b++) {
+        uint8_t *rom;
+        size_t size;
+        nes_t *nes;
+
+        if (!bench_selected(boards[b].name)) {
+            continue;
+        }
+
+        rom = build_bench_rom(boards[b].mapper_type, boards[b].nb_16k_rom_banks, 2, &size);
+        nes = bench_nes(rom, size);
+        free(rom);
+
+        if (boards[b].traced) {
+            nes->cpu->trace = trace_open("bench.trace", FALSE);
+        }
+
+        bench_measure(boards[b].name, run_loop, nes->cpu);
+
+        if (boards[b].traced) {
+            trace_close(nes->cpu->trace);
+            nes->cpu->trace = NULL;
+            unlink("bench.trace");
+        }
+
+        bench_nes_free(nes);
+    }
+}
+
+/* Bus */
+struct bench_bus_s {
+    cpu_t *cpu;
+    uint16_t addrs[BENCH_BUS_ADDRESSES];
+};
+typedef struct bench_bus_s bench_bus_t;
+
+static void run_get_u8(void *ctx, bench_counts_t *counts) {
+    bench_bus_t *bus = ctx;
+    uint8_t sum = 0;
+
+    for (int r = 0; r < BENCH_BUS_ROUNDS; r++) {
+        for (int i = 0; i < BENCH_BUS_ADDRESSES; i++) {
+            sum = (uint8_t) (sum + cpu_get_u8(bus->cpu, bus->addrs[i]));
+        }
+    }
+
+    _sink = sum;
+    counts->ops = BENCH_BUS_ROUNDS * BENCH_BUS_ADDRESSES;
+}
+
+static void run_set_u8(void *ctx, bench_counts_t *counts) {
+    bench_bus_t *bus = ctx;
+
+    for (int r = 0; r < BENCH_BUS_ROUNDS; r++) {
+        for (int i = 0; i < BENCH_BUS_ADDRESSES; i++) {
+            cpu_set_u8(bus->cpu, bus->addrs[i], (uint8_t) (r + i));
+        }
+    }
+
+    counts->ops = BENCH_BUS_ROUNDS * BENCH_BUS_ADDRESSES;
+}
+
+/* NROM: PRG writes go nowhere, every access is pure decoding */
+static void bench_bus(void) {
+    bench_bus_t *bus;
+    uint8_t *rom;
+    size_t size;
+    nes_t *nes;
+    uint32_t seed = 1;
+
+    if (!bench_selected("bus.get_u8") && !bench_selected("bus.set_u8")) {
+        return;
+    }
+
+    rom = build_bench_rom(0, 2, 2, &size);
+    nes = bench_nes(rom, size);
+    free(rom);
+
+    bus = malloc(sizeof(bench_bus_t));
+    bus->cpu = nes->cpu;
+
+    /* Half RAM, 15% RAM mirrors, 10% PRG RAM, 25% PRG ROM */
+    for (int i = 0; i < BENCH_BUS_ADDRESSES; i++) {
+        uint32_t pick, offset;
+
+        seed = seed * 1103515245u + 12345u;
+        pick = (seed >> 16u) % 100;
+        offset = seed >> 8u;
+
+        if (pick < 50) {
+            bus->addrs[i] = (uint16_t) (offset & 0x07ffu);
+        } else if (pick < 65) {
+            bus->addrs[i] = (uint16_t) (0x0800 + offset % 0x1800);
+        } else if (pick < 75) {
+            bus->addrs[i] = (uint16_t) (0x6000 | (offset & 0x1fffu));
+        } else {
+            bus->addrs[i] = (uint16_t) (0x8000 | (offset & 0x7fffu));
+        }
+    }
+
+    if (bench_selected("bus.get_u8")) {
+        bench_measure("bus.get_u8", run_get_u8, bus);
+    }
+
+    if (bench_selected("bus.set_u8")) {
+        bench_measure("bus.set_u8", run_set_u8, bus);
+    }
+
+    free(bus);
+    bench_nes_free(nes);
+}
+
+/* RAM gathers */
+struct bench_gather_s {
+    cpu_t *cpus[BENCH_GATHER_CONSOLES];
+    const uint8_t *rams[BENCH_GATHER_CONSOLES];
+    uint16_t addrs[BENCH_GATHER_ADDRESSES];
+    ram_gather_t *gather;
+    uint8_t out[BENCH_GATHER_CONSOLES * BENCH_GATHER_ADDRESSES];
+    uint8_t changed[BENCH_GATHER_CONSOLES * BENCH_GATHER_ADDRESSES];
+};
+typedef struct bench_gather_s bench_gather_t;
+
+static void run_gather(void *ctx, bench_counts_t *counts) {
+    bench_gather_t *gather = ctx;
+
+    for (int r = 0; r < BENCH_GATHER_ROUNDS; r++) {
+        ram_gather_run(gather->gather, gather->rams, BENCH_GATHER_CONSOLES, gather->out, gather->changed);
+    }
+
+    counts->ops = BENCH_GATHER_ROUNDS * BENCH_GATHER_CONSOLES * BENCH_GATHER_ADDRESSES;
+}
+
+static void run_gather_generic(void *ctx, bench_counts_t *counts) {
+    bench_gather_t *gather = ctx;
+
+    for (int r = 0; r < BENCH_GATHER_ROUNDS; r++) {
+        ram_gather_run_generic(gather->gather, gather->rams, BENCH_GATHER_CONSOLES, gather->out, gather->changed);
+    }
+
+    counts->ops = BENCH_GATHER_ROUNDS * BENCH_GATHER_CONSOLES * BENCH_GATHER_ADDRESSES;
+}
+
+static void run_gather_get_u8(void *ctx, bench_counts_t *counts) {
+    bench_gather_t *gather = ctx;
+
+    for (int r = 0; r < BENCH_GATHER_ROUNDS; r++) {
+        for (int c = 0; c < BENCH_GATHER_CONSOLES; c++) {
+            for (int i = 0; i < BENCH_GATHER_ADDRESSES; i++) {
+                uint8_t *out = &gather->out[c * BENCH_GATHER_ADDRESSES + i];
+                uint8_t val = cpu_get_u8(gather->cpus[c], gather->addrs[i]);
+
+                gather->changed[c * BENCH_GATHER_ADDRESSES + i] = val != *out ? 0xff : 0x00;
+                *out = val;
+            }
+        }
+    }
+
+    counts->ops = BENCH_GATHER_ROUNDS * BENCH_GATHER_CONSOLES * BENCH_GATHER_ADDRESSES;
+}
+
+static void bench_ram_gather(void) {
+    bench_gather_t *gather;
+    uint32_t seed = 1;
+
+    if (!bench_selected("ram.gather") && !bench_selected("ram.gather.generic") && !bench_selected("ram.get_u8")) {
+        return;
+    }
+
+    gather = calloc(1, sizeof(bench_gather_t));
+
+    /* Scattered, as game variables are */
+    for (int i = 0; i < BENCH_GATHER_ADDRESSES; i++) {
+        seed = seed * 1103515245u + 12345u;
+        gather->addrs[i] = (uint16_t) ((seed >> 8u) & 0x07ffu);
+    }
+    gather->gather = ram_gather_init(gather->addrs, BENCH_GATHER_ADDRESSES);
+
+    for (int c = 0; c < BENCH_GATHER_CONSOLES; c++) {
+        gather->cpus[c] = cpu_init();
+        gather->rams[c] = gather->cpus[c]->ram;
+
+        for (int i = 0; i < 0x800; i++) {
+            seed = seed * 1103515245u + 12345u;
+            gather->cpus[c]->ram[i] = (uint8_t) (seed >> 16u);
+        }
+    }
+
+    if (bench_selected("ram.gather")) {
+        bench_measure("ram.gather", run_gather, gather);
+    }
+
+    if (bench_selected("ram.gather.generic")) {
+        bench_measure("ram.gather.generic", run_gather_generic, gather);
+    }
+
+    if (bench_selected("ram.get_u8")) {
+        bench_measure("ram.get_u8", run_gather_get_u8, gather);
+    }
+
+    for (int c = 0; c < BENCH_GATHER_CONSOLES; c++) {
+        cpu_free(gather->cpus[c]);
+    }
+    ram_gather_free(gather->gather);
+    free(gather);
+}
+
+/* Grey observations */
+struct bench_luma_s {
+    luma_t *luma;
+    uint8_t frames[2][PPU_WIDTH * PPU_HEIGHT];
+    uint8_t out[BENCH_LUMA_SIZE * BENCH_LUMA_SIZE];
+};
+typedef struct bench_luma_s bench_luma_t;
+
+static void run_luma(void *ctx, bench_counts_t *counts) {
+    bench_luma_t *luma = ctx;
+
+    for (int i = 0; i < BENCH_LUMA_FRAMES; i++) {
+        luma_run(luma->luma, luma->frames[i & 1], NULL, luma->out);
+    }
+
+    counts->frames = BENCH_LUMA_FRAMES;
+}
+
+static void run_luma_generic(void *ctx, bench_counts_t *counts) {
+    bench_luma_t *luma = ctx;
+
+    for (int i = 0; i < BENCH_LUMA_FRAMES; i++) {
+        luma_run_generic(luma->luma, luma->frames[i & 1], NULL, luma->out);
+    }
+
+    counts->frames = BENCH_LUMA_FRAMES;
+}
+
+static void run_luma_pool(void *ctx, bench_counts_t *counts) {
+    bench_luma_t *luma = ctx;
+
+    for (int i = 0; i < BENCH_LUMA_FRAMES; i++) {
+        luma_run(luma->luma, luma->frames[i & 1], luma->frames[(i + 1) & 1], luma->out);
+    }
+
+    counts->frames = BENCH_LUMA_FRAMES;
+}
+
+static void bench_luma(void) {
+    bench_luma_t *luma;
+    uint32_t seed = 0x1234;
+
+    if (!bench_selected("luma.84x84") && !bench_selected("luma.84x84.generic") && !bench_selected("luma.84x84.pool")) {
+        return;
+    }
+
+    luma = calloc(1, sizeof(bench_luma_t));
+    luma->luma = luma_init(BENCH_LUMA_SIZE, BENCH_LUMA_SIZE);
+    for (int f = 0; f < 2; f++) {
+        for (int i = 0; i < PPU_WIDTH * PPU_HEIGHT; i++) {
+            seed = seed * 1103515245 + 12345;
+            luma->frames[f][i] = (uint8_t) ((seed >> 16) & 0x3f);
+        }
+    }
+
+    if (bench_selected("luma.84x84")) {
+        bench_measure("luma.84x84", run_luma, luma);
+    }
+
+    if (bench_selected("luma.84x84.generic")) {
+        bench_measure("luma.84x84.generic", run_luma_generic, luma);
+    }
+
+    if (bench_selected("luma.84x84.pool")) {
+        bench_measure("luma.84x84.pool", run_luma_pool, luma);
+    }
+
+    luma_free(luma->luma);
+    free(luma);
+}
+
+/* Palette conversion */
+struct bench_palette_s {
+    palette_t *palette;
+    palette_isa_t isa;
+    uint8_t frame[PPU_WIDTH * PPU_HEIGHT];
+    uint8_t emphasis[PPU_HEIGHT];
+    uint8_t out[PPU_WIDTH * PPU_HEIGHT * 4];
+};
+typedef struct bench_palette_s bench_palette_t;
+
+static void run_palette(void *ctx, bench_counts_t *counts) {
+    bench_palette_t *palette = ctx;
+
+    for (int i = 0; i < BENCH_PALETTE_FRAMES; i++) {
+        palette_convert_isa(palette->palette, palette->isa, palette->frame, palette->emphasis, palette->out);
+    }
+
+    counts->frames = BENCH_PALETTE_FRAMES;
+}
+
+static void bench_palette(void) {
+    static const char *formats[] = {"rgba", "rgb565", "yuyv"};
+    static const char *isas[] = {"generic", "sse41", "avx2", "avx512"};
+    bench_palette_t *palette = calloc(1, sizeof(bench_palette_t));
+    uint32_t seed = 0x4321;
+
+    for (int i = 0; i < PPU_WIDTH * PPU_HEIGHT; i++) {
+        seed = seed * 1103515245 + 12345;
+        palette->frame[i] = (uint8_t) ((seed >> 16) & 0x3f);
+    }
+    for (int y = 0; y < PPU_HEIGHT; y++) {
+        palette->emphasis[y] = (uint8_t) (y / 30);
+    }
+
+    for (int f = PALETTE_RGBA; f <= PALETTE_YUYV; f++) {
+        for (int isa = PALETTE_GENERIC; isa <= PALETTE_AVX512; isa++) {
+            char name[64];
+
+            snprintf(name, sizeof(name), "palette.%s.%s", formats[f], isas[isa]);
+            if (!bench_selected(name) || !palette_isa_supported((palette_isa_t) isa)) {
+                continue;
+            }
+
+            palette->palette = palette_init((palette_format_t) f);
+            palette->isa = (palette_isa_t) isa;
+            bench_measure(name, run_palette, palette);
+            palette_free(palette->palette);
+        }
+    }
+
+    free(palette);
+}
+
+/* NTSC filter */
+struct bench_ntsc_s {
+    ntsc_t *ntsc;
+    threadpool_t *pool;
+    uint8_t frame[PPU_WIDTH * PPU_HEIGHT];
+    uint8_t out[NTSC_WIDTH * NTSC_HEIGHT * 4];
+};
+typedef struct bench_ntsc_s bench_ntsc_t;
+
+static void run_ntsc(void *ctx, bench_counts_t *counts) {
+    bench_ntsc_t *ntsc = ctx;
+
+    for (int i = 0; i < BENCH_NTSC_FRAMES; i++) {
+        ntsc_run(ntsc->ntsc, ntsc->pool, ntsc->frame, NULL, (uint32_t) i, ntsc->out);
+    }
+
+    counts->frames = BENCH_NTSC_FRAMES;
+}
+
+static void bench_ntsc(void) {
+    bench_ntsc_t *ntsc;
+    uint32_t seed = 0x2c02;
+
+    if (!bench_selected("ntsc.frame") && !bench_selected("ntsc.frame.threads")) {
+        return;
+    }
+
+    ntsc = calloc(1, sizeof(bench_ntsc_t));
+    ntsc->ntsc = ntsc_init();
+    for (int i = 0; i < PPU_WIDTH * PPU_HEIGHT; i++) {
+        seed = seed * 1103515245 + 12345;
+        ntsc->frame[i] = (uint8_t) ((seed >> 16) & 0x3f);
+    }
+
+    if (bench_selected("ntsc.frame")) {
+        bench_measure("ntsc.frame", run_ntsc, ntsc);
+    }
+
+    if (bench_selected("ntsc.frame.threads")) {
+        ntsc->pool = threadpool_init(0);
+        bench_measure("ntsc.frame.threads", run_ntsc, ntsc);
+        threadpool_free(ntsc->pool);
+    }
+
+    ntsc_free(ntsc->ntsc);
+    free(ntsc);
+}
+
+/* Upscalers */
+struct bench_upscale_s {
+    upscale_t *upscale;
+    threadpool_t *pool;
+    const uint8_t *src;
+    uint8_t frame[BENCH_UPSCALE_WIDTH / 2 * BENCH_UPSCALE_HEIGHT / 2];
+    uint32_t pixels[BENCH_UPSCALE_WIDTH / 2 * BENCH_UPSCALE_HEIGHT / 2];
+    uint32_t out[BENCH_UPSCALE_WIDTH * BENCH_UPSCALE_HEIGHT];
+    /* A converted frame starting with the 4 colors, for the RGBA of palette indexes 0 to 3 */
+    uint32_t colors[PPU_WIDTH * PPU_HEIGHT];
+};
+typedef struct bench_upscale_s bench_upscale_t;
+
+/* Areas of a few colors with edges between them, as drawn by games: most pixels repeat the one on their left or the
+ * one above. The same in RGBA. */
+static void bench_upscale_frame(bench_upscale_t *upscale, uint32_t width, uint32_t height) {
+    uint32_t seed = 0xa5a5;
+
+    for (size_t i = 0; i < (size_t) width * height; i++) {
+        seed = seed * 1103515245 + 12345;
+        if ((seed >> 16) % 8 == 0 || i == 0) {
+            upscale->frame[i] = (uint8_t) ((seed >> 20) % 4);
+        } else if (i >= width && ((seed >> 19) & 1 || i % width == 0)) {
+            upscale->frame[i] = upscale->frame[i - width];
+        } else {
+            upscale->frame[i] = upscale->frame[i - 1];
+        }
+        upscale->pixels[i] = upscale->colors[upscale->frame[i]];
+    }
+}
+
+static void run_upscale(void *ctx, bench_counts_t *counts) {
+    bench_upscale_t *upscale = ctx;
+
+    for (int i = 0; i < BENCH_UPSCALE_FRAMES; i++) {
+        upscale_run(upscale->upscale, upscale->pool, upscale->src, (uint8_t *) upscale->out);
+    }
+
+    counts->frames = BENCH_UPSCALE_FRAMES;
+}
+
+static void run_upscale_generic(void *ctx, bench_counts_t *counts) {
+    bench_upscale_t *upscale = ctx;
+
+    for (int i = 0; i < BENCH_UPSCALE_FRAMES; i++) {
+        upscale_run_generic(upscale->upscale, upscale->src, (uint8_t *) upscale->out);
+    }
+
+    counts->frames = BENCH_UPSCALE_FRAMES;
+}
+
+static void bench_upscale(void) {
+    static const char *names[] = {"upscale.scale2x", "upscale.scale3x", "upscale.scale4x", "upscale.hq2x",
+                                  "upscale.hq3x", "upscale.hq4x", "upscale.xbr2x", "upscale.xbr3x", "upscale.xbr4x"};
+    static const uint8_t colors[4] = {0x0f, 0x16, 0x21, 0x30};
+    static uint8_t indexes[PPU_WIDTH * PPU_HEIGHT], emphasis[PPU_HEIGHT];
+    bench_upscale_t *upscale = calloc(1, sizeof(bench_upscale_t));
+    palette_t *palette = palette_init(PALETTE_RGBA);
+
+    memcpy(indexes, colors, sizeof(colors));
+    palette_convert(palette, indexes, emphasis, (uint8_t *) upscale->colors);
+    palette_free(palette);
+    upscale->pool = threadpool_init(0);
+
+    for (upscale_filter_t filter = UPSCALE_SCALE2X; filter <= UPSCALE_XBR4X; filter++) {
+        uint32_t factor = upscale_factor(filter);
+        char name[64];
+
+        upscale->upscale = upscale_init(filter, BENCH_UPSCALE_WIDTH / factor, BENCH_UPSCALE_HEIGHT / factor);
+        bench_upscale_frame(upscale, BENCH_UPSCALE_WIDTH / factor, BENCH_UPSCALE_HEIGHT / factor);
+        upscale->src = upscale_pixel_size(filter) == 4 ? (const uint8_t *) upscale->pixels : upscale->frame;
+
+        if (bench_selected(names[filter])) {
+            bench_measure(names[filter], run_upscale, upscale);
+        }
+
+        snprintf(name, sizeof(name), "%s.generic", names[filter]);
+        if (bench_selected(name)) {
+            bench_measure(name, run_upscale_generic, upscale);
+        }
+
+        upscale_free(upscale->upscale);
+    }
+
+    threadpool_free(upscale->pool);
+    free(upscale);
+}
+
+/* PNG */
+struct bench_png_s {
+    int level;
+    png_sink_t *sink;
+    uint8_t frame[PPU_WIDTH * PPU_HEIGHT];
+    uint8_t *png;
+};
+typedef struct bench_png_s bench_png_t;
+
+static void run_png_frame(void *ctx, bench_counts_t *counts) {
+    bench_png_t *png = ctx;
+
+    for (int i = 0; i < BENCH_PNG_FRAMES; i++) {
+        _sink = (uint8_t) png_encode(png->frame, NULL, PPU_WIDTH, PPU_HEIGHT, png->level, png->png);
+    }
+
+    counts->frames = BENCH_PNG_FRAMES;
+}
+
+static void run_png_sink(void *ctx, bench_counts_t *counts) {
+    bench_png_t *png = ctx;
+
+    for (int i = 0; i < BENCH_PNG_FRAMES; i++) {
+        png_sink_submit(png->sink, png->frame, NULL);
+    }
+    png_sink_flush(png->sink);
+
+    counts->frames = BENCH_PNG_FRAMES;
+}
+
+static void bench_png(void) {
+    char dir[] = "/tmp/acidnes-bench-png-XXXXXX";
+    char pattern[64];
+    bench_png_t *png = calloc(1, sizeof(bench_png_t));
+    uint32_t seed = 0x5eed;
+
+    /* Areas of a few colors along each line */
+    for (int i = 0; i < PPU_WIDTH * PPU_HEIGHT; i++) {
+        seed = seed * 1103515245 + 12345;
+        png->frame[i] = (seed >> 16) % 8 == 0 ? (uint8_t) ((seed >> 20) % 4) : png->frame[i > 0 ? i - 1 : 0];
+    }
+    png->png = malloc(png_bound(PPU_WIDTH, PPU_HEIGHT));
+
+    png->level = 1;
+    if (bench_selected("png.frame.1")) {
+        bench_measure("png.frame.1", run_png_frame, png);
+    }
+
+    png->level = 6;
+    if (bench_selected("png.frame.6")) {
+        bench_measure("png.frame.6", run_png_frame, png);
+    }
+
+    if (bench_selected("png.sink") && mkdtemp(dir) != NULL) {
+        snprintf(pattern, sizeof(pattern), "%s/%%u.png", dir);
+        png->sink = png_sink_open(pattern, PPU_WIDTH, PPU_HEIGHT, 1, 0, 0);
+
+        if (png->sink != NULL) {
+            uint32_t written;
+
+            bench_measure("png.sink", run_png_sink, png);
+
+            written = png->sink->next_number;
+            png_sink_close(png->sink);
+            for (uint32_t i = 0; i < written; i++) {
+                char file[96];
+
+                snprintf(file, sizeof(file), "%s/%u.png", dir, i);
+                unlink(file);
+            }
+        }
+        rmdir(dir);
+    }
+
+    free(png->png);
+    free(png);
+}
+
+/* PPU */
+static void run_ppu_frames(void *ctx, bench_counts_t *counts) {
+    ppu_t *ppu = ctx;
+
+    for (int i = 0; i < BENCH_PPU_FRAMES * PPU_DOTS_PER_FRAME; i++) {
+        ppu_tick(ppu);
+    }
+
+    counts->frames = BENCH_PPU_FRAMES;
+}
+
+static void bench_ppu_frames(void) {
+    static const struct {
+        const char *name;
+        uint8_t mapper_type;
+        bool skip_render;
+    } boards[] = {
+        {"ppu.frame.nrom", 0, FALSE},
+        {"ppu.frame.nrom.skipped", 0, TRUE},
+        {"ppu.frame.mmc5", 5, FALSE},
+    };
+
+    for (size_t b = 0; b < sizeof(boards) / sizeof(boards[0]); b++) {
+        uint8_t *rom;
+        size_t size;
+        nes_t *nes;
+        ppu_t *ppu;
+        mapper_t *mapper;
+
+        if (!bench_selected(boards[b].name)) {
+            continue;
+        }
+
+        rom = build_bench_rom(boards[b].mapper_type, 2, 2, &size);
+        nes = bench_nes(rom, size);
+        free(rom);
+
+        ppu = nes->ppu;
+        mapper = nes->mapper;
+
+        for (int i = 0; i < 0x800; i++) {
+            ppu->ram[i] = (uint8_t) (i * 7);
+        }
+        for (int i = 0; i < 0x100; i++) {
+            ppu->oam[i] = (uint8_t) (i * 13);
+        }
+
+        if (boards[b].mapper_type == 5) {
+            mapper->write(mapper, 0x5104, 1);
+            for (uint16_t i = 0; i < 0x400; i++) {
+                mapper->write(mapper, (uint16_t) (0x5c00 + i), (uint8_t) i);
+            }
+        }
+
+        ppu_set_u8(ppu, 0x2001, 0x1e);
+        ppu->skip_render = boards[b].skip_render;
+
+        bench_measure(boards[b].name, run_ppu_frames, ppu);
+
+        bench_nes_free(nes);
+    }
+}
+
+/* Save states */
+struct bench_state_s {
+    nes_t *nes;
+    uint8_t *buf;
+    size_t size;
+};
+typedef struct bench_state_s bench_state_t;
+
+static void run_save(void *ctx, bench_counts_t *counts) {
+    bench_state_t *state = ctx;
+
+    for (int i = 0; i < BENCH_STATES; i++) {
+        nes_save_state(state->nes, state->buf);
+    }
+
+    counts->ops = BENCH_STATES;
+}
+
+static void run_load(void *ctx, bench_counts_t *counts) {
+    bench_state_t *state = ctx;
+
+    for (int i = 0; i < BENCH_STATES; i++) {
+        if (!nes_load_state(state->nes, state->buf, state->size)) {
+            fprintf(stderr, "Unable to load state\n");
+            exit(1);
+        }
+    }
+
+    counts->ops = BENCH_STATES;
+}
+
+static void bench_states(void) {
+    bench_state_t state;
+    uint8_t *rom;
+    size_t size;
+
+    if (!bench_selected("state.save") && !bench_selected("state.load")) {
+        return;
+    }
+
+    rom = build_demo_rom(&size);
+    state.nes = bench_nes(rom, size);
+    free(rom);
+
+    for (int i = 0; i < BENCH_FRAMES; i++) {
+        nes_step_frame(state.nes);
+    }
+
+    state.size = nes_state_size(state.nes);
+    state.buf = malloc(state.size);
+    nes_save_state(state.nes, state.buf);
+
+    if (bench_selected("state.save")) {
+        bench_measure("state.save", run_save, &state);
+    }
+
+    if (bench_selected("state.load")) {
+        bench_measure("state.load", run_load, &state);
+    }
+
+    free(state.buf);
+    bench_nes_free(state.nes);
+}
+
+/* Whole console frames */
+static void run_frames(void *ctx, bench_counts_t *counts) {
+    nes_t *nes = ctx;
+    uint64_t clock = nes->cpu->clock;
+
+    for (int i = 0; i < BENCH_FRAMES; i++) {
+        counts->instructions += nes_step_frame(nes);
+    }
+
+    counts->cycles = nes->cpu->clock - clock;
+    counts->frames = BENCH_FRAMES;
+}
+
+/* Takes ownership of nes */
+static void bench_frames(const char *name, nes_t *nes) {
+    if (nes == NULL) {
+        fprintf(stderr, "Unable to start %s\n", name);
+        return;
+    }
+
+    if (bench_selected(name)) {
+        bench_measure(name, run_frames, nes);
+    }
+
+    bench_nes_free(nes);
+}
+
+/* Every 16K bank starts with the routine, the last one (fixed at $C000) also holds the main loop and the vectors:
+ *
+ *   C020  LDX #$00            8000  LDY #inner_loops
+ *   C022  TXA                 8002  LDA $8100,Y
+ *         AND #$07                  ADC $00
+ *         <switch bank A>           STA $00
+ *         JSR $8000                 DEY
+ *         INX                       BNE $8002
+ *         JMP $C022                 RTS
+ */
+uint8_t *build_bench_rom(uint8_t mapper_type, uint8_t nb_16k_rom_banks, uint8_t inner_loops, size_t *size) {
+    const uint8_t routine[] = {
+        0xa0, inner_loops, 0xb9, 0x00, 0x81, 0x65, 0x00, 0x85, 0x00, 0x88, 0xd0, 0xf6, 0x60
+    };
+    uint8_t *rom, *prg, *code;
+
+    *size = 16 + nb_16k_rom_banks * 0x4000 + 0x2000;
+    rom = calloc(*size, 1);
+
+    memcpy(rom, "NES\x1a", 4);
+    rom[4] = nb_16k_rom_banks;
+    rom[5] = 1;
+    rom[6] = (uint8_t) (mapper_type << 4u);
+    rom[7] = mapper_type & 0xf0u;
+
+    prg = rom + 16;
+    for (int bank = 0; bank < nb_16k_rom_banks; bank++) {
+        memcpy(prg + bank * 0x4000, routine, sizeof(routine));
+    }
+
+    code = prg + (nb_16k_rom_banks - 1) * 0x4000 + 0x20;
+
+    code[0] = 0xa2; code[1] = 0x00;                  /* LDX #$00 */
+    code[2] = 0x8a;                                  /* TXA */
+    code[3] = 0x29; code[4] = 0x07;                  /* AND #$07 */
+    code += 5;
+
+    if (mapper_type == 1) {
+        /* MMC1: five writes to the PRG bank register, one bit at a time */
+        for (int i = 0; i < 5; i++) {
+            *code++ = 0x8d; *code++ = 0x00; *code++ = 0xe0;      /* STA $E000 */
+            if (i < 4) {
+                *code++ = 0x4a;                                  /* LSR A */
+            }
+        }
+    } else {
+        /* NROM ignores the write, UxROM switches */
+        *code++ = 0x8d; *code++ = 0x00; *code++ = 0x80;          /* STA $8000 */
+    }
+
+    *code++ = 0x20; *code++ = 0x00; *code++ = 0x80;              /* JSR $8000 */
+    *code++ = 0xe8;                                              /* INX */
+    *code++ = 0x4c; *code++ = 0x22; *code++ = 0xc0;              /* JMP $C022 */
+
+    /* Reset vector: $C020 */
+    prg[nb_16k_rom_banks * 0x4000 - 4] = 0x20;
+    prg[nb_16k_rom_banks * 0x4000 - 3] = 0xc0;
+
+    return rom;
+}
+
+/* NROM-128 demo: fills the first nametable, the palette and 64 sprites, enables NMI and rendering, then loops on
+ * busy work. The NMI handler does the sprite DMA and scrolls diagonally. */
+uint8_t *build_demo_rom(size_t *size) {
+    static const uint8_t code[] = {
+        0x78,                   /* C000  SEI */
+        0xd8,                   /* C001  CLD */
+        0xa2, 0xff,             /* C002  LDX #$FF */
+        0x9a,                   /* C004  TXS */
+        0x2c, 0x02, 0x20,       /* C005  BIT $2002 */
+        0x10, 0xfb,             /* C008  BPL $C005 */
+        0x2c, 0x02, 0x20,       /* C00A  BIT $2002 */
+        0x10, 0xfb,             /* C00D  BPL $C00A */
+        0xa9, 0x20,             /* C00F  LDA #$20 */
+        0x8d, 0x06, 0x20,       /* C011  STA $2006 */
+        0xa9, 0x00,             /* C014  LDA #$00 */
+        0x8d, 0x06, 0x20,       /* C016  STA $2006 */
+        0xa0, 0x04,             /* C019  LDY #$04 */
+        0xa2, 0x00,             /* C01B  LDX #$00 */
+        0x8a,                   /* C01D  TXA */
+        0x8d, 0x07, 0x20,       /* C01E  STA $2007 */
+        0xe8,                   /* C021  INX */
+        0xd0, 0xf9,             /* C022  BNE $C01D */
+        0x88,                   /* C024  DEY */
+        0xd0, 0xf6,             /* C025  BNE $C01D */
+        0xa9, 0x3f,             /* C027  LDA #$3F */
+        0x8d, 0x06, 0x20,       /* C029  STA $2006 */
+        0xa9, 0x00,             /* C02C  LDA #$00 */
+        0x8d, 0x06, 0x20,       /* C02E  STA $2006 */
+        0xa2, 0x00,             /* C031  LDX #$00 */
+        0x8a,                   /* C033  TXA */
+        0x8d, 0x07, 0x20,       /* C034  STA $2007 */
+        0xe8,                   /* C037  INX */
+        0xe0, 0x20,             /* C038  CPX #$20 */
+        0xd0, 0xf7,             /* C03A  BNE $C033 */
+        0xa2, 0x00,             /* C03C  LDX #$00 */
+        0x8a,                   /* C03E  TXA */
+        0x9d, 0x00, 0x02,       /* C03F  STA $0200,X */
+        0xe8,                   /* C042  INX */
+        0xd0, 0xf9,             /* C043  BNE $C03E */
+        0xa9, 0x80,             /* C045  LDA #$80 */
+        0x8d, 0x00, 0x20,       /* C047  STA $2000 */
+        0xa9, 0x1e,             /* C04A  LDA #$1E */
+        0x8d, 0x01, 0x20,       /* C04C  STA $2001 */
+        0xe6, 0x10,             /* C04F  INC $10 */
+        0xa5, 0x10,             /* C051  LDA $10 */
+        0x65, 0x11,             /* C053  ADC $11 */
+        0x85, 0x11,             /* C055  STA $11 */
+        0x4c, 0x4f, 0xc0,       /* C057  JMP $C04F */
+        0x48,                   /* C05A  PHA (NMI) */
+        0xa9, 0x02,             /* C05B  LDA #$02 */
+        0x8d, 0x14, 0x40,       /* C05D  STA $4014 */
+        0xe6, 0x20,             /* C060  INC $20 */
+        0xa5, 0x20,             /* C062  LDA $20 */
+        0x8d, 0x05, 0x20,       /* C064  STA $2005 */
+        0x8d, 0x05, 0x20,       /* C067  STA $2005 */
+        0x68,                   /* C06A  PLA */
+        0x40,                   /* C06B  RTI (IRQ) */
+    };
+    uint8_t *rom, *prg, *chr;
+
+    *size = 16 + 0x4000 + 0x2000;
+    rom = calloc(*size, 1);
+
+    memcpy(rom, "NES\x1a", 4);
+    rom[4] = 1;
+    rom[5] = 1;
+
+    prg = rom + 16;
+    memcpy(prg, code, sizeof(code));
+
+    /* NMI $C05A, reset $C000, IRQ $C06B */
+    prg[0x3ffa] = 0x5a; prg[0x3ffb] = 0xc0;
+    prg[0x3ffc] = 0x00; prg[0x3ffd] = 0xc0;
+    prg[0x3ffe] = 0x6b; prg[0x3fff] = 0xc0;
+
+    chr = prg + 0x4000;
+    for (int i = 0; i < 0x2000; i++) {
+        chr[i] = (uint8_t) ((i * 37) ^ (i >> 3));
+    }
+
+    return rom;
+}
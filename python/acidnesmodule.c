@@ -0,0 +1,505 @@
+/* Python binding: a batch of consoles stepped together, for reinforcement learning.
+ *
+ *   env = acidnes.VecEnv(rom_bytes, 256, threads=0, frameskip=4)
+ *   frames, ram = env.step(actions)    # actions: 256 bytes, one controller 1 byte per console
+ *
+ * frames is a uint8 [N, 240, 256] array of palette indexes, or [N, height, width] of grey levels with
+ * obs_size=(width, height), max_pool=True pooling the last two frames of each step, and ram a uint8 [N, 2048] array.
+ * They are read only views
+ * on the buffers the env writes to, NumPy arrays when NumPy can be imported, memoryviews otherwise. Every call returns the
+ * same two objects, updated in place: copy them to keep an observation past the next step.
+ *
+ * The batch buffers are allocated first and each console is given its slice of them as framebuffer and RAM (see
+ * acidnes_set_buffers): the consoles run straight into the arrays, nothing is copied after a step. Grey levels are
+ * computed into the frames slice of each console once it is done, from the full frame the console keeps.
+ *
+ * step releases the GIL and runs the consoles on a thread pool.
+ *
+ * A console the emulator can't run further (an invalid opcode, a register it doesn't have) stops there, the others
+ * carry on: step raises RuntimeError naming it, until reset starts them all over. */
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include "acidnes.h"
+#include "threadpool.h"
+
+#define VECENV_MAX_FRAMESKIP 64
+
+/* Read only array of bytes, exporting the buffer protocol with a shape. It owns its memory: views on it keep it
+ * alive, the env that writes to it included. */
+struct batch_buffer_s {
+    PyObject_HEAD
+    uint8_t *data;
+    int ndim;
+    Py_ssize_t shape[3];
+    Py_ssize_t strides[3];
+};
+typedef struct batch_buffer_s batch_buffer_t;
+
+struct vecenv_s {
+    PyObject_HEAD
+    acidnes_t **consoles;
+    Py_ssize_t nb_consoles;
+    uint32_t frameskip;
+    threadpool_t *pool;
+    /* Grey observations, NULL for full frames */
+    acidnes_luma_t *luma;
+    size_t frame_size;
+    bool busy;
+
+    /* Data of the buffers the observation views, the consoles' own framebuffers and RAM */
+    uint8_t *frames;
+    uint8_t *ram;
+    PyObject *observation;
+
+    /* Current step */
+    const uint8_t *actions;
+};
+typedef struct vecenv_s vecenv_t;
+
+static PyTypeObject BatchBufferType;
+static PyTypeObject VecEnvType;
+
+/* Buffer */
+static batch_buffer_t *batch_buffer_new(int ndim, const Py_ssize_t *shape) {
+    batch_buffer_t *buffer = PyObject_New(batch_buffer_t, &BatchBufferType);
+    Py_ssize_t stride = 1;
+
+    if (buffer == NULL) {
+        return NULL;
+    }
+
+    buffer->ndim = ndim;
+    for (int i = ndim - 1; i >= 0; i--) {
+        buffer->shape[i] = shape[i];
+        buffer->strides[i] = stride;
+        stride *= shape[i];
+    }
+
+    buffer->data = PyMem_Calloc((size_t) stride, 1);
+    if (buffer->data == NULL) {
+        Py_DECREF(buffer);
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    return buffer;
+}
+
+static void batch_buffer_dealloc(batch_buffer_t *buffer) {
+    PyMem_Free(buffer->data);
+    PyObject_Free(buffer);
+}
+
+static int batch_buffer_get(batch_buffer_t *buffer, Py_buffer *view, int flags) {
+    Py_ssize_t len = buffer->strides[0] * buffer->shape[0];
+
+    if ((flags & PyBUF_WRITABLE) == PyBUF_WRITABLE) {
+        PyErr_SetString(PyExc_BufferError, "observations are read only");
+        return -1;
+    }
+
+    view->obj = (PyObject *) buffer;
+    Py_INCREF(buffer);
+    view->buf = buffer->data;
+    view->len = len;
+    view->readonly = 1;
+    view->itemsize = 1;
+    view->format = (flags & PyBUF_FORMAT) ? "B" : NULL;
+    view->ndim = buffer->ndim;
+    view->shape = (flags & PyBUF_ND) == PyBUF_ND ? buffer->shape : NULL;
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? buffer->strides : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+
+    return 0;
+}
+
+static PyBufferProcs batch_buffer_procs = {
+    .bf_getbuffer = (getbufferproc) batch_buffer_get,
+};
+
+static PyTypeObject BatchBufferType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "acidnes.BatchBuffer",
+    .tp_doc = "Read only view on the observations of a VecEnv",
+    .tp_basicsize = sizeof(batch_buffer_t),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc = (destructor) batch_buffer_dealloc,
+    .tp_as_buffer = &batch_buffer_procs,
+};
+
+/* A NumPy array on the buffer if NumPy is there, a memoryview otherwise */
+static PyObject *batch_buffer_view(batch_buffer_t *buffer) {
+    PyObject *numpy = PyImport_ImportModule("numpy");
+    PyObject *view;
+
+    if (numpy == NULL) {
+        PyErr_Clear();
+        return PyMemoryView_FromObject((PyObject *) buffer);
+    }
+
+    view = PyObject_CallMethod(numpy, "asarray", "O", (PyObject *) buffer);
+    Py_DECREF(numpy);
+
+    return view;
+}
+
+/* VecEnv */
+/* Full frames and RAM are in the batch buffers already, grey levels are computed there */
+static void vecenv_observe(vecenv_t *env, size_t index) {
+    if (env->luma != NULL) {
+        acidnes_get_luma(env->luma, env->consoles[index], env->frames + index * env->frame_size);
+    }
+}
+
+static void vecenv_step_one(void *ctx, size_t index) {
+    vecenv_t *env = ctx;
+    acidnes_t *console = env->consoles[index];
+    uint8_t inputs[VECENV_MAX_FRAMESKIP * 2];
+
+    /* The action is held for every frame of the step */
+    for (uint32_t i = 0; i < env->frameskip; i++) {
+        inputs[i * 2] = env->actions[index];
+        inputs[i * 2 + 1] = 0;
+    }
+
+    acidnes_step_frames(console, env->frameskip, inputs);
+    vecenv_observe(env, index);
+}
+
+static void vecenv_reset_one(void *ctx, size_t index) {
+    vecenv_t *env = ctx;
+    acidnes_t *console = env->consoles[index];
+
+    acidnes_reset(console);
+    vecenv_observe(env, index);
+}
+
+static int vecenv_init(vecenv_t *env, PyObject *args, PyObject *kwargs) {
+    static char *keywords[] = {"rom", "num_envs", "threads", "frameskip", "obs_size", "max_pool", NULL};
+    Py_buffer rom;
+    Py_ssize_t nb_consoles;
+    unsigned int threads = 0, frameskip = 1;
+    PyObject *obs_size = Py_None;
+    unsigned short width = 0, height = 0;
+    int max_pool = 0;
+    Py_ssize_t frames_shape[3], ram_shape[2];
+    batch_buffer_t *frames, *ram;
+    PyObject *frames_view, *ram_view;
+
+    if (env->consoles != NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "VecEnv already initialized");
+        return -1;
+    }
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "y*n|IIOp", keywords, &rom, &nb_consoles, &threads, &frameskip,
+                                     &obs_size, &max_pool)) {
+        return -1;
+    }
+
+    if (obs_size != Py_None) {
+        if (!PyArg_ParseTuple(obs_size, "HH", &width, &height)) {
+            PyBuffer_Release(&rom);
+            return -1;
+        }
+
+        env->luma = acidnes_luma_create(width, height);
+        if (env->luma == NULL) {
+            PyBuffer_Release(&rom);
+            PyErr_Format(PyExc_ValueError, "obs_size must be between (1, 1) and (%d, %d)", ACIDNES_WIDTH,
+                         ACIDNES_HEIGHT);
+            return -1;
+        }
+    } else if (max_pool) {
+        PyBuffer_Release(&rom);
+        PyErr_SetString(PyExc_ValueError, "max_pool needs obs_size");
+        return -1;
+    }
+
+    if (nb_consoles < 1 || frameskip < 1 || frameskip > VECENV_MAX_FRAMESKIP) {
+        PyBuffer_Release(&rom);
+        PyErr_Format(PyExc_ValueError, "num_envs must be at least 1 and frameskip between 1 and %d",
+                     VECENV_MAX_FRAMESKIP);
+        return -1;
+    }
+
+    env->consoles = PyMem_Calloc((size_t) nb_consoles, sizeof(acidnes_t *));
+    if (env->consoles == NULL) {
+        PyBuffer_Release(&rom);
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    env->nb_consoles = nb_consoles;
+    env->frameskip = frameskip;
+
+    for (Py_ssize_t i = 0; i < nb_consoles; i++) {
+        env->consoles[i] = acidnes_create(rom.buf, (size_t) rom.len);
+        if (env->consoles[i] == NULL) {
+            PyBuffer_Release(&rom);
+            PyErr_SetString(PyExc_ValueError, "unsupported or invalid ROM");
+            return -1;
+        }
+
+        /* Only the last frame of a step is looked at, or the last two when pooled */
+        acidnes_set_frameskip(env->consoles[i], frameskip);
+        if (max_pool && !acidnes_set_max_pool(env->consoles[i], 1)) {
+            PyBuffer_Release(&rom);
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+    PyBuffer_Release(&rom);
+
+    env->pool = threadpool_init(threads);
+    if (env->pool == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "unable to start the thread pool");
+        return -1;
+    }
+
+    frames_shape[0] = nb_consoles;
+    frames_shape[1] = env->luma != NULL ? height : ACIDNES_HEIGHT;
+    frames_shape[2] = env->luma != NULL ? width : ACIDNES_WIDTH;
+    env->frame_size = (size_t) (frames_shape[1] * frames_shape[2]);
+    ram_shape[0] = nb_consoles;
+    ram_shape[1] = ACIDNES_RAM_SIZE;
+
+    frames = batch_buffer_new(3, frames_shape);
+    ram = batch_buffer_new(2, ram_shape);
+    frames_view = frames != NULL ? batch_buffer_view(frames) : NULL;
+    ram_view = ram != NULL ? batch_buffer_view(ram) : NULL;
+
+    if (frames_view == NULL || ram_view == NULL) {
+        Py_XDECREF(frames);
+        Py_XDECREF(ram);
+        Py_XDECREF(frames_view);
+        Py_XDECREF(ram_view);
+        return -1;
+    }
+
+    /* The views keep the buffers alive */
+    env->frames = frames->data;
+    env->ram = ram->data;
+    Py_DECREF(frames);
+    Py_DECREF(ram);
+
+    env->observation = PyTuple_Pack(2, frames_view, ram_view);
+    Py_DECREF(frames_view);
+    Py_DECREF(ram_view);
+    if (env->observation == NULL) {
+        return -1;
+    }
+
+    for (Py_ssize_t i = 0; i < nb_consoles; i++) {
+        acidnes_set_buffers(env->consoles[i], env->luma == NULL ? env->frames + (size_t) i * env->frame_size : NULL,
+                            env->ram + (size_t) i * ACIDNES_RAM_SIZE);
+    }
+
+    return 0;
+}
+
+static void vecenv_dealloc(vecenv_t *env) {
+    if (env->pool != NULL) {
+        threadpool_free(env->pool);
+    }
+
+    /* Before the buffers they run in */
+    if (env->consoles != NULL) {
+        for (Py_ssize_t i = 0; i < env->nb_consoles; i++) {
+            acidnes_destroy(env->consoles[i]);
+        }
+    }
+    Py_XDECREF(env->observation);
+
+    acidnes_luma_destroy(env->luma);
+    PyMem_Free(env->consoles);
+    Py_TYPE(env)->tp_free((PyObject *) env);
+}
+
+static bool vecenv_ready(vecenv_t *env) {
+    if (env->observation == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "VecEnv is not initialized");
+        return FALSE;
+    }
+
+    /* Another Python thread is stepping it, with the GIL released */
+    if (env->busy) {
+        PyErr_SetString(PyExc_RuntimeError, "VecEnv is already being stepped");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static PyObject *vecenv_step(vecenv_t *env, PyObject *arg) {
+    Py_buffer actions;
+
+    if (!vecenv_ready(env) || PyObject_GetBuffer(arg, &actions, PyBUF_SIMPLE) != 0) {
+        return NULL;
+    }
+
+    if (actions.len != env->nb_consoles) {
+        PyErr_Format(PyExc_ValueError, "expected %zd actions, got %zd bytes", env->nb_consoles, actions.len);
+        PyBuffer_Release(&actions);
+        return NULL;
+    }
+
+    env->busy = TRUE;
+    env->actions = actions.buf;
+
+    Py_BEGIN_ALLOW_THREADS
+    threadpool_run(env->pool, vecenv_step_one, env, (size_t) env->nb_consoles);
+    Py_END_ALLOW_THREADS
+
+    env->actions = NULL;
+    env->busy = FALSE;
+    PyBuffer_Release(&actions);
+
+    for (Py_ssize_t i = 0; i < env->nb_consoles; i++) {
+        const char *error = acidnes_error(env->consoles[i]);
+
+        if (error != NULL) {
+            PyErr_Format(PyExc_RuntimeError, "console %zd stopped: %s", i, error);
+            return NULL;
+        }
+    }
+
+    Py_INCREF(env->observation);
+    return env->observation;
+}
+
+static PyObject *vecenv_reset(vecenv_t *env, PyObject *unused) {
+    (void) unused;
+
+    if (!vecenv_ready(env)) {
+        return NULL;
+    }
+
+    env->busy = TRUE;
+
+    Py_BEGIN_ALLOW_THREADS
+    threadpool_run(env->pool, vecenv_reset_one, env, (size_t) env->nb_consoles);
+    Py_END_ALLOW_THREADS
+
+    env->busy = FALSE;
+
+    Py_INCREF(env->observation);
+    return env->observation;
+}
+
+static bool vecenv_index(vecenv_t *env, Py_ssize_t index) {
+    if (index < 0 || index >= env->nb_consoles) {
+        PyErr_SetString(PyExc_IndexError, "console index out of range");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static PyObject *vecenv_save(vecenv_t *env, PyObject *args) {
+    Py_ssize_t index;
+    PyObject *state;
+
+    if (!PyArg_ParseTuple(args, "n", &index) || !vecenv_ready(env) || !vecenv_index(env, index)) {
+        return NULL;
+    }
+
+    state = PyBytes_FromStringAndSize(NULL, (Py_ssize_t) acidnes_state_size(env->consoles[index]));
+    if (state != NULL) {
+        acidnes_save(env->consoles[index], (uint8_t *) PyBytes_AS_STRING(state));
+    }
+
+    return state;
+}
+
+static PyObject *vecenv_load(vecenv_t *env, PyObject *args) {
+    Py_ssize_t index;
+    Py_buffer state;
+    int loaded;
+
+    if (!PyArg_ParseTuple(args, "ny*", &index, &state)) {
+        return NULL;
+    }
+
+    if (!vecenv_ready(env) || !vecenv_index(env, index)) {
+        PyBuffer_Release(&state);
+        return NULL;
+    }
+
+    loaded = acidnes_load(env->consoles[index], state.buf, (size_t) state.len);
+    PyBuffer_Release(&state);
+
+    if (!loaded) {
+        PyErr_SetString(PyExc_ValueError, "state does not match this console");
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+static Py_ssize_t vecenv_len(vecenv_t *env) {
+    return env->nb_consoles;
+}
+
+static PyMethodDef vecenv_methods[] = {
+    {"step", (PyCFunction) vecenv_step, METH_O,
+     "step(actions) -> (frames, ram)\n\nRuns frameskip frames on every console, holding its action (controller 1 "
+     "byte: A, B, Select, Start, Up, Down, Left, Right from bit 0). The observations are updated in place."},
+    {"reset", (PyCFunction) vecenv_reset, METH_NOARGS,
+     "reset() -> (frames, ram)\n\nPresses reset on every console."},
+    {"save", (PyCFunction) vecenv_save, METH_VARARGS, "save(index) -> bytes\n\nState of one console."},
+    {"load", (PyCFunction) vecenv_load, METH_VARARGS, "load(index, state)\n\nLoads a state saved by save."},
+    {NULL, NULL, 0, NULL}
+};
+
+static PySequenceMethods vecenv_sequence = {
+    .sq_length = (lenfunc) vecenv_len,
+};
+
+static PyTypeObject VecEnvType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "acidnes.VecEnv",
+    .tp_doc = "VecEnv(rom, num_envs, threads=0, frameskip=1, obs_size=None, max_pool=False)\n\nnum_envs consoles "
+              "of the same ROM, stepped in parallel on threads threads (0: one per CPU). obs_size=(width, height) "
+              "makes frames grey levels of that size, max_pool the max of the last two frames of each step.",
+    .tp_basicsize = sizeof(vecenv_t),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc) vecenv_init,
+    .tp_dealloc = (destructor) vecenv_dealloc,
+    .tp_methods = vecenv_methods,
+    .tp_as_sequence = &vecenv_sequence,
+};
+
+static struct PyModuleDef acidnes_module = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "acidnes",
+    .m_doc = "NES emulator, batched for reinforcement learning",
+    .m_size = -1,
+};
+
+PyMODINIT_FUNC PyInit_acidnes(void) {
+    PyObject *module;
+
+    if (PyType_Ready(&BatchBufferType) < 0 || PyType_Ready(&VecEnvType) < 0) {
+        return NULL;
+    }
+
+    module = PyModule_Create(&acidnes_module);
+    if (module == NULL) {
+        return NULL;
+    }
+
+    Py_INCREF(&VecEnvType);
+    if (PyModule_AddObject(module, "VecEnv", (PyObject *) &VecEnvType) < 0
+        || PyModule_AddIntConstant(module, "WIDTH", ACIDNES_WIDTH) < 0
+        || PyModule_AddIntConstant(module, "HEIGHT", ACIDNES_HEIGHT) < 0
+        || PyModule_AddIntConstant(module, "RAM_SIZE", ACIDNES_RAM_SIZE) < 0) {
+        Py_DECREF(&VecEnvType);
+        Py_DECREF(module);
+        return NULL;
+    }
+
+    return module;
+}
@@ -0,0 +1,486 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "acidnes.h"
+#include "cartridge.h"
+#include "log.h"
+#include "luma.h"
+#include "nes.h"
+#include "ntsc.h"
+#include "palette.h"
+#include "png.h"
+#include "ram_gather.h"
+#include "recorder.h"
+#include "threadpool.h"
+#include "upscale.h"
+
+/* Consoles gathered from per call to the gather kernel */
+#define ACIDNES_GATHER_BATCH 64
+
+struct acidnes_s {
+    nes_t *nes;
+    cartridge_t *cart;
+    /* Frame drawn before the current one, when max pooling */
+    uint8_t *previous;
+};
+
+struct acidnes_palette_s {
+    palette_t *palette;
+};
+
+struct acidnes_ntsc_s {
+    ntsc_t *ntsc;
+    threadpool_t *pool;
+};
+
+struct acidnes_upscale_s {
+    upscale_t *upscale;
+    threadpool_t *pool;
+    /* HQx and xBR: the RGBA frame they start from */
+    palette_t *palette;
+    uint8_t *pixels;
+};
+
+struct acidnes_png_sink_s {
+    png_sink_t *sink;
+};
+
+struct acidnes_luma_s {
+    luma_t *luma;
+};
+
+struct acidnes_gather_s {
+    ram_gather_t *gather;
+};
+
+acidnes_t *acidnes_create(const uint8_t *rom, size_t size) {
+    acidnes_t *console = calloc(1, sizeof(acidnes_t));
+
+    if (console == NULL) {
+        log_error("acidnes", "Unable to allocate the console");
+        return NULL;
+    }
+
+    console->cart = cartridge_load_mem(rom, size);
+    if (console->cart == NULL) {
+        free(console);
+        return NULL;
+    }
+
+    console->nes = nes_init(console->cart);
+    if (console->nes == NULL) {
+        cartridge_free(console->cart);
+        free(console);
+        return NULL;
+    }
+
+    /* Embedders step many consoles for throughput, see acidnes_set_recorder */
+    console->nes->cpu->recording = FALSE;
+
+    return console;
+}
+
+void acidnes_destroy(acidnes_t *console) {
+    if (console == NULL) {
+        return;
+    }
+
+    nes_free(console->nes);
+    cartridge_free(console->cart);
+    free(console->previous);
+    free(console);
+}
+
+void acidnes_reset(acidnes_t *console) {
+    nes_reset(console->nes);
+
+    /* Frames from before the reset are not pooled with the ones after it */
+    if (console->previous != NULL) {
+        memcpy(console->previous, console->nes->ppu->framebuffer, PPU_FRAMEBUFFER_SIZE);
+    }
+}
+
+uint64_t acidnes_step_frames(acidnes_t *console, uint32_t frames, const uint8_t *inputs) {
+    nes_t *nes = console->nes;
+
+    for (uint32_t i = 0; i < frames; i++) {
+        if (inputs != NULL) {
+            nes->cpu->buttons[0] = inputs[i * 2];
+            nes->cpu->buttons[1] = inputs[i * 2 + 1];
+        }
+
+        if (nes->faulted) {
+            break;
+        }
+
+        if (console->previous != NULL && nes_draws_frame(nes)) {
+            memcpy(console->previous, nes->ppu->framebuffer, PPU_FRAMEBUFFER_SIZE);
+        }
+
+        nes_step_frame(nes);
+        if (nes->faulted) {
+            log_error("acidnes", "Console stopped: %s", nes->cpu->fault);
+        }
+    }
+
+    return nes->frame;
+}
+
+void acidnes_step_frames_many(acidnes_t *const *consoles, size_t count, uint32_t frames, const uint8_t *inputs) {
+    for (size_t i = 0; i < count; i++) {
+        acidnes_step_frames(consoles[i], frames, inputs != NULL ? inputs + i * frames * 2 : NULL);
+    }
+}
+
+const char *acidnes_error(const acidnes_t *console) {
+    return console->nes->faulted ? console->nes->cpu->fault : NULL;
+}
+
+void acidnes_install_crash_handler(void) {
+    recorder_install_crash_handler();
+}
+
+void acidnes_set_recorder(acidnes_t *console, int enabled) {
+    console->nes->cpu->recording = enabled != 0;
+}
+
+int acidnes_attach_save(acidnes_t *console, const char *file, int read_only) {
+    if (!console->cart->battery_ram) {
+        log_error("acidnes", "No battery on this cartridge, %s is not attached", file);
+        return 0;
+    }
+
+    return mapper_attach_save(console->nes->mapper, file, read_only != 0);
+}
+
+void acidnes_set_frameskip(acidnes_t *console, uint32_t frameskip) {
+    console->nes->frameskip = frameskip;
+}
+
+const uint8_t *acidnes_get_framebuffer(const acidnes_t *console) {
+    return console->nes->ppu->framebuffer;
+}
+
+uint8_t *acidnes_get_ram(acidnes_t *console) {
+    return console->nes->cpu->ram;
+}
+
+void acidnes_set_buffers(acidnes_t *console, uint8_t *framebuffer, uint8_t *ram) {
+    ppu_set_framebuffer(console->nes->ppu, framebuffer);
+    cpu_set_ram(console->nes->cpu, ram);
+}
+
+acidnes_palette_t *acidnes_palette_create(int format) {
+    static const palette_format_t formats[] = {
+        [ACIDNES_RGBA] = PALETTE_RGBA,
+        [ACIDNES_RGB565] = PALETTE_RGB565,
+        [ACIDNES_YUYV] = PALETTE_YUYV,
+    };
+    acidnes_palette_t *palette;
+
+    if (format < 0 || format >= (int) (sizeof(formats) / sizeof(formats[0]))) {
+        log_error("acidnes", "Unknown pixel format: %d", format);
+        return NULL;
+    }
+
+    palette = calloc(1, sizeof(acidnes_palette_t));
+    if (palette == NULL) {
+        log_error("acidnes", "Unable to allocate the palette");
+        return NULL;
+    }
+
+    palette->palette = palette_init(formats[format]);
+    if (palette->palette == NULL) {
+        free(palette);
+        return NULL;
+    }
+
+    return palette;
+}
+
+void acidnes_palette_destroy(acidnes_palette_t *palette) {
+    if (palette == NULL) {
+        return;
+    }
+
+    palette_free(palette->palette);
+    free(palette);
+}
+
+void acidnes_get_pixels(const acidnes_palette_t *palette, const acidnes_t *console, uint8_t *out) {
+    const ppu_t *ppu = console->nes->ppu;
+
+    palette_convert(palette->palette, ppu->framebuffer, ppu->emphasis, out);
+}
+
+acidnes_ntsc_t *acidnes_ntsc_create(uint32_t threads) {
+    acidnes_ntsc_t *ntsc = calloc(1, sizeof(acidnes_ntsc_t));
+
+    if (ntsc == NULL) {
+        log_error("acidnes", "Unable to allocate the NTSC filter");
+        return NULL;
+    }
+
+    ntsc->ntsc = ntsc_init();
+    ntsc->pool = threadpool_init(threads);
+    if (ntsc->ntsc == NULL || ntsc->pool == NULL) {
+        acidnes_ntsc_destroy(ntsc);
+        return NULL;
+    }
+
+    return ntsc;
+}
+
+void acidnes_ntsc_destroy(acidnes_ntsc_t *ntsc) {
+    if (ntsc == NULL) {
+        return;
+    }
+
+    if (ntsc->pool != NULL) {
+        threadpool_free(ntsc->pool);
+    }
+    if (ntsc->ntsc != NULL) {
+        ntsc_free(ntsc->ntsc);
+    }
+    free(ntsc);
+}
+
+void acidnes_get_ntsc(acidnes_ntsc_t *ntsc, const acidnes_t *console, uint8_t *out) {
+    const nes_t *nes = console->nes;
+
+    ntsc_run(ntsc->ntsc, ntsc->pool, nes->ppu->framebuffer, nes->ppu->emphasis, (uint32_t) (nes->frame % NTSC_PHASES),
+             out);
+}
+
+acidnes_upscale_t *acidnes_upscale_create(int filter, uint32_t threads) {
+    static const upscale_filter_t filters[] = {
+        [ACIDNES_SCALE2X] = UPSCALE_SCALE2X,
+        [ACIDNES_SCALE3X] = UPSCALE_SCALE3X,
+        [ACIDNES_SCALE4X] = UPSCALE_SCALE4X,
+        [ACIDNES_HQ2X] = UPSCALE_HQ2X,
+        [ACIDNES_HQ3X] = UPSCALE_HQ3X,
+        [ACIDNES_HQ4X] = UPSCALE_HQ4X,
+        [ACIDNES_XBR2X] = UPSCALE_XBR2X,
+        [ACIDNES_XBR3X] = UPSCALE_XBR3X,
+        [ACIDNES_XBR4X] = UPSCALE_XBR4X,
+    };
+    acidnes_upscale_t *upscale;
+
+    if (filter < 0 || filter >= (int) (sizeof(filters) / sizeof(filters[0]))) {
+        log_error("acidnes", "Unknown upscaler: %d", filter);
+        return NULL;
+    }
+
+    upscale = calloc(1, sizeof(acidnes_upscale_t));
+    if (upscale == NULL) {
+        log_error("acidnes", "Unable to allocate the upscaler");
+        return NULL;
+    }
+
+    upscale->upscale = upscale_init(filters[filter], ACIDNES_WIDTH, ACIDNES_HEIGHT);
+    upscale->pool = threadpool_init(threads);
+    if (upscale->upscale == NULL || upscale->pool == NULL) {
+        acidnes_upscale_destroy(upscale);
+        return NULL;
+    }
+
+    if (upscale_pixel_size(filters[filter]) == 4) {
+        upscale->palette = palette_init(PALETTE_RGBA);
+        upscale->pixels = malloc((size_t) ACIDNES_WIDTH * ACIDNES_HEIGHT * 4);
+        if (upscale->palette == NULL || upscale->pixels == NULL) {
+            log_error("acidnes", "Unable to allocate the upscaler");
+            acidnes_upscale_destroy(upscale);
+            return NULL;
+        }
+    }
+
+    return upscale;
+}
+
+void acidnes_upscale_destroy(acidnes_upscale_t *upscale) {
+    if (upscale == NULL) {
+        return;
+    }
+
+    if (upscale->pool != NULL) {
+        threadpool_free(upscale->pool);
+    }
+    if (upscale->upscale != NULL) {
+        upscale_free(upscale->upscale);
+    }
+    if (upscale->palette != NULL) {
+        palette_free(upscale->palette);
+    }
+    free(upscale->pixels);
+    free(upscale);
+}
+
+uint32_t acidnes_upscale_factor(const acidnes_upscale_t *upscale) {
+    return upscale_factor(upscale->upscale->filter);
+}
+
+uint32_t acidnes_upscale_pixel_size(const acidnes_upscale_t *upscale) {
+    return upscale_pixel_size(upscale->upscale->filter);
+}
+
+void acidnes_get_upscaled(acidnes_upscale_t *upscale, const acidnes_t *console, uint8_t *out) {
+    const ppu_t *ppu = console->nes->ppu;
+
+    if (upscale->palette == NULL) {
+        upscale_run(upscale->upscale, upscale->pool, ppu->framebuffer, out);
+        return;
+    }
+
+    palette_convert(upscale->palette, ppu->framebuffer, ppu->emphasis, upscale->pixels);
+    upscale_run(upscale->upscale, upscale->pool, upscale->pixels, out);
+}
+
+int acidnes_save_png(const acidnes_t *console, const char *file, int level) {
+    const ppu_t *ppu = console->nes->ppu;
+
+    return png_write(file, ppu->framebuffer, ppu->emphasis, PPU_WIDTH, PPU_HEIGHT, level);
+}
+
+acidnes_png_sink_t *acidnes_png_sink_open(const char *pattern, int level, uint32_t threads, uint32_t queue_size) {
+    acidnes_png_sink_t *sink = calloc(1, sizeof(acidnes_png_sink_t));
+
+    if (sink == NULL) {
+        log_error("acidnes", "Unable to allocate the PNG sink");
+        return NULL;
+    }
+
+    sink->sink = png_sink_open(pattern, PPU_WIDTH, PPU_HEIGHT, level, threads, queue_size);
+    if (sink->sink == NULL) {
+        free(sink);
+        return NULL;
+    }
+
+    return sink;
+}
+
+int acidnes_png_sink_close(acidnes_png_sink_t *sink) {
+    bool ok;
+
+    if (sink == NULL) {
+        return 1;
+    }
+
+    ok = png_sink_close(sink->sink);
+    free(sink);
+
+    return ok;
+}
+
+int acidnes_png_sink_submit(acidnes_png_sink_t *sink, const acidnes_t *console) {
+    const ppu_t *ppu = console->nes->ppu;
+
+    return png_sink_submit(sink->sink, ppu->framebuffer, ppu->emphasis);
+}
+
+acidnes_luma_t *acidnes_luma_create(uint16_t width, uint16_t height) {
+    acidnes_luma_t *luma = calloc(1, sizeof(acidnes_luma_t));
+
+    if (luma == NULL) {
+        log_error("acidnes", "Unable to allocate the observation");
+        return NULL;
+    }
+
+    luma->luma = luma_init(width, height);
+    if (luma->luma == NULL) {
+        free(luma);
+        return NULL;
+    }
+
+    return luma;
+}
+
+void acidnes_luma_destroy(acidnes_luma_t *luma) {
+    if (luma == NULL) {
+        return;
+    }
+
+    luma_free(luma->luma);
+    free(luma);
+}
+
+void acidnes_get_luma(const acidnes_luma_t *luma, const acidnes_t *console, uint8_t *out) {
+    luma_run(luma->luma, console->nes->ppu->framebuffer, console->previous, out);
+}
+
+int acidnes_set_max_pool(acidnes_t *console, int enabled) {
+    if (!enabled) {
+        free(console->previous);
+        console->previous = NULL;
+        console->nes->draw_previous = FALSE;
+        return 1;
+    }
+
+    if (console->previous == NULL) {
+        /* Until a frame is drawn before it, the current one is its own previous frame */
+        console->previous = malloc(PPU_FRAMEBUFFER_SIZE);
+        if (console->previous == NULL) {
+            log_error("acidnes", "Unable to allocate the previous frame");
+            return 0;
+        }
+        memcpy(console->previous, console->nes->ppu->framebuffer, PPU_FRAMEBUFFER_SIZE);
+    }
+
+    console->nes->draw_previous = TRUE;
+    return 1;
+}
+
+acidnes_gather_t *acidnes_gather_create(const uint16_t *addrs, size_t nb_addrs) {
+    acidnes_gather_t *gather = calloc(1, sizeof(acidnes_gather_t));
+
+    if (gather == NULL) {
+        log_error("acidnes", "Unable to allocate the gather list");
+        return NULL;
+    }
+
+    gather->gather = ram_gather_init(addrs, nb_addrs);
+    if (gather->gather == NULL) {
+        free(gather);
+        return NULL;
+    }
+
+    return gather;
+}
+
+void acidnes_gather_destroy(acidnes_gather_t *gather) {
+    if (gather == NULL) {
+        return;
+    }
+
+    ram_gather_free(gather->gather);
+    free(gather);
+}
+
+void acidnes_gather_ram(const acidnes_gather_t *gather, acidnes_t *const *consoles, size_t count, uint8_t *out,
+                        uint8_t *changed) {
+    const uint8_t *rams[ACIDNES_GATHER_BATCH];
+    size_t nb_addrs = gather->gather->nb_addrs;
+
+    for (size_t first = 0; first < count; first += ACIDNES_GATHER_BATCH) {
+        size_t n = count - first < ACIDNES_GATHER_BATCH ? count - first : ACIDNES_GATHER_BATCH;
+
+        for (size_t i = 0; i < n; i++) {
+            rams[i] = consoles[first + i]->nes->cpu->ram;
+        }
+
+        ram_gather_run(gather->gather, rams, n, out + first * nb_addrs,
+                       changed != NULL ? changed + first * nb_addrs : NULL);
+    }
+}
+
+size_t acidnes_state_size(const acidnes_t *console) {
+    return nes_state_size(console->nes);
+}
+
+void acidnes_save(const acidnes_t *console, uint8_t *buf) {
+    nes_save_state(console->nes, buf);
+}
+
+int acidnes_load(acidnes_t *console, const uint8_t *buf, size_t size) {
+    return nes_load_state(console->nes, buf, size) ? 1 : 0;
+}
@@ -0,0 +1,180 @@
+#ifndef __ACIDNES_H__
+#define __ACIDNES_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* libacidnes: consoles to embed in other programs.
+ *
+ * A console owns a copy of its ROM. Consoles are independent: different consoles can be used from different threads
+ * at the same time, one console from one thread at a time.
+ *
+ * Inputs are one byte per controller per frame, bit 0 to 7: A, B, Select, Start, Up, Down, Left, Right. */
+
+#define ACIDNES_WIDTH 256
+#define ACIDNES_HEIGHT 240
+#define ACIDNES_RAM_SIZE 0x800
+
+#if defined(__GNUC__)
+#define ACIDNES_API __attribute__((visibility("default")))
+#else
+#define ACIDNES_API
+#endif
+
+typedef struct acidnes_s acidnes_t;
+
+/* iNES or NES 2.0 image. Returns NULL if it can't be parsed or its board is not supported. */
+ACIDNES_API acidnes_t *acidnes_create(const uint8_t *rom, size_t size);
+ACIDNES_API void acidnes_destroy(acidnes_t *console);
+ACIDNES_API void acidnes_reset(acidnes_t *console);
+
+/* Runs frames frames. inputs holds 2 bytes per frame, controllers 1 and 2, or is NULL to keep the last ones.
+ * Returns the number of frames emulated since the console was created, fewer than asked if the console stopped. */
+ACIDNES_API uint64_t acidnes_step_frames(acidnes_t *console, uint32_t frames, const uint8_t *inputs);
+/* Same for count consoles, inputs holding the inputs of the first console, then of the second... */
+ACIDNES_API void acidnes_step_frames_many(acidnes_t *const *consoles, size_t count, uint32_t frames,
+                                          const uint8_t *inputs);
+
+/* Why the console stopped, NULL while it runs. A console stops on what the emulator doesn't handle, an invalid opcode
+ * or a register it doesn't have, instead of taking the process down: acidnes_step_frames doesn't run it anymore, until
+ * acidnes_reset or acidnes_load. Other consoles are not affected. */
+ACIDNES_API const char *acidnes_error(const acidnes_t *console);
+
+/* On SIGSEGV, SIGBUS, SIGILL, SIGFPE and SIGABRT, dumps the last instructions of the console the crashing thread was
+ * running to stderr, or of every console, then lets the signal take its default action. Replaces the handlers of
+ * these signals, call it once, from the thread that steps the consoles if it isn't a worker of this library. */
+ACIDNES_API void acidnes_install_crash_handler(void);
+
+/* Records the last instructions and bus accesses of the console, for the crash dumps above, at a few percent of its
+ * speed. Off by default: the dumps then only have the console's state. */
+ACIDNES_API void acidnes_set_recorder(acidnes_t *console, int enabled);
+
+/* Battery saves: the cartridge's PRG RAM becomes a mapping of file, created if needed, written back as the game saves.
+ * With read_only, the file is mapped privately: the game starts from the save and can change its copy, the file is
+ * never written, so that any number of consoles can run from the same save. A missing file is blank RAM then. Attach
+ * the save before the first frame. Returns 0 if the cartridge has no battery or the file can't be mapped. */
+ACIDNES_API int acidnes_attach_save(acidnes_t *console, const char *file, int read_only);
+
+/* Draws one frame in frameskip, 0 and 1 draw them all. Skipped frames leave the framebuffer as is. */
+ACIDNES_API void acidnes_set_frameskip(acidnes_t *console, uint32_t frameskip);
+
+/* ACIDNES_WIDTH * ACIDNES_HEIGHT palette indexes (0x00-0x3F), one byte per pixel, rows top to bottom. Valid until the
+ * console is destroyed or given another framebuffer, updated in place by each frame. */
+ACIDNES_API const uint8_t *acidnes_get_framebuffer(const acidnes_t *console);
+/* The ACIDNES_RAM_SIZE bytes of CPU RAM, in place: writes go to the console */
+ACIDNES_API uint8_t *acidnes_get_ram(acidnes_t *console);
+
+/* Makes the console draw to framebuffer (ACIDNES_WIDTH * ACIDNES_HEIGHT bytes) and keep its CPU RAM in ram
+ * (ACIDNES_RAM_SIZE bytes), memory the caller keeps alive until the console is destroyed or given other buffers. The
+ * current frame and RAM are copied there. NULL goes back to the console's own buffer. With a slice of one array per
+ * console, a batch runs straight into that array, nothing to copy after the step. */
+ACIDNES_API void acidnes_set_buffers(acidnes_t *console, uint8_t *framebuffer, uint8_t *ram);
+
+/* Frames as pixels, emphasis included, converted a line at a time with SIMD table lookups when the CPU has them. A
+ * palette can be used from several threads at once. */
+#define ACIDNES_RGBA 0   /* 4 bytes per pixel: R, G, B, 0xFF */
+#define ACIDNES_RGB565 1 /* 2 bytes per pixel, little endian, red in the top bits */
+#define ACIDNES_YUYV 2   /* 2 bytes per pixel: Y0 U Y1 V for each pair of pixels, BT.601 studio range */
+
+typedef struct acidnes_palette_s acidnes_palette_t;
+
+/* Returns NULL if the format is unknown */
+ACIDNES_API acidnes_palette_t *acidnes_palette_create(int format);
+ACIDNES_API void acidnes_palette_destroy(acidnes_palette_t *palette);
+/* out gets ACIDNES_WIDTH * ACIDNES_HEIGHT pixels, rows top to bottom */
+ACIDNES_API void acidnes_get_pixels(const acidnes_palette_t *palette, const acidnes_t *console, uint8_t *out);
+
+/* NTSC composite video: frames turned into the PPU's video signal and decoded back to RGBA pixels (R, G, B, 0xFF) the
+ * way a TV does, with color fringes and dot crawl, at ACIDNES_NTSC_WIDTH x ACIDNES_NTSC_HEIGHT. Bands of lines are
+ * spread over threads threads, the calling one included, 0 for one per CPU. A filter is used from one thread at a
+ * time. */
+#define ACIDNES_NTSC_WIDTH 602
+#define ACIDNES_NTSC_HEIGHT 480
+
+typedef struct acidnes_ntsc_s acidnes_ntsc_t;
+
+ACIDNES_API acidnes_ntsc_t *acidnes_ntsc_create(uint32_t threads);
+ACIDNES_API void acidnes_ntsc_destroy(acidnes_ntsc_t *ntsc);
+ACIDNES_API void acidnes_get_ntsc(acidnes_ntsc_t *ntsc, const acidnes_t *console, uint8_t *out);
+
+/* Pixel art upscalers, factor times wider and taller (2, 3 or 4). The Scale2x family of AdvanceMAME gives the frame's
+ * palette indexes, for a palette conversion to come after. HQx and xBR blend colours, so they give RGBA pixels
+ * (ACIDNES_RGBA), emphasis included. Bands of lines are spread over threads threads, the calling one included, 0 for
+ * one per CPU. Returns NULL if the filter is unknown. An upscaler is used from one thread at a time. */
+#define ACIDNES_SCALE2X 0
+#define ACIDNES_SCALE3X 1
+#define ACIDNES_SCALE4X 2
+#define ACIDNES_HQ2X 3
+#define ACIDNES_HQ3X 4
+#define ACIDNES_HQ4X 5
+#define ACIDNES_XBR2X 6
+#define ACIDNES_XBR3X 7
+#define ACIDNES_XBR4X 8
+
+typedef struct acidnes_upscale_s acidnes_upscale_t;
+
+ACIDNES_API acidnes_upscale_t *acidnes_upscale_create(int filter, uint32_t threads);
+ACIDNES_API void acidnes_upscale_destroy(acidnes_upscale_t *upscale);
+ACIDNES_API uint32_t acidnes_upscale_factor(const acidnes_upscale_t *upscale);
+/* Bytes per output pixel: 1 for the Scale family, 4 for HQx and xBR */
+ACIDNES_API uint32_t acidnes_upscale_pixel_size(const acidnes_upscale_t *upscale);
+/* out gets factor * ACIDNES_WIDTH x factor * ACIDNES_HEIGHT pixels, 4 byte aligned for HQx and xBR */
+ACIDNES_API void acidnes_get_upscaled(acidnes_upscale_t *upscale, const acidnes_t *console, uint8_t *out);
+
+/* Frames as paletted PNG files, 8 bits per pixel, emphasis included, compressed with zlib at level, -1 for its default,
+ * 0 to 9 from fastest to smallest. Written uncompressed when the library is built without zlib. Returns 0 on error. */
+ACIDNES_API int acidnes_save_png(const acidnes_t *console, const char *file, int level);
+
+/* Frame sequences: acidnes_png_sink_submit copies the frame into a queue of queue_size frames, 0 for two per thread,
+ * and threads threads, 0 for one per CPU, encode them. Each frame goes to its own file, pattern with the frame number
+ * from 0 in place of its one integer conversion ("frames/%06u.png"), written in order. When the queue is full, submit
+ * waits for the oldest frame to be written. Frames are submitted from one thread at a time. open returns NULL if the
+ * pattern doesn't have exactly one integer conversion, submit and close 0 if a frame could not be written. */
+typedef struct acidnes_png_sink_s acidnes_png_sink_t;
+
+ACIDNES_API acidnes_png_sink_t *acidnes_png_sink_open(const char *pattern, int level, uint32_t threads,
+                                                      uint32_t queue_size);
+ACIDNES_API int acidnes_png_sink_close(acidnes_png_sink_t *sink);
+ACIDNES_API int acidnes_png_sink_submit(acidnes_png_sink_t *sink, const acidnes_t *console);
+
+/* Grey observations: the frame as luma (0-255, BT.601), area-downsampled to width x height, 84x84 for instance, with
+ * SIMD when the CPU has it. Returns NULL if the size is 0 or larger than a frame. An observation size can be used
+ * from several threads at once. */
+typedef struct acidnes_luma_s acidnes_luma_t;
+
+ACIDNES_API acidnes_luma_t *acidnes_luma_create(uint16_t width, uint16_t height);
+ACIDNES_API void acidnes_luma_destroy(acidnes_luma_t *luma);
+/* out gets width * height bytes, rows top to bottom. With max pooling on, each pixel is the max of the current and
+ * previous frames. */
+ACIDNES_API void acidnes_get_luma(const acidnes_luma_t *luma, const acidnes_t *console, uint8_t *out);
+
+/* Max pooling: keeps the frame drawn before the current one for acidnes_get_luma. With frameskip, the frame before the
+ * last one of each group is drawn too. Returns 0 if it can't be allocated. */
+ACIDNES_API int acidnes_set_max_pool(acidnes_t *console, int enabled);
+
+/* RAM observations of many consoles: a list of addresses ($0000-$1FFF), registered once, read from every console
+ * into a contiguous [consoles x addresses] buffer, with SIMD gathers when the CPU has them. Returns NULL if an address
+ * is not in RAM. A gather list can be used from several threads at once. */
+typedef struct acidnes_gather_s acidnes_gather_t;
+
+ACIDNES_API acidnes_gather_t *acidnes_gather_create(const uint16_t *addrs, size_t nb_addrs);
+ACIDNES_API void acidnes_gather_destroy(acidnes_gather_t *gather);
+/* out[i * nb_addrs + j] is address j of consoles[i]. changed is NULL, or gets 0xFF where a value differs from what out
+ * held before (the previous frame's), 0 elsewhere. */
+ACIDNES_API void acidnes_gather_ram(const acidnes_gather_t *gather, acidnes_t *const *consoles, size_t count,
+                                    uint8_t *out, uint8_t *changed);
+
+/* States are for consoles of the same ROM and version of the library. load returns 0 if the state does not fit the
+ * console's board, leaving the console as it was. */
+ACIDNES_API size_t acidnes_state_size(const acidnes_t *console);
+ACIDNES_API void acidnes_save(const acidnes_t *console, uint8_t *buf);
+ACIDNES_API int acidnes_load(acidnes_t *console, const uint8_t *buf, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __ACIDNES_H__ */
@@ -1,92 +1,336 @@
-#include <stdio.h>
+#include <errno.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "common.h"
+#include "crc32.h"
 #include "cartridge.h"
+#include "log.h"
+
+/* Every loaded cartridge, keyed by the CRC of its banks. Instances running the same game share one entry. */
+static cartridge_t *_cache = NULL;
+static pthread_mutex_t _cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static cartridge_t *cartridge_from_image(uint8_t *image, size_t image_size, bool mapped, const char *name);
+static bool cartridge_parse(cartridge_t *cart, const char *file);
+static cartridge_t *cartridge_cache_find(const cartridge_t *cart);
+static uint64_t cartridge_nes2_rom_size(uint8_t lsb, uint8_t msb, uint32_t bank_size);
+static uint32_t cartridge_nes2_ram_size(uint8_t shift);
+static void cartridge_destroy(cartridge_t *cart);
 
 cartridge_t *cartridge_load(const char *file) {
-    FILE *f_nes;
-    cartridge_t *cart = NULL;
-    uint8_t buffer[16];
+    int fd;
+    struct stat st;
+    uint8_t *image;
+    size_t image_size;
 
-    f_nes = fopen(file, "rb");
-    if (f_nes == NULL) {
-        perror(file);
+    fd = open(file, O_RDONLY);
+    if (fd < 0) {
+        log_error("cartridge", "%s: %s", file, strerror(errno));
 
         return NULL;
     }
 
-    fread(buffer, 16, 1, f_nes);
+    if (fstat(fd, &st) < 0) {
+        log_error("cartridge", "%s: %s", file, strerror(errno));
 
-    /* Validate file is a iNes file */
-    if (buffer[0] != 'N' || buffer[1] != 'E' || buffer[2] != 'S' || buffer[3] != 0x1a) {
-        fprintf(stderr, "Not a valid NES file: %s\n", file);
+        close(fd);
+
+        return NULL;
+    }
 
-        fclose(f_nes);
+    image_size = (size_t) st.st_size;
+    if (image_size < 16) {
+        log_error("cartridge", "Not a valid NES file: %s", file);
+
+        close(fd);
 
         return NULL;
     }
 
-    cart = malloc(sizeof(cartridge_t));
-    if (cart == NULL) {
-        fclose(f_nes);
+    /* The banks are used in place: nothing is copied out of the file, pages are faulted in on first access and
+       shared with every other process mapping the same ROM. */
+    image = mmap(NULL, image_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (image == MAP_FAILED) {
+        log_error("cartridge", "%s: %s", file, strerror(errno));
+
         return NULL;
     }
 
-    cart->nb_16k_rom_banks = buffer[4];
-    cart->nb_8k_vrom_banks = buffer[5];
-    cart->nb_8k_ram_banks = buffer[8];
+    return cartridge_from_image(image, image_size, TRUE, file);
+}
 
-    cart->vert_mirror = get_bit_at(buffer[6], 0);
-    cart->battery_ram = get_bit_at(buffer[6], 1);
-    cart->trainer = get_bit_at(buffer[6], 2);
-    cart->four_screen_vram = get_bit_at(buffer[6], 3);
-    cart->vs_system = get_bit_at(buffer[7], 0);
-    cart->mapper_type = (buffer[6] >> 4 & 0x0f) | (buffer[7] & 0xf0);
-    cart->is_pal = get_bit_at(buffer[9], 0);
+cartridge_t *cartridge_load_mem(const uint8_t *data, size_t size) {
+    uint8_t *image;
 
-    if (cart->mapper_type != 0) {
-        fprintf(stderr, "Unsupported mapper: %02x\n", cart->mapper_type);
+    if (size < 16) {
+        log_error("cartridge", "Not a valid NES file: <memory>");
 
-        free(cart);
-        fclose(f_nes);
+        return NULL;
+    }
 
+    image = malloc(size);
+    if (image == NULL) {
         return NULL;
     }
 
-    /* Read banks */
-    fseek(f_nes, cart->trainer ? 512 : 0, SEEK_CUR);
+    memcpy(image, data, size);
+
+    return cartridge_from_image(image, size, FALSE, "<memory>");
+}
 
-    cart->rom = malloc(cart->nb_16k_rom_banks * 0x4000);
-    if (fread(cart->rom, 0x4000, cart->nb_16k_rom_banks, f_nes) != cart->nb_16k_rom_banks) {
-        perror("rom");
+static cartridge_t *cartridge_from_image(uint8_t *image, size_t image_size, bool mapped, const char *name) {
+    cartridge_t *cart;
+    cartridge_t *cached;
 
-        free(cart->rom);
-        free(cart);
-        fclose(f_nes);
+    cart = calloc(1, sizeof(cartridge_t));
+    if (cart == NULL) {
+        if (mapped) {
+            munmap(image, image_size);
+        } else {
+            free(image);
+        }
 
         return NULL;
     }
 
-    cart->vrom = malloc(cart->nb_8k_vrom_banks * 0x2000);
-    if (fread(cart->vrom, 0x2000, cart->nb_8k_vrom_banks, f_nes) != cart->nb_8k_vrom_banks) {
-        perror("vrom");
+    cart->image = image;
+    cart->image_size = image_size;
+    cart->image_mapped = mapped;
 
-        free(cart->rom);
-        free(cart->vrom);
-        free(cart);
-        fclose(f_nes);
+    if (!cartridge_parse(cart, name)) {
+        cartridge_destroy(cart);
 
         return NULL;
     }
 
-    fclose(f_nes);
+    pthread_mutex_lock(&_cache_lock);
+
+    cached = cartridge_cache_find(cart);
+    if (cached != NULL) {
+        cached->refcount++;
+    } else {
+        cart->refcount = 1;
+        cart->next = _cache;
+        _cache = cart;
+    }
+
+    pthread_mutex_unlock(&_cache_lock);
+
+    if (cached != NULL) {
+        cartridge_destroy(cart);
+
+        return cached;
+    }
 
     return cart;
 }
 
 void cartridge_free(cartridge_t *cartridge) {
-    free(cartridge->rom);
-    free(cartridge->vrom);
-    free(cartridge);
+    cartridge_t **it;
+
+    pthread_mutex_lock(&_cache_lock);
+
+    if (--cartridge->refcount > 0) {
+        pthread_mutex_unlock(&_cache_lock);
+        return;
+    }
+
+    for (it = &_cache; *it != NULL; it = &(*it)->next) {
+        if (*it == cartridge) {
+            *it = cartridge->next;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&_cache_lock);
+
+    cartridge_destroy(cartridge);
+}
+
+const uint8_t *cartridge_get_chr_tiles(cartridge_t *cartridge) {
+    uint32_t chr_size = cartridge->chr_rom_size & ~0xfu;
+    uint8_t *tiles;
+
+    pthread_mutex_lock(&_cache_lock);
+
+    if (cartridge->chr_tiles == NULL && chr_size > 0) {
+        tiles = malloc(chr_size * 4);
+
+        if (tiles != NULL) {
+            for (uint32_t tile = 0; tile < chr_size; tile += 16) {
+                chr_decode_tile(cartridge->vrom + tile, tiles + tile * 4);
+            }
+        }
+
+        cartridge->chr_tiles = tiles;
+    }
+
+    pthread_mutex_unlock(&_cache_lock);
+
+    return cartridge->chr_tiles;
+}
+
+void chr_decode_tile(const uint8_t *tile, uint8_t *pixels) {
+    for (int row = 0; row < 8; row++) {
+        uint8_t lo = tile[row];
+        uint8_t hi = tile[row + 8];
+
+        for (int col = 0; col < 8; col++) {
+            uint8_t bit = 7 - col;
+
+            pixels[row * 8 + col] = (uint8_t) (get_bit_at(lo, bit) | get_bit_at(hi, bit) << 1u);
+        }
+    }
+}
+
+bool cartridge_parse_header(cartridge_t *cart, const uint8_t *header) {
+    /* Validate file is a iNes file */
+    if (header[0] != 'N' || header[1] != 'E' || header[2] != 'S' || header[3] != 0x1a) {
+        return FALSE;
+    }
+
+    cart->nes2 = (header[7] & 0x0c) == 0x08;
+
+    cart->vert_mirror = get_bit_at(header[6], 0);
+    cart->battery_ram = get_bit_at(header[6], 1);
+    cart->trainer = get_bit_at(header[6], 2);
+    cart->four_screen_vram = get_bit_at(header[6], 3);
+    cart->vs_system = get_bit_at(header[7], 0);
+    cart->mapper_type = (header[6] >> 4 & 0x0f) | (header[7] & 0xf0);
+    cart->submapper = 0;
+
+    cart->chr_nvram_size = 0;
+    cart->prg_nvram_size = 0;
+
+    if (cart->nes2) {
+        cart->mapper_type |= (uint16_t) ((header[8] & 0x0f) << 8u);
+        cart->submapper = header[8] >> 4u;
+
+        uint64_t prg_rom_size = cartridge_nes2_rom_size(header[4], header[9] & 0x0f, 0x4000);
+        uint64_t chr_rom_size = cartridge_nes2_rom_size(header[5], header[9] >> 4u, 0x2000);
+
+        /* Sizes that fit are checked against the file by the callers */
+        if (prg_rom_size > UINT32_MAX || chr_rom_size > UINT32_MAX) {
+            return FALSE;
+        }
+
+        cart->prg_rom_size = (uint32_t) prg_rom_size;
+        cart->chr_rom_size = (uint32_t) chr_rom_size;
+
+        cart->prg_ram_size = cartridge_nes2_ram_size(header[10] & 0x0f);
+        cart->prg_nvram_size = cartridge_nes2_ram_size(header[10] >> 4u);
+        cart->chr_ram_size = cartridge_nes2_ram_size(header[11] & 0x0f);
+        cart->chr_nvram_size = cartridge_nes2_ram_size(header[11] >> 4u);
+
+        cart->region = (region_t) (header[12] & 0x03);
+        cart->nb_8k_ram_banks = (uint8_t) ((cart->prg_ram_size + cart->prg_nvram_size) / 0x2000);
+    } else {
+        /* Old dumpers wrote garbage ("DiskDude!") in bytes 7-15: the upper mapper nibble can't be trusted then */
+        if (header[12] != 0 || header[13] != 0 || header[14] != 0 || header[15] != 0) {
+            cart->mapper_type &= 0x0f;
+        }
+
+        cart->prg_rom_size = header[4] * 0x4000;
+        cart->chr_rom_size = header[5] * 0x2000;
+
+        /* A value of 0 infers 8KB for compatibility */
+        cart->nb_8k_ram_banks = header[8];
+        cart->prg_ram_size = (header[8] ? header[8] : 1) * 0x2000;
+        cart->chr_ram_size = header[5] ? 0 : 0x2000;
+
+        cart->region = get_bit_at(header[9], 0) ? REGION_PAL : REGION_NTSC;
+
+        if (cart->battery_ram) {
+            cart->prg_nvram_size = cart->prg_ram_size;
+            cart->prg_ram_size = 0;
+        }
+    }
+
+    cart->nb_16k_rom_banks = (uint16_t) (cart->prg_rom_size / 0x4000);
+    cart->nb_8k_vrom_banks = (uint16_t) (cart->chr_rom_size / 0x2000);
+    cart->is_pal = cart->region == REGION_PAL;
+
+    return TRUE;
+}
+
+static bool cartridge_parse(cartridge_t *cart, const char *file) {
+    size_t offset;
+
+    if (!cartridge_parse_header(cart, cart->image)) {
+        log_error("cartridge", "Not a valid NES file: %s", file);
+
+        return FALSE;
+    }
+
+    /* Locate banks */
+    offset = 16 + (cart->trainer ? 512 : 0);
+
+    if (offset + cart->prg_rom_size + cart->chr_rom_size > cart->image_size) {
+        log_error("cartridge", "Truncated NES file: %s", file);
+
+        return FALSE;
+    }
+
+    cart->rom = cart->image + offset;
+    cart->vrom = cart->rom + cart->prg_rom_size;
+
+    cart->crc = crc32_update(0, cart->rom, cart->prg_rom_size + cart->chr_rom_size);
+
+    return TRUE;
+}
+
+/* NES 2.0 ROM sizes: either a 12 bits number of banks, or 2^E * (MM * 2 + 1) bytes when the MSB nibble is 0xF */
+static uint64_t cartridge_nes2_rom_size(uint8_t lsb, uint8_t msb, uint32_t bank_size) {
+    if (msb == 0x0f) {
+        uint8_t exponent = lsb >> 2u;
+        uint8_t multiplier = lsb & 0x03u;
+
+        /* 2^31 * 7 at most in 64 bits: the caller rejects anything from 4GB, which can't be a real ROM */
+        if (exponent > 31) {
+            return UINT64_MAX;
+        }
+
+        return (1ull << exponent) * (multiplier * 2u + 1u);
+    }
+
+    return (uint64_t) ((msb << 8u) | lsb) * bank_size;
+}
+
+/* NES 2.0 RAM sizes: 64 << n bytes, 0 means none */
+static uint32_t cartridge_nes2_ram_size(uint8_t shift) {
+    return shift ? 64u << shift : 0;
+}
+
+/* Must be called with the cache lock held */
+static cartridge_t *cartridge_cache_find(const cartridge_t *cart) {
+    size_t banks_size = cart->prg_rom_size + cart->chr_rom_size;
+
+    for (cartridge_t *it = _cache; it != NULL; it = it->next) {
+        /* The CRC only narrows down the candidates, the header and banks must match exactly to share an entry */
+        if (it->crc == cart->crc && memcmp(it->image, cart->image, 16) == 0
+            && memcmp(it->rom, cart->rom, banks_size) == 0) {
+            return it;
+        }
+    }
+
+    return NULL;
+}
+
+static void cartridge_destroy(cartridge_t *cart) {
+    if (cart->image_mapped) {
+        munmap((void *) cart->image, cart->image_size);
+    } else {
+        free((void *) cart->image);
+    }
+
+    free((void *) cart->chr_tiles);
+    free(cart);
 }
@@ -5,30 +5,82 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
+
 #include "types.h"
 
+enum cartridge_region {
+    REGION_NTSC = 0,
+    REGION_PAL = 1,
+    REGION_MULTI = 2,
+    REGION_DENDY = 3
+};
+typedef enum cartridge_region region_t;
+
+/* Cartridges are immutable once loaded and shared by every instance running the same ROM: cartridge_load returns
+ * the cached cartridge when one with identical contents is already loaded, and cartridge_free only releases it
+ * when its last user is gone. Mutable state (RAM, mapper registers) belongs to the instances. */
 struct cartridge_s {
-    uint8_t *rom;
-    uint8_t *vrom;
+    /* Read-only mapping of the whole .nes file, or a private copy for ROMs loaded from memory */
+    const uint8_t *image;
+    size_t image_size;
+    bool image_mapped;
 
-    uint8_t mapper_type;
-    uint8_t nb_16k_rom_banks;
-    uint8_t nb_8k_vrom_banks;
+    /* PRG and CHR banks, pointing inside image */
+    const uint8_t *rom;
+    const uint8_t *vrom;
+
+    uint16_t mapper_type;
+    uint8_t submapper;
+    uint16_t nb_16k_rom_banks;
+    uint16_t nb_8k_vrom_banks;
     uint8_t nb_8k_ram_banks;
 
+    /* Sizes in bytes. NES 2.0 headers can describe ROMs that are not a whole number of banks. */
+    uint32_t prg_rom_size;
+    uint32_t chr_rom_size;
+    uint32_t prg_ram_size;
+    uint32_t prg_nvram_size;
+    uint32_t chr_ram_size;
+    uint32_t chr_nvram_size;
+
     bool vert_mirror;
     bool battery_ram;
     bool trainer;
     bool four_screen_vram;
     bool vs_system;
     bool is_pal;
+    bool nes2;
+    region_t region;
+
+    /* CRC32 of the PRG and CHR banks */
+    uint32_t crc;
+
+    /* Derived data, built on first use and shared like the banks */
+    const uint8_t *chr_tiles;
+
+    uint32_t refcount;
+    struct cartridge_s *next;
 };
 
 typedef struct cartridge_s cartridge_t;
 
 cartridge_t *cartridge_load(const char *file);
+/* Same as cartridge_load for a .nes image already in memory. The data is copied, the caller keeps ownership. */
+cartridge_t *cartridge_load_mem(const uint8_t *data, size_t size);
 void cartridge_free(cartridge_t *cartridge);
 
+/* Fills the header fields of cart from the 16 bytes of an iNES or NES 2.0 header. Returns FALSE if the magic is
+ * wrong. Does not check that the mapper is supported nor that the banks are present. */
+bool cartridge_parse_header(cartridge_t *cart, const uint8_t *header);
+
+/* CHR banks decoded to one byte per pixel (0-3), 64 bytes per tile: the tile at CHR offset n starts at n * 4.
+ * Returns NULL when the cartridge has no CHR ROM. */
+const uint8_t *cartridge_get_chr_tiles(cartridge_t *cartridge);
+
+/* Decodes one 16 bytes planar tile to 64 pixels */
+void chr_decode_tile(const uint8_t *tile, uint8_t *pixels);
+
 #ifdef __cplusplus
 }
 #endif
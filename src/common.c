@@ -5,43 +5,31 @@
 #include <ctype.h>
 
 #include "common.h"
+#include "log.h"
 
-void _log_print(const char *tag, const char *fmt, va_list args);
+static void (*_panic_handler)(void) = NULL;
 
-void _log_print(const char *tag, const char *fmt, va_list args) {
-    fprintf(stdout, "[%s]: ", tag);
-    vfprintf(stdout, fmt, args);
-}
-
-void _log(const char *tag, const char *fmt, ...) {
+void _panic(const char *fmt, ...) {
+    char msg[LOG_MAX_MESSAGE];
     va_list args;
 
     va_start(args, fmt);
-    _log_print(tag, fmt, args);
+    vsnprintf(msg, sizeof(msg), fmt, args);
     va_end(args);
-}
 
-void _panic(const char *fmt, ...) {
-    va_list args;
+    log_write(LOG_FATAL, "panic", "%s", msg);
+    log_flush();
 
-    va_start(args, fmt);
-    _log_print("FATAL", fmt, args);
-    va_end(args);
+    if (_panic_handler != NULL) {
+        _panic_handler();
+    }
 
     exit(1);
 }
 
-#ifdef DEBUG
-void _debug_log(const char *tag, const char *fmt, ...) {
-    va_list args;
-
-    va_start(args, fmt);
-    _log_print(tag, fmt, args);
-    va_end(args);
+void _set_panic_handler(void (*handler)(void)) {
+    _panic_handler = handler;
 }
-#else
-inline void _debug_log(const char *tag, const char *fmt, ...) {}
-#endif
 
 uint8_t get_bit_at(uint8_t c, uint8_t pos) {
     if (pos >= 8)
@@ -7,12 +7,10 @@ extern "C" {
 
 #include "types.h"
 
-/* Uncomment for debug output */
-//#define DEBUG 1
-
-void _log(const char *tag, const char *fmt, ...);
+/* Logs the message at LOG_FATAL, flushes the logs and exits */
 void _panic(const char *fmt, ...);
-void _debug_log(const char *tag, const char *fmt, ...);
+/* Called by _panic before exiting, after the message */
+void _set_panic_handler(void (*handler)(void));
 
 uint8_t get_bit_at(uint8_t c, uint8_t pos);
 uint16_t u8_to_u16(uint8_t lo, uint16_t hi);
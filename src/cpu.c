@@ -1,10 +1,14 @@
+#include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "cpu.h"
 #include "opcodes.h"
 #include "common.h"
-#include "mapper.h"
+#include "log.h"
+#include "profiler.h"
+#include "trace.h"
 
 bool page_crossed;
 
@@ -12,7 +16,7 @@ uint8_t get_opcode(cpu_t *cpu);
 uint8_t get_addr_page(uint16_t addr);
 
 /* Debug */
-void dump_state(cpu_t *cpu);
+static void dump_state(cpu_t *cpu);
 
 cpu_t *cpu_init(void) {
     cpu_t *cpu = malloc(sizeof(cpu_t));
@@ -27,8 +31,24 @@ cpu_t *cpu_init(void) {
     cpu->X = 0;
     cpu->Y = 0;
     cpu->P = 0;
+    cpu->ram = cpu->own_ram;
 
     cpu->clock = 0;
+    cpu->trace = NULL;
+    cpu->profiler = NULL;
+
+    cpu->buttons[0] = cpu->buttons[1] = 0;
+    cpu->joypad_shift[0] = cpu->joypad_shift[1] = 0;
+    cpu->joypad_strobe = FALSE;
+    cpu->fault[0] = '\0';
+
+#ifdef CPU_STATS
+    memset(&cpu->stats, 0, sizeof(cpu->stats));
+#endif
+
+    cpu->recording = TRUE;
+    memset(&cpu->recorder, 0, sizeof(cpu->recorder));
+    recorder_register(cpu);
 
     return cpu;
 }
@@ -39,25 +59,127 @@ void cpu_reset(cpu_t *cpu) {
     cpu->X = 0;
     cpu->Y = 0;
     cpu->P = (uint8_t) U | (uint8_t) I;
+    cpu->fault[0] = '\0';
 
-    memset(cpu->ram, 0x00, 0x0800);
-    memset(cpu->sram, 0xff, 0x2000);
+    memset(cpu->ram, 0x00, CPU_RAM_SIZE);
 
     cpu->PC = cpu_get_u16(cpu, RESET_VECTOR);
 }
 
 void cpu_free(cpu_t *cpu) {
+    recorder_unregister(cpu);
     free(cpu);
 }
 
-uint8_t cpu_tick(cpu_t *cpu) {
+void cpu_set_ram(cpu_t *cpu, uint8_t *ram) {
+    if (ram == NULL) {
+        ram = cpu->own_ram;
+    }
+
+    if (ram != cpu->ram) {
+        memcpy(ram, cpu->ram, CPU_RAM_SIZE);
+        cpu->ram = ram;
+    }
+}
+
+struct cpu_state_s {
+    uint64_t clock;
+    uint16_t PC;
+    uint8_t SP;
+    uint8_t A;
+    uint8_t X;
+    uint8_t Y;
+    uint8_t P;
+    uint8_t joypad_shift[2];
+    bool joypad_strobe;
+    uint8_t ram[CPU_RAM_SIZE];
+};
+typedef struct cpu_state_s cpu_state_t;
+
+size_t cpu_state_size(void) {
+    return sizeof(cpu_state_t);
+}
+
+void cpu_save_state(const cpu_t *cpu, uint8_t *buf) {
+    cpu_state_t state;
+
+    memset(&state, 0, sizeof(state));
+    state.clock = cpu->clock;
+    state.PC = cpu->PC;
+    state.SP = cpu->SP;
+    state.A = cpu->A;
+    state.X = cpu->X;
+    state.Y = cpu->Y;
+    state.P = cpu->P;
+    state.joypad_shift[0] = cpu->joypad_shift[0];
+    state.joypad_shift[1] = cpu->joypad_shift[1];
+    state.joypad_strobe = cpu->joypad_strobe;
+    memcpy(state.ram, cpu->ram, CPU_RAM_SIZE);
+
+    memcpy(buf, &state, sizeof(state));
+}
+
+void cpu_load_state(cpu_t *cpu, const uint8_t *buf) {
+    cpu_state_t state;
+
+    memcpy(&state, buf, sizeof(state));
+
+    cpu->clock = state.clock;
+    cpu->PC = state.PC;
+    cpu->SP = state.SP;
+    cpu->A = state.A;
+    cpu->X = state.X;
+    cpu->Y = state.Y;
+    cpu->P = state.P;
+    cpu->joypad_shift[0] = state.joypad_shift[0];
+    cpu->joypad_shift[1] = state.joypad_shift[1];
+    cpu->joypad_strobe = state.joypad_strobe;
+    memcpy(cpu->ram, state.ram, CPU_RAM_SIZE);
+    cpu->fault[0] = '\0';
+}
+
+void cpu_fault(cpu_t *cpu, const char *fmt, ...) {
+    va_list args;
+
+    if (cpu->fault[0] != '\0') {
+        return;
+    }
+
+    va_start(args, fmt);
+    vsnprintf(cpu->fault, sizeof(cpu->fault), fmt, args);
+    va_end(args);
+}
+
+uint16_t cpu_tick(cpu_t *cpu) {
     cpu->instr_cycles = 0;
 
     cpu_interrupt(cpu);
 
-    dump_state(cpu);
+    uint16_t pc = cpu->PC;
+    recorder_instruction_t *record = NULL;
+
+    if (cpu->recording) {
+        recorder_enter(cpu);
+        record = recorder_instruction(&cpu->recorder, (uint32_t) cpu->clock, pc);
+        record->a = cpu->A;
+        record->x = cpu->X;
+        record->y = cpu->Y;
+        record->p = cpu->P;
+        record->sp = cpu->SP;
+    }
+
+    if (cpu->trace != NULL) {
+        trace_cpu(cpu->trace, cpu);
+    }
+
+    if (log_enabled(LOG_TRACE)) {
+        dump_state(cpu);
+    }
 
     uint8_t opcode = get_opcode(cpu);
+    if (record != NULL) {
+        record->opcode = opcode;
+    }
     switch (opcode) {
         /* Add With Carry */
         case 0x69: cpu->addr_mode = IMMEDIATE;      cpu->instr_cycles += 2; ADC(cpu); break;
@@ -380,11 +502,19 @@ uint8_t cpu_tick(cpu_t *cpu) {
         case 0xfc: cpu->addr_mode = ABSOLUTE_X;     cpu->instr_cycles += 4; NOP(cpu); break;
 
         default:
-            _panic("Invalid OpCode: 0x%.2x (%s)\n", opcode, OPCODES[opcode]);
+            cpu_fault(cpu, "Invalid OpCode: 0x%.2x (%s) at $%04X", opcode, OPCODES[opcode], pc);
     }
 
     cpu->clock += cpu->instr_cycles;
 
+#ifdef CPU_STATS
+    cpu_stats_account(&cpu->stats, opcode, cpu->instr_cycles, (uint8_t) cpu->addr_mode);
+#endif
+
+    if (cpu->profiler != NULL) {
+        profiler_account(cpu->profiler, pc, cpu->instr_cycles, cpu->clock);
+    }
+
     return cpu->instr_cycles;
 }
 
@@ -392,12 +522,32 @@ void cpu_interrupt(cpu_t *cpu) {
     if (cpu->ppu->is_nmi) {
         cpu->ppu->is_nmi = FALSE;
         cpu->instr_cycles += 7;
+        CPU_STATS_EVENT(cpu, STATS_NMI);
 
         cpu_push_u16(cpu, cpu->PC);
         cpu_set_flag(cpu, B);
         cpu_push_u8(cpu, cpu->P);
 
         cpu->PC = cpu_get_u16(cpu, NMI_VECTOR);
+
+        if (cpu->profiler != NULL) {
+            profiler_interrupt(cpu->profiler, cpu->PC, (uint8_t) (cpu->SP + 3), TRUE);
+        }
+    } else if (cpu->ppu->dot >= cpu->mapper->irq_dot && !cpu_flag_is_set(cpu, I)) {
+        /* The board holds IRQ low until acknowledged, irq_dot stays in the past until then */
+        cpu->instr_cycles += 7;
+        CPU_STATS_EVENT(cpu, STATS_IRQ);
+
+        cpu_push_u16(cpu, cpu->PC);
+        cpu_unset_flag(cpu, B);
+        cpu_push_u8(cpu, cpu->P | (uint8_t) U);
+        cpu_set_flag(cpu, I);
+
+        cpu->PC = cpu_get_u16(cpu, IRQ_VECTOR);
+
+        if (cpu->profiler != NULL) {
+            profiler_interrupt(cpu->profiler, cpu->PC, (uint8_t) (cpu->SP + 3), FALSE);
+        }
     }
 }
 
@@ -491,59 +641,102 @@ uint16_t cpu_get_addr(cpu_t *cpu) {
             cpu->PC++;
             break;
         default:
-            _panic("cpu_load_value: Invalid AddrMode: %d\n", cpu->addr_mode);
+            cpu_fault(cpu, "cpu_load_value: Invalid AddrMode: %d", cpu->addr_mode);
     }
 
     return addr;
 }
 
+static inline void cpu_record_access(cpu_t *cpu, uint16_t addr, uint8_t value, uint8_t flags) {
+    if (cpu->recording) {
+        recorder_access(&cpu->recorder, addr, value, flags);
+    }
+}
+
+/* Flight recorder: PRG ROM reads, instruction fetches included, are left out. They are most of the accesses and
+ * the ROM has them. */
 uint8_t cpu_get_u8(cpu_t *cpu, uint16_t addr) {
+    uint8_t val;
+
+    if (cpu->profiler != NULL) {
+        profiler_bus_read(cpu->profiler, addr);
+    }
+
     if (addr < 0x2000) {
         /* RAM value */
         /* Addresses higher than 0x0800 are mirror of the first 0x0800 */
-        return cpu->ram[addr % 0x0800];
-    } else if (addr >= 0x2000 && addr <= 0x4000) {
-        if (addr == 0x2002) {
-            return ppu_get_status(cpu->ppu);
-        } else {
-            _panic("_get_u8 not implemented for addr: %04x\n", addr);
-            return 0;
-        }
+        CPU_STATS_READ(cpu, STATS_RAM);
+        val = cpu->ram[addr % 0x0800];
+    } else if (addr >= 0x2000 && addr < 0x4000) {
+        /* PPU registers, mirrored every 8 bytes */
+        CPU_STATS_READ(cpu, STATS_PPU);
+        val = ppu_get_u8(cpu->ppu, addr);
     } else if (addr >= 0x4000 && addr < 0x4020) {
         /* APU and I/O registers */
-        if (addr == 0x4016) {
-            /* joy 1 */
-            /*
-            byte ret = (byte)(_joystick[_joy1bit] ? 1 : 0);
-            _joy1bit++;
-            if (_joy1bit > 7)
-                _joy1bit = 0;
-            return ret;
-            */
-
-            _panic("_get_u8 not implemented for addr: %04x\n", addr);
-            return 0;
+        CPU_STATS_READ(cpu, STATS_APU_IO);
+        if (addr == 0x4016 || addr == 0x4017) {
+            /* Controllers: one button per read, A first, then 1s. Bit 6 is open bus, usually set. */
+            uint8_t port = addr & 0x01u;
+
+            if (cpu->joypad_strobe) {
+                val = (uint8_t) (0x40u | (cpu->buttons[port] & 0x01u));
+            } else {
+                val = (uint8_t) (0x40u | (cpu->joypad_shift[port] & 0x01u));
+                cpu->joypad_shift[port] = (uint8_t) (cpu->joypad_shift[port] >> 1u) | 0x80u;
+            }
+        } else if (addr == 0x4015) {
+            /* APU status: there is no APU, no channel is playing and there is no frame IRQ */
+            val = 0;
         } else {
-            _panic("_get_u8 not implemented for addr: %04x\n", addr);
+            cpu_fault(cpu, "_get_u8 not implemented for addr: %04x", addr);
             return 0;
         }
     } else if (addr >= 0x4020 && addr < 0x6000) {
         /* Expansion ROM (MMC5) */
-        _panic("_get_u8 not implemented for addr: %04x\n", addr);
-        return 0;
-        /*return _mapper.GetExRamByte((ushort)(addr - 0x4020));*/
+        CPU_STATS_READ(cpu, STATS_EXPANSION);
+        if (cpu->mapper->read == NULL) {
+            cpu_fault(cpu, "_get_u8 not implemented for addr: %04x", addr);
+            return 0;
+        }
+
+        val = cpu->mapper->read(cpu->mapper, addr);
     } else if (addr >= 0x6000 && addr < 0x8000) {
         /* SRAM Values */
-        return cpu->sram[addr - 0x6000];
+        CPU_STATS_READ(cpu, STATS_PRG_RAM);
+        val = mapper_get_ram_u8(cpu->mapper, addr);
     } else {
-        return get_prg_u8(addr - 0x8000);
+        CPU_STATS_READ(cpu, STATS_PRG_ROM);
+        return mapper_get_prg_u8(cpu->mapper, addr);
     }
+
+    cpu_record_access(cpu, addr, val, RECORDER_READ);
+    return val;
+}
+
+uint8_t cpu_peek_u8(cpu_t *cpu, uint16_t addr) {
+    if (addr < 0x2000) {
+        return cpu->ram[addr % 0x0800];
+    } else if (addr >= 0x6000 && addr < 0x8000) {
+        return mapper_get_ram_u8(cpu->mapper, addr);
+    } else if (addr >= 0x8000) {
+        return mapper_get_prg_u8(cpu->mapper, addr);
+    }
+
+    return 0;
 }
 
 uint16_t cpu_get_u16(cpu_t *cpu, uint16_t addr) {
+    if (cpu->profiler != NULL) {
+        profiler_bus_read(cpu->profiler, addr);
+        profiler_bus_read(cpu->profiler, (uint16_t) (addr + 1));
+    }
+
     if (addr < 0x2000) {
         /* RAM value */
         /* Addresses higher than 0x0800 are mirror of the first 0x0800 */
+        CPU_STATS_READS(cpu, STATS_RAM, 2);
+        cpu_record_access(cpu, addr, cpu->ram[addr % 0x800], RECORDER_READ);
+        cpu_record_access(cpu, (uint16_t) (addr + 1), cpu->ram[(addr % 0x800) + 1], RECORDER_READ);
         return (uint16_t) ((cpu->ram[(addr % 0x800) + 1] << 8u) + cpu->ram[(addr % 0x800)]);
     } else if (addr >= 0x4020 && addr < 0x6000) {
         /* Expansion ROM (MMC5) */
@@ -551,65 +744,113 @@ uint16_t cpu_get_u16(cpu_t *cpu, uint16_t addr) {
         /*return _mapper.GetExRamShort((ushort)(addr - 0x4020));*/
     } else if (addr >= 0x6000 && addr < 0x8000) {
         /* SRAM value */
-        return (uint16_t) ((cpu->sram[(addr - 0x6000) + 1] << 8u) + cpu->sram[(addr - 0x6000)]);
+        CPU_STATS_READS(cpu, STATS_PRG_RAM, 2);
+        cpu_record_access(cpu, addr, mapper_get_ram_u8(cpu->mapper, addr), RECORDER_READ);
+        cpu_record_access(cpu, (uint16_t) (addr + 1), mapper_get_ram_u8(cpu->mapper, addr + 1), RECORDER_READ);
+        return (uint16_t) ((mapper_get_ram_u8(cpu->mapper, addr + 1) << 8u) + mapper_get_ram_u8(cpu->mapper, addr));
     } else if (addr >= 0x8000) {
-        return get_prg_u16(addr - 0x8000);
+        CPU_STATS_READS(cpu, STATS_PRG_ROM, 2);
+        return (uint16_t) ((mapper_get_prg_u8(cpu->mapper, addr + 1) << 8u) + mapper_get_prg_u8(cpu->mapper, addr));
     } else {
         return 0;
     }
 }
 
 void cpu_set_u8(cpu_t *cpu, uint16_t addr, uint8_t val) {
+    cpu_record_access(cpu, addr, val, RECORDER_WRITE);
+
+    if (cpu->profiler != NULL) {
+        profiler_bus_write(cpu->profiler, addr);
+    }
+
     if (addr < 0x2000) {
         /* RAM value */
         /* Addresses higher than 0x0800 are mirror of the first 0x0800 */
+        CPU_STATS_WRITE(cpu, STATS_RAM);
         cpu->ram[addr % 0x800] = val;
     } else if (addr >= 0x2000 && addr < 0x4000) {
-        /* PPU Status registers */
-        return;
-        /*_ppu->set_u8(addr, val);*/
+        /* PPU registers, mirrored every 8 bytes */
+        CPU_STATS_WRITE(cpu, STATS_PPU);
+        ppu_set_u8(cpu->ppu, addr, val);
     } else if (addr >= 0x4000 && addr < 0x4020) {
         /* APU and I/O registers */
+        CPU_STATS_WRITE(cpu, STATS_APU_IO);
         if (addr == 0x4014) {
-            /* sprite dma */
-            /*ushort addr = (ushort)(val * 0x100);*/
-            /*for (int oamAddr = 0; oamAddr < 256; oamAddr++)*/
-            /*{*/
-            /*_ppu._oam[oamAddr] = cpu->ram[addr + oamAddr];*/
-            /*}*/
+            /* sprite dma, from internal RAM only */
+            if (val < 0x20) {
+                ppu_oam_dma(cpu->ppu, cpu->ram + (val & 0x07u) * 0x100);
+            }
+            cpu->instr_cycles += 513;
+            CPU_STATS_EVENT(cpu, STATS_DMA);
         } else if (addr == 0x4016) {
-            /*if (val == 1) {*/
-            /*_joy1bit = 0;*/
-            /*}*/
+            /* Controllers reload their shift registers while the strobe is high */
+            cpu->joypad_strobe = val & 0x01u;
+            if (cpu->joypad_strobe) {
+                cpu->joypad_shift[0] = cpu->buttons[0];
+                cpu->joypad_shift[1] = cpu->buttons[1];
+            }
         }
     } else if (addr >= 0x4020 && addr < 0x6000) {
         /* Expansion ROM (MMC5) */
-        /*_mapper.SetExRamByte((ushort)(addr - 0x4020), val);*/
-    } else if (addr >= 0x8000) {
-        /*_mapper.SetPrgByte((ushort)(addr - 0x8000), val);*/
+        CPU_STATS_WRITE(cpu, STATS_EXPANSION);
+        if (cpu->mapper->write != NULL) {
+            cpu->mapper->write(cpu->mapper, addr, val);
+        }
+    } else if (addr >= 0x6000 && addr < 0x8000) {
+        /* SRAM value */
+        CPU_STATS_WRITE(cpu, STATS_PRG_RAM);
+        mapper_set_ram_u8(cpu->mapper, addr, val);
+    } else {
+        /* Mapper registers */
+        CPU_STATS_WRITE(cpu, STATS_PRG_ROM);
+        if (cpu->mapper->write != NULL) {
+            cpu->mapper->write(cpu->mapper, addr, val);
+        }
+    }
+}
+
+void cpu_modify_u8(cpu_t *cpu, uint16_t addr, uint8_t old, uint8_t val) {
+    if (addr < 0x8000) {
+        cpu_set_u8(cpu, addr, val);
+        return;
     }
+
+    cpu_set_u8(cpu, addr, old);
+    cpu->mapper->consecutive_write = TRUE;
+    cpu_set_u8(cpu, addr, val);
+    cpu->mapper->consecutive_write = FALSE;
 }
 
 /* Stack */
 void cpu_push_u8(cpu_t *cpu, uint8_t val) {
+    CPU_STATS_WRITE(cpu, STATS_RAM);
+    cpu_record_access(cpu, 0x100 + cpu->SP, val, RECORDER_WRITE);
+    if (cpu->profiler != NULL) {
+        profiler_bus_write(cpu->profiler, 0x100 + cpu->SP);
+    }
     cpu->ram[0x100 + cpu->SP] = val;
     cpu->SP--;
 }
 
 void cpu_push_u16(cpu_t *cpu, uint16_t val) {
-    _debug_log("STACK", "Pushing 0x%04x to stack\n", val);
+    log_trace("STACK", "Pushing 0x%04x to stack", val);
     cpu_push_u8(cpu, (uint8_t) (val >> 8u));
     cpu_push_u8(cpu, (uint8_t) (val & 0xffu));
 }
 
 uint8_t cpu_pop_u8(cpu_t *cpu) {
+    CPU_STATS_READ(cpu, STATS_RAM);
     cpu->SP++;
+    if (cpu->profiler != NULL) {
+        profiler_bus_read(cpu->profiler, 0x100 + cpu->SP);
+    }
+    cpu_record_access(cpu, 0x100 + cpu->SP, cpu->ram[0x100 + cpu->SP], RECORDER_READ);
     return cpu->ram[0x100 + cpu->SP];
 }
 
 uint16_t cpu_pop_u16(cpu_t *cpu) {
     uint16_t val = cpu_pop_u8(cpu) + (cpu_pop_u8(cpu) << 8u);
-    _debug_log("STACK", "Popped 0x%04x from stack\n", val);
+    log_trace("STACK", "Popped 0x%04x from stack", val);
     return val;
 }
 
@@ -662,6 +903,7 @@ bool cpu_flag_is_set(cpu_t *cpu, Flag flag) {
 void cpu_increment_cycles_if_page_crossed(cpu_t *cpu) {
     if (page_crossed) {
         cpu->instr_cycles++;
+        CPU_STATS_EVENT(cpu, STATS_PAGE_CROSS);
     }
 }
 
@@ -674,12 +916,11 @@ inline uint8_t get_addr_page(uint16_t addr) {
 }
 
 /* Debug */
-#ifdef DEBUG
 #pragma clang diagnostic push
 #pragma ide diagnostic ignored "hicpp-signed-bitwise"
-void dump_state(cpu_t *cpu) {
+static void dump_state(cpu_t *cpu) {
     uint8_t p = cpu->P & ~U;
-    uint8_t op = cpu_get_u8(cpu, cpu->PC);
+    uint8_t op = cpu_peek_u8(cpu, cpu->PC);
     char flags[9];
 
     flags[0] = p & N ? 'N' : '-';
@@ -692,10 +933,8 @@ void dump_state(cpu_t *cpu) {
     flags[7] = p & C ? 'C' : '-';
     flags[8] = '\0';
 
-    _debug_log("CPU", "[OP: %s (0x%02x), PC: 0x%04x, SP: 0x%02x, A: 0x%02x, X: 0x%02x, Y: 0x%02x, P: 0x%02x (%s), CL: %10d]\n",
-            OPCODES[op], op, cpu->PC, cpu->SP, cpu->A, cpu->X, cpu->Y, p, flags, cpu->clock);
+    log_trace("CPU", "[OP: %s (0x%02x), PC: 0x%04x, SP: 0x%02x, A: 0x%02x, X: 0x%02x, Y: 0x%02x, P: 0x%02x (%s), "
+                     "CL: %10lu]", OPCODES[op], op, cpu->PC, cpu->SP, cpu->A, cpu->X, cpu->Y, p, flags,
+              (unsigned long) cpu->clock);
 }
 #pragma clang diagnostic pop
-#else
-inline void dump_state(cpu_t *cpu) { }
-#endif
\ No newline at end of file
@@ -6,7 +6,10 @@ extern "C" {
 #endif
 
 #include "types.h"
+#include "cpu_stats.h"
+#include "mapper.h"
 #include "ppu.h"
+#include "recorder.h"
 
 enum addr_mode {
     IMMEDIATE,
@@ -25,6 +28,12 @@ enum addr_mode {
 };
 typedef enum addr_mode addr_mode_t;
 
+#define CPU_FAULT_SIZE 128
+#define CPU_RAM_SIZE 0x0800
+
+struct profiler_s;
+struct trace_s;
+
 struct cpu_s {
     uint16_t PC; /* Program Counter */
     uint8_t SP; /* Stack Pointer */
@@ -33,14 +42,39 @@ struct cpu_s {
     uint8_t Y;  /* Index Register Y */
     uint8_t P;  /* Processor Status (see Flags) */
 
-    uint8_t ram[0x0800];
-    uint8_t sram[0x2000];
+    /* own_ram unless the owner gave another one, see cpu_set_ram */
+    uint8_t *ram;
 
     ppu_t *ppu;
+    mapper_t *mapper;
     uint64_t clock;
 
+    /* Instruction trace, see trace.h */
+    struct trace_s *trace;
+    /* Guest profiler, see profiler.h */
+    struct profiler_s *profiler;
+
+    /* Controllers: buttons held, set by the owner (bit 0 A, B, Select, Start, Up, Down, Left, bit 7 Right), and the
+       shift registers read through $4016 / $4017 */
+    uint8_t buttons[2];
+    uint8_t joypad_shift[2];
+    bool joypad_strobe;
+
     addr_mode_t addr_mode;
-    uint8_t instr_cycles;
+    uint16_t instr_cycles;
+
+    /* What the emulator could not handle, see cpu_fault. Empty while the CPU runs fine. */
+    char fault[CPU_FAULT_SIZE];
+
+    /* Last instructions and bus accesses, see recorder.h. Recorded while recording is set, from cpu_init on. */
+    bool recording;
+    recorder_t recorder;
+
+    uint8_t own_ram[CPU_RAM_SIZE];
+
+#ifdef CPU_STATS
+    cpu_stats_t stats;
+#endif
 };
 typedef struct cpu_s cpu_t;
 
@@ -87,13 +121,32 @@ static const char *OPCODES[256] = {
 cpu_t *cpu_init(void);
 void cpu_free(cpu_t *cpu);
 void cpu_reset(cpu_t *cpu);
-uint8_t cpu_tick(cpu_t *cpu);
+uint16_t cpu_tick(cpu_t *cpu);
 void cpu_interrupt(cpu_t *cpu);
 
+/* Keeps the internal RAM in ram, CPU_RAM_SIZE bytes the caller keeps alive, from now on. The current contents are
+ * copied there. NULL goes back to the CPU's own. */
+void cpu_set_ram(cpu_t *cpu, uint8_t *ram);
+
+/* Something the emulator doesn't handle, an invalid opcode or a register it doesn't have: keeps the first message in
+ * cpu->fault. The instruction completes as best it can, the owner stops running the CPU there (see nes_step_frame).
+ * Cleared by a reset or a state load. */
+void cpu_fault(cpu_t *cpu, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/* State: registers, clock, internal RAM and controller shift registers */
+size_t cpu_state_size(void);
+void cpu_save_state(const cpu_t *cpu, uint8_t *buf);
+void cpu_load_state(cpu_t *cpu, const uint8_t *buf);
+
 /* Read / Write RAM */
 uint8_t cpu_get_u8(cpu_t *cpu, uint16_t addr);
+/* Same as cpu_get_u8 for memory, 0 for registers: reading them has side effects */
+uint8_t cpu_peek_u8(cpu_t *cpu, uint16_t addr);
 uint16_t cpu_get_u16(cpu_t *cpu, uint16_t addr);
 void cpu_set_u8(cpu_t *cpu, uint16_t addr, uint8_t val);
+/* Write of a read-modify-write instruction, which writes old back before val, on the next cycle. Only the board
+ * registers see both writes, see mapper_t.consecutive_write. */
+void cpu_modify_u8(cpu_t *cpu, uint16_t addr, uint8_t old, uint8_t val);
 uint16_t cpu_get_addr(cpu_t *cpu);
 
 /* Stack */
@@ -0,0 +1,88 @@
+#include <string.h>
+
+#include "cpu.h"
+#include "cpu_stats.h"
+
+#ifdef CPU_STATS
+
+static const char *REGIONS[STATS_REGIONS] = {"ram", "ppu", "apu_io", "expansion", "prg_ram", "prg_rom"};
+
+static const char *ADDR_MODES[CPU_STATS_ADDR_MODES] = {
+    "IMMEDIATE", "ABSOLUTE", "ABSOLUTE_X", "ABSOLUTE_Y", "ZERO_PAGE", "ZERO_PAGE_X", "ZERO_PAGE_Y", "IMPLIED",
+    "ACCUMULATOR", "INDIRECT", "INDIRECT_X", "INDIRECT_Y", "RELATIVE"
+};
+
+/* Branches are the xxx10000 opcodes */
+static bool is_branch(uint8_t opcode) {
+    return (opcode & 0x1fu) == 0x10;
+}
+
+void cpu_stats_dump_json(const cpu_t *cpu, FILE *fp) {
+    const cpu_stats_t *stats = &cpu->stats;
+    uint64_t instructions = 0, cycles = 0;
+    uint64_t addr_mode_counts[CPU_STATS_ADDR_MODES] = {0};
+    bool first = TRUE;
+
+    for (int op = 0; op < 256; op++) {
+        instructions += stats->opcodes[op].executions;
+        cycles += stats->opcodes[op].cycles;
+        addr_mode_counts[stats->opcodes[op].addr_mode] += stats->opcodes[op].executions;
+    }
+
+    fprintf(fp, "{\n  \"instructions\": %lu,\n  \"cycles\": %lu,\n  \"clock\": %lu,\n",
+            (unsigned long) instructions, (unsigned long) cycles, (unsigned long) cpu->clock);
+    fprintf(fp, "  \"interrupts\": {\"nmi\": %lu, \"irq\": %lu},\n  \"oam_dma\": %lu,\n",
+            (unsigned long) stats->nmis, (unsigned long) stats->irqs, (unsigned long) stats->dmas);
+
+    fprintf(fp, "  \"opcodes\": [");
+    for (int op = 0; op < 256; op++) {
+        const cpu_stats_opcode_t *counts = &stats->opcodes[op];
+
+        if (counts->executions == 0) {
+            continue;
+        }
+
+        fprintf(fp, "%s\n    {\"opcode\": \"%02X\", \"name\": \"%s\", \"mode\": \"%s\", \"executions\": %lu, "
+                    "\"cycles\": %lu, \"page_crosses\": %lu", first ? "" : ",", op, OPCODES[op],
+                ADDR_MODES[counts->addr_mode], (unsigned long) counts->executions,
+                (unsigned long) counts->cycles, (unsigned long) counts->page_crosses);
+
+        if (is_branch((uint8_t) op)) {
+            fprintf(fp, ", \"taken\": %lu, \"not_taken\": %lu, \"taken_page_crosses\": %lu",
+                    (unsigned long) counts->branches_taken,
+                    (unsigned long) (counts->executions - counts->branches_taken),
+                    (unsigned long) counts->branch_page_crosses);
+        }
+
+        fprintf(fp, "}");
+        first = FALSE;
+    }
+    fprintf(fp, "\n  ],\n");
+
+    fprintf(fp, "  \"addressing_modes\": {");
+    for (int m = 0; m < CPU_STATS_ADDR_MODES; m++) {
+        fprintf(fp, "%s\"%s\": %lu", m > 0 ? ", " : "", ADDR_MODES[m], (unsigned long) addr_mode_counts[m]);
+    }
+    fprintf(fp, "},\n");
+
+    /* Index is the number of cycles, the last entry counts the longer instructions */
+    fprintf(fp, "  \"cycle_histogram\": [");
+    for (int c = 0; c < CPU_STATS_HISTOGRAM_SIZE; c++) {
+        fprintf(fp, "%s%lu", c > 0 ? ", " : "", (unsigned long) stats->cycle_histogram[c]);
+    }
+    fprintf(fp, "],\n");
+
+    fprintf(fp, "  \"bus\": {\n");
+    for (int rw = 0; rw < 2; rw++) {
+        const uint64_t *counts = rw == 0 ? stats->reads : stats->writes;
+
+        fprintf(fp, "    \"%s\": {", rw == 0 ? "reads" : "writes");
+        for (int r = 0; r < STATS_REGIONS; r++) {
+            fprintf(fp, "%s\"%s\": %lu", r > 0 ? ", " : "", REGIONS[r], (unsigned long) counts[r]);
+        }
+        fprintf(fp, "}%s\n", rw == 0 ? "," : "");
+    }
+    fprintf(fp, "  }\n}\n");
+}
+
+#endif
@@ -0,0 +1,123 @@
+#ifndef __CPU_STATS_H__
+#define __CPU_STATS_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+
+#include "types.h"
+
+/* Execution counters, built with -DACIDNES_CPU_STATS=ON (which defines CPU_STATS). Without it, the counters are not
+ * part of cpu_t and every CPU_STATS_* macro expands to nothing.
+ *
+ * Cost when built in: a few memory increments per instruction and one per bus access, no clock read. bench -f
+ * cpu.nestest in Release runs 2 to 3% slower than without them, about the run to run noise of a shared machine.
+ *
+ * Per opcode: executions, cycles, page cross penalties, taken branches (not taken is executions - taken), plus the
+ * addressing modes, a histogram of cycles per instruction and the bus accesses per region. Interrupts and OAM DMA
+ * are counted on their own, their cycles are not charged to the instruction they happen on. */
+
+enum cpu_stats_region {
+    STATS_RAM,
+    STATS_PPU,
+    STATS_APU_IO,
+    STATS_EXPANSION,
+    STATS_PRG_RAM,
+    STATS_PRG_ROM,
+    STATS_REGIONS
+};
+
+/* Things that happened during the current instruction, accounted once it is done */
+enum cpu_stats_events {
+    STATS_PAGE_CROSS = 0x01,
+    STATS_BRANCH_TAKEN = 0x02,
+    STATS_BRANCH_PAGE_CROSS = 0x04,
+    STATS_NMI = 0x08,
+    STATS_IRQ = 0x10,
+    STATS_DMA = 0x20
+};
+
+#define CPU_STATS_HISTOGRAM_SIZE 16
+#define CPU_STATS_ADDR_MODES 13
+
+/* 48 bytes per opcode, in one or two cache lines: accounting an instruction only touches its opcode's entry, the
+ * pending events and one histogram bucket */
+struct cpu_stats_opcode_s {
+    uint64_t executions;
+    uint64_t cycles;
+    uint64_t page_crosses;
+    uint64_t branches_taken;
+    uint64_t branch_page_crosses;
+    /* Fixed per opcode, the count per mode is summed when dumping */
+    uint8_t addr_mode;
+};
+typedef struct cpu_stats_opcode_s cpu_stats_opcode_t;
+
+struct cpu_stats_s {
+    cpu_stats_opcode_t opcodes[256];
+
+    /* Instructions by cycle count, the last bucket holds the longer ones */
+    uint64_t cycle_histogram[CPU_STATS_HISTOGRAM_SIZE];
+
+    uint64_t reads[STATS_REGIONS];
+    uint64_t writes[STATS_REGIONS];
+
+    uint64_t nmis;
+    uint64_t irqs;
+    uint64_t dmas;
+
+    uint8_t events;
+};
+typedef struct cpu_stats_s cpu_stats_t;
+
+#ifdef CPU_STATS
+#define CPU_STATS_EVENT(cpu, event) ((cpu)->stats.events |= (uint8_t) (event))
+#define CPU_STATS_READ(cpu, region) ((cpu)->stats.reads[region]++)
+#define CPU_STATS_READS(cpu, region, n) ((cpu)->stats.reads[region] += (n))
+#define CPU_STATS_WRITE(cpu, region) ((cpu)->stats.writes[region]++)
+#else
+#define CPU_STATS_EVENT(cpu, event) ((void) 0)
+#define CPU_STATS_READ(cpu, region) ((void) 0)
+#define CPU_STATS_READS(cpu, region, n) ((void) 0)
+#define CPU_STATS_WRITE(cpu, region) ((void) 0)
+#endif
+
+/* Accounts the instruction that just executed, called by cpu_tick. Inline: it runs for every instruction. */
+static inline void cpu_stats_account(cpu_stats_t *stats, uint8_t opcode, uint16_t cycles, uint8_t addr_mode) {
+    cpu_stats_opcode_t *op = &stats->opcodes[opcode];
+    uint8_t events = stats->events;
+
+    if (events != 0) {
+        /* Interrupts and DMA are not the instruction's doing */
+        if (events & (STATS_NMI | STATS_IRQ)) {
+            cycles -= 7;
+            stats->nmis += (events & STATS_NMI) != 0;
+            stats->irqs += (events & STATS_IRQ) != 0;
+        }
+        if (events & STATS_DMA) {
+            cycles -= 513;
+            stats->dmas++;
+        }
+
+        op->page_crosses += (events & STATS_PAGE_CROSS) != 0;
+        op->branches_taken += (events & STATS_BRANCH_TAKEN) != 0;
+        op->branch_page_crosses += (events & STATS_BRANCH_PAGE_CROSS) != 0;
+        stats->events = 0;
+    }
+
+    op->executions++;
+    op->cycles += cycles;
+    op->addr_mode = addr_mode;
+    stats->cycle_histogram[cycles < CPU_STATS_HISTOGRAM_SIZE ? cycles : CPU_STATS_HISTOGRAM_SIZE - 1]++;
+}
+
+struct cpu_s;
+
+void cpu_stats_dump_json(const struct cpu_s *cpu, FILE *fp);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __CPU_STATS_H__ */
@@ -0,0 +1,190 @@
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC32_HAVE_CLMUL 1
+#endif
+
+#include "crc32.h"
+
+#define CRC32_POLY 0xedb88320u
+
+/* The folding kernel works on 16 bytes blocks and needs at least 64 of them */
+#define CRC32_CLMUL_MIN_SIZE 64
+
+static uint32_t _tables[8][256];
+static uint32_t (*_crc32_impl)(uint32_t crc, const uint8_t *p, size_t size);
+static pthread_once_t _crc32_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc32_slice8(uint32_t crc, const uint8_t *p, size_t size);
+
+#ifdef CRC32_HAVE_CLMUL
+static uint32_t crc32_clmul(uint32_t crc, const uint8_t *p, size_t size);
+#endif
+
+static void crc32_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+
+        for (int k = 0; k < 8; k++) {
+            c = c & 1u ? CRC32_POLY ^ (c >> 1u) : c >> 1u;
+        }
+
+        _tables[0][i] = c;
+    }
+
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            _tables[t][i] = _tables[0][_tables[t - 1][i] & 0xffu] ^ (_tables[t - 1][i] >> 8u);
+        }
+    }
+
+    _crc32_impl = crc32_slice8;
+
+#ifdef CRC32_HAVE_CLMUL
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+        _crc32_impl = crc32_clmul;
+    }
+#endif
+}
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t size) {
+    pthread_once(&_crc32_once, crc32_init);
+
+    return ~_crc32_impl(~crc, data, size);
+}
+
+uint32_t crc32_update_generic(uint32_t crc, const void *data, size_t size) {
+    pthread_once(&_crc32_once, crc32_init);
+
+    return ~crc32_slice8(~crc, data, size);
+}
+
+/* Works on the pre-inverted CRC */
+static uint32_t crc32_slice8(uint32_t crc, const uint8_t *p, size_t size) {
+    uint32_t lo, hi;
+
+    while (size >= 8) {
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        lo = __builtin_bswap32(lo);
+        hi = __builtin_bswap32(hi);
+#endif
+
+        lo ^= crc;
+        crc = _tables[7][lo & 0xffu] ^ _tables[6][(lo >> 8u) & 0xffu]
+              ^ _tables[5][(lo >> 16u) & 0xffu] ^ _tables[4][lo >> 24u]
+              ^ _tables[3][hi & 0xffu] ^ _tables[2][(hi >> 8u) & 0xffu]
+              ^ _tables[1][(hi >> 16u) & 0xffu] ^ _tables[0][hi >> 24u];
+
+        p += 8;
+        size -= 8;
+    }
+
+    while (size--) {
+        crc = _tables[0][(crc ^ *p++) & 0xffu] ^ (crc >> 8u);
+    }
+
+    return crc;
+}
+
+#ifdef CRC32_HAVE_CLMUL
+/* Folding with carry-less multiplications, from Intel's "Fast CRC Computation for Generic Polynomials Using
+ * PCLMULQDQ Instruction". The constants are the bit-reflected k1-k5 and Barrett values for the IEEE polynomial.
+ * Works on the pre-inverted CRC. */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_clmul(uint32_t crc, const uint8_t *p, size_t size) {
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5k0 = _mm_set_epi64x(0x0000000000, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+    __m128i x1, x2, x3, x4, x5, x6, x7, x8;
+    size_t tail;
+
+    if (size < CRC32_CLMUL_MIN_SIZE) {
+        return crc32_slice8(crc, p, size);
+    }
+
+    tail = size & 15u;
+    size -= tail;
+
+    x1 = _mm_loadu_si128((const __m128i *) (p + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *) (p + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *) (p + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *) (p + 0x30));
+
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int) crc));
+
+    p += 64;
+    size -= 64;
+
+    /* Fold 4 x 128 bits in parallel */
+    while (size >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *) (p + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *) (p + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *) (p + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *) (p + 0x30)));
+
+        p += 64;
+        size -= 64;
+    }
+
+    /* Fold the 4 lanes into one */
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    /* Remaining 16 bytes blocks */
+    while (size >= 16) {
+        x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *) p)), x5);
+
+        p += 16;
+        size -= 16;
+    }
+
+    /* 128 to 64 bits */
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask32);
+    x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction to 32 bits */
+    x2 = _mm_and_si128(x1, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+    x2 = _mm_and_si128(x2, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    crc = (uint32_t) _mm_extract_epi32(x1, 1);
+
+    return crc32_slice8(crc, p, tail);
+}
+#endif
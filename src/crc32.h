@@ -0,0 +1,24 @@
+#ifndef __CRC32_H__
+#define __CRC32_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+#include "types.h"
+
+/* CRC-32 (IEEE 802.3, same as zlib and the ROM databases). Start with crc = 0 and feed the previous result to
+ * continue a checksum: crc32_update(crc32_update(0, a, n), b, m) is the CRC of a followed by b.
+ *
+ * Uses carry-less multiplication folding (PCLMULQDQ) when the CPU supports it, slicing-by-8 tables otherwise. */
+uint32_t crc32_update(uint32_t crc, const void *data, size_t size);
+
+/* Portable implementation, always available. Used as a reference by the tests. */
+uint32_t crc32_update_generic(uint32_t crc, const void *data, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __CRC32_H__ */
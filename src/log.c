@@ -0,0 +1,270 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+/* Single producer (the thread owning it) and single consumer (whoever holds _flush_lock) */
+struct log_buffer_s {
+    char data[LOG_BUFFER_SIZE];
+    uint64_t head;
+    uint64_t tail;
+    uint64_t dropped;
+    /* Taken by a thread, given back when it exits */
+    int in_use;
+    struct log_buffer_s *next;
+};
+typedef struct log_buffer_s log_buffer_t;
+
+static const char *LEVELS[] = {"TRACE", "DEBUG", "INFO", "WARN", "ERROR", "FATAL", "OFF"};
+
+log_level_t _log_level = LOG_INFO;
+
+/* Buffers are only ever added, at the head */
+static log_buffer_t *_buffers = NULL;
+static __thread log_buffer_t *_buffer = NULL;
+
+static pthread_mutex_t _flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _flush_wake = PTHREAD_COND_INITIALIZER;
+static pthread_once_t _once = PTHREAD_ONCE_INIT;
+static pthread_key_t _buffer_key;
+static pthread_t _flusher;
+static bool _flusher_running = FALSE;
+static bool _flusher_stop = FALSE;
+static int _fd = STDERR_FILENO;
+
+static void log_init(void);
+static log_buffer_t *log_buffer(void);
+static void log_release_buffer(void *buffer);
+static void *log_flusher_run(void *arg);
+static void log_drain(void);
+static void log_write_all(const char *data, size_t size);
+static void log_before_fork(void);
+static void log_after_fork_parent(void);
+static void log_after_fork_child(void);
+
+void log_write(log_level_t level, const char *tag, const char *fmt, ...) {
+    char msg[LOG_MAX_MESSAGE];
+    log_buffer_t *buffer;
+    va_list args;
+    uint64_t head, tail;
+    size_t len, offset;
+    int n;
+
+    buffer = log_buffer();
+    if (buffer == NULL) {
+        return;
+    }
+
+    n = snprintf(msg, sizeof(msg), "[%s][%s] ", LEVELS[level], tag);
+    va_start(args, fmt);
+    n += vsnprintf(msg + n, sizeof(msg) - (size_t) n, fmt, args);
+    va_end(args);
+
+    /* One line per message, whether the format ends with a newline or not */
+    len = (size_t) n < sizeof(msg) - 1 ? (size_t) n : sizeof(msg) - 2;
+    if (msg[len - 1] != '\n') {
+        msg[len++] = '\n';
+    }
+
+    head = buffer->head;
+    tail = __atomic_load_n(&buffer->tail, __ATOMIC_ACQUIRE);
+    if (LOG_BUFFER_SIZE - (head - tail) < len) {
+        __atomic_fetch_add(&buffer->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    offset = head & (LOG_BUFFER_SIZE - 1);
+    if (offset + len <= LOG_BUFFER_SIZE) {
+        memcpy(buffer->data + offset, msg, len);
+    } else {
+        memcpy(buffer->data + offset, msg, LOG_BUFFER_SIZE - offset);
+        memcpy(buffer->data, msg + LOG_BUFFER_SIZE - offset, len - (LOG_BUFFER_SIZE - offset));
+    }
+
+    __atomic_store_n(&buffer->head, head + len, __ATOMIC_RELEASE);
+}
+
+void log_set_level(log_level_t level) {
+    _log_level = level;
+}
+
+bool log_set_level_name(const char *name) {
+    for (int level = LOG_TRACE; level <= LOG_OFF; level++) {
+        if (strcasecmp(name, LEVELS[level]) == 0) {
+            log_set_level((log_level_t) level);
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+void log_set_output(int fd) {
+    pthread_mutex_lock(&_flush_lock);
+    log_drain();
+    _fd = fd;
+    pthread_mutex_unlock(&_flush_lock);
+}
+
+void log_flush(void) {
+    pthread_mutex_lock(&_flush_lock);
+    log_drain();
+    pthread_mutex_unlock(&_flush_lock);
+}
+
+void log_shutdown(void) {
+    bool running;
+
+    pthread_mutex_lock(&_flush_lock);
+    running = _flusher_running;
+    _flusher_stop = TRUE;
+    _flusher_running = FALSE;
+    pthread_cond_signal(&_flush_wake);
+    pthread_mutex_unlock(&_flush_lock);
+
+    if (running) {
+        pthread_join(_flusher, NULL);
+    }
+
+    log_flush();
+}
+
+static void log_init(void) {
+    pthread_key_create(&_buffer_key, log_release_buffer);
+    pthread_atfork(log_before_fork, log_after_fork_parent, log_after_fork_child);
+    atexit(log_shutdown);
+
+    if (pthread_create(&_flusher, NULL, log_flusher_run, NULL) == 0) {
+        _flusher_running = TRUE;
+    } else {
+        fprintf(stderr, "Unable to start the log flusher, logs are written on log_flush only\n");
+    }
+}
+
+static log_buffer_t *log_buffer(void) {
+    log_buffer_t *buffer;
+
+    if (_buffer != NULL) {
+        return _buffer;
+    }
+
+    pthread_once(&_once, log_init);
+
+    /* One given back by a thread that exited, or a new one */
+    for (buffer = __atomic_load_n(&_buffers, __ATOMIC_ACQUIRE); buffer != NULL; buffer = buffer->next) {
+        int expected = 0;
+
+        if (__atomic_compare_exchange_n(&buffer->in_use, &expected, 1, FALSE, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    if (buffer == NULL) {
+        buffer = calloc(1, sizeof(log_buffer_t));
+        if (buffer == NULL) {
+            return NULL;
+        }
+
+        buffer->in_use = 1;
+        buffer->next = __atomic_load_n(&_buffers, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&_buffers, &buffer->next, buffer, TRUE, __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED)) {
+        }
+    }
+
+    _buffer = buffer;
+    pthread_setspecific(_buffer_key, buffer);
+
+    return buffer;
+}
+
+/* Thread exit: what is left in the buffer is still flushed, before what the next owner logs */
+static void log_release_buffer(void *buffer) {
+    __atomic_store_n(&((log_buffer_t *) buffer)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void *log_flusher_run(void *arg) {
+    (void) arg;
+
+    pthread_mutex_lock(&_flush_lock);
+    while (!_flusher_stop) {
+        struct timespec until;
+
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += LOG_FLUSH_INTERVAL * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+
+        pthread_cond_timedwait(&_flush_wake, &_flush_lock, &until);
+        log_drain();
+    }
+    pthread_mutex_unlock(&_flush_lock);
+
+    return NULL;
+}
+
+/* Under _flush_lock */
+static void log_drain(void) {
+    for (log_buffer_t *buffer = __atomic_load_n(&_buffers, __ATOMIC_ACQUIRE); buffer != NULL;
+         buffer = buffer->next) {
+        uint64_t head = __atomic_load_n(&buffer->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = buffer->tail;
+        uint64_t dropped = __atomic_exchange_n(&buffer->dropped, 0, __ATOMIC_RELAXED);
+
+        if (head != tail) {
+            size_t offset = tail & (LOG_BUFFER_SIZE - 1);
+            size_t len = head - tail;
+
+            if (offset + len <= LOG_BUFFER_SIZE) {
+                log_write_all(buffer->data + offset, len);
+            } else {
+                log_write_all(buffer->data + offset, LOG_BUFFER_SIZE - offset);
+                log_write_all(buffer->data, len - (LOG_BUFFER_SIZE - offset));
+            }
+
+            __atomic_store_n(&buffer->tail, head, __ATOMIC_RELEASE);
+        }
+
+        if (dropped > 0) {
+            char msg[64];
+            int n = snprintf(msg, sizeof(msg), "[WARN][log] %lu messages dropped\n", (unsigned long) dropped);
+
+            log_write_all(msg, (size_t) n);
+        }
+    }
+}
+
+static void log_write_all(const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(_fd, data, size);
+
+        if (n <= 0) {
+            return;
+        }
+
+        data += n;
+        size -= (size_t) n;
+    }
+}
+
+/* The child of a fork gets the lock in a known state, and no flusher: it flushes on log_flush and at exit */
+static void log_before_fork(void) {
+    pthread_mutex_lock(&_flush_lock);
+}
+
+static void log_after_fork_parent(void) {
+    pthread_mutex_unlock(&_flush_lock);
+}
+
+static void log_after_fork_child(void) {
+    _flusher_running = FALSE;
+    pthread_mutex_unlock(&_flush_lock);
+}
@@ -0,0 +1,75 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+#include "types.h"
+
+/* Leveled logging.
+ *
+ * Levels below LOG_COMPILE_LEVEL (set with -DACIDNES_LOG_LEVEL=..., INFO by default) compile to nothing, their
+ * arguments included. The others are checked against the runtime level first, and only formatted when enabled.
+ *
+ * A message is formatted by the thread logging it and copied into a ring buffer of its own: no lock, no system call.
+ * A flusher thread writes the rings out, in order within a thread. A full ring drops messages and counts them, the
+ * emulation is never held up by logging. log_flush writes out everything logged so far. */
+
+enum log_level {
+    LOG_TRACE,
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARN,
+    LOG_ERROR,
+    LOG_FATAL,
+    LOG_OFF
+};
+typedef enum log_level log_level_t;
+
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_INFO
+#endif
+
+/* Per thread, power of 2 */
+#define LOG_BUFFER_SIZE 65536
+#define LOG_MAX_MESSAGE 512
+/* Milliseconds between flushes */
+#define LOG_FLUSH_INTERVAL 20
+
+extern log_level_t _log_level;
+
+#define log_enabled(level) ((level) >= LOG_COMPILE_LEVEL && (level) >= _log_level)
+
+#define LOG_AT(level, tag, ...)                      \
+    do {                                             \
+        if (log_enabled(level)) {                    \
+            log_write((level), (tag), __VA_ARGS__);  \
+        }                                            \
+    } while (0)
+
+#define log_trace(tag, ...) LOG_AT(LOG_TRACE, tag, __VA_ARGS__)
+#define log_debug(tag, ...) LOG_AT(LOG_DEBUG, tag, __VA_ARGS__)
+#define log_info(tag, ...) LOG_AT(LOG_INFO, tag, __VA_ARGS__)
+#define log_warn(tag, ...) LOG_AT(LOG_WARN, tag, __VA_ARGS__)
+#define log_error(tag, ...) LOG_AT(LOG_ERROR, tag, __VA_ARGS__)
+
+void log_write(log_level_t level, const char *tag, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+void log_set_level(log_level_t level);
+/* "trace", "debug", "info", "warn", "error", "fatal" or "off", case insensitive. Returns FALSE if unknown. */
+bool log_set_level_name(const char *name);
+/* Where the messages go, stderr by default. Flushes what is pending to the previous one first. */
+void log_set_output(int fd);
+
+/* Writes out every message logged so far, from any thread, and how many were dropped */
+void log_flush(void);
+/* Stops the flusher after a last flush, registered with atexit on first use */
+void log_shutdown(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __LOG_H__ */
@@ -0,0 +1,241 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LUMA_HAVE_AVX2 1
+#endif
+
+#include "log.h"
+#include "luma.h"
+#include "palette.h"
+
+/* Adds the luma of one frame line, the max with the previous frame's if any, times w0 to sums0 and times w1 to
+ * sums1, PPU_WIDTH columns each */
+typedef void (*luma_line_fn_t)(const uint8_t *table, const uint8_t *line, const uint8_t *previous, uint16_t w0,
+                               uint16_t w1, uint16_t *sums0, uint16_t *sums1);
+
+static luma_line_fn_t _luma_line_impl;
+static pthread_once_t _luma_once = PTHREAD_ONCE_INIT;
+
+static void luma_line_generic(const uint8_t *table, const uint8_t *line, const uint8_t *previous, uint16_t w0,
+                              uint16_t w1, uint16_t *sums0, uint16_t *sums1);
+#ifdef LUMA_HAVE_AVX2
+static void luma_line_avx2(const uint8_t *table, const uint8_t *line, const uint8_t *previous, uint16_t w0,
+                           uint16_t w1, uint16_t *sums0, uint16_t *sums1);
+#endif
+
+static void luma_init_impl(void) {
+    _luma_line_impl = luma_line_generic;
+
+#ifdef LUMA_HAVE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        _luma_line_impl = luma_line_avx2;
+    }
+#endif
+}
+
+/* Units shared by [a0, a1) and [b0, b1) */
+static uint32_t luma_overlap(uint32_t a0, uint32_t a1, uint32_t b0, uint32_t b1) {
+    uint32_t start = a0 > b0 ? a0 : b0;
+    uint32_t end = a1 < b1 ? a1 : b1;
+
+    return end > start ? end - start : 0;
+}
+
+luma_t *luma_init(uint16_t width, uint16_t height) {
+    luma_t *luma;
+
+    if (width == 0 || height == 0 || width > PPU_WIDTH || height > PPU_HEIGHT) {
+        log_error("luma", "Invalid observation size: %ux%u", width, height);
+        return NULL;
+    }
+
+    luma = calloc(1, sizeof(luma_t));
+    if (luma == NULL) {
+        log_error("luma", "Unable to allocate the observation");
+        return NULL;
+    }
+
+    luma->width = width;
+    luma->height = height;
+    palette_luma(luma->table);
+
+    /* Output column i covers units [i * PPU_WIDTH, (i + 1) * PPU_WIDTH), frame column x [x * width, (x + 1) * width) */
+    for (uint32_t i = 0; i < width; i++) {
+        uint32_t first = i * PPU_WIDTH / width;
+        uint32_t end = ((i + 1) * PPU_WIDTH + width - 1) / width;
+
+        if (end - first > luma->taps) {
+            luma->taps = (uint16_t) (end - first);
+        }
+    }
+
+    luma->x_first = calloc(width, sizeof(uint16_t));
+    luma->x_weights = calloc((size_t) width * luma->taps, sizeof(uint16_t));
+    if (luma->x_first == NULL || luma->x_weights == NULL) {
+        log_error("luma", "Unable to allocate the observation");
+        luma_free(luma);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < width; i++) {
+        uint32_t first = i * PPU_WIDTH / width;
+
+        luma->x_first[i] = (uint16_t) first;
+        for (uint32_t k = 0; k < luma->taps && first + k < PPU_WIDTH; k++) {
+            luma->x_weights[i * luma->taps + k] = (uint16_t) luma_overlap(i * PPU_WIDTH, (i + 1) * PPU_WIDTH,
+                                                                          (first + k) * width,
+                                                                          (first + k + 1) * width);
+        }
+    }
+
+    /* Output lines are at least as tall as frame lines: a frame line falls in one or two of them */
+    for (uint32_t y = 0; y < PPU_HEIGHT; y++) {
+        uint32_t first = y * height / PPU_HEIGHT;
+        uint32_t w0 = luma_overlap(first * PPU_HEIGHT, (first + 1) * PPU_HEIGHT, y * height, (y + 1) * height);
+
+        luma->y_first[y] = (uint16_t) first;
+        luma->y_weights[y][0] = (uint16_t) w0;
+        luma->y_weights[y][1] = (uint16_t) (height - w0);
+    }
+
+    return luma;
+}
+
+void luma_free(luma_t *luma) {
+    free(luma->x_first);
+    free(luma->x_weights);
+    free(luma);
+}
+
+/* Shrinks a complete line of column sums to the output width. Every output pixel's weights add up to
+ * PPU_WIDTH * PPU_HEIGHT. */
+static void luma_output_line(const luma_t *luma, const uint16_t *sums, uint8_t *out) {
+    const uint32_t total = PPU_WIDTH * PPU_HEIGHT;
+
+    for (uint32_t i = 0; i < luma->width; i++) {
+        const uint16_t *weights = &luma->x_weights[i * luma->taps];
+        const uint16_t *columns = &sums[luma->x_first[i]];
+        uint32_t sum = 0;
+
+        for (uint32_t k = 0; k < luma->taps; k++) {
+            sum += (uint32_t) weights[k] * columns[k];
+        }
+
+        out[i] = (uint8_t) ((sum + total / 2) / total);
+    }
+}
+
+static void luma_run_with(const luma_t *luma, luma_line_fn_t line_fn, const uint8_t *frame, const uint8_t *previous,
+                          uint8_t *out) {
+    /* Column sums of the current output line and of the next one. A line's weights add up to PPU_HEIGHT, so a sum
+       never exceeds 255 * PPU_HEIGHT. Columns past the frame, read by the last taps, stay 0. */
+    uint16_t sums[2][PPU_WIDTH * 2] __attribute__((aligned(32)));
+    uint16_t *current = sums[0], *next = sums[1];
+    uint16_t line = 0;
+
+    memset(sums, 0, sizeof(sums));
+
+    for (uint32_t y = 0; y < PPU_HEIGHT; y++) {
+        if (luma->y_first[y] != line) {
+            uint16_t *done = current;
+
+            luma_output_line(luma, done, out + line * luma->width);
+            memset(done, 0, PPU_WIDTH * sizeof(uint16_t));
+            current = next;
+            next = done;
+            line++;
+        }
+
+        line_fn(luma->table, frame + y * PPU_WIDTH, previous != NULL ? previous + y * PPU_WIDTH : NULL,
+                luma->y_weights[y][0], luma->y_weights[y][1], current, next);
+    }
+
+    luma_output_line(luma, current, out + line * luma->width);
+}
+
+void luma_run(const luma_t *luma, const uint8_t *frame, const uint8_t *previous, uint8_t *out) {
+    pthread_once(&_luma_once, luma_init_impl);
+
+    luma_run_with(luma, _luma_line_impl, frame, previous, out);
+}
+
+void luma_run_generic(const luma_t *luma, const uint8_t *frame, const uint8_t *previous, uint8_t *out) {
+    luma_run_with(luma, luma_line_generic, frame, previous, out);
+}
+
+static void luma_line_generic(const uint8_t *table, const uint8_t *line, const uint8_t *previous, uint16_t w0,
+                              uint16_t w1, uint16_t *sums0, uint16_t *sums1) {
+    for (int x = 0; x < PPU_WIDTH; x++) {
+        uint16_t y = table[line[x] & 0x3f];
+
+        if (previous != NULL && table[previous[x] & 0x3f] > y) {
+            y = table[previous[x] & 0x3f];
+        }
+
+        sums0[x] += (uint16_t) (w0 * y);
+        sums1[x] += (uint16_t) (w1 * y);
+    }
+}
+
+#ifdef LUMA_HAVE_AVX2
+/* Luma of 32 indexes: one 16 entry lookup per quarter of the table, each kept where the top bits of the index
+ * select it */
+__attribute__((target("avx2")))
+static __m256i luma_lookup_avx2(const __m256i tables[4], __m256i indexes) {
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    const __m256i high = _mm256_set1_epi8(0x03);
+    __m256i lo = _mm256_and_si256(indexes, low);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(indexes, 4), high);
+    __m256i y = _mm256_setzero_si256();
+
+    for (int i = 0; i < 4; i++) {
+        __m256i select = _mm256_cmpeq_epi8(hi, _mm256_set1_epi8((char) i));
+
+        y = _mm256_or_si256(y, _mm256_and_si256(_mm256_shuffle_epi8(tables[i], lo), select));
+    }
+
+    return y;
+}
+
+__attribute__((target("avx2")))
+static void luma_line_avx2(const uint8_t *table, const uint8_t *line, const uint8_t *previous, uint16_t w0,
+                           uint16_t w1, uint16_t *sums0, uint16_t *sums1) {
+    __m256i tables[4];
+    __m256i weight0 = _mm256_set1_epi16((short) w0);
+    __m256i weight1 = _mm256_set1_epi16((short) w1);
+
+    /* Both 128 bits lanes shuffle on their own: each gets the whole quarter */
+    for (int i = 0; i < 4; i++) {
+        tables[i] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) (table + i * 16)));
+    }
+
+    for (int x = 0; x < PPU_WIDTH; x += 32) {
+        __m256i y = luma_lookup_avx2(tables, _mm256_loadu_si256((const __m256i *) (line + x)));
+        __m256i y_lo, y_hi;
+
+        if (previous != NULL) {
+            y = _mm256_max_epu8(y, luma_lookup_avx2(tables, _mm256_loadu_si256((const __m256i *) (previous + x))));
+        }
+
+        y_lo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(y));
+        y_hi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(y, 1));
+
+        _mm256_store_si256((__m256i *) (sums0 + x),
+                           _mm256_add_epi16(_mm256_load_si256((const __m256i *) (sums0 + x)),
+                                            _mm256_mullo_epi16(y_lo, weight0)));
+        _mm256_store_si256((__m256i *) (sums0 + x + 16),
+                           _mm256_add_epi16(_mm256_load_si256((const __m256i *) (sums0 + x + 16)),
+                                            _mm256_mullo_epi16(y_hi, weight0)));
+        _mm256_store_si256((__m256i *) (sums1 + x),
+                           _mm256_add_epi16(_mm256_load_si256((const __m256i *) (sums1 + x)),
+                                            _mm256_mullo_epi16(y_lo, weight1)));
+        _mm256_store_si256((__m256i *) (sums1 + x + 16),
+                           _mm256_add_epi16(_mm256_load_si256((const __m256i *) (sums1 + x + 16)),
+                                            _mm256_mullo_epi16(y_hi, weight1)));
+    }
+}
+#endif
@@ -0,0 +1,54 @@
+#ifndef __LUMA_H__
+#define __LUMA_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "types.h"
+#include "ppu.h"
+
+/* Grey observations: frames of palette indexes converted to luma and area-downsampled to width x height in one pass,
+ * for agents that look at small grey frames (84x84) rather than full color ones.
+ *
+ * Every output pixel is the average of the part of the frame it covers, fractions of pixels included, rounded to the
+ * nearest. Each line of the frame is read once: its luma is looked up and weighted into the one or two output lines
+ * it falls in, kept as columns of 16 bit sums at full width; an output line is shrunk horizontally once complete.
+ * With a previous frame, each pixel is the max of its luma in both frames before averaging, which keeps sprites drawn
+ * every other frame.
+ *
+ * Uses AVX2 (16 entry table lookups and 16 bit multiply-adds, 32 pixels at a time) when the CPU supports it, plain
+ * loops otherwise. Both give the same results. */
+
+struct luma_s {
+    uint16_t width;
+    uint16_t height;
+    uint8_t table[64];
+
+    /* Frame and output pixels are cut in units so that both are a whole number of them: a frame column is width units
+       wide, an output column PPU_WIDTH. x_weights[i * taps + k] is how many units output column i and frame column
+       x_first[i] + k share, 0 past the ones it covers. */
+    uint16_t taps;
+    uint16_t *x_first;
+    uint16_t *x_weights;
+    /* Same for lines: the first output line frame line i falls in, and its weights there and in the next one */
+    uint16_t y_first[PPU_HEIGHT];
+    uint16_t y_weights[PPU_HEIGHT][2];
+};
+typedef struct luma_s luma_t;
+
+/* Returns NULL if the size is 0 or larger than a frame */
+luma_t *luma_init(uint16_t width, uint16_t height);
+void luma_free(luma_t *luma);
+
+/* frame and previous hold PPU_WIDTH x PPU_HEIGHT palette indexes, previous may be NULL. out gets width x height
+ * bytes. */
+void luma_run(const luma_t *luma, const uint8_t *frame, const uint8_t *previous, uint8_t *out);
+
+/* Portable implementation, always available. Used as a reference by the tests. */
+void luma_run_generic(const luma_t *luma, const uint8_t *frame, const uint8_t *previous, uint8_t *out);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __LUMA_H__ */
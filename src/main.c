@@ -1,15 +1,46 @@
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
-#include "cpu.h"
 #include "cartridge.h"
+#include "common.h"
+#include "log.h"
 #include "mapper.h"
-#include "ppu.h"
+#include "nes.h"
+#include "pacer.h"
+#include "png.h"
+#include "profiler.h"
+#include "recorder.h"
+#include "trace.h"
+
+static volatile sig_atomic_t _quit = 0;
+
+static char *save_path(const char *rom_file);
+static void on_signal(int sig);
+static pacer_t *start_pacer(const cartridge_t *cart);
+static void write_pacer_stats(const pacer_t *pacer);
+static png_sink_t *start_png_sink(void);
+static int shut_down(nes_t *nes, cartridge_t *cart, int status);
+
+/* Reports written at exit, see write_reports */
+static nes_t *_report_nes = NULL;
+
+static void write_reports(void);
+static profiler_t *start_profiler(void);
+static trace_t *start_trace(void);
 
 int main(int argc, char **argv) {
-    cpu_t *cpu;
-    ppu_t *ppu;
+    nes_t *nes;
     cartridge_t *cart;
-    uint8_t cycles;
+    pacer_t *pacer;
+    png_sink_t *sink;
+    const char *level = getenv("ACIDNES_LOG");
+
+    if (level != NULL && !log_set_level_name(level)) {
+        fprintf(stderr, "Unknown log level: %s\n", level);
+        return 1;
+    }
 
     if (argc > 1) {
         printf("Loading %s\n", argv[1]);
@@ -22,40 +53,203 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    mapper_init(cart->mapper_type, cart->rom, cart->nb_16k_rom_banks * 0x4000, cart->vrom, cart->nb_8k_vrom_banks * 0x2000);
-
-    cpu = cpu_init();
-    if (cpu == NULL) {
-        fprintf(stderr, "Unable to initialize CPU\n");
+    nes = nes_init(cart);
+    if (nes == NULL) {
+        cartridge_free(cart);
         return 1;
     }
 
-    cpu_reset(cpu);
+    /* ACIDNES_SAVE_READ_ONLY=1 starts from the save without ever writing it, for batch runs of the same save */
+    if (cart->battery_ram && argc > 1) {
+        const char *read_only = getenv("ACIDNES_SAVE_READ_ONLY");
+        char *file = save_path(argv[1]);
 
-    ppu = ppu_init();
-    if (ppu == NULL) {
-        fprintf(stderr, "Unable to initialize PPU\n");
-        return 1;
+        if (file == NULL || !mapper_attach_save(nes->mapper, file, read_only != NULL && atoi(read_only) != 0)) {
+            free(file);
+            return shut_down(nes, cart, 1);
+        }
+
+        free(file);
     }
 
-    cpu->ppu = ppu;
+    /* ACIDNES_FRAMESKIP=n only draws every nth frame, the emulation is unchanged */
+    if (getenv("ACIDNES_FRAMESKIP") != NULL) {
+        nes->frameskip = (uint32_t) strtoul(getenv("ACIDNES_FRAMESKIP"), NULL, 10);
+    }
 
-    for (;;) {
-        cycles = cpu_tick(cpu);
-        if (cycles == 255) {
-            break;
-        }
+    nes->cpu->profiler = start_profiler();
+    nes->cpu->trace = start_trace();
+    if (nes->cpu->trace == NULL && getenv("ACIDNES_TRACE") != NULL) {
+        return shut_down(nes, cart, 1);
+    }
+
+    /* Also when the emulation panics */
+    _report_nes = nes;
+    atexit(write_reports);
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    recorder_install_crash_handler();
+
+    pacer = start_pacer(cart);
+    if (pacer == NULL) {
+        return shut_down(nes, cart, 1);
+    }
 
-        /* 3 PPU cycles for each CPU cycle */
-        for (int i = 0; i < cycles * 3; i++) {
-            ppu_tick(ppu);
+    sink = start_png_sink();
+    if (sink == NULL && getenv("ACIDNES_PNG") != NULL) {
+        pacer_free(pacer);
+        return shut_down(nes, cart, 1);
+    }
+
+    while (!_quit) {
+        bool drawn = nes_draws_frame(nes);
+
+        nes_step_frame(nes);
+        if (nes->faulted) {
+            _panic("%s", nes->cpu->fault);
         }
+        if (sink != NULL && drawn && !png_sink_submit(sink, nes->ppu->framebuffer, nes->ppu->emphasis)) {
+            _quit = 1;
+        }
+        pacer_end_frame(pacer);
     }
 
-    ppu_free(ppu);
-    cpu_free(cpu);
-    mapper_free();
+    write_pacer_stats(pacer);
+    pacer_free(pacer);
+    if (sink != NULL) {
+        png_sink_close(sink);
+    }
+    write_reports();
+
+    return shut_down(nes, cart, 0);
+}
+
+/* Frees the console and what main attached to it, returns status */
+static int shut_down(nes_t *nes, cartridge_t *cart, int status) {
+    /* Nothing left to report at exit */
+    _report_nes = NULL;
+
+    if (nes->cpu->trace != NULL) {
+        trace_close(nes->cpu->trace);
+    }
+    if (nes->cpu->profiler != NULL) {
+        profiler_free(nes->cpu->profiler);
+    }
+    nes_free(nes);
     cartridge_free(cart);
 
-    return 0;
+    return status;
+}
+
+/* game.nes -> game.sav */
+static char *save_path(const char *rom_file) {
+    const char *ext = strrchr(rom_file, '.');
+    size_t len = ext != NULL && strchr(ext, '/') == NULL ? (size_t) (ext - rom_file) : strlen(rom_file);
+    char *file = malloc(len + 5);
+
+    if (file != NULL) {
+        memcpy(file, rom_file, len);
+        strcpy(file + len, ".sav");
+    }
+
+    return file;
+}
+
+/* ACIDNES_PROFILE=prefix profiles every instruction, with heatmaps. ACIDNES_PROFILE_PERIOD=cycles samples instead. */
+static profiler_t *start_profiler(void) {
+    const char *prefix = getenv("ACIDNES_PROFILE");
+    const char *period = getenv("ACIDNES_PROFILE_PERIOD");
+    uint32_t cycles = period != NULL ? (uint32_t) strtoul(period, NULL, 10) : 0;
+
+    if (prefix == NULL) {
+        return NULL;
+    }
+
+    return profiler_init(cycles, cycles == 0 ? PROFILER_HEATMAP : 0);
+}
+
+/* ACIDNES_TRACE=file writes a binary trace of every instruction, compressed when built with zstd, for acidnes-trace.
+ * See trace.h for what it costs. */
+static trace_t *start_trace(void) {
+    const char *file = getenv("ACIDNES_TRACE");
+
+    if (file == NULL) {
+        return NULL;
+    }
+
+    return trace_open(file, TRUE);
+}
+
+/* ACIDNES_SPEED=n runs at n times the console's frame rate, 0 as fast as possible. Real time by default. */
+static pacer_t *start_pacer(const cartridge_t *cart) {
+    const char *speed = getenv("ACIDNES_SPEED");
+    double hz = cart->is_pal ? PACER_PAL_HZ : PACER_NTSC_HZ;
+
+    return pacer_init(hz, speed != NULL ? strtod(speed, NULL) : 1.0);
+}
+
+/* ACIDNES_PNG=pattern writes every drawn frame as a PNG file, pattern with the frame number ("frames/%06u.png").
+ * ACIDNES_PNG_LEVEL=n is the zlib level, 1 by default: the encoding threads keep up with the emulation. */
+static png_sink_t *start_png_sink(void) {
+    const char *pattern = getenv("ACIDNES_PNG");
+    const char *level = getenv("ACIDNES_PNG_LEVEL");
+
+    if (pattern == NULL) {
+        return NULL;
+    }
+
+    return png_sink_open(pattern, PPU_WIDTH, PPU_HEIGHT, level != NULL ? atoi(level) : 1, 0, 0);
+}
+
+static void write_pacer_stats(const pacer_t *pacer) {
+    pacer_stats_t stats;
+
+    pacer_get_stats(pacer, &stats);
+    log_info("pacer", "%lu frames, %.2f fps, frame time p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms",
+             (unsigned long) stats.frames, stats.fps, stats.p50, stats.p90, stats.p99, stats.max);
+}
+
+static void write_reports(void) {
+    nes_t *nes = _report_nes;
+
+    if (nes == NULL) {
+        return;
+    }
+    _report_nes = NULL;
+
+    if (nes->cpu->profiler != NULL) {
+        profiler_write_reports(nes->cpu->profiler, getenv("ACIDNES_PROFILE"));
+    }
+
+    /* Up to the last instruction, a panic included */
+    if (nes->cpu->trace != NULL) {
+        trace_close(nes->cpu->trace);
+        nes->cpu->trace = NULL;
+    }
+
+#ifdef CPU_STATS
+    {
+        const char *file = getenv("ACIDNES_STATS");
+        FILE *fp;
+
+        if (file == NULL) {
+            file = "acidnes-stats.json";
+        }
+
+        fp = fopen(file, "w");
+        if (fp == NULL) {
+            perror(file);
+            return;
+        }
+
+        cpu_stats_dump_json(nes->cpu, fp);
+        fclose(fp);
+    }
+#endif
+}
+
+static void on_signal(int sig) {
+    (void) sig;
+    _quit = 1;
 }
@@ -1,72 +1,325 @@
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+#include "log.h"
 #include "types.h"
 #include "mapper.h"
 
-uint8_t *_prg_rom = NULL;
-uint8_t *_chr_rom = NULL;
-uint8_t *_ex_ram = NULL;
+struct board_s {
+    uint16_t type;
+    const char *name;
+    bool (*init)(mapper_t *mapper);
+};
+typedef struct board_s board_t;
 
-bool _has_mirroring;
+static const board_t BOARDS[] = {
+    {0, "NROM", nrom_init},
+    {1, "MMC1", mmc1_init},
+    {2, "UxROM", uxrom_init},
+    {3, "CNROM", cnrom_init},
+    {4, "MMC3", mmc3_init},
+    {5, "MMC5", mmc5_init},
+    {7, "AxROM", axrom_init},
+};
 
-void mapper_init(uint8_t mapper_type, uint8_t *prg_rom, uint32_t prg_rom_size, uint8_t *chr_rom, uint32_t chr_rom_size) {
-    _has_mirroring = FALSE;
+static void nrom_update_banks(mapper_t *mapper);
 
-    mapper_free();
+mapper_t *mapper_init(cartridge_t *cart) {
+    const board_t *board = NULL;
+    mapper_t *mapper;
 
-    if (prg_rom_size == 0x4000) {
-        _prg_rom = malloc(sizeof(uint8_t) * 0x8000);
+    for (size_t i = 0; i < sizeof(BOARDS) / sizeof(BOARDS[0]); i++) {
+        if (BOARDS[i].type == cart->mapper_type) {
+            board = &BOARDS[i];
+            break;
+        }
+    }
+
+    if (board == NULL) {
+        log_error("mapper", "Unsupported mapper: %02x", cart->mapper_type);
+        return NULL;
+    }
 
-        memcpy(_prg_rom, prg_rom, 0x4000);
-        memcpy(_prg_rom + 0x4000, prg_rom, 0x4000);
+    if (cart->prg_rom_size < MAPPER_PRG_PAGE_SIZE) {
+        log_error("mapper", "Invalid PRG ROM size: %u", cart->prg_rom_size);
+        return NULL;
+    }
+
+    mapper = calloc(1, sizeof(mapper_t));
+    if (mapper == NULL) {
+        return NULL;
+    }
+
+    mapper->type = board->type;
+    mapper->name = board->name;
+    mapper->irq_dot = UINT64_MAX;
+
+    mapper->prg_rom = cart->rom;
+    mapper->prg_rom_size = cart->prg_rom_size & ~(MAPPER_PRG_PAGE_SIZE - 1);
+
+    if (cart->chr_rom_size >= 0x2000) {
+        /* The pages are writable for CHR RAM only, see mapper_set_chr_u8 */
+        mapper->chr = (uint8_t *) cart->vrom;
+        mapper->chr_size = cart->chr_rom_size & ~(MAPPER_CHR_PAGE_SIZE - 1);
+        mapper->chr_is_ram = FALSE;
     } else {
-        _prg_rom = malloc(sizeof(uint8_t) * prg_rom_size);
-        memcpy(_prg_rom, prg_rom, prg_rom_size);
+        mapper->chr_size = cart->chr_ram_size + cart->chr_nvram_size;
+        if (mapper->chr_size < 0x2000) {
+            mapper->chr_size = 0x2000;
+        }
+
+        mapper->chr = calloc(mapper->chr_size, sizeof(uint8_t));
+        mapper->chr_is_ram = TRUE;
+
+        if (mapper->chr == NULL) {
+            free(mapper);
+            return NULL;
+        }
+    }
+
+    /* Boards without PRG RAM still get the 8K at $6000-$7FFF, as most iNES headers don't tell */
+    mapper->prg_ram_size = cart->prg_ram_size + cart->prg_nvram_size;
+    if (mapper->prg_ram_size < 0x2000) {
+        mapper->prg_ram_size = 0x2000;
+    }
+    mapper->prg_ram_size &= ~(uint32_t) (0x2000 - 1);
+
+    mapper->prg_ram = malloc(mapper->prg_ram_size);
+    if (mapper->prg_ram == NULL) {
+        if (mapper->chr_is_ram) {
+            free(mapper->chr);
+        }
+        free(mapper);
+        return NULL;
+    }
+
+    memset(mapper->prg_ram, 0xff, mapper->prg_ram_size);
+    mapper->prg_ram_page = mapper->prg_ram;
+
+    if (cart->four_screen_vram) {
+        mapper->mirroring = MIRROR_FOUR_SCREEN;
+    } else {
+        mapper->mirroring = cart->vert_mirror ? MIRROR_VERTICAL : MIRROR_HORIZONTAL;
+    }
+
+    if (!board->init(mapper)) {
+        log_error("mapper", "Unable to allocate the %s registers", board->name);
+        mapper_free(mapper);
+        return NULL;
+    }
+    mapper->update_banks(mapper);
+
+    return mapper;
+}
+
+void mapper_free(mapper_t *mapper) {
+    if (mapper->chr_is_ram) {
+        free(mapper->chr);
+    }
+
+    if (mapper->prg_ram_mapped) {
+        mapper_flush_save(mapper);
+        munmap(mapper->prg_ram, mapper->prg_ram_size);
+    } else {
+        free(mapper->prg_ram);
+    }
+
+    free(mapper->regs);
+    free(mapper);
+}
+
+bool mapper_attach_save(mapper_t *mapper, const char *file, bool read_only) {
+    int fd;
+    struct stat st;
+    uint8_t *ram;
+
+    if (mapper->prg_ram_mapped) {
+        return FALSE;
+    }
+
+    fd = read_only ? open(file, O_RDONLY) : open(file, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        /* No save yet: a read only run starts from blank RAM */
+        if (read_only && errno == ENOENT) {
+            return TRUE;
+        }
+
+        log_error("mapper", "%s: %s", file, strerror(errno));
+
+        return FALSE;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        log_error("mapper", "%s: %s", file, strerror(errno));
+
+        close(fd);
+
+        return FALSE;
     }
 
-    _chr_rom = malloc(sizeof(uint8_t) * chr_rom_size);
-    memcpy(_chr_rom, chr_rom, chr_rom_size);
+    /* A new save starts with the current RAM content, a short one is padded with it */
+    if ((size_t) st.st_size < mapper->prg_ram_size) {
+        if (read_only) {
+            if (pread(fd, mapper->prg_ram, (size_t) st.st_size, 0) < 0) {
+                log_error("mapper", "%s: %s", file, strerror(errno));
+            }
 
-    _ex_ram = malloc(sizeof(uint8_t) * 0x1fe0);
+            close(fd);
+
+            return TRUE;
+        }
+
+        if (pwrite(fd, mapper->prg_ram + st.st_size, mapper->prg_ram_size - (size_t) st.st_size, st.st_size) < 0) {
+            log_error("mapper", "%s: %s", file, strerror(errno));
+
+            close(fd);
+
+            return FALSE;
+        }
+    }
+
+    ram = mmap(NULL, mapper->prg_ram_size, PROT_READ | PROT_WRITE, read_only ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (ram == MAP_FAILED) {
+        log_error("mapper", "%s: %s", file, strerror(errno));
+
+        return FALSE;
+    }
+
+    free(mapper->prg_ram);
+
+    mapper->prg_ram = ram;
+    mapper->prg_ram_page = ram;
+    mapper->prg_ram_mapped = TRUE;
+    mapper->prg_ram_shared = !read_only;
+    mapper->prg_ram_dirty = FALSE;
+
+    /* Boards may have RAM pages anywhere */
+    mapper->update_banks(mapper);
+
+    return TRUE;
+}
+
+void mapper_flush_save(mapper_t *mapper) {
+    if (!mapper->prg_ram_dirty) {
+        return;
+    }
+
+    mapper->prg_ram_dirty = FALSE;
+
+    if (mapper->prg_ram_shared && msync(mapper->prg_ram, mapper->prg_ram_size, MS_ASYNC) < 0) {
+        log_error("mapper", "msync: %s", strerror(errno));
+    }
 }
 
-void mapper_free(void) {
-    if (_prg_rom) free(_prg_rom);
-    if (_chr_rom) free(_chr_rom);
-    if (_ex_ram) free(_ex_ram);
+/* Bank switching */
+static int wrap_bank(int bank, uint32_t count) {
+    bank %= (int) count;
+
+    return bank < 0 ? bank + (int) count : bank;
 }
 
-uint8_t get_prg_u8(uint16_t addr) {
-    return _prg_rom[addr];
+void mapper_set_prg_8k(mapper_t *mapper, uint8_t slot, int bank) {
+    bank = wrap_bank(bank, mapper->prg_rom_size / MAPPER_PRG_PAGE_SIZE);
+    mapper->prg_pages[slot & 0x03u] = mapper->prg_rom + bank * MAPPER_PRG_PAGE_SIZE;
 }
 
-uint16_t get_prg_u16(uint16_t addr) {
-    return (uint16_t) ((_prg_rom[addr + 1] << 8u) + _prg_rom[addr]);
+void mapper_set_prg_16k(mapper_t *mapper, uint8_t slot, int bank) {
+    mapper_set_prg_8k(mapper, slot * 2, bank * 2);
+    mapper_set_prg_8k(mapper, slot * 2 + 1, bank * 2 + 1);
 }
 
-inline void set_prg_u8(uint16_t addr, uint8_t value) {} /* do nothing */
+void mapper_set_prg_32k(mapper_t *mapper, int bank) {
+    mapper_set_prg_16k(mapper, 0, bank * 2);
+    mapper_set_prg_16k(mapper, 1, bank * 2 + 1);
+}
 
-uint8_t get_chr_u8(uint16_t addr) {
-    return _chr_rom[addr];
+void mapper_set_chr_1k(mapper_t *mapper, uint8_t slot, int bank) {
+    bank = wrap_bank(bank, mapper->chr_size / MAPPER_CHR_PAGE_SIZE);
+    mapper->chr_pages[slot & 0x07u] = mapper->chr + bank * MAPPER_CHR_PAGE_SIZE;
+    mapper->chr_bg_pages[slot & 0x07u] = mapper->chr_pages[slot & 0x07u];
 }
 
-uint16_t get_chr_u16(uint16_t addr) {
-    return (uint16_t) ((_chr_rom[addr + 1] << 8u) + _chr_rom[addr]);
+void mapper_set_chr_2k(mapper_t *mapper, uint8_t slot, int bank) {
+    mapper_set_chr_1k(mapper, slot * 2, bank * 2);
+    mapper_set_chr_1k(mapper, slot * 2 + 1, bank * 2 + 1);
 }
 
-uint8_t get_ex_ram_u8(uint16_t addr) {
-    return _ex_ram[addr];
+void mapper_set_chr_4k(mapper_t *mapper, uint8_t slot, int bank) {
+    mapper_set_chr_2k(mapper, slot * 2, bank * 2);
+    mapper_set_chr_2k(mapper, slot * 2 + 1, bank * 2 + 1);
 }
 
-uint16_t get_ex_ram_u16(uint16_t addr) {
-    return (uint16_t) ((_ex_ram[addr + 1] << 8u) + _ex_ram[addr]);
+void mapper_set_chr_8k(mapper_t *mapper, int bank) {
+    mapper_set_chr_4k(mapper, 0, bank * 2);
+    mapper_set_chr_4k(mapper, 1, bank * 2 + 1);
+}
+
+void mapper_set_chr_bg_1k(mapper_t *mapper, uint8_t slot, int bank) {
+    bank = wrap_bank(bank, mapper->chr_size / MAPPER_CHR_PAGE_SIZE);
+    mapper->chr_bg_pages[slot & 0x07u] = mapper->chr + bank * MAPPER_CHR_PAGE_SIZE;
+}
+
+/* State: type (2 bytes), mirroring (1 byte), registers, PRG RAM, then CHR RAM if any */
+size_t mapper_state_size(const mapper_t *mapper) {
+    return 3 + mapper->regs_size + mapper->prg_ram_size + (mapper->chr_is_ram ? mapper->chr_size : 0);
+}
+
+void mapper_save_state(const mapper_t *mapper, uint8_t *buf) {
+    buf[0] = (uint8_t) (mapper->type & 0xffu);
+    buf[1] = (uint8_t) (mapper->type >> 8u);
+    buf[2] = (uint8_t) mapper->mirroring;
+    buf += 3;
+
+    memcpy(buf, mapper->regs, mapper->regs_size);
+    buf += mapper->regs_size;
+
+    memcpy(buf, mapper->prg_ram, mapper->prg_ram_size);
+    buf += mapper->prg_ram_size;
+
+    if (mapper->chr_is_ram) {
+        memcpy(buf, mapper->chr, mapper->chr_size);
+    }
+}
+
+bool mapper_load_state(mapper_t *mapper, const uint8_t *buf, size_t size) {
+    if (size != mapper_state_size(mapper) || (buf[0] | buf[1] << 8u) != mapper->type) {
+        return FALSE;
+    }
+
+    mapper->mirroring = (mirroring_t) buf[2];
+    buf += 3;
+
+    memcpy(mapper->regs, buf, mapper->regs_size);
+    buf += mapper->regs_size;
+
+    memcpy(mapper->prg_ram, buf, mapper->prg_ram_size);
+    buf += mapper->prg_ram_size;
+    mapper->prg_ram_dirty = TRUE;
+
+    if (mapper->chr_is_ram) {
+        memcpy(mapper->chr, buf, mapper->chr_size);
+    }
+
+    mapper->update_banks(mapper);
+
+    return TRUE;
 }
 
-void set_ex_ram_u8(uint16_t addr, uint8_t value) {
-    _ex_ram[addr] = value;
+/* NROM (0): 16K or 32K PRG, 8K CHR, no registers */
+bool nrom_init(mapper_t *mapper) {
+    mapper->update_banks = nrom_update_banks;
+    return TRUE;
 }
 
-bool has_mirroring(void) {
-    return FALSE;
+static void nrom_update_banks(mapper_t *mapper) {
+    /* 16K roms are mirrored at 0xC000 by the bank wrapping */
+    mapper_set_prg_32k(mapper, 0);
+    mapper_set_chr_8k(mapper, 0);
 }
@@ -5,23 +5,162 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
+
 #include "types.h"
+#include "cartridge.h"
+
+#define MAPPER_PRG_PAGE_SIZE 0x2000
+#define MAPPER_CHR_PAGE_SIZE 0x0400
+
+enum mirroring {
+    MIRROR_HORIZONTAL,
+    MIRROR_VERTICAL,
+    MIRROR_SINGLE_LOW,
+    MIRROR_SINGLE_HIGH,
+    MIRROR_FOUR_SCREEN,
+    /* Per quadrant, see nt_ciram and nt_pages */
+    MIRROR_BOARD
+};
+typedef enum mirroring mirroring_t;
+
+typedef struct mapper_s mapper_t;
+
+struct ppu_s;
+
+/* One background tile of a scanline, see bg_fetch */
+struct mapper_bg_tile_s {
+    /* Nametable address, $2000-$2FFF */
+    uint16_t nt_addr;
+    uint8_t tile;
+    uint8_t palette;
+    /* Pattern bytes of the tile row */
+    uint8_t lo;
+    uint8_t hi;
+};
+typedef struct mapper_bg_tile_s mapper_bg_tile_t;
+
+/* A cartridge board, one per console instance.
+ *
+ * The CPU sees $8000-$FFFF through four 8K pages and the PPU sees $0000-$1FFF through eight 1K pages. Switching a
+ * bank only swaps a page pointer, so reads cost the same on every board. Boards hook the writes to their registers
+ * and recompute the pages from them in update_banks. */
+struct mapper_s {
+    uint16_t type;
+    const char *name;
+
+    const uint8_t *prg_pages[4];
+    uint8_t *chr_pages[8];
+    /* Pages the background is fetched from. Same as chr_pages, except on boards with separate sprite and background
+       banks which set them with mapper_set_chr_bg_1k. */
+    uint8_t *chr_bg_pages[8];
+    mirroring_t mirroring;
+
+    /* With MIRROR_BOARD: board memory for each nametable quadrant, or NULL for the CIRAM page in nt_ciram */
+    uint8_t *nt_pages[4];
+    uint8_t nt_ciram[4];
+
+    const uint8_t *prg_rom;
+    uint32_t prg_rom_size;
+
+    /* CHR ROM, or CHR RAM owned by the mapper when the cartridge has none */
+    uint8_t *chr;
+    uint32_t chr_size;
+    bool chr_is_ram;
+
+    /* PRG RAM (8K at least) and the page seen at $6000-$7FFF */
+    uint8_t *prg_ram;
+    uint32_t prg_ram_size;
+    uint8_t *prg_ram_page;
+
+    /* Set when PRG RAM is a mapping of a save file, see mapper_attach_save */
+    bool prg_ram_mapped;
+    bool prg_ram_shared;
+    bool prg_ram_dirty;
+
+    /* Board specific registers. Saved and restored as is, so it must not hold pointers. */
+    void *regs;
+    size_t regs_size;
 
-void mapper_init(uint8_t mapper_type, uint8_t *prg_rom, uint32_t prg_rom_size, uint8_t *chr_rom, uint32_t chr_rom_size);
-void mapper_free(void);
+    /* PPU dot from which the board holds the IRQ line low, UINT64_MAX when no IRQ is scheduled */
+    uint64_t irq_dot;
+
+    /* Set by the owner, for boards that look at the PPU timing */
+    struct ppu_s *ppu;
+
+    /* Set during a register write on the cycle after another one, the second write of read-modify-write instructions */
+    bool consecutive_write;
+
+    /* CPU writes to $4020-$FFFF, except $6000-$7FFF */
+    void (*write)(mapper_t *mapper, uint16_t addr, uint8_t val);
+    /* CPU reads from $4020-$5FFF */
+    uint8_t (*read)(mapper_t *mapper, uint16_t addr);
+    /* Catches up with the scanline events (see ppu_next_scanline_event) since the last call and schedules irq_dot.
+       Called by the PPU around any PPUCTRL / PPUMASK change that moves the events. */
+    void (*scanline_sync)(mapper_t *mapper);
+    /* Recomputes the pages and mirroring from regs */
+    void (*update_banks)(mapper_t *mapper);
+    /* Optional, replaces the pattern fetches of a whole background line. Tiles come with their nametable address, tile
+       number and attribute palette; the board fills in the pattern bytes of row fine_y and may change the palette. */
+    void (*bg_fetch)(mapper_t *mapper, mapper_bg_tile_t *tiles, uint8_t count, uint8_t fine_y);
+};
+
+/* Returns NULL if the cartridge's board is not supported. The cartridge must outlive the mapper. */
+mapper_t *mapper_init(cartridge_t *cart);
+void mapper_free(mapper_t *mapper);
+
+static inline uint8_t mapper_get_prg_u8(const mapper_t *mapper, uint16_t addr) {
+    return mapper->prg_pages[(addr >> 13u) & 0x03u][addr & 0x1fffu];
+}
+
+static inline uint8_t mapper_get_chr_u8(const mapper_t *mapper, uint16_t addr) {
+    return mapper->chr_pages[(addr >> 10u) & 0x07u][addr & 0x03ffu];
+}
+
+static inline void mapper_set_chr_u8(mapper_t *mapper, uint16_t addr, uint8_t val) {
+    if (mapper->chr_is_ram) {
+        mapper->chr_pages[(addr >> 10u) & 0x07u][addr & 0x03ffu] = val;
+    }
+}
+
+static inline uint8_t mapper_get_ram_u8(const mapper_t *mapper, uint16_t addr) {
+    return mapper->prg_ram_page[addr & 0x1fffu];
+}
+
+static inline void mapper_set_ram_u8(mapper_t *mapper, uint16_t addr, uint8_t val) {
+    mapper->prg_ram_page[addr & 0x1fffu] = val;
+    mapper->prg_ram_dirty = TRUE;
+}
 
-uint8_t get_prg_u8(uint16_t addr);
-uint16_t get_prg_u16(uint16_t addr);
-void set_prg_u8(uint16_t addr, uint8_t value);
+/* Bank switching, used by the boards. Banks wrap around the size of the ROM, negative banks count from the end. */
+void mapper_set_prg_8k(mapper_t *mapper, uint8_t slot, int bank);
+void mapper_set_prg_16k(mapper_t *mapper, uint8_t slot, int bank);
+void mapper_set_prg_32k(mapper_t *mapper, int bank);
+void mapper_set_chr_1k(mapper_t *mapper, uint8_t slot, int bank);
+void mapper_set_chr_2k(mapper_t *mapper, uint8_t slot, int bank);
+void mapper_set_chr_4k(mapper_t *mapper, uint8_t slot, int bank);
+void mapper_set_chr_8k(mapper_t *mapper, int bank);
+void mapper_set_chr_bg_1k(mapper_t *mapper, uint8_t slot, int bank);
 
-uint8_t get_chr_u8(uint16_t addr);
-uint16_t get_chr_u16(uint16_t addr);
+/* Battery saves: PRG RAM becomes a shared mapping of the save file, created if needed, so writes land in the page
+ * cache as they happen and survive a crash. mapper_flush_save only schedules the write back, call it once per frame.
+ * Read only saves are mapped privately: the game sees its save and can change it, the file is never written. */
+bool mapper_attach_save(mapper_t *mapper, const char *file, bool read_only);
+void mapper_flush_save(mapper_t *mapper);
 
-uint8_t get_ex_ram_u8(uint16_t addr);
-uint16_t get_ex_ram_u16(uint16_t addr);
-void set_ex_ram_u8(uint16_t addr, uint8_t value);
+/* State */
+size_t mapper_state_size(const mapper_t *mapper);
+void mapper_save_state(const mapper_t *mapper, uint8_t *buf);
+bool mapper_load_state(mapper_t *mapper, const uint8_t *buf, size_t size);
 
-bool has_mirroring(void);
+/* Boards: set up regs and the hooks, return FALSE if out of memory */
+bool nrom_init(mapper_t *mapper);
+bool mmc1_init(mapper_t *mapper);
+bool uxrom_init(mapper_t *mapper);
+bool cnrom_init(mapper_t *mapper);
+bool axrom_init(mapper_t *mapper);
+bool mmc3_init(mapper_t *mapper);
+bool mmc5_init(mapper_t *mapper);
 
 #ifdef __cplusplus
 }
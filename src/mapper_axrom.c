@@ -0,0 +1,45 @@
+#include <stdlib.h>
+
+#include "mapper.h"
+
+/* AxROM (7): switchable 32K PRG bank, 8K CHR RAM, single screen mirroring selected by bit 4 */
+struct axrom_regs_s {
+    uint8_t bank;
+};
+typedef struct axrom_regs_s axrom_regs_t;
+
+static void axrom_write(mapper_t *mapper, uint16_t addr, uint8_t val);
+static void axrom_update_banks(mapper_t *mapper);
+
+bool axrom_init(mapper_t *mapper) {
+    mapper->regs = calloc(1, sizeof(axrom_regs_t));
+    if (mapper->regs == NULL) {
+        return FALSE;
+    }
+    mapper->regs_size = sizeof(axrom_regs_t);
+
+    mapper->write = axrom_write;
+    mapper->update_banks = axrom_update_banks;
+
+    return TRUE;
+}
+
+static void axrom_write(mapper_t *mapper, uint16_t addr, uint8_t val) {
+    axrom_regs_t *regs = mapper->regs;
+
+    if (addr < 0x8000) {
+        return;
+    }
+
+    regs->bank = val;
+    axrom_update_banks(mapper);
+}
+
+static void axrom_update_banks(mapper_t *mapper) {
+    axrom_regs_t *regs = mapper->regs;
+
+    mapper_set_prg_32k(mapper, regs->bank & 0x07u);
+    mapper_set_chr_8k(mapper, 0);
+
+    mapper->mirroring = regs->bank & 0x10u ? MIRROR_SINGLE_HIGH : MIRROR_SINGLE_LOW;
+}
@@ -0,0 +1,43 @@
+#include <stdlib.h>
+
+#include "mapper.h"
+
+/* CNROM (3): fixed PRG, switchable 8K CHR bank */
+struct cnrom_regs_s {
+    uint8_t chr_bank;
+};
+typedef struct cnrom_regs_s cnrom_regs_t;
+
+static void cnrom_write(mapper_t *mapper, uint16_t addr, uint8_t val);
+static void cnrom_update_banks(mapper_t *mapper);
+
+bool cnrom_init(mapper_t *mapper) {
+    mapper->regs = calloc(1, sizeof(cnrom_regs_t));
+    if (mapper->regs == NULL) {
+        return FALSE;
+    }
+    mapper->regs_size = sizeof(cnrom_regs_t);
+
+    mapper->write = cnrom_write;
+    mapper->update_banks = cnrom_update_banks;
+
+    return TRUE;
+}
+
+static void cnrom_write(mapper_t *mapper, uint16_t addr, uint8_t val) {
+    cnrom_regs_t *regs = mapper->regs;
+
+    if (addr < 0x8000) {
+        return;
+    }
+
+    regs->chr_bank = val;
+    mapper_set_chr_8k(mapper, regs->chr_bank);
+}
+
+static void cnrom_update_banks(mapper_t *mapper) {
+    cnrom_regs_t *regs = mapper->regs;
+
+    mapper_set_prg_32k(mapper, 0);
+    mapper_set_chr_8k(mapper, regs->chr_bank);
+}
@@ -0,0 +1,126 @@
+#include <stdlib.h>
+
+#include "mapper.h"
+
+/* MMC1 (1): registers are written one bit at a time through a 5 bits shift register.
+ *
+ *   $8000-$9FFF: Control (mirroring, PRG and CHR modes)
+ *   $A000-$BFFF: CHR bank 0
+ *   $C000-$DFFF: CHR bank 1
+ *   $E000-$FFFF: PRG bank
+ *
+ * 512K boards (SUROM) use bit 4 of the CHR bank 0 register to select the 256K PRG half.
+ *
+ * The shift register ignores a write on the cycle after another one: of the two writes of a read-modify-write
+ * instruction, only the first one, the unchanged value, counts. Games reset the shift register with INC on a ROM byte
+ * that has bit 7 set. */
+struct mmc1_regs_s {
+    uint8_t shift;
+    uint8_t shift_count;
+
+    uint8_t control;
+    uint8_t chr_bank_0;
+    uint8_t chr_bank_1;
+    uint8_t prg_bank;
+};
+typedef struct mmc1_regs_s mmc1_regs_t;
+
+static void mmc1_write(mapper_t *mapper, uint16_t addr, uint8_t val);
+static void mmc1_update_banks(mapper_t *mapper);
+
+bool mmc1_init(mapper_t *mapper) {
+    mmc1_regs_t *regs = calloc(1, sizeof(mmc1_regs_t));
+
+    if (regs == NULL) {
+        return FALSE;
+    }
+
+    /* Power on in PRG mode 3: last bank fixed at $C000 */
+    regs->control = 0x0c;
+
+    mapper->regs = regs;
+    mapper->regs_size = sizeof(mmc1_regs_t);
+
+    mapper->write = mmc1_write;
+    mapper->update_banks = mmc1_update_banks;
+
+    return TRUE;
+}
+
+static void mmc1_write(mapper_t *mapper, uint16_t addr, uint8_t val) {
+    mmc1_regs_t *regs = mapper->regs;
+
+    if (addr < 0x8000 || mapper->consecutive_write) {
+        return;
+    }
+
+    if (val & 0x80u) {
+        regs->shift = 0;
+        regs->shift_count = 0;
+        regs->control |= 0x0cu;
+
+        mmc1_update_banks(mapper);
+        return;
+    }
+
+    regs->shift |= (uint8_t) ((val & 0x01u) << regs->shift_count);
+    regs->shift_count++;
+
+    if (regs->shift_count < 5) {
+        return;
+    }
+
+    switch ((addr >> 13u) & 0x03u) {
+        case 0: regs->control = regs->shift; break;
+        case 1: regs->chr_bank_0 = regs->shift; break;
+        case 2: regs->chr_bank_1 = regs->shift; break;
+        case 3: regs->prg_bank = regs->shift; break;
+    }
+
+    regs->shift = 0;
+    regs->shift_count = 0;
+
+    mmc1_update_banks(mapper);
+}
+
+static void mmc1_update_banks(mapper_t *mapper) {
+    mmc1_regs_t *regs = mapper->regs;
+    int nb_banks = (int) (mapper->prg_rom_size / 0x4000);
+    int outer = 0;
+    int bank = regs->prg_bank & 0x0f;
+
+    if (nb_banks > 16) {
+        outer = regs->chr_bank_0 & 0x10 ? 16 : 0;
+        nb_banks = 16;
+    }
+
+    switch ((regs->control >> 2u) & 0x03u) {
+        case 0:
+        case 1:
+            mapper_set_prg_16k(mapper, 0, outer + (bank & ~1));
+            mapper_set_prg_16k(mapper, 1, outer + (bank & ~1) + 1);
+            break;
+        case 2:
+            mapper_set_prg_16k(mapper, 0, outer);
+            mapper_set_prg_16k(mapper, 1, outer + bank);
+            break;
+        case 3:
+            mapper_set_prg_16k(mapper, 0, outer + bank);
+            mapper_set_prg_16k(mapper, 1, outer + nb_banks - 1);
+            break;
+    }
+
+    if (regs->control & 0x10u) {
+        mapper_set_chr_4k(mapper, 0, regs->chr_bank_0);
+        mapper_set_chr_4k(mapper, 1, regs->chr_bank_1);
+    } else {
+        mapper_set_chr_8k(mapper, regs->chr_bank_0 >> 1u);
+    }
+
+    switch (regs->control & 0x03u) {
+        case 0: mapper->mirroring = MIRROR_SINGLE_LOW; break;
+        case 1: mapper->mirroring = MIRROR_SINGLE_HIGH; break;
+        case 2: mapper->mirroring = MIRROR_VERTICAL; break;
+        case 3: mapper->mirroring = MIRROR_HORIZONTAL; break;
+    }
+}
@@ -0,0 +1,186 @@
+#include <stdlib.h>
+
+#include "mapper.h"
+#include "ppu.h"
+
+/* MMC3 (4): 8K PRG and 1K / 2K CHR banks, scanline counter IRQ.
+ *
+ *   $8000-$9FFE (even): Bank select (target register, PRG and CHR modes)
+ *   $8001-$9FFF (odd):  Bank data
+ *   $A000-$BFFE (even): Mirroring
+ *   $A001-$BFFF (odd):  PRG RAM protect, ignored
+ *   $C000-$DFFE (even): IRQ latch
+ *   $C001-$DFFF (odd):  IRQ reload
+ *   $E000-$FFFE (even): IRQ disable and acknowledge
+ *   $E001-$FFFF (odd):  IRQ enable
+ *
+ * The counter is clocked by the rising edges of PPU A12, once per rendering line. Instead of being told about each
+ * of them, the board counts the edges since its last write from the PPU timing (ppu_count_scanline_events) and
+ * schedules the dot at which the counter will reach zero. The CPU takes the IRQ once the PPU passes that dot, the
+ * counter itself is only brought up to date on the next register write. */
+struct mmc3_regs_s {
+    uint8_t bank_select;
+    uint8_t banks[8];
+    uint8_t mirroring;
+
+    uint8_t irq_latch;
+    uint8_t irq_counter;
+    bool irq_reload;
+    bool irq_enabled;
+    bool irq_pending;
+
+    /* PPU dot the counter is up to date with */
+    uint64_t sync_dot;
+};
+typedef struct mmc3_regs_s mmc3_regs_t;
+
+static void mmc3_write(mapper_t *mapper, uint16_t addr, uint8_t val);
+static void mmc3_scanline_sync(mapper_t *mapper);
+static void mmc3_update_banks(mapper_t *mapper);
+static void mmc3_clock_irq_counter(mmc3_regs_t *regs, uint64_t count);
+static void mmc3_schedule_irq(mapper_t *mapper);
+
+bool mmc3_init(mapper_t *mapper) {
+    mmc3_regs_t *regs = calloc(1, sizeof(mmc3_regs_t));
+
+    if (regs == NULL) {
+        return FALSE;
+    }
+
+    /* Keep the header mirroring until the game sets it */
+    regs->mirroring = mapper->mirroring == MIRROR_HORIZONTAL ? 1 : 0;
+
+    mapper->regs = regs;
+    mapper->regs_size = sizeof(mmc3_regs_t);
+
+    mapper->write = mmc3_write;
+    mapper->scanline_sync = mmc3_scanline_sync;
+    mapper->update_banks = mmc3_update_banks;
+
+    return TRUE;
+}
+
+static void mmc3_write(mapper_t *mapper, uint16_t addr, uint8_t val) {
+    mmc3_regs_t *regs = mapper->regs;
+
+    if (addr < 0x8000) {
+        return;
+    }
+
+    /* IRQ registers: bring the counter up to date before changing how it counts */
+    if (addr >= 0xc000) {
+        mmc3_scanline_sync(mapper);
+    }
+
+    switch (addr & 0xe001u) {
+        case 0x8000: regs->bank_select = val; break;
+        case 0x8001: regs->banks[regs->bank_select & 0x07u] = val; break;
+        case 0xa000: regs->mirroring = val & 0x01u; break;
+        case 0xa001: return;
+        case 0xc000: regs->irq_latch = val; break;
+        case 0xc001: regs->irq_counter = 0; regs->irq_reload = TRUE; break;
+        case 0xe000: regs->irq_enabled = FALSE; regs->irq_pending = FALSE; break;
+        case 0xe001: regs->irq_enabled = TRUE; break;
+    }
+
+    if (addr >= 0xc000) {
+        mmc3_schedule_irq(mapper);
+    } else {
+        mmc3_update_banks(mapper);
+    }
+}
+
+static void mmc3_scanline_sync(mapper_t *mapper) {
+    mmc3_regs_t *regs = mapper->regs;
+
+    if (mapper->ppu == NULL) {
+        return;
+    }
+
+    mmc3_clock_irq_counter(regs, ppu_count_scanline_events(mapper->ppu, regs->sync_dot, mapper->ppu->dot));
+    regs->sync_dot = mapper->ppu->dot;
+
+    mmc3_schedule_irq(mapper);
+}
+
+/* Same result as clocking the counter count times, one reload period at a time at most */
+static void mmc3_clock_irq_counter(mmc3_regs_t *regs, uint64_t count) {
+    uint64_t steps;
+
+    while (count > 0) {
+        if (regs->irq_counter == 0 || regs->irq_reload) {
+            regs->irq_counter = regs->irq_latch;
+            regs->irq_reload = FALSE;
+            count--;
+
+            /* Every latch + 1 clocks from here, the counter goes through zero and is reloaded */
+            if (count > regs->irq_latch) {
+                regs->irq_pending |= regs->irq_enabled;
+                count %= (uint64_t) regs->irq_latch + 1;
+            }
+        } else {
+            steps = count < regs->irq_counter ? count : regs->irq_counter;
+            regs->irq_counter = (uint8_t) (regs->irq_counter - steps);
+            count -= steps;
+        }
+
+        if (regs->irq_counter == 0 && regs->irq_enabled) {
+            regs->irq_pending = TRUE;
+        }
+    }
+}
+
+static void mmc3_schedule_irq(mapper_t *mapper) {
+    mmc3_regs_t *regs = mapper->regs;
+    uint64_t clocks;
+
+    if (regs->irq_pending) {
+        mapper->irq_dot = 0;
+        return;
+    }
+
+    if (!regs->irq_enabled || mapper->ppu == NULL) {
+        mapper->irq_dot = UINT64_MAX;
+        return;
+    }
+
+    /* Clocks until the counter reaches zero */
+    if (regs->irq_counter == 0 || regs->irq_reload) {
+        clocks = regs->irq_latch == 0 ? 1 : (uint64_t) regs->irq_latch + 1;
+    } else {
+        clocks = regs->irq_counter;
+    }
+
+    mapper->irq_dot = ppu_next_scanline_event(mapper->ppu, regs->sync_dot, clocks);
+}
+
+static void mmc3_update_banks(mapper_t *mapper) {
+    mmc3_regs_t *regs = mapper->regs;
+    uint8_t chr_invert = regs->bank_select & 0x80u ? 4 : 0;
+
+    if (regs->bank_select & 0x40u) {
+        mapper_set_prg_8k(mapper, 0, -2);
+        mapper_set_prg_8k(mapper, 2, regs->banks[6]);
+    } else {
+        mapper_set_prg_8k(mapper, 0, regs->banks[6]);
+        mapper_set_prg_8k(mapper, 2, -2);
+    }
+    mapper_set_prg_8k(mapper, 1, regs->banks[7]);
+    mapper_set_prg_8k(mapper, 3, -1);
+
+    /* R0 and R1 are 2K banks, the lowest bit is ignored */
+    mapper_set_chr_1k(mapper, chr_invert + 0, regs->banks[0] & 0xfe);
+    mapper_set_chr_1k(mapper, chr_invert + 1, regs->banks[0] | 0x01);
+    mapper_set_chr_1k(mapper, chr_invert + 2, regs->banks[1] & 0xfe);
+    mapper_set_chr_1k(mapper, chr_invert + 3, regs->banks[1] | 0x01);
+    for (uint8_t i = 0; i < 4; i++) {
+        mapper_set_chr_1k(mapper, (uint8_t) ((chr_invert ^ 4) + i), regs->banks[2 + i]);
+    }
+
+    if (mapper->mirroring != MIRROR_FOUR_SCREEN) {
+        mapper->mirroring = regs->mirroring ? MIRROR_HORIZONTAL : MIRROR_VERTICAL;
+    }
+
+    /* Also restores the IRQ schedule after a state load */
+    mmc3_schedule_irq(mapper);
+}
@@ -0,0 +1,339 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "mapper.h"
+#include "ppu.h"
+
+/* MMC5 (5): 8K to 32K PRG banks with RAM in the lower slots, 1K to 8K CHR banks with separate background banks for
+ * 8x16 sprites, 1K of ExRAM, per quadrant nametables, scanline IRQ and an 8x8 bits multiplier.
+ *
+ *   $5100: PRG mode            $5113-$5117: PRG banks ($6000, $8000, $A000, $C000, $E000)
+ *   $5101: CHR mode            $5120-$5127: Sprite CHR banks
+ *   $5102-$5103: RAM protect   $5128-$512B: Background CHR banks
+ *   $5104: ExRAM mode          $5130: CHR bank upper bits
+ *   $5105: Nametables          $5203: IRQ scanline
+ *   $5106: Fill tile           $5204: IRQ enable / status
+ *   $5107: Fill color          $5205-$5206: Multiplier
+ *   $5C00-$5FFF: ExRAM
+ *
+ * In extended attribute mode (ExRAM mode 1) every background tile picks its own 4K CHR bank and palette from the
+ * ExRAM byte matching its nametable entry. This is done for a whole line at once in bg_fetch.
+ *
+ * Like the MMC3's, the scanline IRQ is not clocked by the PPU: it is scheduled at the start of the compare line and
+ * rescheduled whenever rendering is turned on or off. */
+#define MMC5_NT_EXRAM 2
+#define MMC5_NT_FILL 3
+
+struct mmc5_regs_s {
+    uint8_t prg_mode;
+    uint8_t chr_mode;
+    uint8_t ram_protect[2];
+    uint8_t exram_mode;
+    uint8_t nametables;
+    uint8_t fill_tile;
+    uint8_t fill_color;
+
+    uint8_t prg_banks[5];
+    uint16_t chr_banks[12];
+    uint8_t chr_upper;
+    /* 8x8 sprites use the set written last for everything */
+    bool chr_bg_last;
+    bool sprite_16;
+
+    uint8_t irq_scanline;
+    bool irq_enabled;
+    bool irq_pending;
+    /* Next start of the compare line, from the PPU timing at the last sync */
+    uint64_t irq_target;
+
+    uint8_t multiplicand;
+    uint8_t multiplier;
+
+    uint8_t exram[0x400];
+    /* Nametable seen through the fill mode quadrants: the fill tile, and the fill color in every attribute */
+    uint8_t fill_nt[0x400];
+};
+typedef struct mmc5_regs_s mmc5_regs_t;
+
+static void mmc5_write(mapper_t *mapper, uint16_t addr, uint8_t val);
+static uint8_t mmc5_read(mapper_t *mapper, uint16_t addr);
+static void mmc5_scanline_sync(mapper_t *mapper);
+static void mmc5_update_banks(mapper_t *mapper);
+static void mmc5_bg_fetch(mapper_t *mapper, mapper_bg_tile_t *tiles, uint8_t count, uint8_t fine_y);
+static int mmc5_prg_bank(const mmc5_regs_t *regs, uint8_t slot, bool *is_ram);
+static void mmc5_update_fill(mmc5_regs_t *regs);
+static void mmc5_schedule_irq(mapper_t *mapper);
+
+bool mmc5_init(mapper_t *mapper) {
+    mmc5_regs_t *regs = calloc(1, sizeof(mmc5_regs_t));
+
+    if (regs == NULL) {
+        return FALSE;
+    }
+
+    /* Power on in PRG mode 3 with the last bank at $E000 */
+    regs->prg_mode = 3;
+    regs->chr_mode = 3;
+    regs->prg_banks[4] = 0xff;
+    regs->irq_target = UINT64_MAX;
+
+    mapper->regs = regs;
+    mapper->regs_size = sizeof(mmc5_regs_t);
+
+    mapper->write = mmc5_write;
+    mapper->read = mmc5_read;
+    mapper->scanline_sync = mmc5_scanline_sync;
+    mapper->update_banks = mmc5_update_banks;
+
+    return TRUE;
+}
+
+static void mmc5_write(mapper_t *mapper, uint16_t addr, uint8_t val) {
+    mmc5_regs_t *regs = mapper->regs;
+    bool is_ram;
+    int bank;
+
+    if (addr >= 0x8000) {
+        /* Only RAM banks take writes, and only while unprotected */
+        bank = mmc5_prg_bank(regs, (addr >> 13u) & 0x03u, &is_ram);
+
+        if (is_ram && regs->ram_protect[0] == 0x02 && regs->ram_protect[1] == 0x01) {
+            bank %= (int) (mapper->prg_ram_size / MAPPER_PRG_PAGE_SIZE);
+            mapper->prg_ram[bank * MAPPER_PRG_PAGE_SIZE + (addr & 0x1fffu)] = val;
+            mapper->prg_ram_dirty = TRUE;
+        }
+
+        return;
+    }
+
+    if (addr >= 0x5c00 && addr < 0x6000) {
+        /* Writable as nametable or attributes, or as plain RAM in mode 2 */
+        if (regs->exram_mode != 3) {
+            regs->exram[addr & 0x03ffu] = val;
+        }
+        return;
+    }
+
+    switch (addr) {
+        case 0x5100: regs->prg_mode = val & 0x03u; break;
+        case 0x5101: regs->chr_mode = val & 0x03u; break;
+        case 0x5102: regs->ram_protect[0] = val & 0x03u; return;
+        case 0x5103: regs->ram_protect[1] = val & 0x03u; return;
+        case 0x5104: regs->exram_mode = val & 0x03u; break;
+        case 0x5105: regs->nametables = val; break;
+        case 0x5106: regs->fill_tile = val; mmc5_update_fill(regs); return;
+        case 0x5107: regs->fill_color = val & 0x03u; mmc5_update_fill(regs); return;
+        case 0x5113: case 0x5114: case 0x5115: case 0x5116: case 0x5117:
+            regs->prg_banks[addr - 0x5113] = val;
+            break;
+        case 0x5120: case 0x5121: case 0x5122: case 0x5123: case 0x5124: case 0x5125: case 0x5126: case 0x5127:
+        case 0x5128: case 0x5129: case 0x512a: case 0x512b:
+            regs->chr_banks[addr - 0x5120] = (uint16_t) (val | regs->chr_upper << 8u);
+            regs->chr_bg_last = addr >= 0x5128;
+            break;
+        case 0x5130: regs->chr_upper = val & 0x03u; return;
+        case 0x5203:
+            mmc5_scanline_sync(mapper);
+            regs->irq_scanline = val;
+            regs->irq_target = UINT64_MAX;
+            mmc5_schedule_irq(mapper);
+            return;
+        case 0x5204:
+            mmc5_scanline_sync(mapper);
+            regs->irq_enabled = (val & 0x80u) != 0;
+            mmc5_schedule_irq(mapper);
+            return;
+        case 0x5205: regs->multiplicand = val; return;
+        case 0x5206: regs->multiplier = val; return;
+        default: return;
+    }
+
+    mmc5_update_banks(mapper);
+}
+
+static uint8_t mmc5_read(mapper_t *mapper, uint16_t addr) {
+    mmc5_regs_t *regs = mapper->regs;
+    const ppu_t *ppu = mapper->ppu;
+    uint8_t status;
+
+    if (addr >= 0x5c00 && addr < 0x6000) {
+        return regs->exram_mode >= 2 ? regs->exram[addr & 0x03ffu] : (uint8_t) (addr >> 8u);
+    }
+
+    switch (addr) {
+        case 0x5204:
+            mmc5_scanline_sync(mapper);
+
+            status = (uint8_t) (regs->irq_pending ? 0x80 : 0x00);
+            if (ppu != NULL && ppu->scanline < PPU_VBLANK_SCANLINE
+                && (ppu->mask & (PPU_MASK_BG | PPU_MASK_SPRITES))) {
+                status |= 0x40;
+            }
+
+            /* Reading acknowledges */
+            regs->irq_pending = FALSE;
+            mmc5_schedule_irq(mapper);
+
+            return status;
+        case 0x5205: return (uint8_t) (regs->multiplicand * regs->multiplier);
+        case 0x5206: return (uint8_t) ((regs->multiplicand * regs->multiplier) >> 8u);
+        default: return (uint8_t) (addr >> 8u);
+    }
+}
+
+static void mmc5_scanline_sync(mapper_t *mapper) {
+    mmc5_regs_t *regs = mapper->regs;
+    const ppu_t *ppu = mapper->ppu;
+
+    if (ppu == NULL) {
+        return;
+    }
+
+    if (ppu->dot >= regs->irq_target) {
+        regs->irq_pending = TRUE;
+    }
+    regs->irq_target = UINT64_MAX;
+
+    /* The background banks depend on the sprite size, which the board learns by snooping PPUCTRL */
+    if (regs->sprite_16 != ((ppu->ctrl & PPU_CTRL_SPRITE_16) != 0)) {
+        regs->sprite_16 = !regs->sprite_16;
+        mmc5_update_banks(mapper);
+    }
+
+    mmc5_schedule_irq(mapper);
+}
+
+static void mmc5_schedule_irq(mapper_t *mapper) {
+    mmc5_regs_t *regs = mapper->regs;
+    const ppu_t *ppu = mapper->ppu;
+    uint64_t frame_start;
+
+    /* Line 0 never matches: the counter starts there */
+    if (regs->irq_target == UINT64_MAX && ppu != NULL && (ppu->mask & (PPU_MASK_BG | PPU_MASK_SPRITES))
+        && regs->irq_scanline > 0 && regs->irq_scanline < PPU_VBLANK_SCANLINE) {
+        frame_start = ppu->dot - ppu->dot % PPU_DOTS_PER_FRAME;
+        regs->irq_target = frame_start + regs->irq_scanline * PPU_DOTS_PER_LINE;
+
+        if (regs->irq_target <= ppu->dot) {
+            regs->irq_target += PPU_DOTS_PER_FRAME;
+        }
+    }
+
+    if (!regs->irq_enabled) {
+        mapper->irq_dot = UINT64_MAX;
+    } else {
+        mapper->irq_dot = regs->irq_pending ? 0 : regs->irq_target;
+    }
+}
+
+static void mmc5_update_fill(mmc5_regs_t *regs) {
+    memset(regs->fill_nt, regs->fill_tile, 0x3c0);
+    memset(regs->fill_nt + 0x3c0, regs->fill_color * 0x55, 0x40);
+}
+
+/* 8K bank seen in a $8000-$FFFF slot. Bit 7 of the bank registers selects ROM, $E000 is always ROM. */
+static int mmc5_prg_bank(const mmc5_regs_t *regs, uint8_t slot, bool *is_ram) {
+    uint8_t reg;
+    int bank;
+
+    switch (regs->prg_mode) {
+        case 0: reg = 4; bank = (regs->prg_banks[reg] & 0x7c) + slot; break;
+        case 1: reg = slot < 2 ? 2 : 4; bank = (regs->prg_banks[reg] & 0x7e) + (slot & 0x01); break;
+        case 2:
+            reg = slot < 2 ? 2 : slot + 1;
+            bank = slot < 2 ? (regs->prg_banks[reg] & 0x7e) + slot : regs->prg_banks[reg] & 0x7f;
+            break;
+        default: reg = slot + 1; bank = regs->prg_banks[reg] & 0x7f; break;
+    }
+
+    *is_ram = reg < 4 && !(regs->prg_banks[reg] & 0x80u);
+
+    return *is_ram ? bank & 0x07 : bank;
+}
+
+static void mmc5_update_banks(mapper_t *mapper) {
+    mmc5_regs_t *regs = mapper->regs;
+    uint32_t nb_ram_banks = mapper->prg_ram_size / MAPPER_PRG_PAGE_SIZE;
+    uint8_t unit = (uint8_t) (8u >> regs->chr_mode);
+    bool is_ram;
+    int bank;
+
+    /* PRG */
+    mapper->prg_ram_page = mapper->prg_ram + (regs->prg_banks[0] & 0x07u) % nb_ram_banks * MAPPER_PRG_PAGE_SIZE;
+
+    for (uint8_t slot = 0; slot < 4; slot++) {
+        bank = mmc5_prg_bank(regs, slot, &is_ram);
+
+        if (is_ram) {
+            mapper->prg_pages[slot] = mapper->prg_ram + bank % nb_ram_banks * MAPPER_PRG_PAGE_SIZE;
+        } else {
+            mapper_set_prg_8k(mapper, slot, bank);
+        }
+    }
+
+    /* Sprite banks: the last register of each group of the bank size */
+    for (uint8_t group = 0; group < 8 / unit; group++) {
+        bank = regs->chr_banks[(group + 1) * unit - 1];
+
+        for (uint8_t page = 0; page < unit; page++) {
+            mapper_set_chr_1k(mapper, (uint8_t) (group * unit + page), bank * unit + page);
+        }
+    }
+
+    /* Background banks: 4K worth of registers, repeated in both pattern tables */
+    if (regs->sprite_16 || regs->chr_bg_last) {
+        if (regs->chr_mode == 0) {
+            for (uint8_t page = 0; page < 8; page++) {
+                mapper_set_chr_bg_1k(mapper, page, regs->chr_banks[11] * 8 + page);
+            }
+        } else {
+            for (uint8_t group = 0; group < 4 / unit; group++) {
+                bank = regs->chr_banks[8 + (group + 1) * unit - 1];
+
+                for (uint8_t page = 0; page < unit; page++) {
+                    mapper_set_chr_bg_1k(mapper, (uint8_t) (group * unit + page), bank * unit + page);
+                    mapper_set_chr_bg_1k(mapper, (uint8_t) (4 + group * unit + page), bank * unit + page);
+                }
+            }
+        }
+
+        if (!regs->sprite_16) {
+            memcpy(mapper->chr_pages, mapper->chr_bg_pages, sizeof(mapper->chr_pages));
+        }
+    }
+
+    /* Nametables */
+    mapper->mirroring = MIRROR_BOARD;
+    for (uint8_t quadrant = 0; quadrant < 4; quadrant++) {
+        uint8_t source = (regs->nametables >> (quadrant * 2u)) & 0x03u;
+
+        switch (source) {
+            case MMC5_NT_EXRAM: mapper->nt_pages[quadrant] = regs->exram; break;
+            case MMC5_NT_FILL: mapper->nt_pages[quadrant] = regs->fill_nt; break;
+            default: mapper->nt_pages[quadrant] = NULL; break;
+        }
+        mapper->nt_ciram[quadrant] = source & 0x01u;
+    }
+
+    mapper->bg_fetch = regs->exram_mode == 1 ? mmc5_bg_fetch : NULL;
+
+    /* Also restores the IRQ schedule after a state load */
+    mmc5_schedule_irq(mapper);
+}
+
+/* Extended attributes: ExRAM holds the 4K bank (6 bits, plus the upper bits in $5130) and palette of every tile */
+static void mmc5_bg_fetch(mapper_t *mapper, mapper_bg_tile_t *tiles, uint8_t count, uint8_t fine_y) {
+    const mmc5_regs_t *regs = mapper->regs;
+    uint32_t upper = (uint32_t) regs->chr_upper << 6u;
+    uint32_t chr_mask = mapper->chr_size - 1;
+
+    /* CHR sizes are powers of two on every MMC5 board */
+    for (uint8_t i = 0; i < count; i++) {
+        uint8_t ex = regs->exram[tiles[i].nt_addr & 0x03ffu];
+        uint32_t addr = ((upper | (ex & 0x3fu)) << 12u | (uint32_t) tiles[i].tile << 4u | fine_y) & chr_mask;
+
+        tiles[i].lo = mapper->chr[addr];
+        tiles[i].hi = mapper->chr[addr + 8];
+        tiles[i].palette = ex >> 6u;
+    }
+}
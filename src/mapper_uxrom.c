@@ -0,0 +1,44 @@
+#include <stdlib.h>
+
+#include "mapper.h"
+
+/* UxROM (2): switchable 16K PRG bank at $8000, last bank fixed at $C000, 8K CHR RAM */
+struct uxrom_regs_s {
+    uint8_t prg_bank;
+};
+typedef struct uxrom_regs_s uxrom_regs_t;
+
+static void uxrom_write(mapper_t *mapper, uint16_t addr, uint8_t val);
+static void uxrom_update_banks(mapper_t *mapper);
+
+bool uxrom_init(mapper_t *mapper) {
+    mapper->regs = calloc(1, sizeof(uxrom_regs_t));
+    if (mapper->regs == NULL) {
+        return FALSE;
+    }
+    mapper->regs_size = sizeof(uxrom_regs_t);
+
+    mapper->write = uxrom_write;
+    mapper->update_banks = uxrom_update_banks;
+
+    return TRUE;
+}
+
+static void uxrom_write(mapper_t *mapper, uint16_t addr, uint8_t val) {
+    uxrom_regs_t *regs = mapper->regs;
+
+    if (addr < 0x8000) {
+        return;
+    }
+
+    regs->prg_bank = val;
+    mapper_set_prg_16k(mapper, 0, regs->prg_bank);
+}
+
+static void uxrom_update_banks(mapper_t *mapper) {
+    uxrom_regs_t *regs = mapper->regs;
+
+    mapper_set_prg_16k(mapper, 0, regs->prg_bank);
+    mapper_set_prg_16k(mapper, 1, -1);
+    mapper_set_chr_8k(mapper, 0);
+}
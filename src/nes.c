@@ -0,0 +1,187 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "nes.h"
+#include "profiler.h"
+
+struct nes_state_header_s {
+    char magic[8];
+    uint32_t version;
+    uint32_t cpu_size;
+    uint32_t ppu_size;
+    uint32_t mapper_size;
+};
+typedef struct nes_state_header_s nes_state_header_t;
+
+nes_t *nes_init(cartridge_t *cart) {
+    nes_t *nes = calloc(1, sizeof(nes_t));
+
+    if (nes == NULL) {
+        return NULL;
+    }
+
+    nes->cart = cart;
+
+    nes->mapper = mapper_init(cart);
+    if (nes->mapper == NULL) {
+        free(nes);
+        return NULL;
+    }
+
+    nes->cpu = cpu_init();
+    nes->ppu = ppu_init();
+    if (nes->cpu == NULL || nes->ppu == NULL) {
+        log_error("nes", "Unable to initialize the console");
+        nes_free(nes);
+        return NULL;
+    }
+
+    nes->cpu->mapper = nes->mapper;
+    nes->cpu->ppu = nes->ppu;
+    nes->ppu->mapper = nes->mapper;
+    nes->mapper->ppu = nes->ppu;
+
+    cpu_reset(nes->cpu);
+
+    return nes;
+}
+
+void nes_free(nes_t *nes) {
+    if (nes->ppu != NULL) {
+        ppu_free(nes->ppu);
+    }
+
+    if (nes->cpu != NULL) {
+        cpu_free(nes->cpu);
+    }
+
+    mapper_free(nes->mapper);
+    free(nes);
+}
+
+void nes_reset(nes_t *nes) {
+    mapper_t *mapper = nes->mapper;
+
+    /* Boards counting scanlines catch up with the frame left behind, then reschedule their IRQ from the new one */
+    if (mapper->scanline_sync != NULL) {
+        mapper->scanline_sync(mapper);
+    }
+    ppu_reset(nes->ppu);
+    if (mapper->scanline_sync != NULL) {
+        mapper->scanline_sync(mapper);
+    }
+
+    cpu_reset(nes->cpu);
+    nes->faulted = FALSE;
+}
+
+uint64_t nes_step_frame(nes_t *nes) {
+    cpu_t *cpu = nes->cpu;
+    ppu_t *ppu = nes->ppu;
+    uint64_t end = (ppu->dot / PPU_DOTS_PER_FRAME + 1) * PPU_DOTS_PER_FRAME;
+    uint64_t instructions = 0;
+
+    if (nes->faulted) {
+        return 0;
+    }
+
+    ppu->skip_render = !nes_draws_frame(nes);
+
+    while (ppu->dot < end) {
+        uint16_t cycles = cpu_tick(cpu);
+
+        /* 3 PPU cycles for each CPU cycle */
+        for (int i = 0; i < cycles * 3; i++) {
+            ppu_tick(ppu);
+        }
+
+        instructions++;
+
+        if (cpu->fault[0] != '\0') {
+            nes->faulted = TRUE;
+            break;
+        }
+    }
+
+    mapper_flush_save(nes->mapper);
+    if (nes->faulted) {
+        return instructions;
+    }
+    if (cpu->profiler != NULL) {
+        profiler_end_frame(cpu->profiler);
+    }
+    nes->frame++;
+
+    return instructions;
+}
+
+bool nes_draws_frame(const nes_t *nes) {
+    uint32_t left;
+
+    if (nes->frameskip <= 1) {
+        return TRUE;
+    }
+
+    /* Frames left in the group after the next one */
+    left = (uint32_t) ((nes->frameskip - 1) - nes->frame % nes->frameskip);
+
+    return left == 0 || (nes->draw_previous && left == 1);
+}
+
+size_t nes_state_size(const nes_t *nes) {
+    return sizeof(nes_state_header_t) + cpu_state_size() + ppu_state_size() + mapper_state_size(nes->mapper);
+}
+
+void nes_save_state(const nes_t *nes, uint8_t *buf) {
+    nes_state_header_t header;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, NES_STATE_MAGIC, sizeof(NES_STATE_MAGIC));
+    header.version = NES_STATE_VERSION;
+    header.cpu_size = (uint32_t) cpu_state_size();
+    header.ppu_size = (uint32_t) ppu_state_size();
+    header.mapper_size = (uint32_t) mapper_state_size(nes->mapper);
+
+    memcpy(buf, &header, sizeof(header));
+    buf += sizeof(header);
+
+    cpu_save_state(nes->cpu, buf);
+    buf += header.cpu_size;
+
+    ppu_save_state(nes->ppu, buf);
+    buf += header.ppu_size;
+
+    mapper_save_state(nes->mapper, buf);
+}
+
+bool nes_load_state(nes_t *nes, const uint8_t *buf, size_t size) {
+    nes_state_header_t header;
+    const uint8_t *mapper_state;
+
+    if (size != nes_state_size(nes)) {
+        return FALSE;
+    }
+
+    memcpy(&header, buf, sizeof(header));
+    if (memcmp(header.magic, NES_STATE_MAGIC, sizeof(NES_STATE_MAGIC)) != 0 || header.version != NES_STATE_VERSION
+        || header.cpu_size != cpu_state_size() || header.ppu_size != ppu_state_size()) {
+        return FALSE;
+    }
+    buf += sizeof(header);
+
+    /* Check the board before changing anything, a failed load leaves the console as it was */
+    mapper_state = buf + header.cpu_size + header.ppu_size;
+    if ((mapper_state[0] | mapper_state[1] << 8u) != nes->mapper->type) {
+        return FALSE;
+    }
+
+    /* The PPU goes before the mapper: boards reschedule their IRQ from the PPU timing */
+    cpu_load_state(nes->cpu, buf);
+    buf += header.cpu_size;
+
+    ppu_load_state(nes->ppu, buf);
+    nes->faulted = FALSE;
+
+    return mapper_load_state(nes->mapper, mapper_state, header.mapper_size);
+}
@@ -0,0 +1,58 @@
+#ifndef __NES_H__
+#define __NES_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+#include "types.h"
+#include "cartridge.h"
+#include "cpu.h"
+#include "mapper.h"
+#include "ppu.h"
+
+#define NES_STATE_MAGIC "ACIDSAV"
+#define NES_STATE_VERSION 1
+
+/* A console: CPU, PPU and the board of one cartridge, wired together */
+struct nes_s {
+    cartridge_t *cart;
+    mapper_t *mapper;
+    cpu_t *cpu;
+    ppu_t *ppu;
+
+    uint64_t frame;
+    /* Draws one frame in frameskip, the last one of each group. 0 and 1 draw them all. */
+    uint32_t frameskip;
+    /* Also draws the frame before the last one of each group, for observations pooled over two frames */
+    bool draw_previous;
+
+    /* The CPU hit something the emulator doesn't handle, cpu->fault says what. The console doesn't run anymore, until
+       a reset or a state load. */
+    bool faulted;
+};
+typedef struct nes_s nes_t;
+
+/* Powers the console on. Returns NULL if the cartridge's board is not supported. The cartridge must outlive it. */
+nes_t *nes_init(cartridge_t *cart);
+void nes_free(nes_t *nes);
+/* The reset button. The PPU starts over at the top of the next frame, RAM and the board's registers are kept. */
+void nes_reset(nes_t *nes);
+
+/* Runs until the PPU starts the next frame, the framebuffer then holds the frame just finished, unless it was skipped
+ * (ppu->skip_render). Returns the number of instructions executed. Stops after the instruction that faults. */
+uint64_t nes_step_frame(nes_t *nes);
+/* Whether the next nes_step_frame draws its frame */
+bool nes_draws_frame(const nes_t *nes);
+
+/* State: header, CPU, PPU then mapper state. Only loads in the build and board it was saved from. */
+size_t nes_state_size(const nes_t *nes);
+void nes_save_state(const nes_t *nes, uint8_t *buf);
+bool nes_load_state(nes_t *nes, const uint8_t *buf, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __NES_H__ */
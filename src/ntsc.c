@@ -0,0 +1,197 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "ntsc.h"
+#include "ppu.h"
+
+/* Samples per subcarrier cycle, per input pixel, and per group of 3 input pixels, which gives NTSC_GROUP_OUT outputs */
+#define NTSC_CYCLE 12
+#define NTSC_PIXEL 8
+#define NTSC_GROUP 24
+#define NTSC_GROUP_OUT 7
+
+/* Hue of the decoder's reference relative to the PPU's color 0 phase, and the demodulation gain */
+#define NTSC_HUE (2.0 * M_PI / 3.0)
+#define NTSC_SATURATION 2.0
+
+/* Emphasized lines are attenuated during the phases of the emphasized colors */
+#define NTSC_ATTENUATION 0.746
+
+/* Voltages of the 2C02 for the 4 levels, low and high parts of the wave, and black and white */
+static const double NTSC_LOW[4] = {0.228, 0.312, 0.552, 0.880};
+static const double NTSC_HIGH[4] = {0.616, 0.840, 1.100, 1.100};
+static const double NTSC_BLACK = 0.312;
+static const double NTSC_WHITE = 1.100;
+
+struct ntsc_job_s {
+    const ntsc_t *ntsc;
+    const uint8_t *frame;
+    const uint8_t *emphasis;
+    uint32_t phase;
+    uint8_t *out;
+};
+typedef struct ntsc_job_s ntsc_job_t;
+
+/* Whether the wave of color is high at phase */
+static bool ntsc_in_phase(int color, int phase) {
+    return (color + phase) % NTSC_CYCLE < NTSC_CYCLE / 2;
+}
+
+/* Sample of index at subcarrier phase, 0 for black and 1 for white */
+static double ntsc_signal(int index, int emphasis, int phase) {
+    int color = index & 0x0f;
+    int level = (index >> 4) & 0x03;
+    double low, high, signal;
+
+    /* $xE and $xF are black */
+    if (color > 0x0d) {
+        level = 1;
+    }
+
+    low = NTSC_LOW[level];
+    high = NTSC_HIGH[level];
+
+    /* $x0 is a flat high level, $xD and above a flat low one */
+    if (color == 0x00) {
+        low = high;
+    }
+    if (color > 0x0c) {
+        high = low;
+    }
+
+    signal = ntsc_in_phase(color, phase) ? high : low;
+
+    if (color < 0x0e && (((emphasis & 0x01) && ntsc_in_phase(0, phase))
+                         || ((emphasis & 0x02) && ntsc_in_phase(4, phase))
+                         || ((emphasis & 0x04) && ntsc_in_phase(8, phase)))) {
+        signal *= NTSC_ATTENUATION;
+    }
+
+    return (signal - NTSC_BLACK) / (NTSC_WHITE - NTSC_BLACK);
+}
+
+/* Hann window of width samples */
+static double ntsc_window(double distance, int width) {
+    if (fabs(distance) >= width / 2.0) {
+        return 0;
+    }
+
+    return 0.5 * (1 + cos(2 * M_PI * distance / width));
+}
+
+ntsc_t *ntsc_init(void) {
+    ntsc_t *ntsc = calloc(1, sizeof(ntsc_t));
+
+    if (ntsc == NULL) {
+        log_error("ntsc", "Unable to allocate the NTSC filter");
+        return NULL;
+    }
+
+    for (int i = 0; i < NTSC_KERNEL_SIZE; i++) {
+        /* Center of the output pixel, in samples from the start of the group */
+        double center = (i - NTSC_KERNEL_LEFT + 0.5) * NTSC_GROUP / NTSC_GROUP_OUT;
+        double luma_sum = 0, chroma_sum = 0;
+
+        /* Windows are normalized on the samples they cover */
+        for (int s = -NTSC_GROUP * 2; s < NTSC_GROUP * 3; s++) {
+            luma_sum += ntsc_window(s + 0.5 - center, NTSC_LUMA_WINDOW);
+            chroma_sum += ntsc_window(s + 0.5 - center, NTSC_CHROMA_WINDOW);
+        }
+
+        for (int e = 0; e < PALETTE_EMPHASIS; e++) {
+            for (int line = 0; line < NTSC_PHASES; line++) {
+                for (int index = 0; index < PALETTE_SIZE; index++) {
+                    for (int q = 0; q < 3; q++) {
+                        double y = 0, u = 0, v = 0, rgb[3];
+
+                        for (int t = 0; t < NTSC_PIXEL; t++) {
+                            int s = q * NTSC_PIXEL + t;
+                            int phase = (line * (NTSC_CYCLE / NTSC_PHASES) + s) % NTSC_CYCLE;
+                            double signal = ntsc_signal(index, e, phase);
+                            double angle = 2 * M_PI * phase / NTSC_CYCLE + NTSC_HUE;
+                            double chroma = signal * ntsc_window(s + 0.5 - center, NTSC_CHROMA_WINDOW) / chroma_sum;
+
+                            y += signal * ntsc_window(s + 0.5 - center, NTSC_LUMA_WINDOW) / luma_sum;
+                            u += chroma * cos(angle) * NTSC_SATURATION;
+                            v += chroma * sin(angle) * NTSC_SATURATION;
+                        }
+
+                        /* YIQ to RGB */
+                        rgb[0] = y + 0.956 * u + 0.621 * v;
+                        rgb[1] = y - 0.272 * u - 0.647 * v;
+                        rgb[2] = y - 1.106 * u + 1.703 * v;
+
+                        for (int c = 0; c < 3; c++) {
+                            ntsc->kernels[e][line][index][q][i][c] = (int16_t) lround(rgb[c] * 255 * NTSC_KERNEL_ONE);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    return ntsc;
+}
+
+void ntsc_free(ntsc_t *ntsc) {
+    free(ntsc);
+}
+
+static void ntsc_line(const ntsc_t *ntsc, const uint8_t *line, uint8_t emphasis, uint32_t phase, uint8_t *out) {
+    const int16_t (*kernels)[3][NTSC_KERNEL_SIZE][4] = ntsc->kernels[emphasis & 0x07][phase];
+    /* acc[j + NTSC_KERNEL_LEFT] is output pixel j, the ones past the edges are dropped */
+    int32_t acc[NTSC_KERNEL_LEFT + NTSC_WIDTH + NTSC_KERNEL_SIZE][4];
+
+    memset(acc, 0, sizeof(acc));
+
+    for (int x = 0; x < PPU_WIDTH; x++) {
+        const int16_t (*kernel)[4] = kernels[line[x] & 0x3f][x % 3];
+        int32_t (*dst)[4] = &acc[x / 3 * NTSC_GROUP_OUT];
+
+        for (int i = 0; i < NTSC_KERNEL_SIZE; i++) {
+            for (int c = 0; c < 4; c++) {
+                dst[i][c] += kernel[i][c];
+            }
+        }
+    }
+
+    for (int j = 0; j < NTSC_WIDTH; j++) {
+        for (int c = 0; c < 3; c++) {
+            int32_t val = (acc[j + NTSC_KERNEL_LEFT][c] + NTSC_KERNEL_ONE / 2) >> NTSC_KERNEL_BITS;
+
+            out[j * 4 + c] = (uint8_t) (val < 0 ? 0 : val > 255 ? 255 : val);
+        }
+        out[j * 4 + 3] = 0xff;
+    }
+}
+
+static void ntsc_band(void *ctx, size_t band) {
+    const ntsc_job_t *job = ctx;
+    const size_t pitch = NTSC_WIDTH * 4;
+
+    for (size_t y = band * PPU_HEIGHT / NTSC_BANDS; y < (band + 1) * PPU_HEIGHT / NTSC_BANDS; y++) {
+        uint8_t *out = job->out + y * 2 * pitch;
+
+        /* The phase moves by a third of a cycle from one line to the next */
+        ntsc_line(job->ntsc, job->frame + y * PPU_WIDTH, job->emphasis != NULL ? job->emphasis[y] : 0,
+                  (uint32_t) ((job->phase + y) % NTSC_PHASES), out);
+        memcpy(out + pitch, out, pitch);
+    }
+}
+
+void ntsc_run(const ntsc_t *ntsc, threadpool_t *pool, const uint8_t *frame, const uint8_t *emphasis, uint32_t phase,
+              uint8_t *out) {
+    ntsc_job_t job = {ntsc, frame, emphasis, phase % NTSC_PHASES, out};
+
+    if (pool == NULL) {
+        for (size_t band = 0; band < NTSC_BANDS; band++) {
+            ntsc_band(&job, band);
+        }
+        return;
+    }
+
+    threadpool_run(pool, ntsc_band, &job, NTSC_BANDS);
+}
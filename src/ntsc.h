@@ -0,0 +1,61 @@
+#ifndef __NTSC_H__
+#define __NTSC_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "types.h"
+#include "palette.h"
+#include "threadpool.h"
+
+/* NTSC composite video: frames of palette indexes turned into the signal the PPU puts on the wire, then decoded back
+ * to RGB the way a TV does, with its artifacts: color fringes on sharp edges, luma and chroma bleeding into each
+ * other, and dot crawl, the pattern moving from one frame to the next.
+ *
+ * The PPU draws a pixel as 8 samples of a square wave, 12 samples per color subcarrier cycle, at the levels of the
+ * 2C02. The decoder filters luma and demodulates chroma with windows of NTSC_LUMA_WINDOW and NTSC_CHROMA_WINDOW
+ * samples around each output pixel, 7 output pixels for every 3 input ones (2 subcarrier cycles). Everything from
+ * the signal to RGB is linear, so the contribution of each input pixel to its neighbouring output pixels is
+ * precomputed for every color, emphasis, line phase and position in its group of 3. A line is then NTSC_KERNEL_SIZE
+ * additions per pixel.
+ *
+ * The subcarrier phase moves by a third of a cycle at every line and every frame: lines are drawn with one of 3
+ * phases, and the frame's phase (its number mod 3) makes the dots crawl. Output lines are doubled, for a 4:3 picture
+ * at 602x480. Bands of lines are spread over a thread pool. */
+
+#define NTSC_WIDTH 602
+#define NTSC_HEIGHT 480
+#define NTSC_PHASES 3
+
+#define NTSC_LUMA_WINDOW 16
+#define NTSC_CHROMA_WINDOW 24
+
+/* Output pixels an input pixel contributes to, starting NTSC_KERNEL_LEFT before the first of its group */
+#define NTSC_KERNEL_LEFT 4
+#define NTSC_KERNEL_SIZE 14
+
+/* Contributions are in 1/NTSC_KERNEL_ONE of a level */
+#define NTSC_KERNEL_BITS 5
+#define NTSC_KERNEL_ONE (1 << NTSC_KERNEL_BITS)
+
+#define NTSC_BANDS 16
+
+struct ntsc_s {
+    /* [emphasis][line phase][index][position in group][output pixel][R, G, B, unused] */
+    int16_t kernels[PALETTE_EMPHASIS][NTSC_PHASES][PALETTE_SIZE][3][NTSC_KERNEL_SIZE][4];
+};
+typedef struct ntsc_s ntsc_t;
+
+ntsc_t *ntsc_init(void);
+void ntsc_free(ntsc_t *ntsc);
+
+/* frame holds PPU_WIDTH x PPU_HEIGHT palette indexes, emphasis the emphasis bits of each line or NULL. out gets
+ * NTSC_WIDTH x NTSC_HEIGHT RGBA pixels (R, G, B, 0xFF). pool may be NULL to run on the calling thread only. */
+void ntsc_run(const ntsc_t *ntsc, threadpool_t *pool, const uint8_t *frame, const uint8_t *emphasis, uint32_t phase,
+              uint8_t *out);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __NTSC_H__ */
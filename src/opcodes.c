@@ -1,5 +1,7 @@
 #include "opcodes.h"
 #include "common.h"
+#include "log.h"
+#include "profiler.h"
 
 uint8_t add(cpu_t *cpu, uint8_t reg, uint8_t val);
 uint8_t sub(cpu_t *cpu, uint8_t reg, uint8_t val);
@@ -151,7 +153,7 @@ void CLV(cpu_t *cpu) {
 void JMP(cpu_t *cpu) {
     uint16_t addr = cpu_get_addr(cpu);
 
-    _debug_log("JMP", "Jumping to: 0x%04x\n", addr);
+    log_trace("JMP", "Jumping to: 0x%04x", addr);
     cpu->PC = addr;
 }
 
@@ -163,15 +165,23 @@ void JSR(cpu_t *cpu) {
 
     cpu_push_u16(cpu, cpu->PC);
 
-    _debug_log("JSR", "Jumping to sub-routine at: 0x%04x\n", addr);
+    log_trace("JSR", "Jumping to sub-routine at: 0x%04x", addr);
     cpu->PC = addr;
+
+    if (cpu->profiler != NULL) {
+        profiler_call(cpu->profiler, addr, (uint8_t) (cpu->SP + 2));
+    }
 }
 
 void RTS(cpu_t *cpu) {
     uint16_t addr = cpu_pop_u16(cpu);
-    _debug_log("RTS", "Return from sub-routine to: 0x%04x\n", addr);
+    log_trace("RTS", "Return from sub-routine to: 0x%04x", addr);
     cpu->PC = addr;
     cpu->PC++;
+
+    if (cpu->profiler != NULL) {
+        profiler_return(cpu->profiler, cpu->SP);
+    }
 }
 
 void RTI(cpu_t *cpu) {
@@ -182,6 +192,10 @@ void RTI(cpu_t *cpu) {
     cpu->P = p;
 
     cpu->PC = cpu_pop_u16(cpu);
+
+    if (cpu->profiler != NULL) {
+        profiler_return(cpu->profiler, cpu->SP);
+    }
 }
 
 void LDA(cpu_t *cpu) {
@@ -299,8 +313,9 @@ void TYA(cpu_t *cpu) {
 
 void INC(cpu_t *cpu) {
     uint16_t addr = cpu_get_addr(cpu);
-    uint8_t val = cpu_get_u8(cpu, addr) + 1;
-    cpu_set_u8(cpu, addr, val);
+    uint8_t old = cpu_get_u8(cpu, addr);
+    uint8_t val = old + 1;
+    cpu_modify_u8(cpu, addr, old, val);
 
     cpu_set_zero(cpu, val);
     cpu_set_negative(cpu, val);
@@ -320,8 +335,9 @@ void INY(cpu_t *cpu) {
 
 void DEC(cpu_t *cpu) {
     uint16_t addr = cpu_get_addr(cpu);
-    uint8_t val = cpu_get_u8(cpu, addr) - 1;
-    cpu_set_u8(cpu, addr, val);
+    uint8_t old = cpu_get_u8(cpu, addr);
+    uint8_t val = old - 1;
+    cpu_modify_u8(cpu, addr, old, val);
 
     cpu_set_zero(cpu, val);
     cpu_set_negative(cpu, val);
@@ -340,82 +356,82 @@ void DEY(cpu_t *cpu) {
 }
 
 void ASL(cpu_t *cpu) {
-    uint8_t val;
+    uint8_t old, val;
     uint16_t addr = 0;
 
     if (cpu->addr_mode == ACCUMULATOR) {
-        val = cpu->A;
+        old = cpu->A;
     } else {
         addr = cpu_get_addr(cpu);
-        val = cpu_get_u8(cpu, addr);
+        old = cpu_get_u8(cpu, addr);
     }
 
-    val = shift_left(cpu, val);
+    val = shift_left(cpu, old);
 
     if (cpu->addr_mode == ACCUMULATOR) {
         cpu->A = val;
     } else {
-        cpu_set_u8(cpu, addr, val);
+        cpu_modify_u8(cpu, addr, old, val);
     }
 }
 
 void LSR(cpu_t *cpu) {
-    uint8_t val;
+    uint8_t old, val;
     uint16_t addr = 0;
 
     if (cpu->addr_mode == ACCUMULATOR) {
-        val = cpu->A;
+        old = cpu->A;
     } else {
         addr = cpu_get_addr(cpu);
-        val = cpu_get_u8(cpu, addr);
+        old = cpu_get_u8(cpu, addr);
     }
 
-    val = shift_right(cpu, val);
+    val = shift_right(cpu, old);
 
     if (cpu->addr_mode == ACCUMULATOR) {
         cpu->A = val;
     } else {
-        cpu_set_u8(cpu, addr, val);
+        cpu_modify_u8(cpu, addr, old, val);
     }
 }
 
 void ROL(cpu_t *cpu) {
-    uint8_t val;
+    uint8_t old, val;
     uint16_t addr = 0;
 
     if (cpu->addr_mode == ACCUMULATOR) {
-        val = cpu->A;
+        old = cpu->A;
     } else {
         addr = cpu_get_addr(cpu);
-        val = cpu_get_u8(cpu, addr);
+        old = cpu_get_u8(cpu, addr);
     }
 
-    val = rotate_left(cpu, val);
+    val = rotate_left(cpu, old);
 
     if (cpu->addr_mode == ACCUMULATOR) {
         cpu->A = val;
     } else {
-        cpu_set_u8(cpu, addr, val);
+        cpu_modify_u8(cpu, addr, old, val);
     }
 }
 
 void ROR(cpu_t *cpu) {
-    uint8_t val;
+    uint8_t old, val;
     uint16_t addr = 0;
 
     if (cpu->addr_mode == ACCUMULATOR) {
-        val = cpu->A;
+        old = cpu->A;
     } else {
         addr = cpu_get_addr(cpu);
-        val = cpu_get_u8(cpu, addr);
+        old = cpu_get_u8(cpu, addr);
     }
 
-    val = rotate_right(cpu, val);
+    val = rotate_right(cpu, old);
 
     if (cpu->addr_mode == ACCUMULATOR) {
         cpu->A = val;
     } else {
-        cpu_set_u8(cpu, addr, val);
+        cpu_modify_u8(cpu, addr, old, val);
     }
 }
 
@@ -435,6 +451,10 @@ void BRK(cpu_t *cpu) {
     cpu_push_u8(cpu, cpu->P);
 
     cpu->PC = cpu_get_u16(cpu, IRQ_VECTOR);
+
+    if (cpu->profiler != NULL) {
+        profiler_interrupt(cpu->profiler, cpu->PC, (uint8_t) (cpu->SP + 3), FALSE);
+    }
 }
 
 void LAX(cpu_t *cpu) {
@@ -453,27 +473,28 @@ void SAX(cpu_t *cpu) {
 
 void DCP(cpu_t *cpu) {
     uint16_t addr = cpu_get_addr(cpu);
-    uint8_t val = cpu_get_u8(cpu, addr) - 1;
-    cpu_set_u8(cpu, addr, val);
+    uint8_t old = cpu_get_u8(cpu, addr);
+    uint8_t val = old - 1;
+    cpu_modify_u8(cpu, addr, old, val);
 
     cmp(cpu, cpu->A, val);
 }
 
 void ISB(cpu_t *cpu) {
     uint16_t addr = cpu_get_addr(cpu);
-    uint8_t val = cpu_get_u8(cpu, addr) + 1;
-    cpu_set_u8(cpu, addr, val);
+    uint8_t old = cpu_get_u8(cpu, addr);
+    uint8_t val = old + 1;
+    cpu_modify_u8(cpu, addr, old, val);
 
     cpu->A = sub(cpu, cpu->A, val);
 }
 
 void RLA(cpu_t *cpu) {
     uint16_t addr = cpu_get_addr(cpu);
-    uint8_t val = cpu_get_u8(cpu, addr);
+    uint8_t old = cpu_get_u8(cpu, addr);
+    uint8_t val = rotate_left(cpu, old);
 
-    val = rotate_left(cpu, val);
-
-    cpu_set_u8(cpu, addr, val);
+    cpu_modify_u8(cpu, addr, old, val);
 
     cpu->A &= val;
     cpu_set_zero(cpu, cpu->A);
@@ -482,22 +503,20 @@ void RLA(cpu_t *cpu) {
 
 void RRA(cpu_t *cpu) {
     uint16_t addr = cpu_get_addr(cpu);
-    uint8_t val = cpu_get_u8(cpu, addr);
-
-    val = rotate_right(cpu, val);
+    uint8_t old = cpu_get_u8(cpu, addr);
+    uint8_t val = rotate_right(cpu, old);
 
-    cpu_set_u8(cpu, addr, val);
+    cpu_modify_u8(cpu, addr, old, val);
 
     cpu->A = add(cpu, cpu->A, val);
 }
 
 void SLO(cpu_t *cpu) {
     uint16_t addr = cpu_get_addr(cpu);
-    uint8_t val = cpu_get_u8(cpu, addr);
-
-    val = shift_left(cpu, val);
+    uint8_t old = cpu_get_u8(cpu, addr);
+    uint8_t val = shift_left(cpu, old);
 
-    cpu_set_u8(cpu, addr, val);
+    cpu_modify_u8(cpu, addr, old, val);
 
     cpu->A |= val;
     cpu_set_zero(cpu, cpu->A);
@@ -506,11 +525,10 @@ void SLO(cpu_t *cpu) {
 
 void SRE(cpu_t *cpu) {
     uint16_t addr = cpu_get_addr(cpu);
-    uint8_t val = cpu_get_u8(cpu, addr);
+    uint8_t old = cpu_get_u8(cpu, addr);
+    uint8_t val = shift_right(cpu, old);
 
-    val = shift_right(cpu, val);
-
-    cpu_set_u8(cpu, addr, val);
+    cpu_modify_u8(cpu, addr, old, val);
 
     cpu->A ^= val;
     cpu_set_zero(cpu, cpu->A);
@@ -571,8 +589,10 @@ void branch(cpu_t *cpu, int8_t offset) {
 
     if (!addr_are_same_page(pc, cpu->PC)) {
         cpu->instr_cycles += 2;
+        CPU_STATS_EVENT(cpu, STATS_BRANCH_TAKEN | STATS_BRANCH_PAGE_CROSS);
     } else {
         cpu->instr_cycles++;
+        CPU_STATS_EVENT(cpu, STATS_BRANCH_TAKEN);
     }
 }
 
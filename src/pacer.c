@@ -0,0 +1,105 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "pacer.h"
+
+static uint64_t pacer_now(void);
+static void pacer_sleep_until(uint64_t deadline);
+static int pacer_compare(const void *a, const void *b);
+
+pacer_t *pacer_init(double hz, double speed) {
+    pacer_t *pacer = calloc(1, sizeof(pacer_t));
+
+    if (pacer == NULL) {
+        log_error("pacer", "Unable to allocate the pacer");
+        return NULL;
+    }
+
+    pacer->period = speed > 0 ? (uint64_t) (1e9 / (hz * speed)) : 0;
+    pacer->start = pacer_now();
+    pacer->last = pacer->start;
+    pacer->deadline = pacer->start + pacer->period;
+
+    return pacer;
+}
+
+void pacer_free(pacer_t *pacer) {
+    free(pacer);
+}
+
+void pacer_end_frame(pacer_t *pacer) {
+    uint64_t now;
+
+    if (pacer->period != 0) {
+        now = pacer_now();
+        if (now > pacer->deadline + PACER_MAX_LATE * pacer->period) {
+            pacer->deadline = now;
+        }
+
+        if (now + PACER_SPIN < pacer->deadline) {
+            pacer_sleep_until(pacer->deadline - PACER_SPIN);
+        }
+
+        while ((now = pacer_now()) < pacer->deadline) {
+        }
+
+        pacer->deadline += pacer->period;
+    } else {
+        now = pacer_now();
+    }
+
+    pacer->times[pacer->nb_frames++ & (PACER_HISTORY - 1)] =
+            now - pacer->last < UINT32_MAX ? (uint32_t) (now - pacer->last) : UINT32_MAX;
+    pacer->last = now;
+}
+
+void pacer_get_stats(const pacer_t *pacer, pacer_stats_t *stats) {
+    uint32_t times[PACER_HISTORY];
+    size_t n = pacer->nb_frames < PACER_HISTORY ? pacer->nb_frames : PACER_HISTORY;
+
+    memset(stats, 0, sizeof(pacer_stats_t));
+    stats->frames = pacer->nb_frames;
+    if (n == 0) {
+        return;
+    }
+
+    stats->fps = pacer->last > pacer->start ? (double) pacer->nb_frames * 1e9 / (double) (pacer->last - pacer->start)
+                                            : 0;
+
+    memcpy(times, pacer->times, n * sizeof(uint32_t));
+    qsort(times, n, sizeof(uint32_t), pacer_compare);
+
+    /* Nearest rank */
+    stats->p50 = times[(n * 50 + 99) / 100 - 1] / 1e6;
+    stats->p90 = times[(n * 90 + 99) / 100 - 1] / 1e6;
+    stats->p99 = times[(n * 99 + 99) / 100 - 1] / 1e6;
+    stats->max = times[n - 1] / 1e6;
+}
+
+static uint64_t pacer_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+/* Absolute: being preempted between reading the clock and sleeping does not push the deadline back */
+static void pacer_sleep_until(uint64_t deadline) {
+    struct timespec ts;
+
+    ts.tv_sec = (time_t) (deadline / 1000000000u);
+    ts.tv_nsec = (long) (deadline % 1000000000u);
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+static int pacer_compare(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+
+    return x < y ? -1 : x > y;
+}
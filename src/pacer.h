@@ -0,0 +1,57 @@
+#ifndef __PACER_H__
+#define __PACER_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "types.h"
+
+/* Frame pacing.
+ *
+ * pacer_end_frame is called once per emulated frame. Paced, it returns at the frame's deadline: deadlines are
+ * absolute, a late frame does not delay the next ones, and the last PACER_SPIN nanoseconds are spun rather than
+ * slept to take the scheduler's wake-up latency out of the jitter. A pacer more than PACER_MAX_LATE frames behind
+ * (suspended, debugger) starts over from now instead of running flat out to catch up.
+ *
+ * Unlimited, it only measures. Either way the time between frames is kept for the last PACER_HISTORY frames. */
+
+#define PACER_NTSC_HZ 60.0988
+#define PACER_PAL_HZ 50.007
+
+#define PACER_HISTORY 1024
+#define PACER_SPIN 1000000
+#define PACER_MAX_LATE 8
+
+struct pacer_s {
+    uint64_t period; /* Nanoseconds, 0 when unlimited */
+    uint64_t deadline;
+    uint64_t start;
+    uint64_t last;
+    uint64_t nb_frames;
+    uint32_t times[PACER_HISTORY]; /* Nanoseconds from the previous frame */
+};
+typedef struct pacer_s pacer_t;
+
+struct pacer_stats_s {
+    uint64_t frames;
+    double fps; /* Since pacer_init */
+    /* Frame times over the last PACER_HISTORY frames, in milliseconds */
+    double p50;
+    double p90;
+    double p99;
+    double max;
+};
+typedef struct pacer_stats_s pacer_stats_t;
+
+/* speed is a multiple of hz, 0 for as fast as possible */
+pacer_t *pacer_init(double hz, double speed);
+void pacer_free(pacer_t *pacer);
+
+void pacer_end_frame(pacer_t *pacer);
+void pacer_get_stats(const pacer_t *pacer, pacer_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __PACER_H__ */
@@ -0,0 +1,324 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PALETTE_HAVE_SIMD 1
+#endif
+
+#include "log.h"
+#include "palette.h"
+#include "ppu.h"
+
+/* Each emphasis bit dims the other two channels to about 0.816, in 8.8 fixed point */
+#define PALETTE_DIMMED 209
+
+#ifdef PALETTE_HAVE_SIMD
+/* Values of each channel for one line of indexes */
+typedef void (*palette_lookup_fn_t)(const uint8_t (*channels)[PALETTE_SIZE], int nb_channels, const uint8_t *line,
+                                    uint8_t (*planes)[PPU_WIDTH]);
+
+static void palette_lookup_sse41(const uint8_t (*channels)[PALETTE_SIZE], int nb_channels, const uint8_t *line,
+                                 uint8_t (*planes)[PPU_WIDTH]);
+static void palette_lookup_avx2(const uint8_t (*channels)[PALETTE_SIZE], int nb_channels, const uint8_t *line,
+                                uint8_t (*planes)[PPU_WIDTH]);
+static void palette_lookup_avx512(const uint8_t (*channels)[PALETTE_SIZE], int nb_channels, const uint8_t *line,
+                                  uint8_t (*planes)[PPU_WIDTH]);
+static void palette_interleave(palette_format_t format, const uint8_t (*planes)[PPU_WIDTH], uint8_t *out);
+#endif
+
+static palette_isa_t _palette_best;
+static pthread_once_t _palette_once = PTHREAD_ONCE_INIT;
+
+static void palette_init_impl(void) {
+    _palette_best = PALETTE_GENERIC;
+
+#ifdef PALETTE_HAVE_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vbmi")) {
+        _palette_best = PALETTE_AVX512;
+    } else if (__builtin_cpu_supports("avx2")) {
+        _palette_best = PALETTE_AVX2;
+    } else if (__builtin_cpu_supports("sse4.1")) {
+        _palette_best = PALETTE_SSE41;
+    }
+#endif
+}
+
+/* The 2C02 palette most emulators default to */
+const uint8_t PALETTE_RGB[PALETTE_SIZE][3] = {
+    {0x7c, 0x7c, 0x7c}, {0x00, 0x00, 0xfc}, {0x00, 0x00, 0xbc}, {0x44, 0x28, 0xbc},
+    {0x94, 0x00, 0x84}, {0xa8, 0x00, 0x20}, {0xa8, 0x10, 0x00}, {0x88, 0x14, 0x00},
+    {0x50, 0x30, 0x00}, {0x00, 0x78, 0x00}, {0x00, 0x68, 0x00}, {0x00, 0x58, 0x00},
+    {0x00, 0x40, 0x58}, {0x00, 0x00, 0x00}, {0x00, 0x00, 0x00}, {0x00, 0x00, 0x00},
+    {0xbc, 0xbc, 0xbc}, {0x00, 0x78, 0xf8}, {0x00, 0x58, 0xf8}, {0x68, 0x44, 0xfc},
+    {0xd8, 0x00, 0xcc}, {0xe4, 0x00, 0x58}, {0xf8, 0x38, 0x00}, {0xe4, 0x5c, 0x10},
+    {0xac, 0x7c, 0x00}, {0x00, 0xb8, 0x00}, {0x00, 0xa8, 0x00}, {0x00, 0xa8, 0x44},
+    {0x00, 0x88, 0x88}, {0x00, 0x00, 0x00}, {0x00, 0x00, 0x00}, {0x00, 0x00, 0x00},
+    {0xf8, 0xf8, 0xf8}, {0x3c, 0xbc, 0xfc}, {0x68, 0x88, 0xfc}, {0x98, 0x78, 0xf8},
+    {0xf8, 0x78, 0xf8}, {0xf8, 0x58, 0x98}, {0xf8, 0x78, 0x58}, {0xfc, 0xa0, 0x44},
+    {0xf8, 0xb8, 0x00}, {0xb8, 0xf8, 0x18}, {0x58, 0xd8, 0x54}, {0x58, 0xf8, 0x98},
+    {0x00, 0xe8, 0xd8}, {0x78, 0x78, 0x78}, {0x00, 0x00, 0x00}, {0x00, 0x00, 0x00},
+    {0xfc, 0xfc, 0xfc}, {0xa4, 0xe4, 0xfc}, {0xb8, 0xb8, 0xf8}, {0xd8, 0xb8, 0xf8},
+    {0xf8, 0xb8, 0xf8}, {0xf8, 0xa4, 0xc0}, {0xf0, 0xd0, 0xb0}, {0xfc, 0xe0, 0xa8},
+    {0xf8, 0xd8, 0x78}, {0xd8, 0xf8, 0x78}, {0xb8, 0xf8, 0xb8}, {0xb8, 0xf8, 0xd8},
+    {0x00, 0xfc, 0xfc}, {0xf8, 0xd8, 0xf8}, {0x00, 0x00, 0x00}, {0x00, 0x00, 0x00},
+};
+
+void palette_luma(uint8_t luma[PALETTE_SIZE]) {
+    for (int i = 0; i < PALETTE_SIZE; i++) {
+        const uint8_t *rgb = PALETTE_RGB[i];
+
+        /* 0.299 R + 0.587 G + 0.114 B in 8.8 fixed point, the weights summing to 256 */
+        luma[i] = (uint8_t) ((77 * rgb[0] + 150 * rgb[1] + 29 * rgb[2] + 128) >> 8);
+    }
+}
+
+palette_t *palette_init(palette_format_t format) {
+    palette_t *palette;
+
+    if (format != PALETTE_RGBA && format != PALETTE_RGB565 && format != PALETTE_YUYV) {
+        log_error("palette", "Unknown pixel format: %d", (int) format);
+        return NULL;
+    }
+
+    palette = calloc(1, sizeof(palette_t));
+    if (palette == NULL) {
+        log_error("palette", "Unable to allocate the palette");
+        return NULL;
+    }
+
+    palette->format = format;
+    palette->nb_channels = format == PALETTE_RGB565 ? 2 : 3;
+
+    for (int e = 0; e < PALETTE_EMPHASIS; e++) {
+        for (int i = 0; i < PALETTE_SIZE; i++) {
+            int rgb[3];
+
+            for (int c = 0; c < 3; c++) {
+                rgb[c] = PALETTE_RGB[i][c];
+                if (e & ~(1 << c)) {
+                    rgb[c] = (rgb[c] * PALETTE_DIMMED + 128) >> 8;
+                }
+            }
+
+            switch (format) {
+                case PALETTE_RGBA:
+                    for (int c = 0; c < 3; c++) {
+                        palette->channels[e][c][i] = (uint8_t) rgb[c];
+                    }
+                    break;
+                case PALETTE_RGB565: {
+                    int word = (rgb[0] >> 3) << 11 | (rgb[1] >> 2) << 5 | rgb[2] >> 3;
+
+                    palette->channels[e][0][i] = (uint8_t) word;
+                    palette->channels[e][1][i] = (uint8_t) (word >> 8);
+                    break;
+                }
+                case PALETTE_YUYV:
+                    palette->channels[e][0][i] = (uint8_t) (((66 * rgb[0] + 129 * rgb[1] + 25 * rgb[2] + 128) >> 8)
+                                                            + 16);
+                    palette->channels[e][1][i] = (uint8_t) (((-38 * rgb[0] - 74 * rgb[1] + 112 * rgb[2] + 128) >> 8)
+                                                            + 128);
+                    palette->channels[e][2][i] = (uint8_t) (((112 * rgb[0] - 94 * rgb[1] - 18 * rgb[2] + 128) >> 8)
+                                                            + 128);
+                    break;
+            }
+        }
+    }
+
+    return palette;
+}
+
+void palette_free(palette_t *palette) {
+    free(palette);
+}
+
+size_t palette_pixel_size(palette_format_t format) {
+    return format == PALETTE_RGBA ? 4 : 2;
+}
+
+palette_isa_t palette_best_isa(void) {
+    pthread_once(&_palette_once, palette_init_impl);
+
+    return _palette_best;
+}
+
+bool palette_isa_supported(palette_isa_t isa) {
+    return isa <= palette_best_isa();
+}
+
+void palette_convert(const palette_t *palette, const uint8_t *frame, const uint8_t *emphasis, uint8_t *out) {
+    palette_convert_isa(palette, palette_best_isa(), frame, emphasis, out);
+}
+
+/* The reference: one pixel at a time */
+static void palette_convert_line_generic(palette_format_t format, const uint8_t (*channels)[PALETTE_SIZE],
+                                         const uint8_t *line, uint8_t *out) {
+    switch (format) {
+        case PALETTE_RGBA:
+            for (int x = 0; x < PPU_WIDTH; x++) {
+                uint8_t index = line[x] & 0x3f;
+
+                out[x * 4] = channels[0][index];
+                out[x * 4 + 1] = channels[1][index];
+                out[x * 4 + 2] = channels[2][index];
+                out[x * 4 + 3] = 0xff;
+            }
+            break;
+        case PALETTE_RGB565:
+            for (int x = 0; x < PPU_WIDTH; x++) {
+                uint8_t index = line[x] & 0x3f;
+
+                out[x * 2] = channels[0][index];
+                out[x * 2 + 1] = channels[1][index];
+            }
+            break;
+        case PALETTE_YUYV:
+            for (int x = 0; x < PPU_WIDTH; x += 2) {
+                uint8_t i0 = line[x] & 0x3f, i1 = line[x + 1] & 0x3f;
+
+                out[x * 2] = channels[0][i0];
+                out[x * 2 + 1] = (uint8_t) ((channels[1][i0] + channels[1][i1] + 1) >> 1);
+                out[x * 2 + 2] = channels[0][i1];
+                out[x * 2 + 3] = (uint8_t) ((channels[2][i0] + channels[2][i1] + 1) >> 1);
+            }
+            break;
+    }
+}
+
+void palette_convert_isa(const palette_t *palette, palette_isa_t isa, const uint8_t *frame, const uint8_t *emphasis,
+                         uint8_t *out) {
+    size_t pitch = PPU_WIDTH * palette_pixel_size(palette->format);
+#ifdef PALETTE_HAVE_SIMD
+    static const palette_lookup_fn_t lookups[] = {NULL, palette_lookup_sse41, palette_lookup_avx2,
+                                                  palette_lookup_avx512};
+    uint8_t planes[3][PPU_WIDTH] __attribute__((aligned(64)));
+#endif
+
+    for (int y = 0; y < PPU_HEIGHT; y++) {
+        const uint8_t (*channels)[PALETTE_SIZE] = palette->channels[emphasis != NULL ? emphasis[y] & 0x07 : 0];
+        const uint8_t *line = frame + y * PPU_WIDTH;
+
+#ifdef PALETTE_HAVE_SIMD
+        if (isa != PALETTE_GENERIC) {
+            lookups[isa](channels, palette->nb_channels, line, planes);
+            palette_interleave(palette->format, (const uint8_t (*)[PPU_WIDTH]) planes, out + y * pitch);
+            continue;
+        }
+#else
+        (void) isa;
+#endif
+
+        palette_convert_line_generic(palette->format, channels, line, out + y * pitch);
+    }
+}
+
+#ifdef PALETTE_HAVE_SIMD
+/* 16 entries lookups on each quarter of the table, the right one picked with bits 4 and 5 of the index moved to the
+ * top of each byte for PBLENDVB */
+__attribute__((target("sse4.1")))
+static void palette_lookup_sse41(const uint8_t (*channels)[PALETTE_SIZE], int nb_channels, const uint8_t *line,
+                                 uint8_t (*planes)[PPU_WIDTH]) {
+    const __m128i low = _mm_set1_epi8(0x0f);
+
+    for (int c = 0; c < nb_channels; c++) {
+        __m128i t0 = _mm_loadu_si128((const __m128i *) channels[c]);
+        __m128i t1 = _mm_loadu_si128((const __m128i *) (channels[c] + 16));
+        __m128i t2 = _mm_loadu_si128((const __m128i *) (channels[c] + 32));
+        __m128i t3 = _mm_loadu_si128((const __m128i *) (channels[c] + 48));
+
+        for (int x = 0; x < PPU_WIDTH; x += 16) {
+            __m128i indexes = _mm_loadu_si128((const __m128i *) (line + x));
+            __m128i lo = _mm_and_si128(indexes, low);
+            __m128i bit4 = _mm_slli_epi16(indexes, 3);
+            __m128i bit5 = _mm_slli_epi16(indexes, 2);
+            __m128i a = _mm_blendv_epi8(_mm_shuffle_epi8(t0, lo), _mm_shuffle_epi8(t1, lo), bit4);
+            __m128i b = _mm_blendv_epi8(_mm_shuffle_epi8(t2, lo), _mm_shuffle_epi8(t3, lo), bit4);
+
+            _mm_store_si128((__m128i *) (planes[c] + x), _mm_blendv_epi8(a, b, bit5));
+        }
+    }
+}
+
+/* Same, 32 pixels at a time: both 128 bits lanes shuffle on their own, each gets the whole quarter */
+__attribute__((target("avx2")))
+static void palette_lookup_avx2(const uint8_t (*channels)[PALETTE_SIZE], int nb_channels, const uint8_t *line,
+                                uint8_t (*planes)[PPU_WIDTH]) {
+    const __m256i low = _mm256_set1_epi8(0x0f);
+
+    for (int c = 0; c < nb_channels; c++) {
+        __m256i t0 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) channels[c]));
+        __m256i t1 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) (channels[c] + 16)));
+        __m256i t2 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) (channels[c] + 32)));
+        __m256i t3 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) (channels[c] + 48)));
+
+        for (int x = 0; x < PPU_WIDTH; x += 32) {
+            __m256i indexes = _mm256_loadu_si256((const __m256i *) (line + x));
+            __m256i lo = _mm256_and_si256(indexes, low);
+            __m256i bit4 = _mm256_slli_epi16(indexes, 3);
+            __m256i bit5 = _mm256_slli_epi16(indexes, 2);
+            __m256i a = _mm256_blendv_epi8(_mm256_shuffle_epi8(t0, lo), _mm256_shuffle_epi8(t1, lo), bit4);
+            __m256i b = _mm256_blendv_epi8(_mm256_shuffle_epi8(t2, lo), _mm256_shuffle_epi8(t3, lo), bit4);
+
+            _mm256_store_si256((__m256i *) (planes[c] + x), _mm256_blendv_epi8(a, b, bit5));
+        }
+    }
+}
+
+/* VPERMB indexes a whole 64 bytes register with the low 6 bits of each byte: the table is one register */
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+static void palette_lookup_avx512(const uint8_t (*channels)[PALETTE_SIZE], int nb_channels, const uint8_t *line,
+                                  uint8_t (*planes)[PPU_WIDTH]) {
+    for (int c = 0; c < nb_channels; c++) {
+        __m512i table = _mm512_loadu_si512(channels[c]);
+
+        for (int x = 0; x < PPU_WIDTH; x += 64) {
+            __m512i indexes = _mm512_loadu_si512(line + x);
+
+            _mm512_store_si512(planes[c] + x, _mm512_permutexvar_epi8(indexes, table));
+        }
+    }
+}
+
+/* Channels into pixels, 16 at a time */
+__attribute__((target("sse2")))
+static void palette_interleave(palette_format_t format, const uint8_t (*planes)[PPU_WIDTH], uint8_t *out) {
+    const __m128i ones = _mm_set1_epi8(-1);
+    const __m128i even = _mm_set1_epi16(0x00ff);
+
+    for (int x = 0; x < PPU_WIDTH; x += 16) {
+        __m128i c0 = _mm_load_si128((const __m128i *) (planes[0] + x));
+        __m128i c1 = _mm_load_si128((const __m128i *) (planes[1] + x));
+
+        switch (format) {
+            case PALETTE_RGBA: {
+                __m128i c2 = _mm_load_si128((const __m128i *) (planes[2] + x));
+                __m128i rg_lo = _mm_unpacklo_epi8(c0, c1), rg_hi = _mm_unpackhi_epi8(c0, c1);
+                __m128i ba_lo = _mm_unpacklo_epi8(c2, ones), ba_hi = _mm_unpackhi_epi8(c2, ones);
+
+                _mm_storeu_si128((__m128i *) (out + x * 4), _mm_unpacklo_epi16(rg_lo, ba_lo));
+                _mm_storeu_si128((__m128i *) (out + x * 4 + 16), _mm_unpackhi_epi16(rg_lo, ba_lo));
+                _mm_storeu_si128((__m128i *) (out + x * 4 + 32), _mm_unpacklo_epi16(rg_hi, ba_hi));
+                _mm_storeu_si128((__m128i *) (out + x * 4 + 48), _mm_unpackhi_epi16(rg_hi, ba_hi));
+                break;
+            }
+            case PALETTE_RGB565:
+                _mm_storeu_si128((__m128i *) (out + x * 2), _mm_unpacklo_epi8(c0, c1));
+                _mm_storeu_si128((__m128i *) (out + x * 2 + 16), _mm_unpackhi_epi8(c0, c1));
+                break;
+            case PALETTE_YUYV: {
+                /* Averages of each pair: U on its even byte, V on its odd one */
+                __m128i c2 = _mm_load_si128((const __m128i *) (planes[2] + x));
+                __m128i u = _mm_avg_epu8(c1, _mm_srli_epi16(c1, 8));
+                __m128i v = _mm_avg_epu8(c2, _mm_slli_epi16(c2, 8));
+                __m128i uv = _mm_or_si128(_mm_and_si128(u, even), _mm_andnot_si128(even, v));
+
+                _mm_storeu_si128((__m128i *) (out + x * 2), _mm_unpacklo_epi8(c0, uv));
+                _mm_storeu_si128((__m128i *) (out + x * 2 + 16), _mm_unpackhi_epi8(c0, uv));
+                break;
+            }
+        }
+    }
+}
+#endif
@@ -0,0 +1,71 @@
+#ifndef __PALETTE_H__
+#define __PALETTE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+#include "types.h"
+
+/* Colors of the 64 palette indexes the PPU outputs, as 8 bit RGB. Indexes are 6 bits: framebuffers hold 0x00-0x3F.
+ *
+ * palette_convert turns a framebuffer and its per line emphasis bits (ppu->emphasis) into pixels, one line at a time.
+ * Each line is a table lookup per output byte channel (R, G, B or the bytes of RGB565 or Y, U, V) on the table of its
+ * emphasis, done 16 (SSE4.1 PSHUFB), 32 (AVX2 VPSHUFB) or 64 (AVX-512 VBMI VPERMB, the whole table in a register)
+ * pixels at a time, then the channels are interleaved into pixels. The widest the CPU supports is picked once, the
+ * plain per pixel version is the reference the others are tested against. */
+
+#define PALETTE_SIZE 64
+#define PALETTE_EMPHASIS 8
+
+extern const uint8_t PALETTE_RGB[PALETTE_SIZE][3];
+
+enum palette_format {
+    PALETTE_RGBA,   /* R, G, B, 0xFF bytes */
+    PALETTE_RGB565, /* Little endian 16 bit words, red in the top bits */
+    PALETTE_YUYV    /* BT.601 studio range 4:2:2, Y0 U Y1 V for each pair of pixels, U and V their average */
+};
+typedef enum palette_format palette_format_t;
+
+enum palette_isa {
+    PALETTE_GENERIC,
+    PALETTE_SSE41,
+    PALETTE_AVX2,
+    PALETTE_AVX512
+};
+typedef enum palette_isa palette_isa_t;
+
+struct palette_s {
+    palette_format_t format;
+    uint8_t nb_channels;
+    /* For each emphasis (bit 0 red, 1 green, 2 blue), each byte channel of the format, the value of each index */
+    uint8_t channels[PALETTE_EMPHASIS][3][PALETTE_SIZE];
+};
+typedef struct palette_s palette_t;
+
+palette_t *palette_init(palette_format_t format);
+void palette_free(palette_t *palette);
+
+/* Bytes per pixel */
+size_t palette_pixel_size(palette_format_t format);
+
+/* frame holds PPU_WIDTH x PPU_HEIGHT palette indexes, emphasis the emphasis bits of each line, NULL for none. out gets
+ * PPU_WIDTH x PPU_HEIGHT pixels, lines top to bottom. */
+void palette_convert(const palette_t *palette, const uint8_t *frame, const uint8_t *emphasis, uint8_t *out);
+
+/* The widest implementation the CPU supports, and whether it supports one */
+palette_isa_t palette_best_isa(void);
+bool palette_isa_supported(palette_isa_t isa);
+/* Same as palette_convert with a given implementation, for the tests and benchmarks. The CPU must support it. */
+void palette_convert_isa(const palette_t *palette, palette_isa_t isa, const uint8_t *frame, const uint8_t *emphasis,
+                         uint8_t *out);
+
+/* BT.601 luma of each color, 0-255 */
+void palette_luma(uint8_t luma[PALETTE_SIZE]);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __PALETTE_H__ */
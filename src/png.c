@@ -0,0 +1,597 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "crc32.h"
+#include "log.h"
+#include "palette.h"
+#include "png.h"
+
+#define PNG_CHUNK_OVERHEAD 12 /* Length, type and CRC */
+#define PNG_STORED_BLOCK 65535
+
+static const uint8_t PNG_SIGNATURE[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+
+/* The rows of a frame as the PNG has them, and what compresses them */
+struct png_encoder_s {
+    uint32_t width;
+    uint32_t height;
+    uint8_t *rows;
+    size_t rows_size;
+#ifdef HAVE_ZLIB
+    z_stream stream;
+    bool deflating;
+#endif
+};
+typedef struct png_encoder_s png_encoder_t;
+
+struct png_worker_s {
+    png_sink_t *sink;
+    pthread_t thread;
+    png_encoder_t encoder;
+};
+
+/* Colors of each emphasis, for the PLTE chunks */
+static palette_t *_png_palette;
+static pthread_once_t _png_once = PTHREAD_ONCE_INIT;
+
+static void png_init_palette(void);
+static bool png_encoder_init(png_encoder_t *encoder, uint32_t width, uint32_t height, int level);
+static void png_encoder_free(png_encoder_t *encoder);
+static size_t png_encoder_run(png_encoder_t *encoder, const uint8_t *frame, const uint8_t *emphasis, uint8_t *png);
+static size_t png_deflate(png_encoder_t *encoder, uint8_t *out);
+static size_t png_data_bound(size_t size);
+static size_t png_end_chunk(uint8_t *chunk, const char *type, size_t size);
+static void png_put_u32(uint8_t *p, uint32_t val);
+static bool png_write_file(const char *file, const uint8_t *png, size_t size);
+static bool png_check_pattern(const char *pattern);
+static void *png_sink_run(void *arg);
+static void png_sink_write(png_sink_t *sink, const png_slot_t *slot);
+
+static void png_init_palette(void) {
+    _png_palette = palette_init(PALETTE_RGBA);
+}
+
+size_t png_bound(uint32_t width, uint32_t height) {
+    return sizeof(PNG_SIGNATURE) + PNG_CHUNK_OVERHEAD + 13 + PNG_CHUNK_OVERHEAD
+           + PNG_EMPHASIS_SLOTS * PALETTE_SIZE * 3 + PNG_CHUNK_OVERHEAD
+           + png_data_bound((size_t) height * (width + 1)) + PNG_CHUNK_OVERHEAD;
+}
+
+size_t png_encode(const uint8_t *frame, const uint8_t *emphasis, uint32_t width, uint32_t height, int level,
+                  uint8_t *png) {
+    png_encoder_t encoder;
+    size_t size;
+
+    if (!png_encoder_init(&encoder, width, height, level)) {
+        return 0;
+    }
+
+    size = png_encoder_run(&encoder, frame, emphasis, png);
+    png_encoder_free(&encoder);
+
+    return size;
+}
+
+bool png_write(const char *file, const uint8_t *frame, const uint8_t *emphasis, uint32_t width, uint32_t height,
+               int level) {
+    uint8_t *png = malloc(png_bound(width, height));
+    size_t size;
+    bool ok;
+
+    if (png == NULL) {
+        log_error("png", "Unable to allocate the PNG of %s", file);
+        return FALSE;
+    }
+
+    size = png_encode(frame, emphasis, width, height, level, png);
+    ok = size > 0 && png_write_file(file, png, size);
+    free(png);
+
+    return ok;
+}
+
+static bool png_encoder_init(png_encoder_t *encoder, uint32_t width, uint32_t height, int level) {
+    memset(encoder, 0, sizeof(png_encoder_t));
+
+    if (width == 0 || height == 0 || level < -1 || level > 9) {
+        log_error("png", "Invalid PNG: %ux%u, level %d", width, height, level);
+        return FALSE;
+    }
+
+    encoder->width = width;
+    encoder->height = height;
+    encoder->rows_size = (size_t) height * (width + 1);
+    encoder->rows = malloc(encoder->rows_size);
+    if (encoder->rows == NULL) {
+        log_error("png", "Unable to allocate the PNG encoder");
+        return FALSE;
+    }
+
+#ifdef HAVE_ZLIB
+    if (deflateInit(&encoder->stream, level) != Z_OK) {
+        log_error("png", "Unable to start zlib: %s", encoder->stream.msg != NULL ? encoder->stream.msg : "no memory");
+        png_encoder_free(encoder);
+        return FALSE;
+    }
+    encoder->deflating = TRUE;
+#endif
+
+    return TRUE;
+}
+
+static void png_encoder_free(png_encoder_t *encoder) {
+#ifdef HAVE_ZLIB
+    if (encoder->deflating) {
+        deflateEnd(&encoder->stream);
+        encoder->deflating = FALSE;
+    }
+#endif
+    free(encoder->rows);
+    encoder->rows = NULL;
+}
+
+static size_t png_encoder_run(png_encoder_t *encoder, const uint8_t *frame, const uint8_t *emphasis, uint8_t *png) {
+    int8_t slot_of[PALETTE_EMPHASIS];
+    uint8_t slots[PNG_EMPHASIS_SLOTS];
+    uint32_t nb_slots = 0;
+    uint32_t width = encoder->width;
+    uint8_t *chunk = png;
+    size_t size;
+
+    pthread_once(&_png_once, png_init_palette);
+    if (_png_palette == NULL) {
+        return 0;
+    }
+
+    memset(slot_of, -1, sizeof(slot_of));
+
+    /* Filter type 0 on every row: the recommended one for paletted images, and the cheapest */
+    for (uint32_t y = 0; y < encoder->height; y++) {
+        const uint8_t *src = frame + (size_t) y * width;
+        uint8_t *row = encoder->rows + (size_t) y * (width + 1);
+        uint8_t e = emphasis != NULL ? emphasis[y] & (PALETTE_EMPHASIS - 1) : 0;
+        uint8_t base;
+
+        if (slot_of[e] < 0 && nb_slots < PNG_EMPHASIS_SLOTS) {
+            slot_of[e] = (int8_t) nb_slots;
+            slots[nb_slots++] = e;
+        }
+        base = (uint8_t) ((slot_of[e] >= 0 ? slot_of[e] : 0) * PALETTE_SIZE);
+
+        row[0] = 0;
+        for (uint32_t x = 0; x < width; x++) {
+            row[x + 1] = (uint8_t) (base | (src[x] & (PALETTE_SIZE - 1)));
+        }
+    }
+
+    memcpy(chunk, PNG_SIGNATURE, sizeof(PNG_SIGNATURE));
+    chunk += sizeof(PNG_SIGNATURE);
+
+    /* 8 bits per pixel, color type 3 (paletted), deflate, adaptive filtering, no interlacing */
+    png_put_u32(chunk + 8, width);
+    png_put_u32(chunk + 12, encoder->height);
+    chunk[16] = 8;
+    chunk[17] = 3;
+    chunk[18] = 0;
+    chunk[19] = 0;
+    chunk[20] = 0;
+    chunk += png_end_chunk(chunk, "IHDR", 13);
+
+    for (uint32_t s = 0; s < nb_slots; s++) {
+        const uint8_t (*channels)[PALETTE_SIZE] = _png_palette->channels[slots[s]];
+
+        for (int i = 0; i < PALETTE_SIZE; i++) {
+            uint8_t *color = chunk + 8 + (s * PALETTE_SIZE + i) * 3;
+
+            color[0] = channels[0][i];
+            color[1] = channels[1][i];
+            color[2] = channels[2][i];
+        }
+    }
+    chunk += png_end_chunk(chunk, "PLTE", nb_slots * PALETTE_SIZE * 3);
+
+    size = png_deflate(encoder, chunk + 8);
+    if (size == 0) {
+        return 0;
+    }
+    chunk += png_end_chunk(chunk, "IDAT", size);
+
+    chunk += png_end_chunk(chunk, "IEND", 0);
+
+    return (size_t) (chunk - png);
+}
+
+#ifdef HAVE_ZLIB
+static size_t png_data_bound(size_t size) {
+    return compressBound((uLong) size);
+}
+
+/* The rows as a zlib stream. The stream is reset rather than started again for each frame, its buffers kept. */
+static size_t png_deflate(png_encoder_t *encoder, uint8_t *out) {
+    z_stream *stream = &encoder->stream;
+
+    if (deflateReset(stream) != Z_OK) {
+        return 0;
+    }
+
+    stream->next_in = encoder->rows;
+    stream->avail_in = (uInt) encoder->rows_size;
+    stream->next_out = out;
+    stream->avail_out = (uInt) png_data_bound(encoder->rows_size);
+
+    if (deflate(stream, Z_FINISH) != Z_STREAM_END) {
+        log_error("png", "Unable to compress a PNG: %s", stream->msg != NULL ? stream->msg : "output too large");
+        return 0;
+    }
+
+    return stream->total_out;
+}
+#else
+static size_t png_data_bound(size_t size) {
+    size_t blocks = size / PNG_STORED_BLOCK + 1;
+
+    return 2 + size + blocks * 5 + 4;
+}
+
+/* The rows as a zlib stream of stored blocks: a header, LEN and NLEN before each block, the Adler-32 at the end */
+static size_t png_deflate(png_encoder_t *encoder, uint8_t *out) {
+    const uint8_t *data = encoder->rows;
+    size_t size = encoder->rows_size;
+    size_t pos = 0;
+    uint8_t *p = out;
+    uint32_t a = 1;
+    uint32_t b = 0;
+
+    /* Deflate, 32K window, no dictionary, fastest: 0x7801 is a multiple of 31 */
+    *p++ = 0x78;
+    *p++ = 0x01;
+
+    do {
+        uint16_t len = (uint16_t) (size - pos < PNG_STORED_BLOCK ? size - pos : PNG_STORED_BLOCK);
+
+        *p++ = pos + len == size ? 1 : 0;
+        p[0] = (uint8_t) len;
+        p[1] = (uint8_t) (len >> 8);
+        p[2] = (uint8_t) ~len;
+        p[3] = (uint8_t) (~len >> 8);
+        memcpy(p + 4, data + pos, len);
+        p += 4 + len;
+
+        /* 5552 bytes at most between the modulos, the sums can't overflow */
+        for (size_t i = pos; i < pos + len; i += 5552) {
+            size_t end = i + 5552 < pos + len ? i + 5552 : pos + len;
+
+            for (size_t j = i; j < end; j++) {
+                a += data[j];
+                b += a;
+            }
+            a %= 65521;
+            b %= 65521;
+        }
+
+        pos += len;
+    } while (pos < size);
+
+    png_put_u32(p, (b << 16) | a);
+
+    return (size_t) (p + 4 - out);
+}
+#endif
+
+/* The chunk's data is already in place: fills in its length, type and CRC, returns the size of the whole chunk */
+static size_t png_end_chunk(uint8_t *chunk, const char *type, size_t size) {
+    png_put_u32(chunk, (uint32_t) size);
+    memcpy(chunk + 4, type, 4);
+    png_put_u32(chunk + 8 + size, crc32_update(0, chunk + 4, size + 4));
+
+    return size + PNG_CHUNK_OVERHEAD;
+}
+
+/* Big endian */
+static void png_put_u32(uint8_t *p, uint32_t val) {
+    p[0] = (uint8_t) (val >> 24);
+    p[1] = (uint8_t) (val >> 16);
+    p[2] = (uint8_t) (val >> 8);
+    p[3] = (uint8_t) val;
+}
+
+static bool png_write_file(const char *file, const uint8_t *png, size_t size) {
+    FILE *fp = fopen(file, "wb");
+
+    if (fp == NULL) {
+        log_error("png", "%s: %s", file, strerror(errno));
+        return FALSE;
+    }
+
+    if (fwrite(png, 1, size, fp) != size) {
+        log_error("png", "%s: %s", file, strerror(errno));
+        fclose(fp);
+        return FALSE;
+    }
+
+    if (fclose(fp) != 0) {
+        log_error("png", "%s: %s", file, strerror(errno));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+png_sink_t *png_sink_open(const char *pattern, uint32_t width, uint32_t height, int level, uint32_t nb_threads,
+                          uint32_t queue_size) {
+    png_sink_t *sink;
+    size_t frame_size = (size_t) width * height;
+
+    if (width == 0 || height == 0) {
+        log_error("png", "Invalid PNG size: %ux%u", width, height);
+        return NULL;
+    }
+
+    if (!png_check_pattern(pattern)) {
+        log_error("png", "The PNG file pattern needs one integer conversion, for the frame number: %s", pattern);
+        return NULL;
+    }
+
+#ifndef HAVE_ZLIB
+    if (level != 0) {
+        log_warn("png", "PNG compression is not available, writing %s uncompressed", pattern);
+    }
+#endif
+
+    if (nb_threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        nb_threads = cpus > 0 ? (uint32_t) cpus : 1;
+    }
+    if (queue_size == 0) {
+        queue_size = nb_threads * 2;
+    }
+
+    sink = calloc(1, sizeof(png_sink_t));
+    if (sink == NULL) {
+        log_error("png", "Unable to allocate the PNG sink");
+        return NULL;
+    }
+
+    sink->width = width;
+    sink->height = height;
+    sink->level = level;
+    pthread_mutex_init(&sink->lock, NULL);
+    pthread_cond_init(&sink->work, NULL);
+    pthread_cond_init(&sink->freed, NULL);
+
+    sink->pattern = strdup(pattern);
+    sink->slots = calloc(queue_size, sizeof(png_slot_t));
+    sink->workers = calloc(nb_threads, sizeof(png_worker_t));
+    if (sink->pattern == NULL || sink->slots == NULL || sink->workers == NULL) {
+        log_error("png", "Unable to allocate the PNG sink");
+        png_sink_close(sink);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < queue_size; i++) {
+        png_slot_t *slot = &sink->slots[i];
+
+        slot->frame = malloc(frame_size);
+        slot->emphasis = malloc(height);
+        slot->png = malloc(png_bound(width, height));
+        sink->nb_slots++;
+        if (slot->frame == NULL || slot->emphasis == NULL || slot->png == NULL) {
+            log_error("png", "Unable to allocate the PNG sink's queue");
+            png_sink_close(sink);
+            return NULL;
+        }
+    }
+
+    for (uint32_t i = 0; i < nb_threads; i++) {
+        png_worker_t *worker = &sink->workers[i];
+
+        worker->sink = sink;
+        if (!png_encoder_init(&worker->encoder, width, height, level)) {
+            png_sink_close(sink);
+            return NULL;
+        }
+
+        if (pthread_create(&worker->thread, NULL, png_sink_run, worker) != 0) {
+            log_error("png", "Unable to start PNG thread %u", i);
+            png_encoder_free(&worker->encoder);
+            png_sink_close(sink);
+            return NULL;
+        }
+        sink->nb_workers++;
+    }
+
+    return sink;
+}
+
+bool png_sink_close(png_sink_t *sink) {
+    bool ok = png_sink_flush(sink);
+
+    pthread_mutex_lock(&sink->lock);
+    sink->stop = TRUE;
+    pthread_cond_broadcast(&sink->work);
+    pthread_mutex_unlock(&sink->lock);
+
+    for (uint32_t i = 0; i < sink->nb_workers; i++) {
+        pthread_join(sink->workers[i].thread, NULL);
+        png_encoder_free(&sink->workers[i].encoder);
+    }
+
+    for (uint32_t i = 0; i < sink->nb_slots; i++) {
+        free(sink->slots[i].frame);
+        free(sink->slots[i].emphasis);
+        free(sink->slots[i].png);
+    }
+
+    pthread_cond_destroy(&sink->freed);
+    pthread_cond_destroy(&sink->work);
+    pthread_mutex_destroy(&sink->lock);
+    free(sink->workers);
+    free(sink->slots);
+    free(sink->pattern);
+    free(sink);
+
+    return ok;
+}
+
+bool png_sink_submit(png_sink_t *sink, const uint8_t *frame, const uint8_t *emphasis) {
+    png_slot_t *slot;
+
+    pthread_mutex_lock(&sink->lock);
+
+    if (sink->failed) {
+        pthread_mutex_unlock(&sink->lock);
+        return FALSE;
+    }
+
+    /* Backpressure: the oldest frame has to be written before its slot takes this one */
+    while (sink->slots[sink->submit].state != PNG_SLOT_FREE) {
+        pthread_cond_wait(&sink->freed, &sink->lock);
+    }
+
+    slot = &sink->slots[sink->submit];
+    slot->number = sink->next_number++;
+    sink->submit = (sink->submit + 1) % sink->nb_slots;
+
+    pthread_mutex_unlock(&sink->lock);
+
+    /* Free slots are only touched by the submitting thread: the copy is made unlocked */
+    memcpy(slot->frame, frame, (size_t) sink->width * sink->height);
+    slot->has_emphasis = emphasis != NULL;
+    if (emphasis != NULL) {
+        memcpy(slot->emphasis, emphasis, sink->height);
+    }
+
+    pthread_mutex_lock(&sink->lock);
+    slot->state = PNG_SLOT_QUEUED;
+    pthread_cond_signal(&sink->work);
+    pthread_mutex_unlock(&sink->lock);
+
+    return TRUE;
+}
+
+bool png_sink_flush(png_sink_t *sink) {
+    bool ok;
+
+    pthread_mutex_lock(&sink->lock);
+
+    /* Nothing between write and submit, and the ring isn't full either */
+    while (sink->nb_slots > 0 && (sink->write != sink->submit || sink->slots[sink->write].state != PNG_SLOT_FREE)) {
+        pthread_cond_wait(&sink->freed, &sink->lock);
+    }
+    ok = !sink->failed;
+
+    pthread_mutex_unlock(&sink->lock);
+
+    return ok;
+}
+
+/* Encodes the queued frames in turn. Whichever worker finds the oldest frame encoded writes it, and the ones after it
+ * that are encoded too, so that files are written in order while the others keep encoding. */
+static void *png_sink_run(void *arg) {
+    png_worker_t *worker = arg;
+    png_sink_t *sink = worker->sink;
+
+    pthread_mutex_lock(&sink->lock);
+    for (;;) {
+        png_slot_t *slot;
+
+        while (!sink->stop && sink->slots[sink->encode].state != PNG_SLOT_QUEUED) {
+            pthread_cond_wait(&sink->work, &sink->lock);
+        }
+
+        if (sink->slots[sink->encode].state != PNG_SLOT_QUEUED) {
+            break;
+        }
+
+        slot = &sink->slots[sink->encode];
+        slot->state = PNG_SLOT_ENCODING;
+        sink->encode = (sink->encode + 1) % sink->nb_slots;
+        pthread_mutex_unlock(&sink->lock);
+
+        slot->png_size = png_encoder_run(&worker->encoder, slot->frame, slot->has_emphasis ? slot->emphasis : NULL,
+                                         slot->png);
+
+        pthread_mutex_lock(&sink->lock);
+        slot->state = PNG_SLOT_ENCODED;
+
+        if (sink->writing) {
+            continue;
+        }
+
+        sink->writing = TRUE;
+        while (sink->slots[sink->write].state == PNG_SLOT_ENCODED) {
+            png_slot_t *oldest = &sink->slots[sink->write];
+
+            pthread_mutex_unlock(&sink->lock);
+            png_sink_write(sink, oldest);
+            pthread_mutex_lock(&sink->lock);
+
+            oldest->state = PNG_SLOT_FREE;
+            sink->write = (sink->write + 1) % sink->nb_slots;
+            pthread_cond_broadcast(&sink->freed);
+        }
+        sink->writing = FALSE;
+    }
+    pthread_mutex_unlock(&sink->lock);
+
+    return NULL;
+}
+
+static void png_sink_write(png_sink_t *sink, const png_slot_t *slot) {
+    int len = snprintf(NULL, 0, sink->pattern, slot->number);
+    char *file = len >= 0 ? malloc((size_t) len + 1) : NULL;
+    bool ok = FALSE;
+
+    if (file == NULL) {
+        log_error("png", "Unable to name PNG frame %u", slot->number);
+    } else {
+        snprintf(file, (size_t) len + 1, sink->pattern, slot->number);
+        ok = slot->png_size > 0 && png_write_file(file, slot->png, slot->png_size);
+        free(file);
+    }
+
+    if (!ok) {
+        pthread_mutex_lock(&sink->lock);
+        sink->failed = TRUE;
+        pthread_mutex_unlock(&sink->lock);
+    }
+}
+
+/* One %u, %d or %i, with flags and a width, for the frame number. Anything else would read arguments that aren't
+ * there. */
+static bool png_check_pattern(const char *pattern) {
+    int conversions = 0;
+
+    for (const char *p = pattern; *p != '\0'; p++) {
+        if (*p != '%') {
+            continue;
+        }
+
+        p++;
+        if (*p == '%') {
+            continue;
+        }
+
+        while (*p != '\0' && strchr("-+ #0", *p) != NULL) {
+            p++;
+        }
+        while (*p >= '0' && *p <= '9') {
+            p++;
+        }
+
+        if (*p != 'u' && *p != 'd' && *p != 'i') {
+            return FALSE;
+        }
+        conversions++;
+    }
+
+    return conversions == 1;
+}
@@ -0,0 +1,107 @@
+#ifndef __PNG_H__
+#define __PNG_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include "types.h"
+
+/* Frames as paletted PNG files: 8 bits per pixel, the palette indexes as they are, a PLTE chunk with their colors.
+ * One byte per pixel before compression instead of three for RGB, for files and compression times about a third.
+ *
+ * Emphasis is kept by giving each emphasis value used by the frame its own 64 entries of the PLTE chunk, up to 4 of
+ * them. Lines with a fifth one take the emphasis of the first line, which no game needs in practice.
+ *
+ * The data is compressed with zlib at the given level, -1 for its default, 0 to 9 from fastest to smallest. Built
+ * without zlib, the data is written in stored (uncompressed) deflate blocks: the files are still valid PNGs. */
+
+#define PNG_EMPHASIS_SLOTS 4
+
+/* Largest PNG of a width x height frame */
+size_t png_bound(uint32_t width, uint32_t height);
+
+/* frame holds width x height palette indexes (0x00-0x3F), emphasis the emphasis bits of each line, NULL for none.
+ * png gets at most png_bound(width, height) bytes. Returns the size of the PNG, 0 on error. */
+size_t png_encode(const uint8_t *frame, const uint8_t *emphasis, uint32_t width, uint32_t height, int level,
+                  uint8_t *png);
+
+/* Screenshots: png_encode to a file */
+bool png_write(const char *file, const uint8_t *frame, const uint8_t *emphasis, uint32_t width, uint32_t height,
+               int level);
+
+/* Frame sequences: frames are copied into a queue and encoded by a pool of threads, so that the emulation only waits
+ * for the copy. Each frame is written to its own file, the pattern with the frame number, counted from 0, in place of
+ * its one integer conversion ("frames/%06u.png"). Files are written in frame order, once all the ones before them are:
+ * frame n existing means 0 to n - 1 do too.
+ *
+ * When every slot of the queue is taken, png_sink_submit waits for the oldest frame to be written (backpressure). One
+ * thread at a time submits frames. */
+
+typedef struct png_worker_s png_worker_t;
+
+enum png_slot_state {
+    PNG_SLOT_FREE,
+    PNG_SLOT_QUEUED,
+    PNG_SLOT_ENCODING,
+    PNG_SLOT_ENCODED
+};
+typedef enum png_slot_state png_slot_state_t;
+
+struct png_slot_s {
+    png_slot_state_t state;
+    uint32_t number;
+    bool has_emphasis;
+    uint8_t *frame;
+    uint8_t *emphasis;
+    uint8_t *png;
+    size_t png_size;
+};
+typedef struct png_slot_s png_slot_t;
+
+struct png_sink_s {
+    char *pattern;
+    uint32_t width;
+    uint32_t height;
+    int level;
+
+    png_worker_t *workers;
+    uint32_t nb_workers;
+
+    /* Ring of slots: frames are submitted at submit, encoded from encode and written from write, in that order */
+    png_slot_t *slots;
+    uint32_t nb_slots;
+    uint32_t submit;
+    uint32_t encode;
+    uint32_t write;
+    uint32_t next_number;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work;  /* A frame was queued */
+    pthread_cond_t freed; /* A frame was written */
+    bool writing;         /* A worker is writing the encoded frames, in order */
+    bool stop;
+    bool failed;
+};
+typedef struct png_sink_s png_sink_t;
+
+/* Returns NULL if the pattern does not have exactly one integer conversion (%u, %d, with flags and width). nb_threads
+ * encoding threads, 0 for one per online CPU, and queue_size frames queued at most, 0 for two per thread. */
+png_sink_t *png_sink_open(const char *pattern, uint32_t width, uint32_t height, int level, uint32_t nb_threads,
+                          uint32_t queue_size);
+/* Waits for the queued frames to be written. Returns FALSE if one of them could not be. */
+bool png_sink_close(png_sink_t *sink);
+
+/* Queues a copy of the frame, width x height palette indexes, and its emphasis bits per line, NULL for none. Returns
+ * FALSE if a frame could not be written since the sink was opened. */
+bool png_sink_submit(png_sink_t *sink, const uint8_t *frame, const uint8_t *emphasis);
+/* Waits for the queued frames to be written. Returns FALSE if a frame could not be since the sink was opened. */
+bool png_sink_flush(png_sink_t *sink);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __PNG_H__ */
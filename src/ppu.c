@@ -1,11 +1,25 @@
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "ppu.h"
 
+static void ppu_end_line(ppu_t *ppu);
+static void ppu_render_line(ppu_t *ppu);
+static void ppu_skip_line(ppu_t *ppu);
+static void ppu_fetch_tiles(ppu_t *ppu, mapper_bg_tile_t *tiles, uint8_t first, uint8_t count);
+static uint8_t ppu_render_sprites(ppu_t *ppu, uint8_t *line);
+static uint16_t ppu_sprite_addr(const ppu_t *ppu, const uint8_t *sprite, int row, uint8_t height);
+static uint8_t *ppu_nametable(const ppu_t *ppu, uint16_t addr);
+static uint8_t ppu_palette_index(uint16_t addr);
+static uint8_t ppu_vram_get_u8(ppu_t *ppu, uint16_t addr);
+static void ppu_vram_set_u8(ppu_t *ppu, uint16_t addr, uint8_t val);
+
+#define ppu_is_rendering(ppu) (((ppu)->mask & (PPU_MASK_BG | PPU_MASK_SPRITES)) != 0)
+
 ppu_t *ppu_init(void) {
-    ppu_t *ppu = malloc(sizeof(ppu_t));
+    ppu_t *ppu = calloc(1, sizeof(ppu_t));
 
     if (ppu == NULL) {
         return ppu;
@@ -14,14 +28,30 @@ ppu_t *ppu_init(void) {
     ppu->scanline = 0;
     ppu->line_position = 0;
     ppu->is_vblank = FALSE;
+    ppu->is_nmi = FALSE;
+    ppu->dot = 0;
+    ppu->ctrl = 0;
+    ppu->mask = 0;
+    ppu->mapper = NULL;
+    ppu->framebuffer = ppu->own_framebuffer;
 
     return ppu;
 }
 
 void ppu_reset(ppu_t *ppu) {
+    /* The top of the next frame: dot has to stay in step with the scanline, frames end and IRQs are scheduled from it */
+    if (ppu->dot % PPU_DOTS_PER_FRAME != 0) {
+        ppu->dot += PPU_DOTS_PER_FRAME - ppu->dot % PPU_DOTS_PER_FRAME;
+    }
+
     ppu->scanline = 0;
     ppu->line_position = 0;
     ppu->is_vblank = FALSE;
+    ppu->is_nmi = FALSE;
+    ppu->ctrl = 0;
+    ppu->mask = 0;
+    ppu->w = FALSE;
+    ppu->read_buffer = 0;
 }
 
 void ppu_free(ppu_t *ppu) {
@@ -29,21 +59,39 @@ void ppu_free(ppu_t *ppu) {
 }
 
 void ppu_tick(ppu_t  *ppu) {
-    if (ppu->scanline == PPU_VBLANK_SCANLINE && ppu->line_position == PPU_HBLANK_POS) {
-        /* TODO: should_render */
-    }
     ppu->line_position++;
+    ppu->dot++;
 
     if (ppu->line_position > PPU_LAST_LINE_POS) {
         ppu->line_position = 0;
         ppu->scanline++;
+
+        if (ppu->scanline > PPU_LAST_SCANLINE) {
+            ppu->scanline = 0;
+        }
     }
 
-    if (ppu->scanline == PPU_VBLANK_SCANLINE + 1 && ppu->line_position == 1) {
-        ppu->is_vblank = TRUE;
-        ppu->is_nmi = TRUE;
-    } else if (ppu->scanline > PPU_LAST_SCANLINE) {
-        ppu->scanline = 0;
+    if (ppu->scanline < PPU_VBLANK_SCANLINE) {
+        /* The whole line is drawn at once when its fetches are over */
+        if (ppu->line_position == PPU_HBLANK_POS + 1) {
+            ppu_end_line(ppu);
+        }
+    } else if (ppu->scanline == PPU_VBLANK_SCANLINE + 1) {
+        if (ppu->line_position == 1) {
+            ppu->is_vblank = TRUE;
+            ppu->is_nmi = (ppu->ctrl & PPU_CTRL_NMI) != 0;
+        }
+    } else if (ppu->scanline == PPU_LAST_SCANLINE) {
+        if (ppu->line_position == 1) {
+            ppu->is_vblank = FALSE;
+            ppu->sprite_0_hit = FALSE;
+            ppu->sprite_overflow = FALSE;
+        } else if (ppu->line_position == PPU_HBLANK_POS + 1 && ppu_is_rendering(ppu)) {
+            ppu->v = (uint16_t) ((ppu->v & ~0x041fu) | (ppu->t & 0x041fu));
+        } else if (ppu->line_position == 304 && ppu_is_rendering(ppu)) {
+            /* Vertical scroll is reloaded for the next frame */
+            ppu->v = (uint16_t) ((ppu->v & 0x041fu) | (ppu->t & ~0x041fu));
+        }
     }
 }
 
@@ -51,8 +99,509 @@ uint8_t ppu_get_status(ppu_t *ppu) {
     uint8_t status = 0;
 
     status |= (uint8_t)(ppu->is_vblank ? 0x80 : 0x00);
+    status |= (uint8_t)(ppu->sprite_0_hit ? 0x40 : 0x00);
+    status |= (uint8_t)(ppu->sprite_overflow ? 0x20 : 0x00);
 
     ppu->is_vblank = 0;
+    ppu->w = FALSE;
 
     return status;
 }
+
+uint8_t ppu_get_u8(ppu_t *ppu, uint16_t addr) {
+    uint16_t vram_addr;
+    uint8_t val;
+
+    switch (addr & 0x2007u) {
+        case 0x2002:
+            return ppu_get_status(ppu);
+        case 0x2004:
+            return ppu->oam[ppu->oam_addr];
+        case 0x2007:
+            vram_addr = ppu->v & 0x3fffu;
+
+            /* Reads are delayed by one, except for the palette which still refills the buffer with the nametable
+               underneath */
+            if (vram_addr >= 0x3f00) {
+                val = ppu->palette[ppu_palette_index(vram_addr)];
+                ppu->read_buffer = ppu_vram_get_u8(ppu, vram_addr - 0x1000);
+            } else {
+                val = ppu->read_buffer;
+                ppu->read_buffer = ppu_vram_get_u8(ppu, vram_addr);
+            }
+
+            ppu->v = (uint16_t) (ppu->v + (ppu->ctrl & PPU_CTRL_INCREMENT_32 ? 32 : 1));
+
+            return val;
+        default:
+            /* Write only registers */
+            return 0;
+    }
+}
+
+void ppu_set_u8(ppu_t *ppu, uint16_t addr, uint8_t val) {
+    uint8_t *reg;
+    bool timing_changed;
+
+    switch (addr & 0x2007u) {
+        case 0x2000:
+            reg = &ppu->ctrl;
+            ppu->t = (uint16_t) ((ppu->t & ~0x0c00u) | (val & 0x03u) << 10u);
+
+            /* Enabling NMI during vblank triggers it right away */
+            if (ppu->is_vblank && !(ppu->ctrl & PPU_CTRL_NMI) && (val & PPU_CTRL_NMI)) {
+                ppu->is_nmi = TRUE;
+            }
+            break;
+        case 0x2001:
+            reg = &ppu->mask;
+            break;
+        case 0x2003:
+            ppu->oam_addr = val;
+            return;
+        case 0x2004:
+            ppu->oam[ppu->oam_addr++] = val;
+            return;
+        case 0x2005:
+            if (!ppu->w) {
+                ppu->t = (uint16_t) ((ppu->t & ~0x001fu) | val >> 3u);
+                ppu->x = val & 0x07u;
+            } else {
+                ppu->t = (uint16_t) ((ppu->t & ~0x73e0u) | (val & 0x07u) << 12u | (val & 0xf8u) << 2u);
+            }
+            ppu->w = !ppu->w;
+            return;
+        case 0x2006:
+            if (!ppu->w) {
+                ppu->t = (uint16_t) ((ppu->t & 0x00ffu) | (val & 0x3fu) << 8u);
+            } else {
+                ppu->t = (uint16_t) ((ppu->t & 0xff00u) | val);
+                ppu->v = ppu->t;
+            }
+            ppu->w = !ppu->w;
+            return;
+        case 0x2007:
+            ppu_vram_set_u8(ppu, ppu->v & 0x3fffu, val);
+            ppu->v = (uint16_t) (ppu->v + (ppu->ctrl & PPU_CTRL_INCREMENT_32 ? 32 : 1));
+            return;
+        default:
+            return;
+    }
+
+    timing_changed = *reg != val && ppu->mapper != NULL && ppu->mapper->scanline_sync != NULL;
+
+    /* Boards counting scanline events catch up with the old timing, then reschedule with the new one */
+    if (timing_changed) {
+        ppu->mapper->scanline_sync(ppu->mapper);
+    }
+
+    *reg = val;
+
+    if (timing_changed) {
+        ppu->mapper->scanline_sync(ppu->mapper);
+    }
+}
+
+void ppu_oam_dma(ppu_t *ppu, const uint8_t *page) {
+    for (int i = 0; i < 0x100; i++) {
+        ppu->oam[(uint8_t) (ppu->oam_addr + i)] = page[i];
+    }
+}
+
+void ppu_set_framebuffer(ppu_t *ppu, uint8_t *framebuffer) {
+    if (framebuffer == NULL) {
+        framebuffer = ppu->own_framebuffer;
+    }
+
+    if (framebuffer != ppu->framebuffer) {
+        memcpy(framebuffer, ppu->framebuffer, PPU_FRAMEBUFFER_SIZE);
+        ppu->framebuffer = framebuffer;
+    }
+}
+
+/* VRAM */
+size_t ppu_state_size(void) {
+    return offsetof(ppu_t, framebuffer);
+}
+
+void ppu_save_state(const ppu_t *ppu, uint8_t *buf) {
+    memcpy(buf, ppu, ppu_state_size());
+}
+
+void ppu_load_state(ppu_t *ppu, const uint8_t *buf) {
+    mapper_t *mapper = ppu->mapper;
+
+    /* The saved mapper pointer is meaningless, keep ours */
+    memcpy(ppu, buf, ppu_state_size());
+    ppu->mapper = mapper;
+}
+
+static uint8_t *ppu_nametable(const ppu_t *ppu, uint16_t addr) {
+    const mapper_t *mapper = ppu->mapper;
+    uint8_t quadrant = (addr >> 10u) & 0x03u;
+    uint8_t *page;
+
+    switch (mapper->mirroring) {
+        case MIRROR_HORIZONTAL: page = (uint8_t *) ppu->ram + (quadrant >> 1u) * 0x400; break;
+        case MIRROR_VERTICAL: page = (uint8_t *) ppu->ram + (quadrant & 0x01u) * 0x400; break;
+        case MIRROR_SINGLE_LOW: page = (uint8_t *) ppu->ram; break;
+        case MIRROR_SINGLE_HIGH: page = (uint8_t *) ppu->ram + 0x400; break;
+        case MIRROR_FOUR_SCREEN: page = (uint8_t *) ppu->ram + quadrant * 0x400; break;
+        default:
+            page = mapper->nt_pages[quadrant];
+            if (page == NULL) {
+                page = (uint8_t *) ppu->ram + (mapper->nt_ciram[quadrant] & 0x01u) * 0x400;
+            }
+            break;
+    }
+
+    return page + (addr & 0x03ffu);
+}
+
+/* $3F10, $3F14, $3F18 and $3F1C mirror the backdrop entries */
+static uint8_t ppu_palette_index(uint16_t addr) {
+    uint8_t index = addr & 0x1fu;
+
+    return (index & 0x13u) == 0x10 ? index & 0x0fu : index;
+}
+
+static uint8_t ppu_vram_get_u8(ppu_t *ppu, uint16_t addr) {
+    if (addr < 0x2000) {
+        return mapper_get_chr_u8(ppu->mapper, addr);
+    } else if (addr < 0x3f00) {
+        return *ppu_nametable(ppu, addr);
+    } else {
+        return ppu->palette[ppu_palette_index(addr)];
+    }
+}
+
+static void ppu_vram_set_u8(ppu_t *ppu, uint16_t addr, uint8_t val) {
+    if (addr < 0x2000) {
+        mapper_set_chr_u8(ppu->mapper, addr, val);
+    } else if (addr < 0x3f00) {
+        *ppu_nametable(ppu, addr) = val;
+    } else {
+        ppu->palette[ppu_palette_index(addr)] = val & 0x3fu;
+    }
+}
+
+/* Rendering
+ *
+ * Lines are drawn in one go at the end of their fetches (dot 257), with the scroll and the banks in effect at that
+ * point. Background tiles are gathered for the whole line first, so the pattern fetches run in a tight loop, or in
+ * a single call to the board's bg_fetch for boards that pick them per tile. */
+static void ppu_end_line(ppu_t *ppu) {
+    uint16_t v = ppu->v;
+
+    if (!ppu_is_rendering(ppu) || ppu->mapper == NULL) {
+        if (!ppu->skip_render) {
+            memset(ppu->framebuffer + ppu->scanline * PPU_WIDTH,
+                   ppu->palette[0] & (ppu->mask & PPU_MASK_GREYSCALE ? 0x30 : 0x3f), PPU_WIDTH);
+            ppu->emphasis[ppu->scanline] = ppu->mask >> 5u;
+        }
+        return;
+    }
+
+    if (ppu->skip_render) {
+        ppu_skip_line(ppu);
+    } else {
+        ppu_render_line(ppu);
+    }
+
+    /* Next fine Y, wrapping to the next nametable after line 29 */
+    if ((v & 0x7000u) != 0x7000u) {
+        v += 0x1000;
+    } else {
+        v &= ~0x7000u;
+        switch (v & 0x03e0u) {
+            case 29 << 5: v = (uint16_t) ((v & ~0x03e0u) ^ 0x0800u); break;
+            case 31 << 5: v &= ~0x03e0u; break;
+            default: v += 0x20; break;
+        }
+    }
+
+    /* Horizontal scroll is reloaded for the next line */
+    ppu->v = (uint16_t) ((v & ~0x041fu) | (ppu->t & 0x041fu));
+}
+
+static void ppu_render_line(ppu_t *ppu) {
+    mapper_bg_tile_t tiles[PPU_WIDTH / 8 + 1];
+    uint8_t bg[PPU_WIDTH + 8];
+    uint8_t sprites[PPU_WIDTH];
+    uint8_t *out = ppu->framebuffer + ppu->scanline * PPU_WIDTH;
+    uint8_t color_mask = ppu->mask & PPU_MASK_GREYSCALE ? 0x30 : 0x3f;
+    uint8_t has_sprites;
+
+    /* Background: the 33 tiles the line overlaps */
+    ppu_fetch_tiles(ppu, tiles, 0, PPU_WIDTH / 8 + 1);
+
+    if (ppu->mask & PPU_MASK_BG) {
+        for (uint8_t i = 0; i < PPU_WIDTH / 8 + 1; i++) {
+            uint8_t lo = tiles[i].lo, hi = tiles[i].hi;
+            uint8_t palette = (uint8_t) (tiles[i].palette << 2u);
+
+            for (uint8_t bit = 0; bit < 8; bit++) {
+                uint8_t pixel = (uint8_t) ((lo >> (7 - bit) & 0x01u) | (hi >> (7 - bit) & 0x01u) << 1u);
+
+                bg[i * 8 + bit] = pixel ? palette | pixel : 0;
+            }
+        }
+
+        if (!(ppu->mask & PPU_MASK_BG_LEFT)) {
+            memset(bg + ppu->x, 0, 8);
+        }
+    } else {
+        memset(bg, 0, sizeof(bg));
+    }
+
+    has_sprites = ppu->mask & PPU_MASK_SPRITES ? ppu_render_sprites(ppu, sprites) : 0;
+
+    for (uint16_t x = 0; x < PPU_WIDTH; x++) {
+        uint8_t pixel = bg[x + ppu->x];
+
+        if (has_sprites && sprites[x]) {
+            uint8_t sprite = sprites[x];
+
+            if ((sprite & 0x80u) && pixel && x != PPU_WIDTH - 1) {
+                ppu->sprite_0_hit = TRUE;
+            }
+
+            /* Sprites behind the background only show through its transparent pixels */
+            if (!(sprite & 0x40u) || !pixel) {
+                pixel = sprite & 0x1fu;
+            }
+        }
+
+        out[x] = ppu->palette[pixel] & color_mask;
+    }
+
+    ppu->emphasis[ppu->scanline] = ppu->mask >> 5u;
+}
+
+/* Same flags as ppu_render_line, without drawing: sprites are only counted, and sprite 0 hit is an AND of the opaque
+ * pixels of sprite 0 and of the two background tiles under it. Once the flags are set, nothing is left to do. */
+static void ppu_skip_line(ppu_t *ppu) {
+    uint8_t height = ppu->ctrl & PPU_CTRL_SPRITE_16 ? 16 : 8;
+    const uint8_t *sprite = ppu->oam;
+    int row = ppu->scanline - sprite[0] - 1;
+    mapper_bg_tile_t tiles[2];
+    uint16_t addr, opaque_bg;
+    uint8_t lo, hi, opaque, first, shift, x = sprite[3];
+
+    if (!(ppu->mask & PPU_MASK_SPRITES)) {
+        return;
+    }
+
+    if (!ppu->sprite_overflow) {
+        uint8_t count = 0;
+
+        for (int i = 0; i < 64; i++) {
+            int r = ppu->scanline - ppu->oam[i * 4] - 1;
+
+            if (r >= 0 && r < height && ++count > 8) {
+                ppu->sprite_overflow = TRUE;
+                break;
+            }
+        }
+    }
+
+    if (ppu->sprite_0_hit || !(ppu->mask & PPU_MASK_BG) || row < 0 || row >= height) {
+        return;
+    }
+
+    /* Sprite 0, leftmost pixel in bit 7 */
+    addr = ppu_sprite_addr(ppu, sprite, row, height);
+    lo = mapper_get_chr_u8(ppu->mapper, addr);
+    hi = mapper_get_chr_u8(ppu->mapper, addr + 8);
+    opaque = lo | hi;
+    if (sprite[2] & 0x40u) {
+        opaque = (uint8_t) ((opaque * 0x0202020202ull & 0x010884422010ull) % 1023);
+    }
+
+    /* Pixels past the right edge, and the last column, never hit. Neither do the left 8 pixels when either layer is
+       hidden there. */
+    if (x > PPU_WIDTH - 9) {
+        opaque &= (uint8_t) (0xff00u >> (PPU_WIDTH - 1 - x));
+    }
+    if (x < 8 && (~ppu->mask & (PPU_MASK_BG_LEFT | PPU_MASK_SPRITES_LEFT))) {
+        opaque &= (uint8_t) (0xffu >> (8 - x));
+    }
+
+    if (!opaque) {
+        return;
+    }
+
+    /* Background pixels x to x + 7, the line starting fine X into the first tile */
+    first = (uint8_t) ((x + ppu->x) >> 3u);
+    shift = (uint8_t) ((x + ppu->x) & 0x07u);
+    ppu_fetch_tiles(ppu, tiles, first, 2);
+    opaque_bg = (uint16_t) ((tiles[0].lo | tiles[0].hi) << 8u | (tiles[1].lo | tiles[1].hi));
+
+    if ((uint8_t) (opaque_bg >> (8 - shift)) & opaque) {
+        ppu->sprite_0_hit = TRUE;
+    }
+}
+
+/* Nametable, attribute and pattern bytes of count background tiles of the line, starting at tile first */
+static void ppu_fetch_tiles(ppu_t *ppu, mapper_bg_tile_t *tiles, uint8_t first, uint8_t count) {
+    mapper_t *mapper = ppu->mapper;
+    uint16_t v = ppu->v;
+    uint8_t fine_y = (v >> 12u) & 0x07u;
+
+    /* Coarse X of the first tile, into the next nametable past 31 */
+    if ((v & 0x1fu) + first > 31) {
+        v = (uint16_t) (((v & ~0x1fu) | ((v + first) & 0x1fu)) ^ 0x0400u);
+    } else {
+        v = (uint16_t) (v + first);
+    }
+
+    for (uint8_t i = 0; i < count; i++) {
+        uint8_t *nt = ppu_nametable(ppu, v) - (v & 0x03ffu);
+        uint8_t attr = nt[0x3c0 | ((v >> 4u) & 0x38u) | ((v >> 2u) & 0x07u)];
+
+        tiles[i].nt_addr = (uint16_t) (0x2000 | (v & 0x0fffu));
+        tiles[i].tile = nt[v & 0x03ffu];
+        tiles[i].palette = (attr >> (((v >> 4u) & 0x04u) | (v & 0x02u))) & 0x03u;
+
+        if ((v & 0x1fu) == 31) {
+            v = (uint16_t) ((v & ~0x1fu) ^ 0x0400u);
+        } else {
+            v++;
+        }
+    }
+
+    if (mapper->bg_fetch != NULL) {
+        mapper->bg_fetch(mapper, tiles, count, fine_y);
+    } else {
+        uint16_t table = ppu->ctrl & PPU_CTRL_BG_TABLE ? 0x1000 : 0x0000;
+
+        for (uint8_t i = 0; i < count; i++) {
+            uint16_t addr = (uint16_t) (table | tiles[i].tile << 4u | fine_y);
+            const uint8_t *page = mapper->chr_bg_pages[addr >> 10u];
+
+            tiles[i].lo = page[addr & 0x03ffu];
+            tiles[i].hi = page[(addr & 0x03ffu) + 8];
+        }
+    }
+}
+
+/* Sprite pixels of the line: palette entry (0x10-0x1f), 0x40 if behind the background, 0x80 for sprite 0.
+ * Returns the number of sprites on the line. */
+static uint8_t ppu_render_sprites(ppu_t *ppu, uint8_t *line) {
+    const mapper_t *mapper = ppu->mapper;
+    uint8_t height = ppu->ctrl & PPU_CTRL_SPRITE_16 ? 16 : 8;
+    uint8_t count = 0;
+
+    memset(line, 0, PPU_WIDTH);
+
+    for (int i = 0; i < 64; i++) {
+        const uint8_t *sprite = ppu->oam + i * 4;
+        /* Sprites are drawn one line below their Y */
+        int row = ppu->scanline - sprite[0] - 1;
+        uint8_t attr = sprite[2], x = sprite[3];
+        uint16_t addr;
+        uint8_t lo, hi, flags;
+
+        if (row < 0 || row >= height) {
+            continue;
+        }
+
+        if (count == 8) {
+            ppu->sprite_overflow = TRUE;
+            break;
+        }
+        count++;
+
+        addr = ppu_sprite_addr(ppu, sprite, row, height);
+        lo = mapper_get_chr_u8(mapper, addr);
+        hi = mapper_get_chr_u8(mapper, addr + 8);
+        flags = (uint8_t) (0x10u | (attr & 0x03u) << 2u | (attr & 0x20u ? 0x40u : 0) | (i == 0 ? 0x80u : 0));
+
+        for (uint8_t bit = 0; bit < 8 && x + bit < PPU_WIDTH; bit++) {
+            uint8_t shift = attr & 0x40u ? bit : 7 - bit;
+            uint8_t pixel = (uint8_t) ((lo >> shift & 0x01u) | (hi >> shift & 0x01u) << 1u);
+
+            /* Lower OAM entries win, even when they're behind the background */
+            if (!pixel || line[x + bit] || (x + bit < 8 && !(ppu->mask & PPU_MASK_SPRITES_LEFT))) {
+                continue;
+            }
+
+            line[x + bit] = flags | pixel;
+        }
+    }
+
+    return count;
+}
+
+/* Pattern address of row of a sprite, vertical flip applied */
+static uint16_t ppu_sprite_addr(const ppu_t *ppu, const uint8_t *sprite, int row, uint8_t height) {
+    uint8_t tile = sprite[1];
+
+    if (sprite[2] & 0x80u) {
+        row = height - 1 - row;
+    }
+
+    if (height == 16) {
+        return (uint16_t) ((tile & 0x01u) << 12u | ((tile & 0xfeu) + (row >> 3)) << 4u | (row & 0x07));
+    }
+
+    return (uint16_t) ((ppu->ctrl & PPU_CTRL_SPRITE_TABLE ? 0x1000 : 0x0000) | tile << 4u | row);
+}
+
+/* Position of the scanline events in a line, 0 when the pattern tables don't make A12 toggle */
+static uint16_t ppu_scanline_event_pos(const ppu_t *ppu) {
+    if (!(ppu->mask & (PPU_MASK_BG | PPU_MASK_SPRITES))) {
+        return 0;
+    }
+
+    if (ppu->ctrl & PPU_CTRL_SPRITE_16) {
+        return PPU_A12_RISE_POS;
+    }
+
+    switch (ppu->ctrl & (PPU_CTRL_SPRITE_TABLE | PPU_CTRL_BG_TABLE)) {
+        case PPU_CTRL_SPRITE_TABLE: return PPU_A12_RISE_POS;
+        case PPU_CTRL_BG_TABLE: return PPU_A12_RISE_POS_BG;
+        default: return 0;
+    }
+}
+
+/* Events at or before dot: lines 0-239 and the pre-render line each have one */
+static uint64_t ppu_scanline_events_until(uint64_t dot, uint16_t pos) {
+    uint64_t frame = dot / PPU_DOTS_PER_FRAME;
+    uint32_t frame_dot = (uint32_t) (dot % PPU_DOTS_PER_FRAME);
+    uint32_t line = frame_dot / PPU_DOTS_PER_LINE;
+    uint32_t count = line < PPU_VBLANK_SCANLINE ? line : PPU_VBLANK_SCANLINE;
+
+    if ((line < PPU_VBLANK_SCANLINE || line == PPU_LAST_SCANLINE) && frame_dot % PPU_DOTS_PER_LINE >= pos) {
+        count++;
+    }
+
+    return frame * PPU_EVENTS_PER_FRAME + count;
+}
+
+uint64_t ppu_count_scanline_events(const ppu_t *ppu, uint64_t from, uint64_t to) {
+    uint16_t pos = ppu_scanline_event_pos(ppu);
+
+    if (pos == 0 || to <= from) {
+        return 0;
+    }
+
+    return ppu_scanline_events_until(to, pos) - ppu_scanline_events_until(from, pos);
+}
+
+uint64_t ppu_next_scanline_event(const ppu_t *ppu, uint64_t dot, uint64_t n) {
+    uint16_t pos = ppu_scanline_event_pos(ppu);
+    uint64_t event;
+    uint32_t index;
+
+    if (pos == 0) {
+        return UINT64_MAX;
+    }
+
+    /* Events are numbered from 1: the nth one after dot is number until(dot) + n */
+    event = ppu_scanline_events_until(dot, pos) + n - 1;
+    index = (uint32_t) (event % PPU_EVENTS_PER_FRAME);
+
+    return (event / PPU_EVENTS_PER_FRAME) * PPU_DOTS_PER_FRAME
+           + (index < PPU_VBLANK_SCANLINE ? index : PPU_LAST_SCANLINE) * PPU_DOTS_PER_LINE + pos;
+}
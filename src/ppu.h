@@ -6,6 +6,11 @@ extern "C" {
 #endif
 
 #include "types.h"
+#include "mapper.h"
+
+#define PPU_WIDTH 256
+#define PPU_HEIGHT 240
+#define PPU_FRAMEBUFFER_SIZE (PPU_WIDTH * PPU_HEIGHT)
 
 #define PPU_VBLANK_SCANLINE 240
 #define PPU_HBLANK_POS 256
@@ -13,14 +18,72 @@ extern "C" {
 #define PPU_LAST_SCANLINE 261
 #define PPU_LAST_LINE_POS 340
 
+#define PPU_DOTS_PER_LINE (PPU_LAST_LINE_POS + 1)
+#define PPU_DOTS_PER_FRAME (PPU_DOTS_PER_LINE * (PPU_LAST_SCANLINE + 1))
+
+/* Dot where A12 rises on rendering lines, when sprites are fetched from $1000 and the background from $0000 */
+#define PPU_A12_RISE_POS 260
+/* Same when the background is fetched from $1000 and the sprites from $0000 */
+#define PPU_A12_RISE_POS_BG 324
+
+#define PPU_EVENTS_PER_FRAME (PPU_VBLANK_SCANLINE + 1)
+
+enum ppu_ctrl_flags {
+    PPU_CTRL_INCREMENT_32 = 0x04,
+    PPU_CTRL_SPRITE_TABLE = 0x08,
+    PPU_CTRL_BG_TABLE = 0x10,
+    PPU_CTRL_SPRITE_16 = 0x20,
+    PPU_CTRL_NMI = 0x80
+};
+
+enum ppu_mask_flags {
+    PPU_MASK_GREYSCALE = 0x01,
+    PPU_MASK_BG_LEFT = 0x02,
+    PPU_MASK_SPRITES_LEFT = 0x04,
+    PPU_MASK_BG = 0x08,
+    PPU_MASK_SPRITES = 0x10
+};
+
 struct ppu_s {
     uint16_t scanline;
     uint16_t line_position;
     bool is_vblank;
 
+    /* Dots since power on: frame * PPU_DOTS_PER_FRAME + scanline * PPU_DOTS_PER_LINE + line_position */
+    uint64_t dot;
+
+    uint8_t ctrl;
+    uint8_t mask;
+    bool sprite_0_hit;
+    bool sprite_overflow;
+    uint8_t oam_addr;
+    uint8_t read_buffer;
+
+    /* Internal registers: current and temporary VRAM address, fine X scroll, write toggle */
+    uint16_t v;
+    uint16_t t;
+    uint8_t x;
+    bool w;
+
     bool is_nmi;
 
+    mapper_t *mapper;
+
+    /* Nametables, 4K for four screen boards */
     uint8_t ram[0x2000];
+    uint8_t palette[0x20];
+    uint8_t oam[0x100];
+
+    /* Palette indexes, one byte per pixel, and the PPUMASK emphasis bits of each line. The framebuffer is
+       own_framebuffer unless the owner gave another one, see ppu_set_framebuffer. */
+    uint8_t *framebuffer;
+    uint8_t emphasis[PPU_HEIGHT];
+
+    /* Lines are not drawn, the framebuffer keeps its contents. Sprite 0 hit and sprite overflow, the only results of
+       rendering the CPU can see, are still computed, at the same dots. */
+    bool skip_render;
+
+    uint8_t own_framebuffer[PPU_FRAMEBUFFER_SIZE];
 };
 typedef struct ppu_s ppu_t;
 
@@ -30,6 +93,27 @@ void ppu_reset(ppu_t *ppu);
 
 void ppu_tick(ppu_t *ppu);
 uint8_t ppu_get_status(ppu_t *ppu);
+uint8_t ppu_get_u8(ppu_t *ppu, uint16_t addr);
+void ppu_set_u8(ppu_t *ppu, uint16_t addr, uint8_t val);
+void ppu_oam_dma(ppu_t *ppu, const uint8_t *page);
+
+/* Draws to framebuffer, PPU_FRAMEBUFFER_SIZE bytes the caller keeps alive, from now on. The current frame is copied
+ * there. NULL goes back to the PPU's own. */
+void ppu_set_framebuffer(ppu_t *ppu, uint8_t *framebuffer);
+
+/* State: everything up to the framebuffer, which is output and redrawn by the next frame */
+size_t ppu_state_size(void);
+void ppu_save_state(const ppu_t *ppu, uint8_t *buf);
+void ppu_load_state(ppu_t *ppu, const uint8_t *buf);
+
+/* Scanline events: the rising edges of A12 that scanline counters clock on, one per rendering line while rendering
+ * is enabled. They are computed from the timing state instead of being tracked dot by dot, so a board can schedule
+ * its IRQ ahead of time. Both functions assume the current PPUCTRL / PPUMASK values hold for the whole range. */
+
+/* Number of events in (from, to] */
+uint64_t ppu_count_scanline_events(const ppu_t *ppu, uint64_t from, uint64_t to);
+/* Dot of the nth event after dot, or UINT64_MAX if rendering is disabled */
+uint64_t ppu_next_scanline_event(const ppu_t *ppu, uint64_t dot, uint64_t n);
 
 #ifdef __cplusplus
 }
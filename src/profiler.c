@@ -0,0 +1,347 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "profiler.h"
+
+#define PROFILER_INITIAL_NODES 256
+#define PROFILER_INITIAL_FRAMES 1024
+
+static uint32_t profiler_child(profiler_t *profiler, uint32_t parent, uint16_t addr, uint8_t kind);
+static void profiler_push(profiler_t *profiler, uint32_t node, uint8_t sp);
+static int profiler_node_name(const profiler_t *profiler, uint32_t node, char *buf, size_t size);
+static bool profiler_write_file(const profiler_t *profiler, const char *prefix, const char *suffix,
+                                void (*write)(const profiler_t *, FILE *));
+
+profiler_t *profiler_init(uint32_t period, uint32_t flags) {
+    profiler_t *profiler = calloc(1, sizeof(profiler_t));
+
+    if (profiler == NULL) {
+        return NULL;
+    }
+
+    profiler->period = period;
+    profiler->charge = PROFILER_NO_NODE;
+
+    profiler->cycles = calloc(0x10000, sizeof(uint64_t));
+    profiler->instructions = calloc(0x10000, sizeof(uint64_t));
+    profiler->nodes = malloc(PROFILER_INITIAL_NODES * sizeof(profiler_node_t));
+    profiler->frames = malloc(PROFILER_INITIAL_FRAMES * sizeof(profiler_frame_t));
+    if (flags & PROFILER_HEATMAP) {
+        profiler->reads = calloc(0x10000, sizeof(uint32_t));
+        profiler->writes = calloc(0x10000, sizeof(uint32_t));
+    }
+
+    if (profiler->cycles == NULL || profiler->instructions == NULL || profiler->nodes == NULL
+        || profiler->frames == NULL || ((flags & PROFILER_HEATMAP) && (profiler->reads == NULL
+                                                                       || profiler->writes == NULL))) {
+        log_error("profiler", "Unable to allocate the profiler");
+        profiler_free(profiler);
+        return NULL;
+    }
+
+    profiler->max_nodes = PROFILER_INITIAL_NODES;
+    profiler->max_frames = PROFILER_INITIAL_FRAMES;
+
+    /* Whatever runs outside of any call: the reset code and the main loop */
+    memset(&profiler->nodes[0], 0, sizeof(profiler_node_t));
+    profiler->nodes[0].kind = PROFILER_ROOT;
+    profiler->nodes[0].first_child = PROFILER_NO_NODE;
+    profiler->nodes[0].next_sibling = PROFILER_NO_NODE;
+    profiler->nb_nodes = 1;
+
+    return profiler;
+}
+
+void profiler_free(profiler_t *profiler) {
+    free(profiler->cycles);
+    free(profiler->instructions);
+    free(profiler->reads);
+    free(profiler->writes);
+    free(profiler->nodes);
+    free(profiler->frames);
+    free(profiler);
+}
+
+static uint32_t profiler_current(const profiler_t *profiler) {
+    return profiler->depth > 0 ? profiler->stack[profiler->depth - 1].node : 0;
+}
+
+void profiler_call(profiler_t *profiler, uint16_t addr, uint8_t sp) {
+    uint32_t current = profiler_current(profiler);
+
+    /* JSR itself is the caller's */
+    profiler->charge = current;
+    profiler_push(profiler, profiler_child(profiler, current, addr, PROFILER_CALL), sp);
+}
+
+void profiler_interrupt(profiler_t *profiler, uint16_t addr, uint8_t sp, bool nmi) {
+    uint32_t current = profiler_current(profiler);
+
+    profiler_push(profiler, profiler_child(profiler, current, addr, nmi ? PROFILER_NMI : PROFILER_IRQ), sp);
+    profiler->interrupt_depth++;
+}
+
+void profiler_return(profiler_t *profiler, uint8_t sp) {
+    /* RTS / RTI are the callee's */
+    if (profiler->charge == PROFILER_NO_NODE) {
+        profiler->charge = profiler_current(profiler);
+    }
+
+    /* Every call made with the stack at or below this point is over */
+    while (profiler->depth > 0 && profiler->stack[profiler->depth - 1].sp <= sp) {
+        uint8_t kind = profiler->nodes[profiler->stack[profiler->depth - 1].node].kind;
+
+        if (kind == PROFILER_NMI || kind == PROFILER_IRQ) {
+            profiler->interrupt_depth--;
+        }
+        profiler->depth--;
+    }
+}
+
+void profiler_charge(profiler_t *profiler, uint16_t pc, uint16_t cycles, uint64_t clock) {
+    uint32_t index = profiler->charge != PROFILER_NO_NODE ? profiler->charge : profiler_current(profiler);
+    profiler_node_t *node = &profiler->nodes[index];
+    uint64_t charged = cycles;
+
+    profiler->charge = PROFILER_NO_NODE;
+
+    if (profiler->period > 0) {
+        /* The sample stands for everything since the previous one */
+        if (profiler->last_sample > 0) {
+            charged = clock - profiler->last_sample;
+        }
+        profiler->last_sample = clock;
+        profiler->next_sample = (clock / profiler->period + 1) * profiler->period;
+    }
+
+    profiler->cycles[pc] += charged;
+    profiler->instructions[pc]++;
+
+    node->cycles += charged;
+    if (node->frame != profiler->nb_frames) {
+        node->frame = profiler->nb_frames;
+        node->frame_cycles = 0;
+    }
+    node->frame_cycles += charged;
+    if (node->frame_cycles > profiler->frame.top_cycles) {
+        profiler->frame.top_node = index;
+        profiler->frame.top_cycles = node->frame_cycles;
+    }
+
+    profiler->frame.cycles += charged;
+    profiler->frame.instructions++;
+    if (profiler->interrupt_depth > 0) {
+        profiler->frame.interrupt_cycles += charged;
+    }
+}
+
+void profiler_end_frame(profiler_t *profiler) {
+    if (profiler->nb_frames == profiler->max_frames) {
+        profiler_frame_t *frames = realloc(profiler->frames, profiler->max_frames * 2 * sizeof(profiler_frame_t));
+
+        if (frames == NULL) {
+            /* Keep profiling, the frames past this point are not recorded */
+            memset(&profiler->frame, 0, sizeof(profiler->frame));
+            return;
+        }
+
+        profiler->frames = frames;
+        profiler->max_frames *= 2;
+    }
+
+    profiler->frames[profiler->nb_frames++] = profiler->frame;
+    memset(&profiler->frame, 0, sizeof(profiler->frame));
+}
+
+static uint32_t profiler_child(profiler_t *profiler, uint32_t parent, uint16_t addr, uint8_t kind) {
+    profiler_node_t *node;
+    uint32_t index;
+
+    for (index = profiler->nodes[parent].first_child; index != PROFILER_NO_NODE;
+         index = profiler->nodes[index].next_sibling) {
+        if (profiler->nodes[index].addr == addr && profiler->nodes[index].kind == kind) {
+            return index;
+        }
+    }
+
+    if (profiler->nb_nodes == profiler->max_nodes) {
+        profiler_node_t *nodes = realloc(profiler->nodes, profiler->max_nodes * 2 * sizeof(profiler_node_t));
+
+        if (nodes == NULL) {
+            /* Out of memory: the callee is charged to its caller */
+            return parent;
+        }
+
+        profiler->nodes = nodes;
+        profiler->max_nodes *= 2;
+    }
+
+    index = profiler->nb_nodes++;
+    node = &profiler->nodes[index];
+    memset(node, 0, sizeof(profiler_node_t));
+    node->addr = addr;
+    node->kind = kind;
+    node->parent = parent;
+    node->first_child = PROFILER_NO_NODE;
+    node->next_sibling = profiler->nodes[parent].first_child;
+    profiler->nodes[parent].first_child = index;
+
+    return index;
+}
+
+static void profiler_push(profiler_t *profiler, uint32_t node, uint8_t sp) {
+    /* Deeper calls are charged to the deepest one followed */
+    if (profiler->depth == PROFILER_MAX_DEPTH) {
+        return;
+    }
+
+    profiler->stack[profiler->depth].node = node;
+    profiler->stack[profiler->depth].sp = sp;
+    profiler->depth++;
+}
+
+/* Output */
+static int profiler_node_name(const profiler_t *profiler, uint32_t node, char *buf, size_t size) {
+    const profiler_node_t *n = &profiler->nodes[node];
+
+    switch (n->kind) {
+        case PROFILER_ROOT:
+            return snprintf(buf, size, "reset");
+        case PROFILER_NMI:
+            return snprintf(buf, size, "NMI:$%04X", n->addr);
+        case PROFILER_IRQ:
+            return snprintf(buf, size, "IRQ:$%04X", n->addr);
+        default:
+            return snprintf(buf, size, "$%04X", n->addr);
+    }
+}
+
+void profiler_write_folded(const profiler_t *profiler, FILE *fp) {
+    uint32_t path[PROFILER_MAX_DEPTH + 1];
+    char name[16];
+
+    for (uint32_t i = 0; i < profiler->nb_nodes; i++) {
+        uint32_t depth = 0;
+
+        if (profiler->nodes[i].cycles == 0) {
+            continue;
+        }
+
+        for (uint32_t n = i; n != 0 && depth < PROFILER_MAX_DEPTH; n = profiler->nodes[n].parent) {
+            path[depth++] = n;
+        }
+        path[depth++] = 0;
+
+        while (depth > 0) {
+            profiler_node_name(profiler, path[--depth], name, sizeof(name));
+            fprintf(fp, "%s%c", name, depth > 0 ? ';' : ' ');
+        }
+        fprintf(fp, "%lu\n", (unsigned long) profiler->nodes[i].cycles);
+    }
+}
+
+void profiler_write_pcs(const profiler_t *profiler, FILE *fp) {
+    fprintf(fp, "address,cycles,instructions\n");
+    for (uint32_t addr = 0; addr < 0x10000; addr++) {
+        if (profiler->instructions[addr] > 0) {
+            fprintf(fp, "%04X,%lu,%lu\n", addr, (unsigned long) profiler->cycles[addr],
+                    (unsigned long) profiler->instructions[addr]);
+        }
+    }
+}
+
+void profiler_write_frames(const profiler_t *profiler, FILE *fp) {
+    char name[16];
+
+    fprintf(fp, "frame,cycles,instructions,interrupt_cycles,top_function,top_cycles\n");
+    for (uint64_t i = 0; i < profiler->nb_frames; i++) {
+        const profiler_frame_t *frame = &profiler->frames[i];
+
+        profiler_node_name(profiler, frame->top_node, name, sizeof(name));
+        fprintf(fp, "%lu,%lu,%lu,%lu,%s,%lu\n", (unsigned long) i, (unsigned long) frame->cycles,
+                (unsigned long) frame->instructions, (unsigned long) frame->interrupt_cycles, name,
+                (unsigned long) frame->top_cycles);
+    }
+}
+
+void profiler_write_heatmap(const profiler_t *profiler, FILE *fp) {
+    fprintf(fp, "address,reads,writes\n");
+    if (profiler->reads == NULL) {
+        return;
+    }
+
+    for (uint32_t addr = 0; addr < 0x10000; addr++) {
+        if (profiler->reads[addr] > 0 || profiler->writes[addr] > 0) {
+            fprintf(fp, "%04X,%u,%u\n", addr, profiler->reads[addr], profiler->writes[addr]);
+        }
+    }
+}
+
+/* Bits needed for n, a cheap log scale */
+static uint8_t profiler_log2(uint32_t n) {
+    return n == 0 ? 0 : (uint8_t) (32 - __builtin_clz(n));
+}
+
+void profiler_write_heatmap_image(const profiler_t *profiler, FILE *fp) {
+    uint8_t max_bits = 1;
+
+    fprintf(fp, "P6\n256 256\n255\n");
+    if (profiler->reads == NULL) {
+        return;
+    }
+
+    for (uint32_t addr = 0; addr < 0x10000; addr++) {
+        uint8_t bits = profiler_log2(profiler->reads[addr] | profiler->writes[addr]);
+        max_bits = bits > max_bits ? bits : max_bits;
+    }
+
+    for (uint32_t addr = 0; addr < 0x10000; addr++) {
+        uint8_t pixel[3];
+
+        pixel[0] = (uint8_t) (profiler_log2(profiler->writes[addr]) * 255 / max_bits);
+        pixel[1] = (uint8_t) (profiler_log2(profiler->reads[addr]) * 255 / max_bits);
+        pixel[2] = 0;
+        fwrite(pixel, 1, sizeof(pixel), fp);
+    }
+}
+
+bool profiler_write_reports(const profiler_t *profiler, const char *prefix) {
+    bool ok = profiler_write_file(profiler, prefix, ".folded", profiler_write_folded)
+              && profiler_write_file(profiler, prefix, ".pcs.csv", profiler_write_pcs)
+              && profiler_write_file(profiler, prefix, ".frames.csv", profiler_write_frames);
+
+    if (ok && profiler->reads != NULL) {
+        ok = profiler_write_file(profiler, prefix, ".heatmap.csv", profiler_write_heatmap)
+             && profiler_write_file(profiler, prefix, ".heatmap.ppm", profiler_write_heatmap_image);
+    }
+
+    return ok;
+}
+
+static bool profiler_write_file(const profiler_t *profiler, const char *prefix, const char *suffix,
+                                void (*write)(const profiler_t *, FILE *)) {
+    size_t len = strlen(prefix) + strlen(suffix) + 1;
+    char *file = malloc(len);
+    FILE *fp;
+
+    if (file == NULL) {
+        return FALSE;
+    }
+
+    snprintf(file, len, "%s%s", prefix, suffix);
+    fp = fopen(file, "wb");
+    if (fp == NULL) {
+        log_error("profiler", "%s: %s", file, strerror(errno));
+        free(file);
+        return FALSE;
+    }
+
+    write(profiler, fp);
+    fclose(fp);
+    free(file);
+
+    return TRUE;
+}
@@ -0,0 +1,143 @@
+#ifndef __PROFILER_H__
+#define __PROFILER_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+
+#include "types.h"
+
+/* Guest code profiler.
+ *
+ * Cycles are charged to the PC of the instruction and to the current node of a call tree, built from JSR / RTS and
+ * from interrupts / RTI. Returns are matched on the stack pointer, so code that drops or fakes return addresses
+ * (RTS jump tables, stack resets) does not derail it. Addresses are CPU addresses: with bank switching, the same
+ * address can be different code.
+ *
+ * In full mode every instruction is charged. In sampling mode, only the instruction running when the period
+ * elapses is, with the cycles since the previous sample; the call tree is still followed on every call.
+ *
+ * With PROFILER_HEATMAP, every CPU bus read and write is counted per address, instruction fetches included. */
+
+#define PROFILER_MAX_DEPTH 256
+#define PROFILER_NO_NODE UINT32_MAX
+
+enum profiler_flags {
+    PROFILER_HEATMAP = 0x01
+};
+
+enum profiler_node_kind {
+    PROFILER_ROOT,
+    PROFILER_CALL,
+    PROFILER_NMI,
+    PROFILER_IRQ
+};
+
+struct profiler_node_s {
+    uint16_t addr;
+    uint8_t kind;
+    uint32_t parent;
+    uint32_t first_child;
+    uint32_t next_sibling;
+    uint64_t cycles; /* Self cycles */
+
+    /* Self cycles during the frame in progress, valid when frame matches it */
+    uint64_t frame;
+    uint64_t frame_cycles;
+};
+typedef struct profiler_node_s profiler_node_t;
+
+struct profiler_call_s {
+    uint32_t node;
+    uint8_t sp; /* SP before the return address was pushed */
+};
+typedef struct profiler_call_s profiler_call_t;
+
+struct profiler_frame_s {
+    uint64_t cycles;
+    uint64_t instructions; /* Samples in sampling mode */
+    uint64_t interrupt_cycles;
+    uint32_t top_node; /* Node with the most self cycles during the frame */
+    uint64_t top_cycles;
+};
+typedef struct profiler_frame_s profiler_frame_t;
+
+struct profiler_s {
+    uint32_t period;
+    uint64_t next_sample;
+    uint64_t last_sample;
+
+    /* Per CPU address */
+    uint64_t *cycles;
+    uint64_t *instructions;
+    uint32_t *reads;
+    uint32_t *writes;
+
+    profiler_node_t *nodes;
+    uint32_t nb_nodes;
+    uint32_t max_nodes;
+
+    profiler_call_t stack[PROFILER_MAX_DEPTH];
+    uint32_t depth;
+    uint32_t interrupt_depth;
+    /* Node the instruction in progress is charged to when it called or returned, PROFILER_NO_NODE otherwise */
+    uint32_t charge;
+
+    profiler_frame_t *frames;
+    uint64_t nb_frames;
+    uint64_t max_frames;
+    profiler_frame_t frame;
+};
+typedef struct profiler_s profiler_t;
+
+/* period: cycles between samples, 0 to charge every instruction */
+profiler_t *profiler_init(uint32_t period, uint32_t flags);
+void profiler_free(profiler_t *profiler);
+
+/* Hooks, called by the CPU. sp is the stack pointer before the call pushed anything, after the return popped. */
+void profiler_call(profiler_t *profiler, uint16_t addr, uint8_t sp);
+void profiler_interrupt(profiler_t *profiler, uint16_t addr, uint8_t sp, bool nmi);
+void profiler_return(profiler_t *profiler, uint8_t sp);
+void profiler_charge(profiler_t *profiler, uint16_t pc, uint16_t cycles, uint64_t clock);
+void profiler_end_frame(profiler_t *profiler);
+
+static inline void profiler_account(profiler_t *profiler, uint16_t pc, uint16_t cycles, uint64_t clock) {
+    if (profiler->period == 0 || clock >= profiler->next_sample) {
+        profiler_charge(profiler, pc, cycles, clock);
+    } else {
+        profiler->charge = PROFILER_NO_NODE;
+    }
+}
+
+static inline void profiler_bus_read(profiler_t *profiler, uint16_t addr) {
+    if (profiler->reads != NULL) {
+        profiler->reads[addr]++;
+    }
+}
+
+static inline void profiler_bus_write(profiler_t *profiler, uint16_t addr) {
+    if (profiler->writes != NULL) {
+        profiler->writes[addr]++;
+    }
+}
+
+/* Folded stacks, one "reset;$C72D;NMI:$C085;$C5F5 cycles" line per node, for flamegraph.pl and similar tools */
+void profiler_write_folded(const profiler_t *profiler, FILE *fp);
+/* CSV: address, cycles, instructions (executions in full mode, samples otherwise) */
+void profiler_write_pcs(const profiler_t *profiler, FILE *fp);
+/* CSV: frame, cycles, instructions, interrupt cycles, function with the most self cycles and its cycles */
+void profiler_write_frames(const profiler_t *profiler, FILE *fp);
+/* CSV: address, reads, writes, for the addresses accessed */
+void profiler_write_heatmap(const profiler_t *profiler, FILE *fp);
+/* 256x256 PPM, one pixel per address (row = high byte), log scaled: reads in green, writes in red */
+void profiler_write_heatmap_image(const profiler_t *profiler, FILE *fp);
+
+/* All of the above, to prefix.folded, prefix.pcs.csv, prefix.frames.csv, prefix.heatmap.csv, prefix.heatmap.ppm */
+bool profiler_write_reports(const profiler_t *profiler, const char *prefix);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __PROFILER_H__ */
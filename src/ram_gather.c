@@ -0,0 +1,159 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RAM_GATHER_HAVE_AVX2 1
+#endif
+
+#include "log.h"
+#include "ram_gather.h"
+
+typedef void (*ram_gather_fn_t)(const ram_gather_t *gather, const uint8_t *const *rams, size_t nb_rams, uint8_t *out,
+                                uint8_t *changed);
+
+static ram_gather_fn_t _ram_gather_impl;
+static pthread_once_t _ram_gather_once = PTHREAD_ONCE_INIT;
+
+#ifdef RAM_GATHER_HAVE_AVX2
+static void ram_gather_run_avx2(const ram_gather_t *gather, const uint8_t *const *rams, size_t nb_rams, uint8_t *out,
+                                uint8_t *changed);
+#endif
+
+static void ram_gather_init_impl(void) {
+    _ram_gather_impl = ram_gather_run_generic;
+
+#ifdef RAM_GATHER_HAVE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        _ram_gather_impl = ram_gather_run_avx2;
+    }
+#endif
+}
+
+ram_gather_t *ram_gather_init(const uint16_t *addrs, size_t nb_addrs) {
+    ram_gather_t *gather = calloc(1, sizeof(ram_gather_t));
+
+    if (gather == NULL) {
+        log_error("ram_gather", "Unable to allocate the RAM gather list");
+        return NULL;
+    }
+
+    gather->nb_addrs = nb_addrs;
+    gather->addrs = calloc(nb_addrs + 1, sizeof(uint16_t));
+    gather->offsets = calloc(nb_addrs + 1, sizeof(int32_t));
+    gather->shifts = calloc(nb_addrs + 1, sizeof(uint32_t));
+    if (gather->addrs == NULL || gather->offsets == NULL || gather->shifts == NULL) {
+        log_error("ram_gather", "Unable to allocate the RAM gather list");
+        ram_gather_free(gather);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < nb_addrs; i++) {
+        uint16_t addr;
+
+        if (addrs[i] >= 0x2000) {
+            log_error("ram_gather", "Not a RAM address: $%04X", addrs[i]);
+            ram_gather_free(gather);
+            return NULL;
+        }
+
+        addr = addrs[i] & (RAM_GATHER_SIZE - 1);
+        gather->addrs[i] = addr;
+
+        /* Dwords are read little endian: the one ending on addr has it in its top byte */
+        if (addr >= 3) {
+            gather->offsets[i] = addr - 3;
+            gather->shifts[i] = 24;
+        } else {
+            gather->offsets[i] = addr;
+            gather->shifts[i] = 0;
+        }
+    }
+
+    return gather;
+}
+
+void ram_gather_free(ram_gather_t *gather) {
+    free(gather->addrs);
+    free(gather->offsets);
+    free(gather->shifts);
+    free(gather);
+}
+
+void ram_gather_run(const ram_gather_t *gather, const uint8_t *const *rams, size_t nb_rams, uint8_t *out,
+                    uint8_t *changed) {
+    pthread_once(&_ram_gather_once, ram_gather_init_impl);
+
+    _ram_gather_impl(gather, rams, nb_rams, out, changed);
+}
+
+void ram_gather_run_generic(const ram_gather_t *gather, const uint8_t *const *rams, size_t nb_rams, uint8_t *out,
+                            uint8_t *changed) {
+    size_t n = gather->nb_addrs;
+
+    for (size_t r = 0; r < nb_rams; r++) {
+        const uint8_t *ram = rams[r];
+
+        for (size_t i = 0; i < n; i++) {
+            uint8_t val = ram[gather->addrs[i]];
+
+            if (changed != NULL) {
+                changed[i] = val != out[i] ? 0xff : 0x00;
+            }
+            out[i] = val;
+        }
+
+        out += n;
+        if (changed != NULL) {
+            changed += n;
+        }
+    }
+}
+
+#ifdef RAM_GATHER_HAVE_AVX2
+__attribute__((target("avx2")))
+static void ram_gather_run_avx2(const ram_gather_t *gather, const uint8_t *const *rams, size_t nb_rams, uint8_t *out,
+                                uint8_t *changed) {
+    /* Low byte of each dword to the bottom of its 128 bits lane, then the two lanes' results side by side */
+    const __m256i pack = _mm256_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                          0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m256i join = _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0);
+    const __m128i ones = _mm_set1_epi8(-1);
+    size_t n = gather->nb_addrs;
+    size_t blocks = n / 8;
+
+    for (size_t r = 0; r < nb_rams; r++) {
+        const int *ram = (const int *) rams[r];
+
+        for (size_t b = 0; b < blocks; b++) {
+            __m256i offsets = _mm256_loadu_si256((const __m256i *) (gather->offsets + b * 8));
+            __m256i shifts = _mm256_loadu_si256((const __m256i *) (gather->shifts + b * 8));
+            __m256i dwords = _mm256_srlv_epi32(_mm256_i32gather_epi32(ram, offsets, 1), shifts);
+            __m128i vals = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(dwords, pack),
+                                                                              join));
+
+            if (changed != NULL) {
+                __m128i old = _mm_loadl_epi64((const __m128i *) (out + b * 8));
+
+                _mm_storel_epi64((__m128i *) (changed + b * 8), _mm_xor_si128(_mm_cmpeq_epi8(old, vals), ones));
+            }
+            _mm_storel_epi64((__m128i *) (out + b * 8), vals);
+        }
+
+        for (size_t i = blocks * 8; i < n; i++) {
+            uint8_t val = rams[r][gather->addrs[i]];
+
+            if (changed != NULL) {
+                changed[i] = val != out[i] ? 0xff : 0x00;
+            }
+            out[i] = val;
+        }
+
+        out += n;
+        if (changed != NULL) {
+            changed += n;
+        }
+    }
+}
+#endif
@@ -0,0 +1,46 @@
+#ifndef __RAM_GATHER_H__
+#define __RAM_GATHER_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+#include "types.h"
+
+/* Bulk reads of CPU RAM: the same list of addresses, registered once, read from many consoles into one contiguous
+ * [consoles x addresses] buffer.
+ *
+ * Uses AVX2 gathers, 8 addresses per instruction, when the CPU supports them, plain loads otherwise. Addresses are
+ * CPU addresses below $2000, mirrors folded into the 2K of RAM. A gather never reads outside of the 2K. */
+
+#define RAM_GATHER_SIZE 0x800
+
+struct ram_gather_s {
+    size_t nb_addrs;
+    uint16_t *addrs;
+    /* For the gathers: where the dword ending on each address starts, or the address itself when it is too close to
+       the start, and how far to shift the dword down to get the byte */
+    int32_t *offsets;
+    uint32_t *shifts;
+};
+typedef struct ram_gather_s ram_gather_t;
+
+/* Returns NULL if an address is not in RAM */
+ram_gather_t *ram_gather_init(const uint16_t *addrs, size_t nb_addrs);
+void ram_gather_free(ram_gather_t *gather);
+
+/* out[i * nb_addrs + j] is address j of rams[i]. With changed, changed[i * nb_addrs + j] is set to 0xFF if that
+ * value differs from what out held before, 0 otherwise. */
+void ram_gather_run(const ram_gather_t *gather, const uint8_t *const *rams, size_t nb_rams, uint8_t *out,
+                    uint8_t *changed);
+
+/* Portable implementation, always available. Used as a reference by the tests. */
+void ram_gather_run_generic(const ram_gather_t *gather, const uint8_t *const *rams, size_t nb_rams, uint8_t *out,
+                            uint8_t *changed);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __RAM_GATHER_H__ */
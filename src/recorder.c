@@ -0,0 +1,254 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "cpu.h"
+#include "log.h"
+#include "recorder.h"
+
+#define RECORDER_STACK_SIZE 65536
+
+__thread struct cpu_s *_recorder_current = NULL;
+
+/* Slots are claimed and released with atomics, the crash handler reads them as they are */
+static struct cpu_s *_cpus[RECORDER_MAX_CPUS];
+/* Live CPUs that did not get a slot */
+static int _unregistered = 0;
+
+static uint8_t _crash_stack[RECORDER_STACK_SIZE];
+
+static bool recorder_set_stack(void *stack, size_t size);
+static int recorder_slot(const struct cpu_s *cpu);
+static void recorder_dump_crash(int fd);
+static void recorder_on_panic(void);
+static void recorder_on_signal(int sig);
+static void recorder_printf(int fd, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void recorder_dump_memory(int fd, const uint8_t *mem, uint16_t base, uint16_t size);
+
+void recorder_register(struct cpu_s *cpu) {
+    for (int i = 0; i < RECORDER_MAX_CPUS; i++) {
+        struct cpu_s *expected = NULL;
+
+        if (__atomic_compare_exchange_n(&_cpus[i], &expected, cpu, FALSE, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            _set_panic_handler(recorder_on_panic);
+            return;
+        }
+    }
+
+    /* More CPUs than slots: this one is only dumped when it crashes itself */
+    _set_panic_handler(recorder_on_panic);
+    if (__atomic_fetch_add(&_unregistered, 1, __ATOMIC_ACQ_REL) == 0) {
+        log_warn("recorder", "More than %d CPUs, the others are only dumped when they crash", RECORDER_MAX_CPUS);
+    }
+}
+
+void recorder_unregister(struct cpu_s *cpu) {
+    if (_recorder_current == cpu) {
+        _recorder_current = NULL;
+    }
+
+    for (int i = 0; i < RECORDER_MAX_CPUS; i++) {
+        struct cpu_s *expected = cpu;
+
+        if (__atomic_compare_exchange_n(&_cpus[i], &expected, NULL, FALSE, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            return;
+        }
+    }
+
+    __atomic_fetch_sub(&_unregistered, 1, __ATOMIC_ACQ_REL);
+}
+
+void recorder_install_crash_handler(void) {
+    static const int signals[] = {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT};
+    struct sigaction action;
+
+    recorder_set_stack(_crash_stack, sizeof(_crash_stack));
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = recorder_on_signal;
+    action.sa_flags = SA_ONSTACK | SA_RESETHAND;
+    sigemptyset(&action.sa_mask);
+
+    for (size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); i++) {
+        sigaction(signals[i], &action, NULL);
+    }
+}
+
+void *recorder_thread_stack(void) {
+    void *stack = malloc(RECORDER_STACK_SIZE);
+
+    if (stack == NULL) {
+        log_error("recorder", "Unable to allocate a signal stack");
+        return NULL;
+    }
+
+    if (!recorder_set_stack(stack, RECORDER_STACK_SIZE)) {
+        free(stack);
+        return NULL;
+    }
+
+    return stack;
+}
+
+void recorder_thread_stack_free(void *stack) {
+    stack_t disable;
+
+    if (stack == NULL) {
+        return;
+    }
+
+    memset(&disable, 0, sizeof(disable));
+    disable.ss_flags = SS_DISABLE;
+    sigaltstack(&disable, NULL);
+    free(stack);
+}
+
+void recorder_dump_all(int fd) {
+    for (int i = 0; i < RECORDER_MAX_CPUS; i++) {
+        struct cpu_s *cpu = __atomic_load_n(&_cpus[i], __ATOMIC_ACQUIRE);
+
+        if (cpu != NULL) {
+            recorder_printf(fd, "\n=== Flight recorder, CPU %d ===\n", i);
+            recorder_dump(cpu, fd);
+        }
+    }
+}
+
+void recorder_dump(const struct cpu_s *cpu, int fd) {
+    const recorder_t *recorder = &cpu->recorder;
+    uint32_t first = recorder->nb_instructions > RECORDER_INSTRUCTIONS
+                     ? recorder->nb_instructions - RECORDER_INSTRUCTIONS : 0;
+
+    if (!cpu->recording) {
+        recorder_printf(fd, "Not recording, last %u instructions from when it was:\n", recorder->nb_instructions - first);
+    } else {
+        recorder_printf(fd, "Last %u instructions, oldest first, with their bus accesses:\n",
+                        recorder->nb_instructions - first);
+    }
+
+    for (uint32_t i = first; i < recorder->nb_instructions; i++) {
+        const recorder_instruction_t *instr = &recorder->instructions[i & (RECORDER_INSTRUCTIONS - 1)];
+        uint32_t end = i + 1 < recorder->nb_instructions
+                       ? recorder->instructions[(i + 1) & (RECORDER_INSTRUCTIONS - 1)].access : recorder->nb_accesses;
+        uint32_t access = instr->access;
+
+        recorder_printf(fd, "%s PC:%04X OP:%02X (%s) A:%02X X:%02X Y:%02X P:%02X SP:%02X CYC:%u\n",
+                        i + 1 == recorder->nb_instructions ? ">" : " ", instr->pc, instr->opcode,
+                        OPCODES[instr->opcode], instr->a, instr->x, instr->y, instr->p, instr->sp, instr->cycle);
+
+        /* Older accesses are overwritten already */
+        if (recorder->nb_accesses - access > RECORDER_ACCESSES) {
+            access = recorder->nb_accesses - RECORDER_ACCESSES;
+        }
+
+        for (; access != end; access++) {
+            const recorder_access_t *a = &recorder->accesses[access & (RECORDER_ACCESSES - 1)];
+
+            recorder_printf(fd, "      %s $%04X = %02X\n", a->flags & RECORDER_WRITE ? "W" : "R", a->addr, a->value);
+        }
+    }
+
+    recorder_printf(fd, "State: PC:%04X A:%02X X:%02X Y:%02X P:%02X SP:%02X CYC:%lu\n", cpu->PC, cpu->A, cpu->X,
+                    cpu->Y, cpu->P, cpu->SP, (unsigned long) cpu->clock);
+
+    if (cpu->ppu != NULL) {
+        recorder_printf(fd, "PPU: frame %lu, scanline %u, dot %u, ctrl %02X, mask %02X, v %04X, vblank %d\n",
+                        (unsigned long) (cpu->ppu->dot / PPU_DOTS_PER_FRAME), cpu->ppu->scanline,
+                        cpu->ppu->line_position, cpu->ppu->ctrl, cpu->ppu->mask, cpu->ppu->v, cpu->ppu->is_vblank);
+    }
+
+    if (cpu->mapper != NULL) {
+        recorder_printf(fd, "Mapper: %u, IRQ at dot %lu\n", cpu->mapper->type, (unsigned long) cpu->mapper->irq_dot);
+    }
+
+    recorder_printf(fd, "Zero page:\n");
+    recorder_dump_memory(fd, cpu->ram, 0x0000, 0x100);
+    recorder_printf(fd, "Stack:\n");
+    recorder_dump_memory(fd, cpu->ram + 0x100, 0x0100, 0x100);
+}
+
+/* Own stack, for the calling thread: a stack overflow must still be reported */
+static bool recorder_set_stack(void *stack, size_t size) {
+    stack_t alt;
+
+    alt.ss_sp = stack;
+    alt.ss_size = size;
+    alt.ss_flags = 0;
+    if (sigaltstack(&alt, NULL) != 0) {
+        log_error("recorder", "sigaltstack: %s", strerror(errno));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static int recorder_slot(const struct cpu_s *cpu) {
+    for (int i = 0; i < RECORDER_MAX_CPUS; i++) {
+        if (__atomic_load_n(&_cpus[i], __ATOMIC_ACQUIRE) == cpu) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/* The CPU of the crashing thread alone: the others are fine, and with many consoles they would bury it */
+static void recorder_dump_crash(int fd) {
+    struct cpu_s *cpu = _recorder_current;
+    int slot = cpu != NULL ? recorder_slot(cpu) : -1;
+
+    if (slot >= 0) {
+        recorder_printf(fd, "\n=== Flight recorder, CPU %d, running on the crashing thread ===\n", slot);
+        recorder_dump(cpu, fd);
+    } else if (cpu != NULL && __atomic_load_n(&_unregistered, __ATOMIC_ACQUIRE) > 0) {
+        recorder_printf(fd, "\n=== Flight recorder, CPU past the first %d, running on the crashing thread ===\n",
+                        RECORDER_MAX_CPUS);
+        recorder_dump(cpu, fd);
+    } else {
+        recorder_dump_all(fd);
+    }
+}
+
+static void recorder_on_panic(void) {
+    recorder_dump_crash(STDERR_FILENO);
+}
+
+static void recorder_on_signal(int sig) {
+    recorder_printf(STDERR_FILENO, "\nFatal signal %d\n", sig);
+    recorder_dump_crash(STDERR_FILENO);
+
+    /* SA_RESETHAND restored the default action */
+    raise(sig);
+}
+
+/* No stdio: the crash can come from inside it. vsnprintf does not allocate for these formats. */
+static void recorder_printf(int fd, const char *fmt, ...) {
+    char buf[256];
+    va_list args;
+    int len;
+
+    va_start(args, fmt);
+    len = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+
+    if (len > 0) {
+        ssize_t written = write(fd, buf, (size_t) len < sizeof(buf) ? (size_t) len : sizeof(buf) - 1);
+        (void) written;
+    }
+}
+
+static void recorder_dump_memory(int fd, const uint8_t *mem, uint16_t base, uint16_t size) {
+    for (uint16_t i = 0; i < size; i += 16) {
+        const uint8_t *m = mem + i;
+
+        recorder_printf(fd, "  %04X  %02X %02X %02X %02X %02X %02X %02X %02X"
+                            "  %02X %02X %02X %02X %02X %02X %02X %02X\n",
+                        base + i, m[0], m[1], m[2], m[3], m[4], m[5], m[6], m[7],
+                        m[8], m[9], m[10], m[11], m[12], m[13], m[14], m[15]);
+    }
+}
@@ -0,0 +1,109 @@
+#ifndef __RECORDER_H__
+#define __RECORDER_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "types.h"
+
+/* Flight recorder: the last instructions and CPU bus accesses of every CPU, for post-mortems.
+ *
+ * Both are rings in the CPU itself, written in place: an instruction is its registers before it executes, plus where
+ * its bus accesses start in the other ring. On a crash, by _panic and, once recorder_install_crash_handler has been
+ * called, on a fatal signal, the rings are dumped to stderr along with a snapshot of the console state: only the ones
+ * of the CPU the crashing thread was running, or of every live CPU when it wasn't running any.
+ *
+ * A CPU records while its recording flag is set, from cpu_init on: the player and the tests always record. It costs
+ * a few percent of the emulation (2.5% on bench -f cpu.nestest), so libacidnes consoles don't by default, see
+ * acidnes_set_recorder. A CPU that doesn't record pays one predicted branch per instruction and per recorded bus
+ * access, and is dumped with its state only.
+ *
+ * Up to RECORDER_MAX_CPUS CPUs are registered for the dumps of every CPU, the others are only dumped when they crash. */
+
+/* Powers of 2 */
+#define RECORDER_INSTRUCTIONS 256
+#define RECORDER_ACCESSES 1024
+
+#define RECORDER_MAX_CPUS 64
+
+enum recorder_access_flags {
+    RECORDER_READ = 0x00,
+    RECORDER_WRITE = 0x01
+};
+
+struct recorder_instruction_s {
+    uint32_t cycle; /* Truncated to 32 bits */
+    uint32_t access; /* Index of its first bus access */
+    uint16_t pc;
+    uint8_t opcode;
+    uint8_t a;
+    uint8_t x;
+    uint8_t y;
+    uint8_t p;
+    uint8_t sp;
+};
+typedef struct recorder_instruction_s recorder_instruction_t;
+
+struct recorder_access_s {
+    uint16_t addr;
+    uint8_t value;
+    uint8_t flags;
+};
+typedef struct recorder_access_s recorder_access_t;
+
+struct recorder_s {
+    uint32_t nb_instructions;
+    uint32_t nb_accesses;
+    recorder_instruction_t instructions[RECORDER_INSTRUCTIONS];
+    recorder_access_t accesses[RECORDER_ACCESSES];
+};
+typedef struct recorder_s recorder_t;
+
+struct cpu_s;
+
+/* The CPU the thread runs, set by cpu_tick */
+extern __thread struct cpu_s *_recorder_current;
+
+/* Called by cpu_init / cpu_free: the CPUs dumped on a crash */
+void recorder_register(struct cpu_s *cpu);
+void recorder_unregister(struct cpu_s *cpu);
+
+/* SIGSEGV, SIGBUS, SIGILL, SIGFPE and SIGABRT dump the recorders, then the signal takes its default action. The
+ * calling thread gets its own signal stack, see recorder_thread_stack. */
+void recorder_install_crash_handler(void);
+
+/* Gives the calling thread its own signal stack, for a stack overflow to still be reported. Threads running CPUs
+ * call it, the thread pool's workers do. Returns it, for recorder_thread_stack_free when the thread is done, NULL if
+ * it could not be set. */
+void *recorder_thread_stack(void);
+void recorder_thread_stack_free(void *stack);
+
+/* Recorder and state of one CPU, written with write(2) only, to fd */
+void recorder_dump(const struct cpu_s *cpu, int fd);
+void recorder_dump_all(int fd);
+
+static inline void recorder_enter(struct cpu_s *cpu) {
+    _recorder_current = cpu;
+}
+
+/* The CPU fills in the registers and the opcode */
+static inline recorder_instruction_t *recorder_instruction(recorder_t *recorder, uint32_t cycle, uint16_t pc) {
+    recorder_instruction_t *instruction =
+            &recorder->instructions[recorder->nb_instructions++ & (RECORDER_INSTRUCTIONS - 1)];
+
+    instruction->cycle = cycle;
+    instruction->access = recorder->nb_accesses;
+    instruction->pc = pc;
+    return instruction;
+}
+
+/* Reads are recorded once done, with their value: a read that panics is not in the ring, the message has it */
+static inline void recorder_access(recorder_t *recorder, uint16_t addr, uint8_t value, uint8_t flags) {
+    recorder->accesses[recorder->nb_accesses++ & (RECORDER_ACCESSES - 1)] = (recorder_access_t) {addr, value, flags};
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __RECORDER_H__ */
@@ -0,0 +1,133 @@
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "recorder.h"
+#include "threadpool.h"
+
+static void *threadpool_worker(void *arg);
+static void threadpool_work(threadpool_t *pool);
+
+threadpool_t *threadpool_init(uint32_t nb_threads) {
+    threadpool_t *pool = calloc(1, sizeof(threadpool_t));
+
+    if (pool == NULL) {
+        log_error("threadpool", "Unable to allocate the thread pool");
+        return NULL;
+    }
+
+    if (nb_threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        nb_threads = cpus > 0 ? (uint32_t) cpus : 1;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    pool->threads = calloc(nb_threads, sizeof(pthread_t));
+    if (pool->threads == NULL) {
+        log_error("threadpool", "Unable to allocate the thread pool");
+        threadpool_free(pool);
+        return NULL;
+    }
+
+    /* The calling thread is one of them */
+    for (uint32_t i = 0; i < nb_threads - 1; i++) {
+        if (pthread_create(&pool->threads[i], NULL, threadpool_worker, pool) != 0) {
+            log_error("threadpool", "Unable to start thread %u of the pool", i);
+            threadpool_free(pool);
+            return NULL;
+        }
+        pool->nb_threads++;
+    }
+
+    return pool;
+}
+
+void threadpool_free(threadpool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = TRUE;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (uint32_t i = 0; i < pool->nb_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+}
+
+void threadpool_run(threadpool_t *pool, threadpool_fn_t fn, void *ctx, size_t count) {
+    /* Not worth waking anyone up */
+    if (pool->nb_threads == 0 || count < 2) {
+        for (size_t i = 0; i < count; i++) {
+            fn(ctx, i);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->ctx = ctx;
+    pool->count = count;
+    pool->next = 0;
+    pool->active = pool->nb_threads;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    threadpool_work(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->active > 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void *threadpool_worker(void *arg) {
+    threadpool_t *pool = arg;
+    uint64_t generation = 0;
+    /* Workers run the consoles, their crashes are reported too */
+    void *stack = recorder_thread_stack();
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->stop && pool->generation == generation) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+
+        if (pool->stop) {
+            break;
+        }
+
+        generation = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        threadpool_work(pool);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->active == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    recorder_thread_stack_free(stack);
+    return NULL;
+}
+
+/* Takes indexes until there are none left */
+static void threadpool_work(threadpool_t *pool) {
+    size_t i;
+
+    while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->count) {
+        pool->fn(pool->ctx, i);
+    }
+}
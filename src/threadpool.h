@@ -0,0 +1,49 @@
+#ifndef __THREADPOOL_H__
+#define __THREADPOOL_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include "types.h"
+
+/* Parallel loops over a fixed set of threads.
+ *
+ * threadpool_run calls fn(ctx, i) once for every i in [0, count), on the pool's threads and the calling one, and
+ * returns once every call has. Indexes are handed out one at a time, so uneven work balances itself. One loop runs at
+ * a time per pool: threadpool_run must not be called from two threads at once, nor from fn. */
+
+typedef void (*threadpool_fn_t)(void *ctx, size_t index);
+
+struct threadpool_s {
+    pthread_t *threads;
+    uint32_t nb_threads; /* Workers, the calling thread not included */
+
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    uint64_t generation;
+    uint32_t active;
+    bool stop;
+
+    /* Current loop */
+    threadpool_fn_t fn;
+    void *ctx;
+    size_t count;
+    size_t next;
+};
+typedef struct threadpool_s threadpool_t;
+
+/* Runs loops on nb_threads threads in total, the calling one included. 0 for one per online CPU. */
+threadpool_t *threadpool_init(uint32_t nb_threads);
+void threadpool_free(threadpool_t *pool);
+
+void threadpool_run(threadpool_t *pool, threadpool_fn_t fn, void *ctx, size_t count);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __THREADPOOL_H__ */
@@ -0,0 +1,403 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "log.h"
+#include "trace.h"
+
+struct trace_header_s {
+    char magic[8];
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t flags;
+};
+typedef struct trace_header_s trace_header_t;
+
+struct trace_block_s {
+    uint32_t nb_records;
+    uint32_t stored_size;
+};
+typedef struct trace_block_s trace_block_t;
+
+/* Writer thread, shared by every open trace */
+static pthread_mutex_t _writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _writer_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t _writer_done = PTHREAD_COND_INITIALIZER;
+static pthread_t _writer;
+static uint32_t _writer_users = 0;
+static bool _writer_stop = FALSE;
+static trace_buffer_t *_queue_head = NULL;
+static trace_buffer_t *_queue_tail = NULL;
+
+static void *trace_writer_run(void *arg);
+static void trace_write_buffer(trace_buffer_t *buffer, void *scratch, size_t scratch_size);
+static bool trace_write_all(int fd, const void *data, size_t size);
+
+trace_t *trace_open(const char *file, bool compress) {
+    trace_t *trace;
+    trace_header_t header;
+
+    trace = calloc(1, sizeof(trace_t));
+    if (trace == NULL) {
+        return NULL;
+    }
+
+#ifdef HAVE_ZSTD
+    trace->flags = compress ? TRACE_ZSTD : 0;
+#else
+    if (compress) {
+        log_warn("trace", "Trace compression is not available, writing %s uncompressed", file);
+    }
+#endif
+
+    trace->fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (trace->fd < 0) {
+        log_error("trace", "%s: %s", file, strerror(errno));
+        free(trace);
+
+        return NULL;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(trace_record_t);
+    header.flags = trace->flags;
+
+    if (!trace_write_all(trace->fd, &header, sizeof(header))) {
+        log_error("trace", "%s: %s", file, strerror(errno));
+        close(trace->fd);
+        free(trace);
+
+        return NULL;
+    }
+
+    for (int i = 0; i < TRACE_BUFFERS; i++) {
+        trace_buffer_t *buffer = malloc(sizeof(trace_buffer_t));
+
+        if (buffer == NULL) {
+            break;
+        }
+
+        buffer->trace = trace;
+        buffer->next = trace->free_buffers;
+        trace->free_buffers = buffer;
+        trace->nb_free++;
+        trace->nb_buffers++;
+    }
+
+    if (trace->nb_free < 2) {
+        trace_close(trace);
+
+        return NULL;
+    }
+
+    pthread_mutex_lock(&_writer_lock);
+
+    if (_writer_users == 0) {
+        _writer_stop = FALSE;
+        if (pthread_create(&_writer, NULL, trace_writer_run, NULL) != 0) {
+            pthread_mutex_unlock(&_writer_lock);
+            log_error("trace", "Unable to start the trace writer");
+            trace_close(trace);
+
+            return NULL;
+        }
+    }
+    _writer_users++;
+
+    pthread_mutex_unlock(&_writer_lock);
+
+    trace->current = trace->free_buffers;
+    trace->free_buffers = trace->current->next;
+    trace->nb_free--;
+    trace->current->count = 0;
+
+    return trace;
+}
+
+/* Hands the current buffer to the writer and takes a free one, waiting if there is none */
+void trace_submit(trace_t *trace) {
+    trace_buffer_t *buffer = trace->current;
+
+    pthread_mutex_lock(&_writer_lock);
+
+    buffer->next = NULL;
+    if (_queue_tail != NULL) {
+        _queue_tail->next = buffer;
+    } else {
+        _queue_head = buffer;
+    }
+    _queue_tail = buffer;
+    pthread_cond_signal(&_writer_work);
+
+    while (trace->free_buffers == NULL) {
+        pthread_cond_wait(&_writer_done, &_writer_lock);
+    }
+
+    trace->current = trace->free_buffers;
+    trace->free_buffers = trace->current->next;
+    trace->nb_free--;
+
+    pthread_mutex_unlock(&_writer_lock);
+
+    trace->current->count = 0;
+}
+
+void trace_close(trace_t *trace) {
+    bool stop = FALSE;
+
+    if (trace->current != NULL) {
+        if (trace->current->count > 0) {
+            trace_submit(trace);
+        }
+
+        pthread_mutex_lock(&_writer_lock);
+
+        /* Wait for everything in flight */
+        while (trace->nb_free < trace->nb_buffers - 1) {
+            pthread_cond_wait(&_writer_done, &_writer_lock);
+        }
+
+        stop = --_writer_users == 0;
+        if (stop) {
+            _writer_stop = TRUE;
+            pthread_cond_signal(&_writer_work);
+        }
+
+        pthread_mutex_unlock(&_writer_lock);
+
+        if (stop) {
+            pthread_join(_writer, NULL);
+        }
+
+        free(trace->current);
+    }
+
+    while (trace->free_buffers != NULL) {
+        trace_buffer_t *next = trace->free_buffers->next;
+
+        free(trace->free_buffers);
+        trace->free_buffers = next;
+    }
+
+    if (trace->error) {
+        log_error("trace", "Trace is incomplete");
+    }
+
+    close(trace->fd);
+    free(trace);
+}
+
+static void *trace_writer_run(void *arg) {
+    size_t scratch_size = 0;
+    void *scratch = NULL;
+    trace_buffer_t *buffer;
+
+    (void) arg;
+
+#ifdef HAVE_ZSTD
+    scratch_size = ZSTD_compressBound(sizeof(trace_record_t) * TRACE_BUFFER_RECORDS);
+    scratch = malloc(scratch_size);
+#endif
+
+    pthread_mutex_lock(&_writer_lock);
+
+    for (;;) {
+        while (_queue_head == NULL && !_writer_stop) {
+            pthread_cond_wait(&_writer_work, &_writer_lock);
+        }
+
+        if (_queue_head == NULL) {
+            break;
+        }
+
+        buffer = _queue_head;
+        _queue_head = buffer->next;
+        if (_queue_head == NULL) {
+            _queue_tail = NULL;
+        }
+
+        /* Writes happen outside of the lock, producers keep filling their other buffers meanwhile */
+        pthread_mutex_unlock(&_writer_lock);
+        trace_write_buffer(buffer, scratch, scratch_size);
+        pthread_mutex_lock(&_writer_lock);
+
+        buffer->next = buffer->trace->free_buffers;
+        buffer->trace->free_buffers = buffer;
+        buffer->trace->nb_free++;
+        pthread_cond_broadcast(&_writer_done);
+    }
+
+    pthread_mutex_unlock(&_writer_lock);
+
+    free(scratch);
+
+    return NULL;
+}
+
+static void trace_write_buffer(trace_buffer_t *buffer, void *scratch, size_t scratch_size) {
+    trace_t *trace = buffer->trace;
+    trace_block_t block;
+    const void *data = buffer->records;
+
+    block.nb_records = buffer->count;
+    block.stored_size = (uint32_t) (buffer->count * sizeof(trace_record_t));
+
+#ifdef HAVE_ZSTD
+    if (trace->flags & TRACE_ZSTD) {
+        size_t size = ZSTD_compress(scratch, scratch_size, buffer->records, block.stored_size, 1);
+
+        if (ZSTD_isError(size)) {
+            trace->error = TRUE;
+            return;
+        }
+
+        data = scratch;
+        block.stored_size = (uint32_t) size;
+    }
+#else
+    (void) scratch;
+    (void) scratch_size;
+#endif
+
+    if (!trace_write_all(trace->fd, &block, sizeof(block)) || !trace_write_all(trace->fd, data, block.stored_size)) {
+        trace->error = TRUE;
+    }
+}
+
+static bool trace_write_all(int fd, const void *data, size_t size) {
+    const uint8_t *it = data;
+
+    while (size > 0) {
+        ssize_t written = write(fd, it, size);
+
+        if (written < 0) {
+            return FALSE;
+        }
+
+        it += written;
+        size -= (size_t) written;
+    }
+
+    return TRUE;
+}
+
+/* Reading */
+trace_reader_t *trace_reader_open(const char *file) {
+    trace_reader_t *reader;
+    trace_header_t header;
+
+    reader = calloc(1, sizeof(trace_reader_t));
+    if (reader == NULL) {
+        return NULL;
+    }
+
+    reader->fp = fopen(file, "rb");
+    if (reader->fp == NULL) {
+        log_error("trace", "%s: %s", file, strerror(errno));
+        free(reader);
+
+        return NULL;
+    }
+
+    if (fread(&header, sizeof(header), 1, reader->fp) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC))
+        || header.version != TRACE_VERSION || header.record_size != sizeof(trace_record_t)) {
+        log_error("trace", "Not a trace file: %s", file);
+        trace_reader_close(reader);
+
+        return NULL;
+    }
+
+#ifndef HAVE_ZSTD
+    if (header.flags & TRACE_ZSTD) {
+        log_error("trace", "Compressed trace, rebuild with zstd to read it: %s", file);
+        trace_reader_close(reader);
+
+        return NULL;
+    }
+#endif
+
+    reader->flags = header.flags;
+    reader->records = malloc(sizeof(trace_record_t) * TRACE_BUFFER_RECORDS);
+    reader->scratch = reader->flags & TRACE_ZSTD ? malloc(sizeof(trace_record_t) * TRACE_BUFFER_RECORDS * 2) : NULL;
+
+    if (reader->records == NULL || (reader->flags & TRACE_ZSTD && reader->scratch == NULL)) {
+        trace_reader_close(reader);
+
+        return NULL;
+    }
+
+    return reader;
+}
+
+bool trace_reader_next(trace_reader_t *reader, trace_record_t *record, uint64_t *cycle) {
+    trace_block_t block;
+    uint64_t full;
+
+    while (reader->index == reader->count) {
+        size_t raw_size;
+
+        if (fread(&block, sizeof(block), 1, reader->fp) != 1) {
+            return FALSE;
+        }
+
+        raw_size = block.nb_records * sizeof(trace_record_t);
+        if (block.nb_records > TRACE_BUFFER_RECORDS || block.stored_size > raw_size * 2) {
+            log_error("trace", "Corrupted trace");
+            return FALSE;
+        }
+
+        if (reader->flags & TRACE_ZSTD) {
+#ifdef HAVE_ZSTD
+            if (fread(reader->scratch, 1, block.stored_size, reader->fp) != block.stored_size
+                || ZSTD_decompress(reader->records, raw_size, reader->scratch, block.stored_size) != raw_size) {
+                log_error("trace", "Corrupted trace");
+                return FALSE;
+            }
+#endif
+        } else if (block.stored_size != raw_size || fread(reader->records, 1, raw_size, reader->fp) != raw_size) {
+            log_error("trace", "Corrupted trace");
+            return FALSE;
+        }
+
+        reader->count = block.nb_records;
+        reader->index = 0;
+    }
+
+    *record = reader->records[reader->index++];
+
+    /* Cycles only go forward: a smaller low half means it wrapped */
+    full = (reader->cycle & ~(uint64_t) UINT32_MAX) | record->cycle;
+    if (full < reader->cycle) {
+        full += (uint64_t) UINT32_MAX + 1;
+    }
+    reader->cycle = full;
+    *cycle = full;
+
+    return TRUE;
+}
+
+void trace_reader_close(trace_reader_t *reader) {
+    if (reader->fp != NULL) {
+        fclose(reader->fp);
+    }
+
+    free(reader->records);
+    free(reader->scratch);
+    free(reader);
+}
+
+int trace_format(const trace_record_t *record, uint64_t cycle, char *buf, size_t size) {
+    return snprintf(buf, size, "PC:%04X OP:%02X (%s) A:%02X X:%02X Y:%02X P:%02X SP:%02X CYC:%lu",
+                    record->pc, record->opcode, OPCODES[record->opcode], record->a, record->x, record->y, record->p,
+                    record->sp, (unsigned long) cycle);
+}
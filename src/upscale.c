@@ -0,0 +1,1154 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define UPSCALE_HAVE_SSSE3 1
+#endif
+
+#include "log.h"
+#include "upscale.h"
+
+/* One source line, with the lines above and below it, into 2 or 3 output lines */
+typedef void (*upscale_2x_fn_t)(const uint8_t *above, const uint8_t *line, const uint8_t *below, uint32_t width,
+                                uint8_t *out0, uint8_t *out1);
+typedef void (*upscale_3x_fn_t)(const uint8_t *above, const uint8_t *line, const uint8_t *below, uint32_t width,
+                                uint8_t *out0, uint8_t *out1, uint8_t *out2);
+
+/* HQx and xBR read the 4 RGBA bytes of a pixel as one uint32_t, the alpha of 0xff being here */
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define UPSCALE_ALPHA 0x000000ffU
+#else
+#define UPSCALE_ALPHA 0xff000000U
+#endif
+
+/* Source lines y - 2 to y + 2, repeating the top and bottom ones, and their YUV */
+struct upscale_lines_s {
+    const uint32_t *rgb[5];
+    const uint32_t *yuv[5];
+};
+typedef struct upscale_lines_s upscale_lines_t;
+
+/* One source line into factor output lines of pitch pixels */
+typedef void (*upscale_rgb_fn_t)(const upscale_lines_t *lines, uint32_t width, uint32_t factor, uint32_t *out,
+                                 size_t pitch);
+
+struct upscale_impl_s {
+    upscale_2x_fn_t scale2x;
+    upscale_3x_fn_t scale3x;
+    upscale_rgb_fn_t hqx;
+    upscale_rgb_fn_t xbr;
+};
+typedef struct upscale_impl_s upscale_impl_t;
+
+struct upscale_job_s {
+    const upscale_impl_t *impl;
+    /* HQx or xBR, NULL for the Scale family */
+    upscale_rgb_fn_t rgb;
+    uint32_t factor;
+    const uint8_t *src;
+    uint32_t width;
+    uint32_t height;
+    uint8_t *dst;
+    uint32_t *yuv;
+};
+typedef struct upscale_job_s upscale_job_t;
+
+static const upscale_impl_t *_upscale_impl;
+static pthread_once_t _upscale_once = PTHREAD_ONCE_INIT;
+
+static void upscale_2x_generic(const uint8_t *above, const uint8_t *line, const uint8_t *below, uint32_t width,
+                               uint8_t *out0, uint8_t *out1);
+static void upscale_3x_generic(const uint8_t *above, const uint8_t *line, const uint8_t *below, uint32_t width,
+                               uint8_t *out0, uint8_t *out1, uint8_t *out2);
+static void upscale_hqx_generic(const upscale_lines_t *lines, uint32_t width, uint32_t factor, uint32_t *out,
+                                size_t pitch);
+static void upscale_xbr_generic(const upscale_lines_t *lines, uint32_t width, uint32_t factor, uint32_t *out,
+                                size_t pitch);
+static void upscale_init_hq(void);
+static void upscale_init_xbr(void);
+#ifdef UPSCALE_HAVE_SSSE3
+static void upscale_2x_ssse3(const uint8_t *above, const uint8_t *line, const uint8_t *below, uint32_t width,
+                             uint8_t *out0, uint8_t *out1);
+static void upscale_3x_ssse3(const uint8_t *above, const uint8_t *line, const uint8_t *below, uint32_t width,
+                             uint8_t *out0, uint8_t *out1, uint8_t *out2);
+static void upscale_hqx_ssse3(const upscale_lines_t *lines, uint32_t width, uint32_t factor, uint32_t *out,
+                              size_t pitch);
+static void upscale_xbr_ssse3(const upscale_lines_t *lines, uint32_t width, uint32_t factor, uint32_t *out,
+                              size_t pitch);
+#endif
+
+static const upscale_impl_t _upscale_generic = {
+    upscale_2x_generic, upscale_3x_generic, upscale_hqx_generic, upscale_xbr_generic
+};
+#ifdef UPSCALE_HAVE_SSSE3
+static const upscale_impl_t _upscale_ssse3 = {
+    upscale_2x_ssse3, upscale_3x_ssse3, upscale_hqx_ssse3, upscale_xbr_ssse3
+};
+#endif
+
+static void upscale_init_impl(void) {
+    upscale_init_hq();
+    upscale_init_xbr();
+    _upscale_impl = &_upscale_generic;
+
+#ifdef UPSCALE_HAVE_SSSE3
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) {
+        _upscale_impl = &_upscale_ssse3;
+    }
+#endif
+}
+
+upscale_t *upscale_init(upscale_filter_t filter, uint32_t width, uint32_t height) {
+    upscale_t *upscale;
+
+    if ((uint32_t) filter > UPSCALE_XBR4X) {
+        log_error("upscale", "Unknown upscaler: %d", (int) filter);
+        return NULL;
+    }
+
+    upscale = calloc(1, sizeof(upscale_t));
+    if (upscale == NULL) {
+        log_error("upscale", "Unable to allocate the upscaler");
+        return NULL;
+    }
+
+    upscale->filter = filter;
+    upscale->width = width;
+    upscale->height = height;
+
+    if (filter == UPSCALE_SCALE4X) {
+        upscale->scratch = malloc((size_t) width * height * 4);
+        if (upscale->scratch == NULL) {
+            log_error("upscale", "Unable to allocate the upscaler");
+            upscale_free(upscale);
+            return NULL;
+        }
+    }
+
+    if (upscale_pixel_size(filter) == 4) {
+        upscale->yuv = malloc((size_t) width * height * sizeof(uint32_t));
+        if (upscale->yuv == NULL) {
+            log_error("upscale", "Unable to allocate the upscaler");
+            upscale_free(upscale);
+            return NULL;
+        }
+    }
+
+    return upscale;
+}
+
+void upscale_free(upscale_t *upscale) {
+    free(upscale->yuv);
+    free(upscale->scratch);
+    free(upscale);
+}
+
+uint32_t upscale_factor(upscale_filter_t filter) {
+    switch (filter) {
+        case UPSCALE_SCALE2X:
+        case UPSCALE_HQ2X:
+        case UPSCALE_XBR2X:
+            return 2;
+        case UPSCALE_SCALE3X:
+        case UPSCALE_HQ3X:
+        case UPSCALE_XBR3X:
+            return 3;
+        case UPSCALE_SCALE4X:
+        case UPSCALE_HQ4X:
+        case UPSCALE_XBR4X:
+            return 4;
+    }
+
+    return 1;
+}
+
+uint32_t upscale_pixel_size(upscale_filter_t filter) {
+    return filter >= UPSCALE_HQ2X ? 4 : 1;
+}
+
+/* Pixel x, its neighbours past the edges being the border pixels. Names are the reference's:
+ *
+ *   A B C
+ *   D E F
+ *   G H I */
+static void upscale_2x_pixel(const uint8_t *above, const uint8_t *line, const uint8_t *below, uint32_t width,
+                             uint32_t x, uint8_t *out0, uint8_t *out1) {
+    uint8_t b = above[x], e = line[x], h = below[x];
+    uint8_t d = line[x > 0 ? x - 1 : 0], f = line[x + 1 < width ? x + 1 : x];
+
+    if (b != h && d != f) {
+        out0[x * 2] = d == b ? d : e;
+        out0[x * 2 + 1] = b == f ? f : e;
+        out1[x * 2] = d == h ? d : e;
+        out1[x * 2 + 1] = h == f ? f : e;
+    } else {
+        out0[x * 2] = out0[x * 2 + 1] = out1[x * 2] = out1[x * 2 + 1] = e;
+    }
+}
+
+static void upscale_3x_pixel(const uint8_t *above, const uint8_t *line, const uint8_t *below, uint32_t width,
+                             uint32_t x, uint8_t *out0, uint8_t *out1, uint8_t *out2) {
+    uint32_t left = x > 0 ? x - 1 : 0, right = x + 1 < width ? x + 1 : x;
+    uint8_t a = above[left], b = above[x], c = above[right];
+    uint8_t d = line[left], e = line[x], f = line[right];
+    uint8_t g = below[left], h = below[x], i = below[right];
+
+    if (b != h && d != f) {
+        out0[x * 3] = d == b ? d : e;
+        out0[x * 3 + 1] = (d == b && e != c) || (b == f && e != a) ? b : e;
+        out0[x * 3 + 2] = b == f ? f : e;
+        out1[x * 3] = (d == b && e != g) || (d == h && e != a) ? d : e;
+        out1[x * 3 + 1] = e;
+        out1[x * 3 + 2] = (b == f && e != i) || (h == f && e != c) ? f : e;
+        out2[x * 3] = d == h ? d : e;
+        out2[x * 3 + 1] = (d == h && e != i) || (h == f && e != g) ? h : e;
+        out2[x * 3 + 2] = h == f ? f : e;
+    } else {
+        for (int k = 0; k < 3; k++) {
+            out0[x * 3 + k] = out1[x * 3 + k] = out2[x * 3 + k] = e;
+        }
+    }
+}
+
+static void upscale_2x_generic(const uint8_t *above, const uint8_t *line, const uint8_t *below, uint32_t width,
+                               uint8_t *out0, uint8_t *out1) {
+    for (uint32_t x = 0; x < width; x++) {
+        upscale_2x_pixel(above, line, below, width, x, out0, out1);
+    }
+}
+
+static void upscale_3x_generic(const uint8_t *above, const uint8_t *line, const uint8_t *below, uint32_t width,
+                               uint8_t *out0, uint8_t *out1, uint8_t *out2) {
+    for (uint32_t x = 0; x < width; x++) {
+        upscale_3x_pixel(above, line, below, width, x, out0, out1, out2);
+    }
+}
+
+/* Y, U and V of the hqx library's table, truncated the same way */
+static uint32_t upscale_yuv(const uint8_t *pixel) {
+    int r = pixel[0], g = pixel[1], b = pixel[2];
+    uint32_t y = (uint32_t) ((299 * r + 587 * g + 114 * b) / 1000);
+    uint32_t u = (uint32_t) ((-169 * (r - g) + 500 * (b - g)) / 1000 + 128);
+    uint32_t v = (uint32_t) ((500 * (r - g) - 81 * (b - g)) / 1000 + 128);
+
+    return y << 16 | u << 8 | v;
+}
+
+/* (c1 * w1 + c2 * w2) >> s on each channel, w1 + w2 being 1 << s */
+static uint32_t upscale_mix2(uint32_t c1, uint32_t w1, uint32_t c2, uint32_t w2, int s) {
+    return ((((c1 & 0x00ff00ffU) * w1 + (c2 & 0x00ff00ffU) * w2) >> s) & 0x00ff00ffU) |
+           (((((c1 >> 8) & 0x00ff00ffU) * w1 + ((c2 >> 8) & 0x00ff00ffU) * w2) >> s << 8) & 0xff00ff00U);
+}
+
+static uint32_t upscale_mix3(uint32_t c1, uint32_t w1, uint32_t c2, uint32_t w2, uint32_t c3, uint32_t w3, int s) {
+    return ((((c1 & 0x00ff00ffU) * w1 + (c2 & 0x00ff00ffU) * w2 + (c3 & 0x00ff00ffU) * w3) >> s) & 0x00ff00ffU) |
+           (((((c1 >> 8) & 0x00ff00ffU) * w1 + ((c2 >> 8) & 0x00ff00ffU) * w2 + ((c3 >> 8) & 0x00ff00ffU) * w3) >> s
+             << 8) & 0xff00ff00U);
+}
+
+static void upscale_fill(uint32_t *out, size_t pitch, uint32_t factor, uint32_t pixel) {
+    for (uint32_t y = 0; y < factor; y++) {
+        for (uint32_t x = 0; x < factor; x++) {
+            out[y * pitch + x] = pixel;
+        }
+    }
+}
+
+/* HQx. The 3x3 neighbourhood is numbered
+ *
+ *   0 1 2
+ *   3 4 5
+ *   6 7 8
+ *
+ * and bit n of a pattern is set when neighbour n (4 skipped) is far from the centre in YUV. Each corner of the output
+ * block is worked out as the top left one of the neighbourhood mirrored onto it, picking one of these rules. They and
+ * the blends of HQ2x are those of the hqx library once its 256 cases are folded into masks, as FFmpeg's hqx filter
+ * has them. HQ3x and HQ4x draw the same rules with blends of their sizes, which on some patterns are not those of the
+ * library's own tables. */
+enum upscale_hq_rule {
+    /* The corner is on an edge between two far neighbours: the pixel itself */
+    HQ_CENTER,
+    /* Leaning towards the left, top or top left neighbour */
+    HQ_LEFT,
+    HQ_TOP,
+    HQ_DIAGONAL,
+    HQ_DIAGONAL_TOP,
+    HQ_DIAGONAL_LEFT,
+    /* Alone in its corner, barely blended */
+    HQ_CORNER,
+    HQ_SOFT_TOP,
+    HQ_SOFT_LEFT,
+    /* A line of another colour goes through the corner */
+    HQ_BLEND,
+    /* Nothing nearby: the smooth blend of pattern 0, or the one of an edge past the corner, with the top left
+     * neighbour close or far */
+    HQ_SMOOTH,
+    HQ_EDGE,
+    HQ_EDGE_FAR,
+    HQ_DEFAULT
+};
+typedef enum upscale_hq_rule upscale_hq_rule_t;
+
+/* upscale_hq_rule of each corner mirrored onto the top left, for each pattern and wdiffs */
+static uint8_t _upscale_hq_rules[4][256][8];
+
+/* Pattern bit of each neighbour */
+static const uint8_t UPSCALE_HQ_BIT[9] = {0, 1, 2, 3, 0, 4, 5, 6, 7};
+
+/* The neighbourhood mirrored onto the top left, top right, bottom left and bottom right corners */
+static const uint8_t UPSCALE_HQ_MIRRORS[4][9] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8},
+    {2, 1, 0, 5, 4, 3, 8, 7, 6},
+    {6, 7, 8, 3, 4, 5, 0, 1, 2},
+    {8, 7, 6, 5, 4, 3, 2, 1, 0}
+};
+
+static bool upscale_hq_diff(uint32_t yuv1, uint32_t yuv2) {
+    return abs((int) (yuv1 >> 16) - (int) (yuv2 >> 16)) > 48 ||
+           abs((int) (yuv1 >> 8 & 0xff) - (int) (yuv2 >> 8 & 0xff)) > 7 ||
+           abs((int) (yuv1 & 0xff) - (int) (yuv2 & 0xff)) > 6;
+}
+
+/* w and yuv get the neighbourhood of pixel x */
+static void upscale_hq_gather(const upscale_lines_t *lines, uint32_t width, uint32_t x, uint32_t *w, uint32_t *yuv) {
+    uint32_t columns[3] = {x > 0 ? x - 1 : 0, x, x + 1 < width ? x + 1 : x};
+
+    for (int n = 0; n < 9; n++) {
+        w[n] = lines->rgb[n / 3 + 1][columns[n % 3]];
+        yuv[n] = lines->yuv[n / 3 + 1][columns[n % 3]];
+    }
+}
+
+/* Whether neighbours a and b are far from each other */
+static uint32_t upscale_hq_far(const uint32_t *w, const uint32_t *yuv, int a, int b) {
+    return w[a] != w[b] && upscale_hq_diff(yuv[a], yuv[b]);
+}
+
+static uint32_t upscale_hq_pattern(const uint32_t *w, const uint32_t *yuv) {
+    uint32_t pattern = 0;
+
+    for (int n = 0; n < 9; n++) {
+        if (n != 4) {
+            pattern |= upscale_hq_far(w, yuv, 4, n) << UPSCALE_HQ_BIT[n];
+        }
+    }
+
+    return pattern;
+}
+
+/* The rule of the top left corner for pattern p. Bits 0 to 2 of wdiffs tell whether the top and right, bottom and
+ * left, left and top neighbours are far from each other. */
+static upscale_hq_rule_t upscale_hq_rule(uint32_t p, uint32_t wdiffs) {
+#define P(mask, value) ((p & (mask)) == (value))
+#define WDIFF_1_5 (wdiffs & 1)
+#define WDIFF_7_3 (wdiffs & 2)
+#define WDIFF_3_1 (wdiffs & 4)
+    if ((P(0xbf, 0x37) || P(0xdb, 0x13)) && WDIFF_1_5) {
+        return HQ_LEFT;
+    }
+    if ((P(0xdb, 0x49) || P(0xef, 0x6d)) && WDIFF_7_3) {
+        return HQ_TOP;
+    }
+    if ((P(0x0b, 0x0b) || P(0xfe, 0x4a) || P(0xfe, 0x1a)) && WDIFF_3_1) {
+        return HQ_CENTER;
+    }
+    if ((P(0x6f, 0x2a) || P(0x5b, 0x0a) || P(0xbf, 0x3a) || P(0xdf, 0x5a) || P(0x9f, 0x8a) || P(0xcf, 0x8a) ||
+         P(0xef, 0x4e) || P(0x3f, 0x0e) || P(0xfb, 0x5a) || P(0xbb, 0x8a) || P(0x7f, 0x5a) || P(0xaf, 0x8a) ||
+         P(0xeb, 0x8a)) && WDIFF_3_1) {
+        return HQ_DIAGONAL;
+    }
+    if (P(0x0b, 0x08)) {
+        return HQ_DIAGONAL_TOP;
+    }
+    if (P(0x0b, 0x02)) {
+        return HQ_DIAGONAL_LEFT;
+    }
+    if (P(0x2f, 0x2f)) {
+        return HQ_CORNER;
+    }
+    if (P(0xbf, 0x37) || P(0xdb, 0x13)) {
+        return HQ_SOFT_TOP;
+    }
+    if (P(0xdb, 0x49) || P(0xef, 0x6d)) {
+        return HQ_SOFT_LEFT;
+    }
+    if (P(0x1b, 0x03) || P(0x4f, 0x43) || P(0x8b, 0x83) || P(0x6b, 0x43)) {
+        return HQ_LEFT;
+    }
+    if (P(0x4b, 0x09) || P(0x8b, 0x89) || P(0x1f, 0x19) || P(0x3b, 0x19)) {
+        return HQ_TOP;
+    }
+    if (P(0x7e, 0x2a) || P(0xef, 0xab) || P(0xbf, 0x8f) || P(0x7e, 0x0e)) {
+        return HQ_BLEND;
+    }
+    if (P(0xfb, 0x6a) || P(0x6f, 0x6e) || P(0x3f, 0x3e) || P(0xfb, 0xfa) || P(0xdf, 0xde) || P(0xdf, 0x1e)) {
+        return HQ_DIAGONAL;
+    }
+    if (P(0x0a, 0x00)) {
+        return HQ_SMOOTH;
+    }
+    if (P(0x4f, 0x4b) || P(0x9f, 0x1b) || P(0x2f, 0x0b) || P(0xbe, 0x0a) || P(0xee, 0x0a) || P(0x7e, 0x0a) ||
+        P(0xeb, 0x4b) || P(0x3b, 0x1b)) {
+        return p & 1 ? HQ_EDGE_FAR : HQ_EDGE;
+    }
+#undef WDIFF_3_1
+#undef WDIFF_7_3
+#undef WDIFF_1_5
+#undef P
+
+    return HQ_DEFAULT;
+}
+
+static void upscale_init_hq(void) {
+    for (int corner = 0; corner < 4; corner++) {
+        for (uint32_t pattern = 0; pattern < 256; pattern++) {
+            uint32_t p = 0;
+
+            for (int n = 0; n < 9; n++) {
+                if (n != 4) {
+                    p |= (pattern >> UPSCALE_HQ_BIT[UPSCALE_HQ_MIRRORS[corner][n]] & 1) << UPSCALE_HQ_BIT[n];
+                }
+            }
+            for (uint32_t wdiffs = 0; wdiffs < 8; wdiffs++) {
+                _upscale_hq_rules[corner][pattern][wdiffs] = (uint8_t) upscale_hq_rule(p, wdiffs);
+            }
+        }
+    }
+}
+
+static uint32_t upscale_hq2x_corner(upscale_hq_rule_t rule, const uint32_t *w) {
+    switch (rule) {
+        case HQ_CENTER:
+            return w[4];
+        case HQ_LEFT:
+            return upscale_mix2(w[4], 3, w[3], 1, 2);
+        case HQ_TOP:
+            return upscale_mix2(w[4], 3, w[1], 1, 2);
+        case HQ_DIAGONAL:
+            return upscale_mix2(w[4], 3, w[0], 1, 2);
+        case HQ_DIAGONAL_TOP:
+            return upscale_mix3(w[4], 2, w[0], 1, w[1], 1, 2);
+        case HQ_DIAGONAL_LEFT:
+            return upscale_mix3(w[4], 2, w[0], 1, w[3], 1, 2);
+        case HQ_CORNER:
+            return upscale_mix3(w[4], 14, w[3], 1, w[1], 1, 4);
+        case HQ_SOFT_TOP:
+            return upscale_mix3(w[4], 5, w[1], 2, w[3], 1, 3);
+        case HQ_SOFT_LEFT:
+            return upscale_mix3(w[4], 5, w[3], 2, w[1], 1, 3);
+        case HQ_BLEND:
+            return upscale_mix3(w[4], 2, w[3], 3, w[1], 3, 3);
+        case HQ_SMOOTH:
+        case HQ_EDGE:
+        case HQ_EDGE_FAR:
+            return upscale_mix3(w[4], 2, w[3], 1, w[1], 1, 2);
+        case HQ_DEFAULT:
+            break;
+    }
+
+    return upscale_mix3(w[4], 6, w[3], 1, w[1], 1, 3);
+}
+
+static uint32_t upscale_hq3x_corner(upscale_hq_rule_t rule, const uint32_t *w) {
+    switch (rule) {
+        case HQ_CENTER:
+        case HQ_CORNER:
+            return w[4];
+        case HQ_LEFT:
+        case HQ_SOFT_LEFT:
+            return upscale_mix2(w[4], 3, w[3], 1, 2);
+        case HQ_TOP:
+        case HQ_SOFT_TOP:
+            return upscale_mix2(w[4], 3, w[1], 1, 2);
+        case HQ_BLEND:
+        case HQ_EDGE_FAR:
+            return upscale_mix3(w[4], 2, w[3], 7, w[1], 7, 4);
+        case HQ_SMOOTH:
+        case HQ_EDGE:
+            return upscale_mix3(w[4], 2, w[3], 1, w[1], 1, 2);
+        case HQ_DIAGONAL:
+        case HQ_DIAGONAL_TOP:
+        case HQ_DIAGONAL_LEFT:
+        case HQ_DEFAULT:
+            break;
+    }
+
+    return upscale_mix2(w[4], 3, w[0], 1, 2);
+}
+
+/* The 2x2 quarter of the block: outer corner, next to it along the top, along the side, inner corner */
+static void upscale_hq4x_corner(upscale_hq_rule_t rule, const uint32_t *w, uint32_t *q) {
+    uint32_t c = w[4];
+
+    switch (rule) {
+        case HQ_CENTER:
+            q[0] = q[1] = q[2] = q[3] = c;
+            break;
+        case HQ_LEFT:
+            q[0] = q[2] = upscale_mix2(c, 5, w[3], 3, 3);
+            q[1] = q[3] = upscale_mix2(c, 7, w[3], 1, 3);
+            break;
+        case HQ_TOP:
+            q[0] = q[1] = upscale_mix2(c, 5, w[1], 3, 3);
+            q[2] = q[3] = upscale_mix2(c, 7, w[1], 1, 3);
+            break;
+        case HQ_DIAGONAL:
+            q[0] = upscale_mix2(c, 5, w[0], 3, 3);
+            q[1] = q[2] = upscale_mix2(c, 3, w[0], 1, 2);
+            q[3] = upscale_mix2(c, 7, w[0], 1, 3);
+            break;
+        case HQ_DIAGONAL_TOP:
+            q[0] = upscale_mix2(c, 5, w[0], 3, 3);
+            q[1] = upscale_mix3(c, 5, w[1], 2, w[0], 1, 3);
+            q[2] = upscale_mix2(c, 3, w[0], 1, 2);
+            q[3] = upscale_mix2(c, 7, w[0], 1, 3);
+            break;
+        case HQ_DIAGONAL_LEFT:
+            q[0] = upscale_mix2(c, 5, w[0], 3, 3);
+            q[1] = upscale_mix2(c, 3, w[0], 1, 2);
+            q[2] = upscale_mix3(c, 5, w[3], 2, w[0], 1, 3);
+            q[3] = upscale_mix2(c, 7, w[0], 1, 3);
+            break;
+        case HQ_CORNER:
+            q[0] = upscale_mix3(c, 14, w[3], 1, w[1], 1, 4);
+            q[1] = q[2] = q[3] = c;
+            break;
+        case HQ_SOFT_TOP:
+            q[0] = q[1] = upscale_mix3(c, 5, w[1], 2, w[3], 1, 3);
+            q[2] = q[3] = upscale_mix3(c, 6, w[3], 1, w[1], 1, 3);
+            break;
+        case HQ_SOFT_LEFT:
+            q[0] = q[2] = upscale_mix3(c, 5, w[3], 2, w[1], 1, 3);
+            q[1] = q[3] = upscale_mix3(c, 6, w[3], 1, w[1], 1, 3);
+            break;
+        case HQ_BLEND:
+            q[0] = upscale_mix2(w[3], 1, w[1], 1, 1);
+            q[1] = upscale_mix3(w[1], 2, c, 1, w[3], 1, 2);
+            q[2] = upscale_mix3(w[3], 2, c, 1, w[1], 1, 2);
+            q[3] = upscale_mix3(c, 6, w[3], 1, w[1], 1, 3);
+            break;
+        case HQ_SMOOTH:
+            q[0] = upscale_mix3(c, 2, w[1], 1, w[3], 1, 2);
+            q[1] = upscale_mix3(c, 5, w[1], 2, w[3], 1, 3);
+            q[2] = upscale_mix3(c, 5, w[3], 2, w[1], 1, 3);
+            q[3] = upscale_mix3(c, 6, w[3], 1, w[1], 1, 3);
+            break;
+        case HQ_EDGE:
+            q[0] = upscale_mix3(c, 2, w[1], 1, w[3], 1, 2);
+            q[1] = upscale_mix2(c, 3, w[1], 1, 2);
+            q[2] = upscale_mix2(c, 3, w[3], 1, 2);
+            q[3] = c;
+            break;
+        case HQ_EDGE_FAR:
+            q[0] = upscale_mix2(w[1], 1, w[3], 1, 1);
+            q[1] = upscale_mix2(w[1], 1, c, 1, 1);
+            q[2] = upscale_mix2(w[3], 1, c, 1, 1);
+            q[3] = c;
+            break;
+        case HQ_DEFAULT:
+            q[0] = upscale_mix3(c, 6, w[3], 1, w[1], 1, 3);
+            q[1] = upscale_mix2(c, 7, w[1], 1, 3);
+            q[2] = upscale_mix2(c, 7, w[3], 1, 3);
+            q[3] = c;
+            break;
+    }
+}
+
+static void upscale_hq_block(uint32_t factor, const uint32_t *neighbours, const uint32_t *yuv, uint32_t pattern,
+                             uint32_t *out, size_t pitch) {
+    static const uint8_t sides[4][3] = {{0, 1, 1}, {0, 2, 3}, {1, 3, 5}, {2, 3, 7}};
+    upscale_hq_rule_t rules[4];
+    uint32_t corners[4], wdiffs[4];
+    /* The 3 pairs of each corner come from these 4 */
+    uint32_t top_right = upscale_hq_far(neighbours, yuv, 1, 5), bottom_left = upscale_hq_far(neighbours, yuv, 7, 3);
+    uint32_t top_left = upscale_hq_far(neighbours, yuv, 1, 3), bottom_right = upscale_hq_far(neighbours, yuv, 5, 7);
+
+    wdiffs[0] = top_right | bottom_left << 1 | top_left << 2;
+    wdiffs[1] = top_left | bottom_right << 1 | top_right << 2;
+    wdiffs[2] = bottom_right | top_left << 1 | bottom_left << 2;
+    wdiffs[3] = bottom_left | top_right << 1 | bottom_right << 2;
+
+    for (uint32_t corner = 0; corner < 4; corner++) {
+        const uint8_t *mirror = UPSCALE_HQ_MIRRORS[corner];
+        uint32_t w[9], q[4];
+        size_t bottom = corner >> 1, right = corner & 1;
+
+        for (int n = 0; n < 9; n++) {
+            w[n] = neighbours[mirror[n]];
+        }
+        rules[corner] = (upscale_hq_rule_t) _upscale_hq_rules[corner][pattern][wdiffs[corner]];
+        if (factor == 2) {
+            out[bottom * pitch + right] = upscale_hq2x_corner(rules[corner], w);
+        } else if (factor == 3) {
+            corners[corner] = upscale_hq3x_corner(rules[corner], w);
+            out[bottom * 2 * pitch + right * 2] = corners[corner];
+        } else {
+            size_t outer = bottom * 3 * pitch, inner = (bottom ? 2 : 1) * pitch;
+            size_t side = right * 3, middle = right ? 2 : 1;
+
+            upscale_hq4x_corner(rules[corner], w, q);
+            out[outer + side] = q[0];
+            out[outer + middle] = q[1];
+            out[inner + side] = q[2];
+            out[inner + middle] = q[3];
+        }
+    }
+
+    /* HQ3x: the middle of a side leans a quarter towards a close neighbour. Next to a far one it is the pixel itself,
+     * unless a line cuts one of the corners beside it, then it is halfway between them. */
+    if (factor == 3) {
+        out[pitch + 1] = neighbours[4];
+        for (int k = 0; k < 4; k++) {
+            uint32_t a = sides[k][0], b = sides[k][1], n = sides[k][2];
+            size_t at = (size_t) (n / 3) * pitch + n % 3;
+
+            if (!(pattern >> UPSCALE_HQ_BIT[n] & 1)) {
+                out[at] = upscale_mix2(neighbours[4], 3, neighbours[n], 1, 2);
+            } else if (rules[a] == HQ_EDGE || rules[a] == HQ_EDGE_FAR || rules[a] == HQ_BLEND ||
+                       rules[b] == HQ_EDGE || rules[b] == HQ_EDGE_FAR || rules[b] == HQ_BLEND) {
+                out[at] = upscale_mix2(corners[a], 1, corners[b], 1, 1);
+            } else {
+                out[at] = neighbours[4];
+            }
+        }
+    }
+}
+
+static void upscale_hq_pixel(const upscale_lines_t *lines, uint32_t width, uint32_t x, uint32_t factor,
+                             uint32_t *out, size_t pitch) {
+    uint32_t w[9], yuv[9];
+
+    upscale_hq_gather(lines, width, x, w, yuv);
+    upscale_hq_block(factor, w, yuv, upscale_hq_pattern(w, yuv), out + x * factor, pitch);
+}
+
+static void upscale_hqx_generic(const upscale_lines_t *lines, uint32_t width, uint32_t factor, uint32_t *out,
+                                size_t pitch) {
+    for (uint32_t x = 0; x < width; x++) {
+        upscale_hq_pixel(lines, width, x, factor, out, pitch);
+    }
+}
+
+/* xBR. The 5x5 window without its corners is named as in the reference:
+ *
+ *      A1 B1 C1
+ *   A0 PA PB PC C4
+ *   D0 PD PE PF F4
+ *   G0 PG PH PI I4
+ *      G5 H5 I5
+ *
+ * Each corner of the output block is rounded off as the bottom right one of the window and block turned onto it, in
+ * the order of the reference since a corner can blend pixels that the previous ones already did. */
+enum upscale_xbr_pixel {
+    XBR_PB = 7,
+    XBR_PC = 8,
+    XBR_PD = 11,
+    XBR_PE = 12,
+    XBR_PF = 13,
+    XBR_F4 = 14,
+    XBR_PG = 16,
+    XBR_PH = 17,
+    XBR_PI = 18,
+    XBR_I4 = 19,
+    XBR_H5 = 22,
+    XBR_I5 = 23
+};
+
+/* The window and the 2x2, 3x3 and 4x4 blocks turned onto each corner, as indexes into the unturned ones */
+static uint8_t _upscale_xbr_windows[4][25];
+static uint8_t _upscale_xbr_blocks[3][4][16];
+
+/* a + (b - a) * m / (1 << s) on each channel */
+static uint32_t upscale_xbr_blend(uint32_t a, uint32_t b, uint32_t m, int s) {
+    return upscale_mix2(a, (1U << s) - m, b, m, s);
+}
+
+/* The halves are rounded down before they are added, as in the reference */
+static uint32_t upscale_xbr_half(uint32_t a, uint32_t b) {
+    return (((a & 0xfefefefeU) >> 1) + ((b & 0xfefefefeU) >> 1)) | UPSCALE_ALPHA;
+}
+
+static uint32_t upscale_xbr_diff(uint32_t yuv1, uint32_t yuv2) {
+    return (uint32_t) (abs((int) (yuv1 >> 16) - (int) (yuv2 >> 16)) +
+                       abs((int) (yuv1 >> 8 & 0xff) - (int) (yuv2 >> 8 & 0xff)) +
+                       abs((int) (yuv1 & 0xff) - (int) (yuv2 & 0xff)));
+}
+
+static void upscale_xbr_gather(const upscale_lines_t *lines, uint32_t width, uint32_t x, uint32_t *rgb,
+                               uint32_t *yuv) {
+    uint32_t columns[5];
+
+    for (int k = 0; k < 5; k++) {
+        int64_t column = (int64_t) x + k - 2;
+        columns[k] = (uint32_t) (column < 0 ? 0 : column >= width ? width - 1 : column);
+    }
+    for (int n = 0; n < 25; n++) {
+        rgb[n] = lines->rgb[n / 5][columns[n % 5]];
+        yuv[n] = lines->yuv[n / 5][columns[n % 5]];
+    }
+}
+
+/* The n x n matrix turned a quarter so that what was on the right comes to the bottom, as indexes into the one that
+ * was turned */
+static void upscale_xbr_turn(const uint8_t *m, uint32_t n, uint8_t *turned) {
+    for (uint32_t i = 0; i < n; i++) {
+        for (uint32_t j = 0; j < n; j++) {
+            turned[i * n + j] = m[(n - 1 - j) * n + i];
+        }
+    }
+}
+
+static void upscale_init_xbr(void) {
+    for (uint32_t k = 0; k < 25; k++) {
+        _upscale_xbr_windows[0][k] = (uint8_t) k;
+    }
+    for (uint32_t k = 0; k < 16; k++) {
+        _upscale_xbr_blocks[0][0][k] = _upscale_xbr_blocks[1][0][k] = _upscale_xbr_blocks[2][0][k] = (uint8_t) k;
+    }
+    for (int corner = 1; corner < 4; corner++) {
+        upscale_xbr_turn(_upscale_xbr_windows[corner - 1], 5, _upscale_xbr_windows[corner]);
+        for (uint32_t n = 2; n <= 4; n++) {
+            upscale_xbr_turn(_upscale_xbr_blocks[n - 2][corner - 1], n, _upscale_xbr_blocks[n - 2][corner]);
+        }
+    }
+}
+
+/* The bottom right corner of the n x n block e, both turned by the index tables window and block */
+static void upscale_xbr_corner(const uint32_t *rgb, const uint32_t *yuv, const uint8_t *window, uint32_t n,
+                               const uint8_t *block, uint32_t *e) {
+#define RGB(a) rgb[window[XBR_##a]]
+#define E(k) e[block[k]]
+#define DF(a, b) upscale_xbr_diff(yuv[window[XBR_##a]], yuv[window[XBR_##b]])
+#define EQ(a, b) (DF(a, b) < 155)
+    uint32_t edge, inside, px, last = n * n - 1;
+    bool straight;
+
+    if (RGB(PE) == RGB(PH) || RGB(PE) == RGB(PF)) {
+        return;
+    }
+
+    edge = DF(PE, PC) + DF(PE, PG) + DF(PI, H5) + DF(PI, F4) + (DF(PH, PF) << 2);
+    inside = DF(PH, PD) + DF(PH, I5) + DF(PF, I4) + DF(PF, PB) + (DF(PE, PI) << 2);
+    px = DF(PE, PF) <= DF(PE, PH) ? RGB(PF) : RGB(PH);
+
+    if (n == 3) {
+        straight = (!EQ(PF, PB) && !EQ(PF, PC)) || (!EQ(PH, PD) && !EQ(PH, PG)) ||
+                   (EQ(PE, PI) && ((!EQ(PF, F4) && !EQ(PF, I4)) || (!EQ(PH, H5) && !EQ(PH, I5)))) ||
+                   EQ(PE, PG) || EQ(PE, PC);
+    } else {
+        straight = (!EQ(PF, PB) && !EQ(PH, PD)) || (EQ(PE, PI) && !EQ(PF, I4) && !EQ(PH, I5)) ||
+                   EQ(PE, PG) || EQ(PE, PC);
+    }
+
+    if (edge < inside && straight) {
+        uint32_t ke = DF(PF, PG), ki = DF(PH, PC);
+        bool left = (ke << 1) <= ki && RGB(PE) != RGB(PG) && RGB(PD) != RGB(PG);
+        bool up = ke >= (ki << 1) && RGB(PE) != RGB(PC) && RGB(PB) != RGB(PC);
+
+        if (n == 2) {
+            if (left && up) {
+                E(3) = upscale_xbr_blend(E(3), px, 7, 3);
+                E(2) = upscale_xbr_blend(E(2), px, 1, 2);
+                E(1) = E(2);
+            } else if (left) {
+                E(3) = upscale_xbr_blend(E(3), px, 3, 2);
+                E(2) = upscale_xbr_blend(E(2), px, 1, 2);
+            } else if (up) {
+                E(3) = upscale_xbr_blend(E(3), px, 3, 2);
+                E(1) = upscale_xbr_blend(E(1), px, 1, 2);
+            } else {
+                E(3) = upscale_xbr_half(E(3), px);
+            }
+        } else if (n == 3) {
+            if (left && up) {
+                E(7) = upscale_xbr_blend(E(7), px, 3, 2);
+                E(6) = upscale_xbr_blend(E(6), px, 1, 2);
+                E(5) = E(7);
+                E(2) = E(6);
+                E(8) = px;
+            } else if (left) {
+                E(7) = upscale_xbr_blend(E(7), px, 3, 2);
+                E(5) = upscale_xbr_blend(E(5), px, 1, 2);
+                E(6) = upscale_xbr_blend(E(6), px, 1, 2);
+                E(8) = px;
+            } else if (up) {
+                E(5) = upscale_xbr_blend(E(5), px, 3, 2);
+                E(7) = upscale_xbr_blend(E(7), px, 1, 2);
+                E(2) = upscale_xbr_blend(E(2), px, 1, 2);
+                E(8) = px;
+            } else {
+                E(8) = upscale_xbr_blend(E(8), px, 7, 3);
+                E(5) = upscale_xbr_blend(E(5), px, 1, 3);
+                E(7) = upscale_xbr_blend(E(7), px, 1, 3);
+            }
+        } else {
+            if (left && up) {
+                E(13) = upscale_xbr_blend(E(13), px, 3, 2);
+                E(12) = upscale_xbr_blend(E(12), px, 1, 2);
+                E(15) = E(14) = E(11) = px;
+                E(10) = E(3) = E(12);
+                E(7) = E(13);
+            } else if (left) {
+                E(11) = upscale_xbr_blend(E(11), px, 3, 2);
+                E(13) = upscale_xbr_blend(E(13), px, 3, 2);
+                E(10) = upscale_xbr_blend(E(10), px, 1, 2);
+                E(12) = upscale_xbr_blend(E(12), px, 1, 2);
+                E(14) = E(15) = px;
+            } else if (up) {
+                E(14) = upscale_xbr_blend(E(14), px, 3, 2);
+                E(7) = upscale_xbr_blend(E(7), px, 3, 2);
+                E(10) = upscale_xbr_blend(E(10), px, 1, 2);
+                E(3) = upscale_xbr_blend(E(3), px, 1, 2);
+                E(11) = E(15) = px;
+            } else {
+                E(11) = upscale_xbr_half(E(11), px);
+                E(14) = upscale_xbr_half(E(14), px);
+                E(15) = px;
+            }
+        }
+    } else if (edge <= inside) {
+        E(last) = upscale_xbr_half(E(last), px);
+    }
+#undef EQ
+#undef DF
+#undef E
+#undef RGB
+}
+
+static void upscale_xbr_block(uint32_t factor, const uint32_t *rgb, const uint32_t *yuv, uint32_t *out,
+                              size_t pitch) {
+    uint32_t e[16];
+
+    for (uint32_t k = 0; k < factor * factor; k++) {
+        e[k] = rgb[XBR_PE];
+    }
+
+    /* Bottom right, top right, top left, bottom left */
+    for (int corner = 0; corner < 4; corner++) {
+        upscale_xbr_corner(rgb, yuv, _upscale_xbr_windows[corner], factor, _upscale_xbr_blocks[factor - 2][corner],
+                           e);
+    }
+
+    for (uint32_t y = 0; y < factor; y++) {
+        for (uint32_t x = 0; x < factor; x++) {
+            out[y * pitch + x] = e[y * factor + x];
+        }
+    }
+}
+
+static void upscale_xbr_pixel(const upscale_lines_t *lines, uint32_t width, uint32_t x, uint32_t factor,
+                              uint32_t *out, size_t pitch) {
+    uint32_t rgb[25], yuv[25];
+
+    upscale_xbr_gather(lines, width, x, rgb, yuv);
+    upscale_xbr_block(factor, rgb, yuv, out + x * factor, pitch);
+}
+
+static void upscale_xbr_generic(const upscale_lines_t *lines, uint32_t width, uint32_t factor, uint32_t *out,
+                                size_t pitch) {
+    for (uint32_t x = 0; x < width; x++) {
+        upscale_xbr_pixel(lines, width, x, factor, out, pitch);
+    }
+}
+
+static void upscale_band(void *ctx, size_t band) {
+    const upscale_job_t *job = ctx;
+    uint32_t width = job->width, height = job->height, factor = job->factor;
+    size_t pitch = (size_t) width * factor;
+
+    for (uint32_t y = (uint32_t) (band * height / UPSCALE_BANDS); y < (band + 1) * height / UPSCALE_BANDS; y++) {
+        const uint8_t *above = job->src + (size_t) (y > 0 ? y - 1 : 0) * width;
+        const uint8_t *line = job->src + (size_t) y * width;
+        const uint8_t *below = job->src + (size_t) (y + 1 < height ? y + 1 : y) * width;
+        uint8_t *out = job->dst + (size_t) y * factor * pitch;
+
+        if (factor == 2) {
+            job->impl->scale2x(above, line, below, width, out, out + pitch);
+        } else {
+            job->impl->scale3x(above, line, below, width, out, out + pitch, out + pitch * 2);
+        }
+    }
+}
+
+/* Runs of the same colour are common, their YUV is only worked out once */
+static void upscale_yuv_band(void *ctx, size_t band) {
+    const upscale_job_t *job = ctx;
+    size_t start = band * job->height / UPSCALE_BANDS * job->width;
+    size_t end = (band + 1) * job->height / UPSCALE_BANDS * job->width;
+    const uint32_t *src = (const uint32_t *) job->src;
+    uint32_t last = 0, yuv = upscale_yuv((const uint8_t *) &last);
+
+    for (size_t i = start; i < end; i++) {
+        if (src[i] != last) {
+            last = src[i];
+            yuv = upscale_yuv((const uint8_t *) &src[i]);
+        }
+        job->yuv[i] = yuv;
+    }
+}
+
+static void upscale_rgb_band(void *ctx, size_t band) {
+    const upscale_job_t *job = ctx;
+    uint32_t width = job->width, height = job->height, factor = job->factor;
+    size_t pitch = (size_t) width * factor;
+    const uint32_t *src = (const uint32_t *) job->src;
+    upscale_lines_t lines;
+
+    for (uint32_t y = (uint32_t) (band * height / UPSCALE_BANDS); y < (band + 1) * height / UPSCALE_BANDS; y++) {
+        for (int k = 0; k < 5; k++) {
+            int64_t row = (int64_t) y + k - 2;
+            size_t offset = (size_t) (row < 0 ? 0 : row >= height ? height - 1 : row) * width;
+
+            lines.rgb[k] = src + offset;
+            lines.yuv[k] = job->yuv + offset;
+        }
+
+        job->rgb(&lines, width, factor, (uint32_t *) job->dst + (size_t) y * factor * pitch, pitch);
+    }
+}
+
+static void upscale_pass(upscale_job_t *job, threadpool_t *pool, threadpool_fn_t fn) {
+    if (pool == NULL) {
+        for (size_t band = 0; band < UPSCALE_BANDS; band++) {
+            fn(job, band);
+        }
+        return;
+    }
+
+    threadpool_run(pool, fn, job, UPSCALE_BANDS);
+}
+
+static void upscale_run_with(upscale_t *upscale, const upscale_impl_t *impl, threadpool_t *pool,
+                             const uint8_t *src, uint8_t *dst) {
+    upscale_job_t job = {impl, NULL, upscale_factor(upscale->filter), src, upscale->width, upscale->height, dst,
+                         upscale->yuv};
+
+    switch (upscale->filter) {
+        case UPSCALE_SCALE2X:
+        case UPSCALE_SCALE3X:
+            upscale_pass(&job, pool, upscale_band);
+            break;
+        case UPSCALE_SCALE4X:
+            job.factor = 2;
+            job.dst = upscale->scratch;
+            upscale_pass(&job, pool, upscale_band);
+
+            job.src = upscale->scratch;
+            job.width *= 2;
+            job.height *= 2;
+            job.dst = dst;
+            upscale_pass(&job, pool, upscale_band);
+            break;
+        case UPSCALE_HQ2X:
+        case UPSCALE_HQ3X:
+        case UPSCALE_HQ4X:
+        case UPSCALE_XBR2X:
+        case UPSCALE_XBR3X:
+        case UPSCALE_XBR4X:
+            /* The bands of the second pass read the YUV of their neighbours' lines */
+            job.rgb = upscale->filter >= UPSCALE_XBR2X ? impl->xbr : impl->hqx;
+            upscale_pass(&job, pool, upscale_yuv_band);
+            upscale_pass(&job, pool, upscale_rgb_band);
+            break;
+    }
+}
+
+void upscale_run(upscale_t *upscale, threadpool_t *pool, const uint8_t *src, uint8_t *dst) {
+    pthread_once(&_upscale_once, upscale_init_impl);
+
+    upscale_run_with(upscale, _upscale_impl, pool, src, dst);
+}
+
+void upscale_run_generic(upscale_t *upscale, const uint8_t *src, uint8_t *dst) {
+    pthread_once(&_upscale_once, upscale_init_impl);
+
+    upscale_run_with(upscale, &_upscale_generic, NULL, src, dst);
+}
+
+#ifdef UPSCALE_HAVE_SSSE3
+/* mask ? a : b */
+__attribute__((target("ssse3")))
+static __m128i upscale_select(__m128i mask, __m128i a, __m128i b) {
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+/* The first pixel and the ones too close to the right edge for a whole block are done one by one, to repeat the
+ * border pixels */
+__attribute__((target("ssse3")))
+static void upscale_2x_ssse3(const uint8_t *above, const uint8_t *line, const uint8_t *below, uint32_t width,
+                             uint8_t *out0, uint8_t *out1) {
+    uint32_t x = 1;
+
+    upscale_2x_pixel(above, line, below, width, 0, out0, out1);
+
+    for (; x + 17 <= width; x += 16) {
+        __m128i b = _mm_loadu_si128((const __m128i *) (above + x));
+        __m128i d = _mm_loadu_si128((const __m128i *) (line + x - 1));
+        __m128i e = _mm_loadu_si128((const __m128i *) (line + x));
+        __m128i f = _mm_loadu_si128((const __m128i *) (line + x + 1));
+        __m128i h = _mm_loadu_si128((const __m128i *) (below + x));
+        __m128i same = _mm_or_si128(_mm_cmpeq_epi8(b, h), _mm_cmpeq_epi8(d, f));
+        __m128i e0 = upscale_select(_mm_andnot_si128(same, _mm_cmpeq_epi8(d, b)), d, e);
+        __m128i e1 = upscale_select(_mm_andnot_si128(same, _mm_cmpeq_epi8(b, f)), f, e);
+        __m128i e2 = upscale_select(_mm_andnot_si128(same, _mm_cmpeq_epi8(d, h)), d, e);
+        __m128i e3 = upscale_select(_mm_andnot_si128(same, _mm_cmpeq_epi8(h, f)), f, e);
+
+        _mm_storeu_si128((__m128i *) (out0 + x * 2), _mm_unpacklo_epi8(e0, e1));
+        _mm_storeu_si128((__m128i *) (out0 + x * 2 + 16), _mm_unpackhi_epi8(e0, e1));
+        _mm_storeu_si128((__m128i *) (out1 + x * 2), _mm_unpacklo_epi8(e2, e3));
+        _mm_storeu_si128((__m128i *) (out1 + x * 2 + 16), _mm_unpackhi_epi8(e2, e3));
+    }
+
+    for (; x < width; x++) {
+        upscale_2x_pixel(above, line, below, width, x, out0, out1);
+    }
+}
+
+/* 48 bytes of a0 b0 c0 a1 b1 c1... from 16 of each: each output vector takes a third of its bytes from each input */
+__attribute__((target("ssse3")))
+static void upscale_store3(uint8_t *out, __m128i a, __m128i b, __m128i c) {
+    const __m128i a0 = _mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5);
+    const __m128i b0 = _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1);
+    const __m128i c0 = _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1);
+    const __m128i a1 = _mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1);
+    const __m128i b1 = _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10);
+    const __m128i c1 = _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1);
+    const __m128i a2 = _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1);
+    const __m128i b2 = _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1);
+    const __m128i c2 = _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15);
+
+    _mm_storeu_si128((__m128i *) out, _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, a0), _mm_shuffle_epi8(b, b0)),
+                                                   _mm_shuffle_epi8(c, c0)));
+    _mm_storeu_si128((__m128i *) (out + 16), _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, a1),
+                                                                       _mm_shuffle_epi8(b, b1)),
+                                                          _mm_shuffle_epi8(c, c1)));
+    _mm_storeu_si128((__m128i *) (out + 32), _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, a2),
+                                                                       _mm_shuffle_epi8(b, b2)),
+                                                          _mm_shuffle_epi8(c, c2)));
+}
+
+__attribute__((target("ssse3")))
+static void upscale_3x_ssse3(const uint8_t *above, const uint8_t *line, const uint8_t *below, uint32_t width,
+                             uint8_t *out0, uint8_t *out1, uint8_t *out2) {
+    uint32_t x = 1;
+
+    upscale_3x_pixel(above, line, below, width, 0, out0, out1, out2);
+
+    for (; x + 17 <= width; x += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (above + x - 1));
+        __m128i b = _mm_loadu_si128((const __m128i *) (above + x));
+        __m128i c = _mm_loadu_si128((const __m128i *) (above + x + 1));
+        __m128i d = _mm_loadu_si128((const __m128i *) (line + x - 1));
+        __m128i e = _mm_loadu_si128((const __m128i *) (line + x));
+        __m128i f = _mm_loadu_si128((const __m128i *) (line + x + 1));
+        __m128i g = _mm_loadu_si128((const __m128i *) (below + x - 1));
+        __m128i h = _mm_loadu_si128((const __m128i *) (below + x));
+        __m128i i = _mm_loadu_si128((const __m128i *) (below + x + 1));
+        __m128i same = _mm_or_si128(_mm_cmpeq_epi8(b, h), _mm_cmpeq_epi8(d, f));
+        __m128i db = _mm_andnot_si128(same, _mm_cmpeq_epi8(d, b));
+        __m128i bf = _mm_andnot_si128(same, _mm_cmpeq_epi8(b, f));
+        __m128i dh = _mm_andnot_si128(same, _mm_cmpeq_epi8(d, h));
+        __m128i hf = _mm_andnot_si128(same, _mm_cmpeq_epi8(h, f));
+        __m128i ea = _mm_cmpeq_epi8(e, a), ec = _mm_cmpeq_epi8(e, c);
+        __m128i eg = _mm_cmpeq_epi8(e, g), ei = _mm_cmpeq_epi8(e, i);
+
+        upscale_store3(out0 + x * 3, upscale_select(db, d, e),
+                       upscale_select(_mm_or_si128(_mm_andnot_si128(ec, db), _mm_andnot_si128(ea, bf)), b, e),
+                       upscale_select(bf, f, e));
+        upscale_store3(out1 + x * 3,
+                       upscale_select(_mm_or_si128(_mm_andnot_si128(eg, db), _mm_andnot_si128(ea, dh)), d, e), e,
+                       upscale_select(_mm_or_si128(_mm_andnot_si128(ei, bf), _mm_andnot_si128(ec, hf)), f, e));
+        upscale_store3(out2 + x * 3, upscale_select(dh, d, e),
+                       upscale_select(_mm_or_si128(_mm_andnot_si128(ei, dh), _mm_andnot_si128(eg, hf)), h, e),
+                       upscale_select(hf, f, e));
+    }
+
+    for (; x < width; x++) {
+        upscale_3x_pixel(above, line, below, width, x, out0, out1, out2);
+    }
+}
+
+/* The first pixel and the ones too close to the right edge for 4 whole neighbourhoods are done one by one */
+__attribute__((target("ssse3")))
+static void upscale_hqx_ssse3(const upscale_lines_t *lines, uint32_t width, uint32_t factor, uint32_t *out,
+                              size_t pitch) {
+    const __m128i threshold = _mm_set1_epi32(48 << 16 | 7 << 8 | 6);
+    uint32_t x = 1;
+
+    upscale_hq_pixel(lines, width, 0, factor, out, pitch);
+
+    for (; x + 5 <= width; x += 4) {
+        __m128i c = _mm_loadu_si128((const __m128i *) (lines->rgb[2] + x));
+        __m128i cy = _mm_loadu_si128((const __m128i *) (lines->yuv[2] + x));
+        __m128i flat = _mm_set1_epi32(-1), pattern = _mm_setzero_si128();
+        uint32_t patterns[4];
+        int same;
+
+        for (int n = 0; n < 9; n++) {
+            __m128i w, y, far;
+
+            if (n == 4) {
+                continue;
+            }
+            w = _mm_loadu_si128((const __m128i *) (lines->rgb[n / 3 + 1] + x + n % 3 - 1));
+            y = _mm_loadu_si128((const __m128i *) (lines->yuv[n / 3 + 1] + x + n % 3 - 1));
+            far = _mm_subs_epu8(_mm_or_si128(_mm_subs_epu8(y, cy), _mm_subs_epu8(cy, y)), threshold);
+            flat = _mm_and_si128(flat, _mm_cmpeq_epi32(w, c));
+            pattern = _mm_or_si128(pattern, _mm_andnot_si128(_mm_cmpeq_epi32(far, _mm_setzero_si128()),
+                                                             _mm_set1_epi32(1 << UPSCALE_HQ_BIT[n])));
+        }
+
+        same = _mm_movemask_ps(_mm_castsi128_ps(flat));
+        _mm_storeu_si128((__m128i *) patterns, pattern);
+        for (uint32_t lane = 0; lane < 4; lane++) {
+            uint32_t w[9], yuv[9];
+
+            if (same >> lane & 1) {
+                upscale_fill(out + (x + lane) * factor, pitch, factor, lines->rgb[2][x + lane]);
+                continue;
+            }
+            upscale_hq_gather(lines, width, x + lane, w, yuv);
+            upscale_hq_block(factor, w, yuv, patterns[lane], out + (x + lane) * factor, pitch);
+        }
+    }
+
+    for (; x < width; x++) {
+        upscale_hq_pixel(lines, width, x, factor, out, pitch);
+    }
+}
+
+/* A corner is only looked at when the pixel differs from both neighbours on its sides */
+__attribute__((target("ssse3")))
+static void upscale_xbr_ssse3(const upscale_lines_t *lines, uint32_t width, uint32_t factor, uint32_t *out,
+                              size_t pitch) {
+    uint32_t x = 1;
+
+    upscale_xbr_pixel(lines, width, 0, factor, out, pitch);
+
+    for (; x + 5 <= width; x += 4) {
+        __m128i e = _mm_loadu_si128((const __m128i *) (lines->rgb[2] + x));
+        __m128i b = _mm_cmpeq_epi32(e, _mm_loadu_si128((const __m128i *) (lines->rgb[1] + x)));
+        __m128i d = _mm_cmpeq_epi32(e, _mm_loadu_si128((const __m128i *) (lines->rgb[2] + x - 1)));
+        __m128i f = _mm_cmpeq_epi32(e, _mm_loadu_si128((const __m128i *) (lines->rgb[2] + x + 1)));
+        __m128i h = _mm_cmpeq_epi32(e, _mm_loadu_si128((const __m128i *) (lines->rgb[3] + x)));
+        /* Every corner has a side equal to the pixel */
+        __m128i flat = _mm_and_si128(_mm_and_si128(_mm_or_si128(h, f), _mm_or_si128(f, b)),
+                                     _mm_and_si128(_mm_or_si128(b, d), _mm_or_si128(d, h)));
+        int same = _mm_movemask_ps(_mm_castsi128_ps(flat));
+
+        for (uint32_t lane = 0; lane < 4; lane++) {
+            if (same >> lane & 1) {
+                upscale_fill(out + (x + lane) * factor, pitch, factor, lines->rgb[2][x + lane]);
+            } else {
+                upscale_xbr_pixel(lines, width, x + lane, factor, out, pitch);
+            }
+        }
+    }
+
+    for (; x < width; x++) {
+        upscale_xbr_pixel(lines, width, x, factor, out, pitch);
+    }
+}
+#endif
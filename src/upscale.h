@@ -0,0 +1,69 @@
+#ifndef __UPSCALE_H__
+#define __UPSCALE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "types.h"
+#include "threadpool.h"
+
+/* Pixel art upscalers. Scale2x, Scale3x and Scale4x (Scale2x twice), as defined by AdvanceMAME, work on frames of
+ * palette indexes: each output block depends on the pixel and its 8 neighbours being equal or not, so the results are
+ * exactly the reference ones, and palette conversion can come after. HQ2x, HQ3x and HQ4x (Maxim Stepin's hqx) and
+ * xBR 2x, 3x and 4x (Hyllian's, as FFmpeg's xbr filter has it) blend colours, so they work on the RGBA pixels of
+ * palette_convert (PALETTE_RGBA): HQx picks one of its blends from which of the 8 neighbours are far from the pixel in
+ * YUV, xBR rounds off the corners whose edges are the straightest in a 5x5 window. Edges repeat the border pixels.
+ *
+ * Uses SSSE3 when the CPU supports it: the equalities of 16 pixels at a time with PCMPEQB, the blocks picked with
+ * masks and interleaved into the output lines, plain loops otherwise. For HQx and xBR, the YUV distances and
+ * equalities of 4 pixels at a time find those of a flat area, whose blocks are filled without going through the
+ * rules. Bands of source lines are spread over a thread pool. */
+
+#define UPSCALE_BANDS 16
+
+enum upscale_filter {
+    UPSCALE_SCALE2X,
+    UPSCALE_SCALE3X,
+    UPSCALE_SCALE4X,
+    UPSCALE_HQ2X,
+    UPSCALE_HQ3X,
+    UPSCALE_HQ4X,
+    UPSCALE_XBR2X,
+    UPSCALE_XBR3X,
+    UPSCALE_XBR4X
+};
+typedef enum upscale_filter upscale_filter_t;
+
+struct upscale_s {
+    upscale_filter_t filter;
+    uint32_t width;
+    uint32_t height;
+    /* Scale2x output, the input of the second pass of Scale4x */
+    uint8_t *scratch;
+    /* Y << 16 | U << 8 | V of each source pixel, for HQx and xBR */
+    uint32_t *yuv;
+};
+typedef struct upscale_s upscale_t;
+
+/* For width x height frames. Returns NULL if the filter is unknown. */
+upscale_t *upscale_init(upscale_filter_t filter, uint32_t width, uint32_t height);
+void upscale_free(upscale_t *upscale);
+
+/* How many times wider and taller the output is */
+uint32_t upscale_factor(upscale_filter_t filter);
+
+/* Bytes per pixel of the frames: 1 for the palette indexes of the Scale family, 4 for the RGBA pixels of HQx and xBR */
+uint32_t upscale_pixel_size(upscale_filter_t filter);
+
+/* dst gets factor * width x factor * height pixels. The RGBA frames of HQx and xBR must be 4 byte aligned. pool may be
+ * NULL to run on the calling thread only. */
+void upscale_run(upscale_t *upscale, threadpool_t *pool, const uint8_t *src, uint8_t *dst);
+
+/* Portable implementation on the calling thread, always available. Used as a reference by the tests. */
+void upscale_run_generic(upscale_t *upscale, const uint8_t *src, uint8_t *dst);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __UPSCALE_H__ */
@@ -1,18 +1,77 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/wait.h>
 
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "acidnes.h"
 #include "cpu.h"
 #include "cartridge.h"
+#include "common.h"
+#include "crc32.h"
+#include "log.h"
+#include "luma.h"
 #include "mapper.h"
+#include "nes.h"
+#include "ntsc.h"
+#include "pacer.h"
+#include "palette.h"
+#include "png.h"
 #include "ppu.h"
+#include "profiler.h"
+#include "ram_gather.h"
+#include "recorder.h"
+#include "threadpool.h"
+#include "trace.h"
+#include "trace_check.h"
+#include "upscale.h"
 
-void dump_cpu(cpu_t *cpu);
+int check_rom(const char *rom, const char *log);
+uint8_t *build_rom(uint8_t mapper_type, uint8_t nb_16k_rom_banks, uint8_t nb_8k_vrom_banks, size_t *size);
+acidnes_t *library_console(uint32_t frames);
+acidnes_t *emphasis_console(uint32_t frames, cartridge_t **cart, nes_t **reference);
 
 int test_1_nestest();
+int test_2_cartridge_cache();
+int test_3_crc32();
+int test_4_mappers();
+int test_5_mmc3();
+int test_6_ppu();
+int test_7_mmc5();
+int test_8_battery_save();
+int test_9_trace();
+int test_10_nes();
+int test_11_cpu_stats();
+int test_12_profiler();
+int test_13_recorder();
+int test_14_log();
+int test_15_pacer();
+int test_16_frameskip();
+int test_17_library();
+int test_18_threadpool();
+int test_19_ram_gather();
+int test_20_luma();
+int test_21_palette();
+int test_22_ntsc();
+int test_23_upscale();
+int test_24_png();
 
-int main() {
+/* With a ROM and its reference log, only checks the CPU trace of that ROM */
+int main(int argc, char **argv) {
     int fails = 0;
     int err;
 
+    if (argc == 3) {
+        return check_rom(argv[1], argv[2]);
+    }
+
     if ((err = test_1_nestest())) {
         fails++;
         fprintf(stderr, "test_1_nestest: FAIL (0x%04x)\n", err);
@@ -20,21 +79,229 @@ int main() {
         fprintf(stderr, "test_1_nestest: OK\n");
     }
 
+    if ((err = test_2_cartridge_cache())) {
+        fails++;
+        fprintf(stderr, "test_2_cartridge_cache: FAIL (0x%04x)\n", err);
+    } else {
+        fprintf(stderr, "test_2_cartridge_cache: OK\n");
+    }
+
+    if ((err = test_3_crc32())) {
+        fails++;
+        fprintf(stderr, "test_3_crc32: FAIL (0x%04x)\n", err);
+    } else {
+        fprintf(stderr, "test_3_crc32: OK\n");
+    }
+
+    if ((err = test_4_mappers())) {
+        fails++;
+        fprintf(stderr, "test_4_mappers: FAIL (0x%04x)\n", err);
+    } else {
+        fprintf(stderr, "test_4_mappers: OK\n");
+    }
+
+    if ((err = test_5_mmc3())) {
+        fails++;
+        fprintf(stderr, "test_5_mmc3: FAIL (0x%04x)\n", err);
+    } else {
+        fprintf(stderr, "test_5_mmc3: OK\n");
+    }
+
+    if ((err = test_6_ppu())) {
+        fails++;
+        fprintf(stderr, "test_6_ppu: FAIL (0x%04x)\n", err);
+    } else {
+        fprintf(stderr, "test_6_ppu: OK\n");
+    }
+
+    if ((err = test_7_mmc5())) {
+        fails++;
+        fprintf(stderr, "test_7_mmc5: FAIL (0x%04x)\n", err);
+    } else {
+        fprintf(stderr, "test_7_mmc5: OK\n");
+    }
+
+    if ((err = test_8_battery_save())) {
+        fails++;
+        fprintf(stderr, "test_8_battery_save: FAIL (0x%04x)\n", err);
+    } else {
+        fprintf(stderr, "test_8_battery_save: OK\n");
+    }
+
+    if ((err = test_9_trace())) {
+        fails++;
+        fprintf(stderr, "test_9_trace: FAIL (0x%04x)\n", err);
+    } else {
+        fprintf(stderr, "test_9_trace: OK\n");
+    }
+
+    if ((err = test_10_nes())) {
+        fails++;
+        fprintf(stderr, "test_10_nes: FAIL (0x%04x)\n", err);
+    } else {
+        fprintf(stderr, "test_10_nes: OK\n");
+    }
+
+    if ((err = test_11_cpu_stats())) {
+        fails++;
+        fprintf(stderr, "test_11_cpu_stats: FAIL (0x%04x)\n", err);
+    } else {
+        fprintf(stderr, "test_11_cpu_stats: OK\n");
+    }
+
+    if ((err = test_12_profiler())) {
+        fails++;
+        fprintf(stderr, "test_12_profiler: FAIL (0x%04x)\n", err);
+    } else {
+        fprintf(stderr, "test_12_profiler: OK\n");
+    }
+
+    if ((err = test_13_recorder())) {
+        fails++;
+        fprintf(stderr, "test_13_recorder: FAIL (0x%04x)\n", err);
+    } else {
+        fprintf(stderr, "test_13_recorder: OK\n");
+    }
+
+    if ((err = test_14_log())) {
+        fails++;
+        fprintf(stderr, "test_14_log: FAIL (0x%04x)\n", err);
+    } else {
+        fprintf(stderr, "test_14_log: OK\n");
+    }
+
+    if ((err = test_15_pacer())) {
+        fails++;
+        fprintf(stderr, "test_15_pacer: FAIL (0x%04x)\n", err);
+    } else {
+        fprintf(stderr, "test_15_pacer: OK\n");
+    }
+
+    if ((err = test_16_frameskip())) {
+        fails++;
+        fprintf(stderr, "test_16_frameskip: FAIL (0x%04x)\n", err);
+    } else {
+        fprintf(stderr, "test_16_frameskip: OK\n");
+    }
+
+    if ((err = test_17_library())) {
+        fails++;
+        fprintf(stderr, "test_17_library: FAIL (0x%04x)\n", err);
+    } else {
+        fprintf(stderr, "test_17_library: OK\n");
+    }
+
+    if ((err = test_18_threadpool())) {
+        fails++;
+        fprintf(stderr, "test_18_threadpool: FAIL (0x%04x)\n", err);
+    } else {
+        fprintf(stderr, "test_18_threadpool: OK\n");
+    }
+
+    if ((err = test_19_ram_gather())) {
+        fails++;
+        fprintf(stderr, "test_19_ram_gather: FAIL (0x%04x)\n", err);
+    } else {
+        fprintf(stderr, "test_19_ram_gather: OK\n");
+    }
+
+    if ((err = test_20_luma())) {
+        fails++;
+        fprintf(stderr, "test_20_luma: FAIL (0x%04x)\n", err);
+    } else {
+        fprintf(stderr, "test_20_luma: OK\n");
+    }
+
+    if ((err = test_21_palette())) {
+        fails++;
+        fprintf(stderr, "test_21_palette: FAIL (0x%04x)\n", err);
+    } else {
+        fprintf(stderr, "test_21_palette: OK\n");
+    }
+
+    if ((err = test_22_ntsc())) {
+        fails++;
+        fprintf(stderr, "test_22_ntsc: FAIL (0x%04x)\n", err);
+    } else {
+        fprintf(stderr, "test_22_ntsc: OK\n");
+    }
+
+    if ((err = test_23_upscale())) {
+        fails++;
+        fprintf(stderr, "test_23_upscale: FAIL (0x%04x)\n", err);
+    } else {
+        fprintf(stderr, "test_23_upscale: OK\n");
+    }
+
+    if ((err = test_24_png())) {
+        fails++;
+        fprintf(stderr, "test_24_png: FAIL (0x%04x)\n", err);
+    } else {
+        fprintf(stderr, "test_24_png: OK\n");
+    }
+
     return fails > 0 ? 1 : 0;
 }
 
+int check_rom(const char *rom, const char *log) {
+    cpu_t *cpu;
+    ppu_t *ppu;
+    mapper_t *mapper;
+    cartridge_t *cart;
+    trace_check_t *check;
+    size_t left;
+
+    check = trace_check_load(log);
+    cart = cartridge_load(rom);
+    if (check == NULL || cart == NULL || (mapper = mapper_init(cart)) == NULL) {
+        return 1;
+    }
+
+    cpu = cpu_init();
+    ppu = ppu_init();
+    cpu->mapper = mapper;
+    cpu->ppu = ppu;
+    mapper->ppu = ppu;
+    cpu_reset(cpu);
+
+    trace_check_start(check, cpu);
+    left = trace_check_run(check, cpu);
+
+    fprintf(stderr, "%s: %lu / %lu instructions match\n", rom, (unsigned long) (check->count - left),
+            (unsigned long) check->count);
+
+    ppu_free(ppu);
+    cpu_free(cpu);
+    mapper_free(mapper);
+    cartridge_free(cart);
+    trace_check_free(check);
+
+    return left > 0 ? 1 : 0;
+}
+
 int test_1_nestest() {
     cpu_t *cpu;
     ppu_t *ppu;
+    mapper_t *mapper;
     cartridge_t *cart;
+    trace_check_t *check;
+    size_t left;
+
+    /* The original nestest.log, in the Nintendulator format */
+    check = trace_check_load("tests/nestest-full-output.txt");
+    if (check == NULL) {
+        return 1;
+    }
 
     cart = cartridge_load("tests/nestest.nes");
     if (cart == NULL) {
         return 1;
     }
 
-    mapper_init(cart->mapper_type, cart->rom, cart->nb_16k_rom_banks * 0x4000, cart->vrom,
-                cart->nb_8k_vrom_banks * 0x2000);
+    mapper = mapper_init(cart);
+    if (mapper == NULL) {
+        return 1;
+    }
 
     cpu = cpu_init();
     if (cpu == NULL) {
@@ -42,6 +309,7 @@ int test_1_nestest() {
         return 1;
     }
 
+    cpu->mapper = mapper;
     cpu_reset(cpu);
 
     ppu = ppu_init();
@@ -51,44 +319,2781 @@ int test_1_nestest() {
     }
 
     cpu->ppu = ppu;
-    cpu->PC = 0xc000;
-    cpu->clock = 7; /* TODO: Figure out why it starts at 7 */
 
-    for (;;) {
-        dump_cpu(cpu);
+    /* Automation mode: starts at $C000 and returns to $0001 at the end */
+    trace_check_start(check, cpu);
+    left = trace_check_run(check, cpu);
 
-        cpu_tick(cpu);
+    uint16_t status_code = (uint16_t) (cpu->ram[0x02] << 8u) | cpu->ram[0x03];
 
-        if (cpu->PC == 0x0001) {
-            break;
+    ppu_free(ppu);
+    cpu_free(cpu);
+    mapper_free(mapper);
+    cartridge_free(cart);
+    trace_check_free(check);
+
+    if (left > 0) {
+        return 0x100;
+    }
+
+    return status_code;
+}
+
+int test_2_cartridge_cache() {
+    cartridge_t *a, *b, cart;
+    uint8_t header[16] = {0};
+    const uint8_t *tiles;
+    int err = 0;
+
+    a = cartridge_load("tests/nestest.nes");
+    b = cartridge_load("tests/nestest.nes");
+    if (a == NULL || b == NULL) {
+        return 1;
+    }
+
+    if (a != b || a->refcount != 2) {
+        err = 2;
+    } else if (a->crc != 0x158b0388) {
+        err = 3;
+    }
+
+    tiles = cartridge_get_chr_tiles(a);
+    if (tiles == NULL || tiles != cartridge_get_chr_tiles(b)) {
+        err = 4;
+    }
+
+    cartridge_free(b);
+    if (a->refcount != 1) {
+        err = 5;
+    }
+    cartridge_free(a);
+
+    /* NES 2.0 exponent sizes: 2^30 * 7 bytes doesn't fit in 32 bits, 2^20 * 3 does */
+    memcpy(header, "NES\x1a", 4);
+    header[7] = 0x08;
+    header[9] = 0x0f;
+    header[4] = 30 << 2 | 3;
+    if (cartridge_parse_header(&cart, header)) {
+        err = 6;
+    }
+    header[4] = 20 << 2 | 1;
+    if (!cartridge_parse_header(&cart, header) || cart.prg_rom_size != 3 << 20) {
+        err = 7;
+    }
+
+    return err;
+}
+
+int test_3_crc32() {
+    uint8_t data[1000];
+
+    if (crc32_update(0, "123456789", 9) != 0xcbf43926) {
+        return 1;
+    }
+
+    for (int i = 0; i < (int) sizeof(data); i++) {
+        data[i] = (uint8_t) (i * 7 + 3);
+    }
+
+    /* The accelerated path must match the table driven one for every length and alignment */
+    for (int size = 0; size < 300; size++) {
+        for (int offset = 0; offset < 4; offset++) {
+            uint32_t crc = crc32_update(0, data + offset, size);
+
+            if (crc != crc32_update_generic(0, data + offset, size)) {
+                return 0x100 + size;
+            }
+
+            if (crc != crc32_update(crc32_update(0, data + offset, size / 3), data + offset + size / 3,
+                                    size - size / 3)) {
+                return 0x200 + size;
+            }
         }
     }
 
-    uint16_t status_code = (uint16_t) (cpu->ram[0x02] << 8u) | cpu->ram[0x03];
+    return 0;
+}
+
+/* Checks the page each CPU / PPU window points to after bank switches. Every 8K PRG page and 1K CHR page of the
+ * test ROMs starts with its own index. */
+int test_4_mappers() {
+    cpu_t *cpu = cpu_init();
+    cartridge_t *cart;
+    mapper_t *mapper;
+    uint8_t *rom, *state;
+    size_t size;
+    int err = 0;
+
+    if (cpu == NULL) {
+        return 1;
+    }
+
+    /* UxROM, 128K: 16K bank at $8000, last bank fixed at $C000 */
+    rom = build_rom(2, 8, 0, &size);
+    cart = cartridge_load_mem(rom, size);
+    mapper = mapper_init(cart);
+    cpu->mapper = mapper;
+
+    cpu_set_u8(cpu, 0x8000, 3);
+    if (cpu_get_u8(cpu, 0x8000) != 6 || cpu_get_u8(cpu, 0xa000) != 7 || cpu_get_u8(cpu, 0xc000) != 14
+        || cpu_get_u8(cpu, 0xe000) != 15) {
+        err = 0x10;
+    }
+
+    /* CHR RAM is writable */
+    mapper_set_chr_u8(mapper, 0x1234, 0x42);
+    if (mapper_get_chr_u8(mapper, 0x1234) != 0x42) {
+        err = 0x11;
+    }
+
+    mapper_free(mapper);
+    cartridge_free(cart);
+    free(rom);
+
+    /* CNROM, 32K CHR */
+    rom = build_rom(3, 2, 4, &size);
+    cart = cartridge_load_mem(rom, size);
+    mapper = mapper_init(cart);
+    cpu->mapper = mapper;
+
+    cpu_set_u8(cpu, 0xffff, 2);
+    if (mapper_get_chr_u8(mapper, 0x0000) != 16 || mapper_get_chr_u8(mapper, 0x1c00) != 23) {
+        err = 0x20;
+    }
+
+    /* CHR ROM is not */
+    mapper_set_chr_u8(mapper, 0x0000, 0x42);
+    if (mapper_get_chr_u8(mapper, 0x0000) != 16) {
+        err = 0x21;
+    }
+
+    mapper_free(mapper);
+    cartridge_free(cart);
+    free(rom);
+
+    /* AxROM, 256K: 32K banks and single screen mirroring */
+    rom = build_rom(7, 16, 0, &size);
+    cart = cartridge_load_mem(rom, size);
+    mapper = mapper_init(cart);
+    cpu->mapper = mapper;
+
+    cpu_set_u8(cpu, 0x8000, 0x15);
+    if (cpu_get_u8(cpu, 0x8000) != 20 || cpu_get_u8(cpu, 0xe000) != 23 || mapper->mirroring != MIRROR_SINGLE_HIGH) {
+        err = 0x30;
+    }
+
+    mapper_free(mapper);
+    cartridge_free(cart);
+    free(rom);
+
+    /* MMC1, 256K PRG, 128K CHR */
+    rom = build_rom(1, 16, 16, &size);
+    cart = cartridge_load_mem(rom, size);
+    mapper = mapper_init(cart);
+    cpu->mapper = mapper;
+
+    if (cpu_get_u8(cpu, 0xc000) != 30) {
+        err = 0x40;
+    }
+
+    /* PRG bank 5 at $8000, written one bit at a time */
+    for (int i = 0; i < 5; i++) {
+        cpu_set_u8(cpu, 0xe000, (uint8_t) (5 >> i));
+    }
+
+    if (cpu_get_u8(cpu, 0x8000) != 10 || cpu_get_u8(cpu, 0xc000) != 30) {
+        err = 0x41;
+    }
+
+    /* Control: vertical mirroring, PRG mode 2, 4K CHR banks; CHR bank 1 = 7 */
+    for (int i = 0; i < 5; i++) {
+        cpu_set_u8(cpu, 0x8000, (uint8_t) (0x1a >> i));
+    }
+    for (int i = 0; i < 5; i++) {
+        cpu_set_u8(cpu, 0xc000, (uint8_t) (7 >> i));
+    }
+
+    if (cpu_get_u8(cpu, 0x8000) != 0 || cpu_get_u8(cpu, 0xc000) != 10 || mapper_get_chr_u8(mapper, 0x1000) != 28
+        || mapper->mirroring != MIRROR_VERTICAL) {
+        err = 0x42;
+    }
+
+    /* Save, switch, then restore */
+    state = malloc(mapper_state_size(mapper));
+    mapper_save_state(mapper, state);
+
+    cpu_set_u8(cpu, 0x8000, 0x80);
+    for (int i = 0; i < 5; i++) {
+        cpu_set_u8(cpu, 0xe000, (uint8_t) (1 >> i));
+    }
+
+    if (cpu_get_u8(cpu, 0x8000) != 2) {
+        err = 0x43;
+    }
+
+    if (!mapper_load_state(mapper, state, mapper_state_size(mapper)) || cpu_get_u8(cpu, 0xc000) != 10
+        || mapper_get_chr_u8(mapper, 0x1000) != 28) {
+        err = 0x44;
+    }
+
+    /* Read-modify-write instructions: the unchanged value counts, the write on the next cycle doesn't. PRG mode 2,
+     * bank 5 at $C000. */
+    for (int i = 0; i < 5; i++) {
+        cpu_modify_u8(cpu, 0xe000, (uint8_t) ((5 >> i) & 1), (uint8_t) (~(5 >> i) & 1));
+    }
+    if (cpu_get_u8(cpu, 0xc000) != 10) {
+        err = 0x45;
+    }
+
+    /* INC on a ROM byte with bit 7 set resets the shift register, back to PRG mode 3 with bank 3 at $8000 */
+    cpu_modify_u8(cpu, 0x8000, 0xff, 0x00);
+    for (int i = 0; i < 5; i++) {
+        cpu_set_u8(cpu, 0xe000, (uint8_t) (3 >> i));
+    }
+    if (cpu_get_u8(cpu, 0x8000) != 6 || cpu_get_u8(cpu, 0xc000) != 30) {
+        err = 0x46;
+    }
+
+    free(state);
+    mapper_free(mapper);
+    cartridge_free(cart);
+    free(rom);
 
-    ppu_free(ppu);
     cpu_free(cpu);
-    mapper_free();
+
+    return err;
+}
+
+/* MMC3 banking, and the predicted IRQ against a counter clocked on every A12 edge, dot by dot */
+int test_5_mmc3() {
+    cpu_t *cpu = cpu_init();
+    ppu_t *ppu = ppu_init();
+    cartridge_t *cart;
+    mapper_t *mapper;
+    uint8_t *rom;
+    size_t size;
+    int err = 0;
+
+    uint8_t latch = 20, counter = 0;
+    bool reload = FALSE, enabled = FALSE, pending = FALSE;
+    uint64_t ack_dot = 0;
+    int nb_irqs = 0;
+
+    if (cpu == NULL || ppu == NULL) {
+        return 1;
+    }
+
+    /* 256K PRG, 128K CHR */
+    rom = build_rom(4, 16, 16, &size);
+    cart = cartridge_load_mem(rom, size);
+    mapper = mapper_init(cart);
+    cpu->mapper = mapper;
+    cpu->ppu = ppu;
+    ppu->mapper = mapper;
+    mapper->ppu = ppu;
+
+    /* R6 = 5, R7 = 9, PRG mode 0 */
+    cpu_set_u8(cpu, 0x8000, 0x06);
+    cpu_set_u8(cpu, 0x8001, 5);
+    cpu_set_u8(cpu, 0x8000, 0x07);
+    cpu_set_u8(cpu, 0x8001, 9);
+
+    if (cpu_get_u8(cpu, 0x8000) != 5 || cpu_get_u8(cpu, 0xa000) != 9 || cpu_get_u8(cpu, 0xc000) != 30
+        || cpu_get_u8(cpu, 0xe000) != 31) {
+        err = 0x10;
+    }
+
+    /* PRG mode 1 swaps $8000 and $C000; CHR mode 1 puts the 2K banks at $1000. R0 = 8, R2 = 3. */
+    cpu_set_u8(cpu, 0x8000, 0xc0);
+    cpu_set_u8(cpu, 0x8001, 8);
+    cpu_set_u8(cpu, 0x8000, 0xc2);
+    cpu_set_u8(cpu, 0x8001, 3);
+    cpu_set_u8(cpu, 0xa000, 1);
+
+    if (cpu_get_u8(cpu, 0x8000) != 30 || cpu_get_u8(cpu, 0xc000) != 5 || mapper_get_chr_u8(mapper, 0x1000) != 8
+        || mapper_get_chr_u8(mapper, 0x1400) != 9 || mapper_get_chr_u8(mapper, 0x0000) != 3
+        || mapper->mirroring != MIRROR_HORIZONTAL) {
+        err = 0x11;
+    }
+
+    /* Sprites at $1000, rendering on */
+    cpu_set_u8(cpu, 0x2000, 0x08);
+    cpu_set_u8(cpu, 0x2001, 0x18);
+    cpu_set_u8(cpu, 0xc000, latch);
+    cpu_set_u8(cpu, 0xc001, 0);
+    cpu_set_u8(cpu, 0xe001, 0);
+    reload = TRUE;
+    enabled = TRUE;
+
+    while (ppu->dot < 8 * PPU_DOTS_PER_FRAME && !err) {
+        uint16_t event_pos = 0;
+
+        ppu_tick(ppu);
+
+        if (ppu->mask & 0x18) {
+            switch (ppu->ctrl & 0x18) {
+                case 0x08: event_pos = PPU_A12_RISE_POS; break;
+                case 0x10: event_pos = PPU_A12_RISE_POS_BG; break;
+            }
+        }
+
+        if (event_pos && ppu->line_position == event_pos
+            && (ppu->scanline < PPU_VBLANK_SCANLINE || ppu->scanline == PPU_LAST_SCANLINE)) {
+            if (counter == 0 || reload) {
+                counter = latch;
+                reload = FALSE;
+            } else {
+                counter--;
+            }
+
+            if (counter == 0 && enabled) {
+                pending = TRUE;
+            }
+        }
+
+        if ((ppu->dot >= mapper->irq_dot) != pending) {
+            fprintf(stderr, "MMC3 IRQ mismatch at dot %lu: scheduled at %lu, expected %d\n",
+                    (unsigned long) ppu->dot, (unsigned long) mapper->irq_dot, pending);
+            err = 0x20;
+        }
+
+        /* Acknowledge a while after each IRQ, with a new latch value each time, 0 included */
+        if (pending && ack_dot == 0) {
+            ack_dot = ppu->dot + 500;
+        } else if (pending && ppu->dot == ack_dot) {
+            nb_irqs++;
+            latch = (uint8_t) ((nb_irqs * 7) % 40);
+
+            cpu_set_u8(cpu, 0xe000, 0);
+            cpu_set_u8(cpu, 0xc000, latch);
+            cpu_set_u8(cpu, 0xe001, 0);
+            pending = FALSE;
+            ack_dot = 0;
+
+            if (nb_irqs % 5 == 0) {
+                cpu_set_u8(cpu, 0xc001, 0);
+                counter = 0;
+                reload = TRUE;
+            }
+        }
+
+        /* Move the events around: background at $1000, both tables at $0000, rendering off */
+        switch (ppu->dot) {
+            case 2 * PPU_DOTS_PER_FRAME + 1000: cpu_set_u8(cpu, 0x2000, 0x10); break;
+            case 3 * PPU_DOTS_PER_FRAME + 50000: cpu_set_u8(cpu, 0x2000, 0x00); break;
+            case 4 * PPU_DOTS_PER_FRAME: cpu_set_u8(cpu, 0x2000, 0x08); break;
+            case 5 * PPU_DOTS_PER_FRAME + 20000: cpu_set_u8(cpu, 0x2001, 0x00); break;
+            case 6 * PPU_DOTS_PER_FRAME + 7000: cpu_set_u8(cpu, 0x2001, 0x10); break;
+        }
+    }
+
+    if (!err && nb_irqs < 20) {
+        err = 0x21;
+    }
+
+    mapper_free(mapper);
     cartridge_free(cart);
+    free(rom);
 
-    return status_code;
+    ppu_free(ppu);
+    cpu_free(cpu);
+
+    return err;
 }
 
-void dump_cpu(cpu_t *cpu) {
-    uint8_t p = cpu->P & (uint8_t) ~((uint8_t) U);
-    uint8_t op = cpu_get_u8(cpu, cpu->PC);
-    char flags[9];
+/* Registers, VRAM access and a rendered frame with a background and sprite 0 */
+int test_6_ppu() {
+    cpu_t *cpu = cpu_init();
+    ppu_t *ppu = ppu_init();
+    cartridge_t *cart;
+    mapper_t *mapper;
+    uint8_t *rom, *chr;
+    size_t size;
+    int err = 0;
+
+    if (cpu == NULL || ppu == NULL) {
+        return 1;
+    }
 
-    flags[0] = p & (uint8_t) N ? 'N' : '-';
-    flags[1] = p & (uint8_t) V ? 'V' : '-';
-    flags[2] = p & (uint8_t) U ? 'U' : '-';
-    flags[3] = p & (uint8_t) B ? 'B' : '-';
-    flags[4] = p & (uint8_t) D ? 'D' : '-';
-    flags[5] = p & (uint8_t) I ? 'I' : '-';
-    flags[6] = p & (uint8_t) Z ? 'Z' : '-';
-    flags[7] = p & (uint8_t) C ? 'C' : '-';
-    flags[8] = '\0';
+    /* Tile 1 is solid color 1, tile 2 solid color 2 */
+    rom = build_rom(0, 1, 1, &size);
+    chr = rom + 16 + 0x4000;
+    for (int row = 0; row < 8; row++) {
+        chr[0x10 + row] = 0xff;
+        chr[0x28 + row] = 0xff;
+    }
+
+    cart = cartridge_load_mem(rom, size);
+    mapper = mapper_init(cart);
+    cpu->mapper = mapper;
+    cpu->ppu = ppu;
+    ppu->mapper = mapper;
+    mapper->ppu = ppu;
+
+    /* Palette, $3F10 mirrors $3F00 */
+    cpu_set_u8(cpu, 0x2006, 0x3f);
+    cpu_set_u8(cpu, 0x2006, 0x00);
+    cpu_set_u8(cpu, 0x2007, 0x0f);
+    cpu_set_u8(cpu, 0x2006, 0x3f);
+    cpu_set_u8(cpu, 0x2006, 0x05);
+    cpu_set_u8(cpu, 0x2007, 0x21);
+    cpu_set_u8(cpu, 0x2007, 0x22);
+    cpu_set_u8(cpu, 0x2006, 0x3f);
+    cpu_set_u8(cpu, 0x2006, 0x11);
+    cpu_set_u8(cpu, 0x2007, 0x16);
+
+    cpu_set_u8(cpu, 0x2006, 0x3f);
+    cpu_set_u8(cpu, 0x2006, 0x10);
+    if (cpu_get_u8(cpu, 0x2007) != 0x0f) {
+        err = 0x10;
+    }
+
+    /* Tiles 1 and 2 top left, with palette 1 */
+    cpu_set_u8(cpu, 0x2006, 0x20);
+    cpu_set_u8(cpu, 0x2006, 0x00);
+    cpu_set_u8(cpu, 0x2007, 1);
+    cpu_set_u8(cpu, 0x2007, 2);
+    cpu_set_u8(cpu, 0x2006, 0x23);
+    cpu_set_u8(cpu, 0x2006, 0xc0);
+    cpu_set_u8(cpu, 0x2007, 0x01);
+
+    /* Reads through $2007 are one behind */
+    cpu_set_u8(cpu, 0x2006, 0x20);
+    cpu_set_u8(cpu, 0x2006, 0x01);
+    cpu_get_u8(cpu, 0x2007);
+    if (cpu_get_u8(cpu, 0x2007) != 2) {
+        err = 0x11;
+    }
+
+    /* Sprite 0: tile 1 at (4, 1), over the background */
+    cpu->ram[0x200] = 0;
+    cpu->ram[0x201] = 1;
+    cpu->ram[0x202] = 0;
+    cpu->ram[0x203] = 4;
+    for (int i = 4; i < 0x100; i++) {
+        cpu->ram[0x200 + i] = 0xff;
+    }
+    cpu_set_u8(cpu, 0x2003, 0);
+    cpu_set_u8(cpu, 0x4014, 0x02);
+
+    cpu_set_u8(cpu, 0x2005, 0);
+    cpu_set_u8(cpu, 0x2005, 0);
+    cpu_set_u8(cpu, 0x2000, 0x80);
+    cpu_set_u8(cpu, 0x2001, 0x1e);
+
+    while (ppu->dot < 2 * PPU_DOTS_PER_FRAME) {
+        ppu_tick(ppu);
+
+        if (ppu->scanline == 10 && ppu->line_position == 0 && !ppu->sprite_0_hit) {
+            err = 0x20;
+        }
+    }
+
+    if (ppu->framebuffer[0] != 0x21 || ppu->framebuffer[7] != 0x21 || ppu->framebuffer[8] != 0x22
+        || ppu->framebuffer[16] != 0x0f) {
+        err = 0x21;
+    }
+
+    if (ppu->framebuffer[PPU_WIDTH + 3] != 0x21 || ppu->framebuffer[PPU_WIDTH + 4] != 0x16
+        || ppu->framebuffer[PPU_WIDTH + 11] != 0x16 || ppu->framebuffer[PPU_WIDTH + 12] != 0x22
+        || ppu->framebuffer[8 * PPU_WIDTH + 3] != 0x0f || ppu->framebuffer[8 * PPU_WIDTH + 4] != 0x16) {
+        err = 0x22;
+    }
+
+    if (!ppu->is_nmi) {
+        err = 0x23;
+    }
+
+    mapper_free(mapper);
+    cartridge_free(cart);
+    free(rom);
+
+    ppu_free(ppu);
+    cpu_free(cpu);
+
+    return err;
+}
+
+/* MMC5 banking, RAM, multiplier, ExRAM, fill mode, extended attributes and IRQ */
+int test_7_mmc5() {
+    cpu_t *cpu = cpu_init();
+    ppu_t *ppu = ppu_init();
+    cartridge_t *cart;
+    mapper_t *mapper;
+    uint8_t *rom, *chr;
+    uint64_t irq_dot;
+    size_t size;
+    int err = 0;
+
+    if (cpu == NULL || ppu == NULL) {
+        return 1;
+    }
+
+    /* 256K PRG, 16K PRG RAM, 128K CHR; tile 7 of 4K bank 3 is solid color 1 */
+    rom = build_rom(5, 16, 16, &size);
+    rom[8] = 2;
+    chr = rom + 16 + 16 * 0x4000;
+    for (int row = 0; row < 8; row++) {
+        chr[3 * 0x1000 + 7 * 16 + row] = 0xff;
+    }
+
+    cart = cartridge_load_mem(rom, size);
+    mapper = mapper_init(cart);
+    cpu->mapper = mapper;
+    cpu->ppu = ppu;
+    ppu->mapper = mapper;
+    mapper->ppu = ppu;
+
+    /* Last bank at $E000 on power on, then 16K banks */
+    if (cpu_get_u8(cpu, 0xe000) != 31) {
+        err = 0x10;
+    }
+
+    cpu_set_u8(cpu, 0x5100, 1);
+    cpu_set_u8(cpu, 0x5115, 0x84);
+    cpu_set_u8(cpu, 0x5117, 0x8e);
+    if (cpu_get_u8(cpu, 0x8000) != 4 || cpu_get_u8(cpu, 0xa000) != 5 || cpu_get_u8(cpu, 0xc000) != 14
+        || cpu_get_u8(cpu, 0xe000) != 15) {
+        err = 0x11;
+    }
+
+    /* RAM bank 1 at $8000 and $6000, writable once unprotected */
+    cpu_set_u8(cpu, 0x5100, 3);
+    cpu_set_u8(cpu, 0x5114, 0x01);
+    cpu_set_u8(cpu, 0x5113, 0x01);
+    cpu_set_u8(cpu, 0x8000, 0x42);
+    if (cpu_get_u8(cpu, 0x8000) == 0x42) {
+        err = 0x12;
+    }
+
+    cpu_set_u8(cpu, 0x5102, 0x02);
+    cpu_set_u8(cpu, 0x5103, 0x01);
+    cpu_set_u8(cpu, 0x8000, 0x42);
+    if (cpu_get_u8(cpu, 0x8000) != 0x42 || cpu_get_u8(cpu, 0x6000) != 0x42) {
+        err = 0x13;
+    }
+
+    /* Multiplier */
+    cpu_set_u8(cpu, 0x5205, 200);
+    cpu_set_u8(cpu, 0x5206, 100);
+    if (cpu_get_u8(cpu, 0x5205) != 0x20 || cpu_get_u8(cpu, 0x5206) != 0x4e) {
+        err = 0x20;
+    }
+
+    /* CHR: 1K then 8K banks, background banks with 8x16 sprites */
+    cpu_set_u8(cpu, 0x5120, 5);
+    if (mapper_get_chr_u8(mapper, 0x0000) != 5) {
+        err = 0x30;
+    }
+
+    cpu_set_u8(cpu, 0x5101, 0);
+    cpu_set_u8(cpu, 0x5127, 2);
+    if (mapper_get_chr_u8(mapper, 0x0000) != 16 || mapper_get_chr_u8(mapper, 0x1c00) != 23) {
+        err = 0x31;
+    }
+
+    cpu_set_u8(cpu, 0x2000, 0x20);
+    cpu_set_u8(cpu, 0x5101, 3);
+    cpu_set_u8(cpu, 0x5128, 9);
+    if (mapper->chr_bg_pages[0][0] != 9 || mapper->chr_bg_pages[4][0] != 9 || mapper_get_chr_u8(mapper, 0) != 5) {
+        err = 0x32;
+    }
+    cpu_set_u8(cpu, 0x2000, 0x00);
+
+    /* ExRAM as RAM */
+    cpu_set_u8(cpu, 0x5104, 2);
+    cpu_set_u8(cpu, 0x5c10, 0x99);
+    if (cpu_get_u8(cpu, 0x5c10) != 0x99) {
+        err = 0x40;
+    }
+
+    /* Fill mode in every quadrant */
+    cpu_set_u8(cpu, 0x5105, 0xff);
+    cpu_set_u8(cpu, 0x5106, 0x33);
+    cpu_set_u8(cpu, 0x5107, 2);
+    cpu_set_u8(cpu, 0x2006, 0x24);
+    cpu_set_u8(cpu, 0x2006, 0x00);
+    cpu_get_u8(cpu, 0x2007);
+    if (cpu_get_u8(cpu, 0x2007) != 0x33) {
+        err = 0x41;
+    }
+    cpu_set_u8(cpu, 0x2006, 0x2b);
+    cpu_set_u8(cpu, 0x2006, 0xc0);
+    cpu_get_u8(cpu, 0x2007);
+    if (cpu_get_u8(cpu, 0x2007) != 0xaa) {
+        err = 0x42;
+    }
+
+    /* Extended attributes: the top left tile is tile 7 from bank 3 with palette 3 */
+    cpu_set_u8(cpu, 0x5105, 0x00);
+    cpu_set_u8(cpu, 0x5c00, 0xc3);
+    cpu_set_u8(cpu, 0x5104, 1);
+    cpu_set_u8(cpu, 0x2006, 0x20);
+    cpu_set_u8(cpu, 0x2006, 0x00);
+    cpu_set_u8(cpu, 0x2007, 7);
+    cpu_set_u8(cpu, 0x2006, 0x3f);
+    cpu_set_u8(cpu, 0x2006, 0x00);
+    cpu_set_u8(cpu, 0x2007, 0x0f);
+    cpu_set_u8(cpu, 0x2006, 0x3f);
+    cpu_set_u8(cpu, 0x2006, 0x0d);
+    cpu_set_u8(cpu, 0x2007, 0x2a);
+    cpu_set_u8(cpu, 0x2005, 0);
+    cpu_set_u8(cpu, 0x2005, 0);
+    cpu_set_u8(cpu, 0x2000, 0x00);
+
+    /* IRQ at the start of line 100, scheduled once rendering is on */
+    cpu_set_u8(cpu, 0x5203, 100);
+    cpu_set_u8(cpu, 0x5204, 0x80);
+    if (mapper->irq_dot != UINT64_MAX) {
+        err = 0x50;
+    }
+
+    cpu_set_u8(cpu, 0x2001, 0x0a);
+    if (mapper->irq_dot != 100 * PPU_DOTS_PER_LINE) {
+        err = 0x51;
+    }
+
+    while (ppu->dot < 2 * PPU_DOTS_PER_FRAME) {
+        ppu_tick(ppu);
+
+        if (ppu->dot == PPU_DOTS_PER_FRAME + 120 * PPU_DOTS_PER_LINE) {
+            irq_dot = mapper->irq_dot;
+
+            if (irq_dot != 100 * PPU_DOTS_PER_LINE || cpu_get_u8(cpu, 0x5204) != 0xc0
+                || mapper->irq_dot != 2 * PPU_DOTS_PER_FRAME + 100 * PPU_DOTS_PER_LINE) {
+                err = 0x52;
+            }
+        }
+    }
+
+    if (ppu->framebuffer[0] != 0x2a || ppu->framebuffer[7] != 0x2a || ppu->framebuffer[8] != 0x0f) {
+        err = 0x60;
+    }
+
+    mapper_free(mapper);
+    cartridge_free(cart);
+    free(rom);
+
+    ppu_free(ppu);
+    cpu_free(cpu);
+
+    return err;
+}
+
+/* Writes to a shared save reach the file, writes to a read only save don't */
+int test_8_battery_save() {
+    /* Copies $6000 to $00 then increments it, once */
+    static const uint8_t program[] = {
+        0xad, 0x00, 0x60, /* LDA $6000 */
+        0x85, 0x00,       /* STA $00 */
+        0xee, 0x00, 0x60, /* INC $6000 */
+        0x4c, 0x08, 0x80  /* $8008: JMP $8008 */
+    };
+    char file[] = "/tmp/acidnes-save-XXXXXX";
+    acidnes_t *consoles[3];
+    cartridge_t *cart;
+    mapper_t *mapper;
+    uint8_t *rom;
+    uint8_t saved[2];
+    size_t size;
+    FILE *fp;
+    int fd;
+    int err = 0;
+
+    fd = mkstemp(file);
+    if (fd < 0) {
+        return 1;
+    }
+    close(fd);
+    unlink(file);
+
+    rom = build_rom(0, 1, 1, &size);
+    rom[6] |= 0x02;
+    cart = cartridge_load_mem(rom, size);
+    free(rom);
+
+    if (cart == NULL || !cart->battery_ram) {
+        return 2;
+    }
+
+    /* Created on first use, with the power on content */
+    mapper = mapper_init(cart);
+    if (!mapper_attach_save(mapper, file, FALSE) || !mapper->prg_ram_mapped
+        || mapper_get_ram_u8(mapper, 0x6000) != 0xff) {
+        err = 0x10;
+    }
+
+    mapper_set_ram_u8(mapper, 0x6000, 0x12);
+    mapper_set_ram_u8(mapper, 0x7fff, 0x34);
+    if (!mapper->prg_ram_dirty) {
+        err = 0x11;
+    }
+
+    mapper_flush_save(mapper);
+    if (mapper->prg_ram_dirty) {
+        err = 0x12;
+    }
+    mapper_free(mapper);
+
+    fp = fopen(file, "rb");
+    if (fp == NULL || fread(saved, 1, 1, fp) != 1 || fseek(fp, 0x1fff, SEEK_SET) != 0
+        || fread(saved + 1, 1, 1, fp) != 1 || saved[0] != 0x12 || saved[1] != 0x34) {
+        err = 0x13;
+    }
+    if (fp != NULL) {
+        fclose(fp);
+    }
+
+    /* Read only: the game sees the save and its own writes, the file keeps the old content */
+    mapper = mapper_init(cart);
+    if (!mapper_attach_save(mapper, file, TRUE) || mapper_get_ram_u8(mapper, 0x6000) != 0x12) {
+        err = 0x20;
+    }
+
+    mapper_set_ram_u8(mapper, 0x6000, 0x56);
+    mapper_flush_save(mapper);
+    if (mapper_get_ram_u8(mapper, 0x6000) != 0x56) {
+        err = 0x21;
+    }
+    mapper_free(mapper);
+
+    mapper = mapper_init(cart);
+    if (!mapper_attach_save(mapper, file, FALSE) || mapper_get_ram_u8(mapper, 0x6000) != 0x12) {
+        err = 0x22;
+    }
+    mapper_free(mapper);
+
+    /* Read only through the library: every console starts from the save, the game's writes stay in its own copy */
+    rom = build_rom(0, 1, 1, &size);
+    memcpy(rom + 16, program, sizeof(program));
+    rom[16 + 0x3ffc] = 0x00;
+    rom[16 + 0x3ffd] = 0x80;
+    if (acidnes_attach_save(consoles[0] = acidnes_create(rom, size), file, 1)) {
+        err = 0x30;
+    }
+    rom[6] |= 0x02;
+    for (int i = 1; i < 3; i++) {
+        consoles[i] = acidnes_create(rom, size);
+        if (consoles[i] == NULL || !acidnes_attach_save(consoles[i], file, 1)) {
+            err = 0x31;
+            continue;
+        }
+
+        acidnes_step_frames(consoles[i], 1, NULL);
+        if (acidnes_get_ram(consoles[i])[0] != 0x12) {
+            err = 0x32;
+        }
+    }
+    free(rom);
+
+    fp = fopen(file, "rb");
+    if (fp == NULL || fread(saved, 1, 1, fp) != 1 || saved[0] != 0x12) {
+        err = 0x33;
+    }
+    if (fp != NULL) {
+        fclose(fp);
+    }
+
+    for (int i = 0; i < 3; i++) {
+        acidnes_destroy(consoles[i]);
+    }
+
+    unlink(file);
+    cartridge_free(cart);
+
+    return err;
+}
+
+/* nestest traced to a binary file, decoded back to the reference log */
+int test_9_trace() {
+    char file[] = "/tmp/acidnes-trace-XXXXXX";
+    cpu_t *cpu;
+    ppu_t *ppu;
+    mapper_t *mapper;
+    cartridge_t *cart;
+    trace_reader_t *reader;
+    trace_record_t record;
+    uint64_t cycle;
+    char expected[128], actual[128];
+    FILE *fp;
+    int fd;
+    int lines = 0;
+    int err = 0;
+
+    fd = mkstemp(file);
+    if (fd < 0) {
+        return 1;
+    }
+    close(fd);
+
+    cart = cartridge_load("tests/nestest.nes");
+    if (cart == NULL || (mapper = mapper_init(cart)) == NULL) {
+        return 1;
+    }
+
+    cpu = cpu_init();
+    ppu = ppu_init();
+    cpu->mapper = mapper;
+    cpu_reset(cpu);
+    cpu->ppu = ppu;
+    cpu->PC = 0xc000;
+    cpu->clock = 7;
+
+    cpu->trace = trace_open(file, FALSE);
+    if (cpu->trace == NULL) {
+        return 2;
+    }
+
+    while (cpu->PC != 0x0001) {
+        cpu_tick(cpu);
+    }
+
+    trace_close(cpu->trace);
+
+    ppu_free(ppu);
+    cpu_free(cpu);
+    mapper_free(mapper);
+    cartridge_free(cart);
+
+    reader = trace_reader_open(file);
+    fp = fopen("tests/nestest-output.txt", "r");
+    if (reader == NULL || fp == NULL) {
+        return 3;
+    }
+
+    while (fgets(expected, sizeof(expected), fp) != NULL) {
+        lines++;
+
+        if (!trace_reader_next(reader, &record, &cycle)) {
+            err = 0x10;
+            break;
+        }
+
+        trace_format(&record, cycle, actual, sizeof(actual));
+        expected[strcspn(expected, "\n")] = '\0';
+
+        if (strcmp(expected, actual) != 0) {
+            fprintf(stderr, "Line %d\nExpected: %s\nActual:   %s\n", lines, expected, actual);
+            err = 0x11;
+            break;
+        }
+    }
+
+    fclose(fp);
+    trace_reader_close(reader);
+    unlink(file);
+
+    return err;
+}
+
+/* Controllers, and save states: running on from a loaded state must give the same frames */
+int test_10_nes() {
+    cartridge_t *cart;
+    nes_t *nes, *fresh;
+    uint8_t *state, *frame, *rom;
+    size_t size;
+    uint8_t bits = 0;
+    int err = 0;
+
+    cart = cartridge_load("tests/nestest.nes");
+    if (cart == NULL || (nes = nes_init(cart)) == NULL) {
+        return 1;
+    }
+
+    /* A, Start and Right held: read back A first, one bit per read, then 1s */
+    nes->cpu->buttons[0] = 0x89;
+    cpu_set_u8(nes->cpu, 0x4016, 1);
+    cpu_set_u8(nes->cpu, 0x4016, 0);
+    for (int i = 0; i < 8; i++) {
+        bits |= (uint8_t) ((cpu_get_u8(nes->cpu, 0x4016) & 0x01u) << i);
+    }
+    if (bits != 0x89 || (cpu_get_u8(nes->cpu, 0x4016) & 0x01u) != 1 || (cpu_get_u8(nes->cpu, 0x4017) & 0x01u) != 0) {
+        err = 0x10;
+    }
+    nes->cpu->buttons[0] = 0;
+
+    for (int i = 0; i < 30; i++) {
+        nes_step_frame(nes);
+    }
+
+    size = nes_state_size(nes);
+    state = malloc(size);
+    frame = malloc(PPU_FRAMEBUFFER_SIZE);
+    nes_save_state(nes, state);
+
+    for (int i = 0; i < 10; i++) {
+        nes_step_frame(nes);
+    }
+    memcpy(frame, nes->ppu->framebuffer, PPU_FRAMEBUFFER_SIZE);
+
+    if (nes_load_state(nes, state, size - 1) || !nes_load_state(nes, state, size)) {
+        err = 0x20;
+    }
+
+    for (int i = 0; i < 10; i++) {
+        nes_step_frame(nes);
+    }
+
+    if (memcmp(frame, nes->ppu->framebuffer, PPU_FRAMEBUFFER_SIZE) != 0) {
+        err = 0x21;
+    }
+
+    /* The menu shows something */
+    for (size_t i = 1; i < PPU_FRAMEBUFFER_SIZE && err == 0; i++) {
+        if (frame[i] != frame[0]) {
+            break;
+        }
+        if (i == PPU_FRAMEBUFFER_SIZE - 1) {
+            err = 0x22;
+        }
+    }
+
+    /* Reset in the middle of a frame, then the same frames as a console just powered on */
+    for (int i = 0; i < 1000; i++) {
+        cpu_tick(nes->cpu);
+    }
+    nes_reset(nes);
+    if (nes->ppu->dot % PPU_DOTS_PER_FRAME != 0 || nes->ppu->scanline != 0) {
+        err = 0x30;
+    }
+
+    fresh = nes_init(cart);
+    if (fresh == NULL) {
+        return 2;
+    }
+    for (int i = 0; i < 20; i++) {
+        nes_step_frame(nes);
+        nes_step_frame(fresh);
+    }
+    if (memcmp(fresh->ppu->framebuffer, nes->ppu->framebuffer, PPU_FRAMEBUFFER_SIZE) != 0
+        || fresh->ppu->dot % PPU_DOTS_PER_FRAME != nes->ppu->dot % PPU_DOTS_PER_FRAME
+        || fresh->cpu->PC != nes->cpu->PC) {
+        err = 0x31;
+    }
+    nes_free(fresh);
+
+    free(frame);
+    free(state);
+    nes_free(nes);
+    cartridge_free(cart);
+
+    /* A scanline IRQ scheduled before a reset doesn't fire after it: rendering is off */
+    rom = build_rom(4, 16, 16, &size);
+    cart = cartridge_load_mem(rom, size);
+    free(rom);
+    if (cart == NULL || (nes = nes_init(cart)) == NULL) {
+        return 3;
+    }
+    cpu_set_u8(nes->cpu, 0x2000, 0x08);
+    cpu_set_u8(nes->cpu, 0x2001, 0x18);
+    cpu_set_u8(nes->cpu, 0xc000, 20);
+    cpu_set_u8(nes->cpu, 0xc001, 0);
+    cpu_set_u8(nes->cpu, 0xe001, 0);
+    for (int i = 0; i < 1000; i++) {
+        ppu_tick(nes->ppu);
+    }
+    if (nes->mapper->irq_dot == UINT64_MAX) {
+        err = 0x32;
+    }
+    nes_reset(nes);
+    if (nes->mapper->irq_dot != UINT64_MAX) {
+        err = 0x33;
+    }
+    nes_free(nes);
+    cartridge_free(cart);
+
+    return err;
+}
+
+/* Only checks something when built with ACIDNES_CPU_STATS */
+int test_11_cpu_stats() {
+#ifdef CPU_STATS
+    cartridge_t *cart;
+    nes_t *nes;
+    cpu_t *cpu;
+    uint64_t instructions = 0, executions = 0, cycles = 0;
+    uint64_t reads = 0, taken = 0, branches = 0;
+    int err = 0;
+
+    cart = cartridge_load("tests/nestest.nes");
+    if (cart == NULL || (nes = nes_init(cart)) == NULL) {
+        return 1;
+    }
+
+    cpu = nes->cpu;
+    cpu->PC = 0xc000;
+    cpu->clock = 0;
+
+    while (cpu->PC != 0x0001) {
+        cpu_tick(cpu);
+        instructions++;
+    }
+
+    for (int op = 0; op < 256; op++) {
+        executions += cpu->stats.opcodes[op].executions;
+        cycles += cpu->stats.opcodes[op].cycles;
+        if ((op & 0x1f) == 0x10) {
+            taken += cpu->stats.opcodes[op].branches_taken;
+            branches += cpu->stats.opcodes[op].executions;
+        }
+    }
+
+    for (int r = 0; r < STATS_REGIONS; r++) {
+        reads += cpu->stats.reads[r];
+    }
+
+    /* No interrupt nor DMA in nestest: every cycle belongs to an instruction */
+    if (executions != instructions || cycles != cpu->clock) {
+        err = 0x10;
+    }
+
+    /* JMP $C5F5 first, and at least one opcode fetch per instruction from PRG ROM */
+    if (cpu->stats.opcodes[0x4c].executions == 0 || cpu->stats.reads[STATS_PRG_ROM] < instructions || reads == 0) {
+        err = 0x11;
+    }
+
+    if (taken == 0 || taken > branches) {
+        err = 0x12;
+    }
+
+    /* LDA abs,X crosses pages in nestest */
+    if (cpu->stats.opcodes[0xbd].page_crosses == 0) {
+        err = 0x13;
+    }
+
+    nes_free(nes);
+    cartridge_free(cart);
+
+    return err;
+#else
+    return 0;
+#endif
+}
+
+/* Runs nestest in automation mode with a profiler, returns the cycles run */
+static uint64_t profile_nestest(cpu_t *cpu, profiler_t *profiler) {
+    uint64_t clock = cpu->clock;
+
+    cpu->profiler = profiler;
+    cpu->PC = 0xc000;
+    cpu->SP = 0xfd;
+
+    while (cpu->PC != 0x0001) {
+        cpu_tick(cpu);
+    }
+
+    profiler_end_frame(profiler);
+    cpu->profiler = NULL;
+
+    return cpu->clock - clock;
+}
+
+/* Full and sampled profiles of nestest */
+int test_12_profiler() {
+    cartridge_t *cart;
+    nes_t *nes;
+    profiler_t *profiler;
+    uint64_t cycles, pc_cycles = 0, node_cycles = 0, samples = 0;
+    uint32_t node;
+    int err = 0;
+
+    cart = cartridge_load("tests/nestest.nes");
+    if (cart == NULL || (nes = nes_init(cart)) == NULL) {
+        return 1;
+    }
+
+    profiler = profiler_init(0, PROFILER_HEATMAP);
+    cycles = profile_nestest(nes->cpu, profiler);
+
+    for (uint32_t addr = 0; addr < 0x10000; addr++) {
+        pc_cycles += profiler->cycles[addr];
+    }
+    for (uint32_t i = 0; i < profiler->nb_nodes; i++) {
+        node_cycles += profiler->nodes[i].cycles;
+    }
+
+    if (pc_cycles != cycles || node_cycles != cycles || profiler->nb_frames != 1
+        || profiler->frames[0].cycles != cycles || profiler->frames[0].interrupt_cycles != 0) {
+        err = 0x10;
+    }
+
+    /* $C72D is the first test routine called from the main code, the final RTS leaves every call */
+    for (node = profiler->nodes[0].first_child; node != PROFILER_NO_NODE; node = profiler->nodes[node].next_sibling) {
+        if (profiler->nodes[node].addr == 0xc72d) {
+            break;
+        }
+    }
+    if (node == PROFILER_NO_NODE || profiler->nodes[node].cycles == 0 || profiler->depth != 0) {
+        err = 0x11;
+    }
+
+    /* JMP $C5F5 fetched once, return addresses pushed */
+    if (profiler->instructions[0xc000] != 1 || profiler->reads[0xc000] != 1 || profiler->writes[0x01fd] == 0) {
+        err = 0x12;
+    }
+
+    profiler_free(profiler);
+
+    /* Sampling: every sample stands for the cycles since the previous one */
+    profiler = profiler_init(100, 0);
+    cycles = profile_nestest(nes->cpu, profiler);
+
+    pc_cycles = 0;
+    for (uint32_t addr = 0; addr < 0x10000; addr++) {
+        pc_cycles += profiler->cycles[addr];
+        samples += profiler->instructions[addr];
+    }
+
+    if (pc_cycles > cycles || pc_cycles + 100 + 8 < cycles || samples < cycles / 100 || samples > cycles / 100 + 2
+        || profiler->reads != NULL) {
+        err = 0x20;
+    }
+
+    profiler_free(profiler);
+    nes_free(nes);
+    cartridge_free(cart);
+
+    return err;
+}
+
+/* Runs crash in a child with stderr to a pipe, returns what it wrote and how it ended */
+static char *capture_crash(void (*crash)(cpu_t *), cpu_t *cpu, int *status) {
+    static char output[1 << 16];
+    size_t len = 0;
+    ssize_t n;
+    int fds[2];
+    pid_t pid;
+
+    if (pipe(fds) != 0) {
+        return NULL;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        dup2(fds[1], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        crash(cpu);
+        _exit(0);
+    }
+
+    close(fds[1]);
+    while ((n = read(fds[0], output + len, sizeof(output) - 1 - len)) > 0) {
+        len += (size_t) n;
+    }
+    close(fds[0]);
+    output[len] = '\0';
+
+    waitpid(pid, status, 0);
+    return output;
+}
+
+/* 0x02 is not an opcode: the CPU faults, and the player panics with it */
+static void crash_invalid_opcode(cpu_t *cpu) {
+    cpu->ram[0x0300] = 0x02;
+    cpu->PC = 0x0300;
+    cpu_tick(cpu);
+    if (cpu->fault[0] != '\0') {
+        _panic("%s", cpu->fault);
+    }
+}
+
+static void crash_signal(cpu_t *cpu) {
+    (void) cpu;
+    recorder_install_crash_handler();
+    raise(SIGSEGV);
+}
+
+static void *crash_signal_thread(void *arg) {
+    (void) arg;
+    recorder_thread_stack();
+    raise(SIGSEGV);
+    return NULL;
+}
+
+/* From a thread that runs no CPU */
+static void crash_signal_other_thread(cpu_t *cpu) {
+    pthread_t thread;
+
+    (void) cpu;
+    recorder_install_crash_handler();
+    pthread_create(&thread, NULL, crash_signal_thread, NULL);
+    pthread_join(thread, NULL);
+}
+
+/* On a CPU past the slots */
+static void crash_unregistered(cpu_t *cpu) {
+    cpu_t *extra = NULL;
+
+    for (int i = 0; i < RECORDER_MAX_CPUS; i++) {
+        extra = cpu_init();
+    }
+    extra->ppu = cpu->ppu;
+    extra->mapper = cpu->mapper;
+    crash_invalid_opcode(extra);
+}
+
+static int count_occurrences(const char *haystack, const char *needle) {
+    int count = 0;
+
+    while ((haystack = strstr(haystack, needle)) != NULL) {
+        count++;
+        haystack += strlen(needle);
+    }
+    return count;
+}
+
+/* Flight recorder contents, and its dumps on panic and on a fatal signal */
+int test_13_recorder() {
+    cartridge_t *cart;
+    nes_t *nes, *other;
+    cpu_t *cpu;
+    const recorder_instruction_t *first, *last;
+    const recorder_access_t *access;
+    char *output;
+    int status;
+    int err = 0;
+
+    cart = cartridge_load("tests/nestest.nes");
+    if (cart == NULL || (nes = nes_init(cart)) == NULL) {
+        return 1;
+    }
+
+    /* Not running on this thread, so not in the dumps of its crashes */
+    if ((other = nes_init(cart)) == NULL) {
+        return 2;
+    }
+
+    cpu = nes->cpu;
+    cpu->PC = 0xc000;
+    cpu->SP = 0xfd;
+    cpu->recorder.nb_instructions = 0;
+    cpu_tick(cpu);
+
+    /* JMP $C5F5: only reads PRG ROM, which is not recorded */
+    first = &cpu->recorder.instructions[0];
+    if (first->pc != 0xc000 || first->opcode != 0x4c || first->sp != 0xfd
+        || cpu->recorder.nb_accesses != first->access) {
+        err = 0x10;
+    }
+
+    while (cpu->PC != 0x0001) {
+        cpu_tick(cpu);
+    }
+
+    /* The final RTS pops $0000 */
+    last = &cpu->recorder.instructions[(cpu->recorder.nb_instructions - 1) & (RECORDER_INSTRUCTIONS - 1)];
+    access = &cpu->recorder.accesses[last->access & (RECORDER_ACCESSES - 1)];
+    if (last->opcode != 0x60 || cpu->recorder.nb_accesses != last->access + 2 || access[0].addr != 0x0100 + last->sp + 1
+        || access[1].addr != 0x0100 + last->sp + 2 || access[0].value != 0 || access[1].flags != RECORDER_READ) {
+        err = 0x11;
+    }
+
+    /* Not recording, as libacidnes consoles by default: the rings are left as they are */
+    cpu->recording = FALSE;
+    cpu->PC = 0xc000;
+    cpu_tick(cpu);
+    cpu_push_u8(cpu, 0);
+    if (cpu->PC != 0xc5f5 || cpu->recorder.nb_accesses != last->access + 2
+        || last != &cpu->recorder.instructions[(cpu->recorder.nb_instructions - 1) & (RECORDER_INSTRUCTIONS - 1)]) {
+        err = 0x16;
+    }
+    cpu->SP++;
+    cpu->recording = TRUE;
+
+    output = capture_crash(crash_invalid_opcode, cpu, &status);
+    if (output == NULL || !WIFEXITED(status) || WEXITSTATUS(status) != 1
+        || strstr(output, "Last 256 instructions") == NULL || strstr(output, "> PC:0300 OP:02 (BAD)") == NULL
+        || strstr(output, "      R $0300 = 02") == NULL || strstr(output, "Mapper: 0") == NULL
+        || strstr(output, "Invalid OpCode: 0x02 (BAD) at $0300") == NULL
+        || strstr(output, ", running on the crashing thread ===") == NULL
+        || count_occurrences(output, "=== Flight recorder") != 1) {
+        err = 0x12;
+    }
+
+    output = capture_crash(crash_signal, cpu, &status);
+    if (output == NULL || !WIFSIGNALED(status) || WTERMSIG(status) != SIGSEGV
+        || strstr(output, "Fatal signal 11") == NULL || strstr(output, "> PC:C66E OP:60 (RTS)") == NULL
+        || count_occurrences(output, "=== Flight recorder") != 1) {
+        err = 0x13;
+    }
+
+    /* Every CPU, when the crashing thread runs none */
+    output = capture_crash(crash_signal_other_thread, cpu, &status);
+    if (output == NULL || !WIFSIGNALED(status) || WTERMSIG(status) != SIGSEGV
+        || strstr(output, "Fatal signal 11") == NULL || strstr(output, "> PC:C66E OP:60 (RTS)") == NULL
+        || count_occurrences(output, "=== Flight recorder") < 2) {
+        err = 0x14;
+    }
+
+    /* The dump is what matters, the warning is compiled out with ACIDNES_LOG_LEVEL above WARN */
+    output = capture_crash(crash_unregistered, cpu, &status);
+    if (output == NULL || !WIFEXITED(status) || WEXITSTATUS(status) != 1
+        || (LOG_COMPILE_LEVEL <= LOG_WARN && strstr(output, "[WARN][recorder] More than 64 CPUs") == NULL)
+        || strstr(output, "=== Flight recorder, CPU past the first 64, running on the crashing thread ===") == NULL
+        || strstr(output, "> PC:0300 OP:02 (BAD)") == NULL || count_occurrences(output, "=== Flight recorder") != 1) {
+        err = 0x15;
+    }
+
+    nes_free(other);
+    nes_free(nes);
+    cartridge_free(cart);
+
+    return err;
+}
+
+static int _log_evaluations = 0;
+
+static int log_evaluate(void) {
+    return ++_log_evaluations;
+}
+
+static void *log_from_thread(void *arg) {
+    log_info("test", "from thread %d", *(int *) arg);
+    return NULL;
+}
+
+/* Levels, threads, and drops: a full ring loses messages, never their count */
+int test_14_log() {
+    static char output[1 << 20];
+    char *line;
+    pthread_t thread;
+    FILE *file;
+    ssize_t len;
+    int id = 42;
+    int logged = 0, dropped = 0;
+    int err = 0;
+
+    file = tmpfile();
+    if (file == NULL) {
+        return 1;
+    }
+
+    log_set_output(fileno(file));
+    log_set_level(LOG_INFO);
+
+    log_info("test", "from main %d", 1);
+    pthread_create(&thread, NULL, log_from_thread, &id);
+    pthread_join(thread, NULL);
+
+    /* Compiled out below INFO by default, and disabled at runtime: the arguments are not evaluated */
+    log_trace("test", "trace %d", log_evaluate());
+    log_set_level(LOG_ERROR);
+    log_warn("test", "warn %d", log_evaluate());
+    log_set_level(LOG_INFO);
+    if (_log_evaluations != 0 || log_enabled(LOG_WARN) != (LOG_COMPILE_LEVEL <= LOG_WARN)) {
+        err = 0x10;
+    }
+
+    if (!log_set_level_name("Debug") || _log_level != LOG_DEBUG || log_set_level_name("verbose")) {
+        err = 0x11;
+    }
+    log_set_level(LOG_INFO);
+
+    for (int i = 0; i < 1000; i++) {
+        log_info("flood", "%04d %0400d", i, 0);
+    }
+
+    log_set_output(STDERR_FILENO);
+
+    len = pread(fileno(file), output, sizeof(output) - 1, 0);
+    fclose(file);
+    if (len < 0) {
+        return 2;
+    }
+    output[len] = '\0';
+
+    if (LOG_COMPILE_LEVEL > LOG_INFO) {
+        /* Built with -DACIDNES_LOG_LEVEL above INFO: every message of this test is compiled out */
+        if (len != 0) {
+            err = 0x14;
+        }
+
+        return err;
+    }
+
+    if (strstr(output, "[INFO][test] from main 1\n") == NULL || strstr(output, "[INFO][test] from thread 42\n") == NULL
+        || strstr(output, "trace") != NULL || strstr(output, "warn") != NULL) {
+        err = 0x12;
+    }
+
+    for (line = strstr(output, "[INFO][flood]"); line != NULL; line = strstr(line + 1, "[INFO][flood]")) {
+        logged++;
+    }
+    for (line = strstr(output, "[WARN][log] "); line != NULL; line = strstr(line + 1, "[WARN][log] ")) {
+        dropped += atoi(line + strlen("[WARN][log] "));
+    }
+
+    /* 1000 messages of 420 bytes do not fit in one ring, unless the flusher got to run in between */
+    if (logged + dropped != 1000 || logged == 0) {
+        err = 0x13;
+    }
+
+    return err;
+}
+
+/* Paced frames are never early, and are not late on average; unlimited frames are not held back */
+int test_15_pacer() {
+    struct timespec start, end;
+    pacer_t *pacer;
+    pacer_stats_t stats;
+    double elapsed, period;
+    int err = 0;
+
+    /* 10x NTSC: 1.66 ms per frame */
+    pacer = pacer_init(PACER_NTSC_HZ, 10);
+    if (pacer == NULL) {
+        return 1;
+    }
+
+    period = 1e3 / (PACER_NTSC_HZ * 10);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < 60; i++) {
+        pacer_end_frame(pacer);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (double) (end.tv_sec - start.tv_sec) * 1e3 + (double) (end.tv_nsec - start.tv_nsec) / 1e6;
+
+    pacer_get_stats(pacer, &stats);
+    if (stats.frames != 60 || elapsed < 59 * period || stats.fps > PACER_NTSC_HZ * 10 * 1.01) {
+        err = 0x10;
+    }
+    if (stats.p50 > stats.p90 || stats.p90 > stats.p99 || stats.p99 > stats.max || stats.p50 < period * 0.5) {
+        err = 0x11;
+    }
+    pacer_free(pacer);
+
+    pacer = pacer_init(PACER_PAL_HZ, 0);
+    if (pacer == NULL) {
+        return 2;
+    }
+
+    for (int i = 0; i < 10000; i++) {
+        pacer_end_frame(pacer);
+    }
+
+    pacer_get_stats(pacer, &stats);
+    if (stats.frames != 10000 || stats.fps < PACER_PAL_HZ * 100 || stats.p50 > 1) {
+        err = 0x12;
+    }
+    pacer_free(pacer);
+
+    return err;
+}
+
+/* Skipped frames: same sprite 0 hits and overflows, at the same dots, as drawn ones, over random screens */
+int test_16_frameskip() {
+    ppu_t *drawn = ppu_init();
+    ppu_t *skipped = ppu_init();
+    cartridge_t *cart;
+    mapper_t *mapper;
+    uint8_t *rom, *chr;
+    uint32_t seed = 0x12345678;
+    uint32_t hits = 0;
+    size_t size;
+    nes_t *nes[2];
+    int err = 0;
+
+    if (drawn == NULL || skipped == NULL) {
+        return 1;
+    }
+
+    /* Sparse patterns: a hit depends on single pixels */
+    rom = build_rom(0, 1, 1, &size);
+    chr = rom + 16 + 0x4000;
+    for (int i = 0; i < 0x2000; i++) {
+        seed = seed * 1103515245 + 12345;
+        chr[i] = (uint8_t) ((seed >> 4) & (seed >> 12) & (seed >> 18) & (seed >> 24));
+    }
+
+    cart = cartridge_load_mem(rom, size);
+    mapper = mapper_init(cart);
+    drawn->mapper = mapper;
+    skipped->mapper = mapper;
+    skipped->skip_render = TRUE;
+
+    for (int frame = 0; frame < 200 && err == 0; frame++) {
+        for (int i = 0; i < 0x800; i++) {
+            seed = seed * 1103515245 + 12345;
+            drawn->ram[i] = (uint8_t) (seed >> 16);
+        }
+        for (int i = 0; i < 0x100; i++) {
+            seed = seed * 1103515245 + 12345;
+            drawn->oam[i] = (uint8_t) (seed >> 16);
+        }
+
+        /* Sprite 0 on screen, half the time at an edge */
+        seed = seed * 1103515245 + 12345;
+        drawn->oam[0] = (uint8_t) ((seed >> 8) % 230);
+        if (seed & 0x01u) {
+            drawn->oam[3] = (uint8_t) (seed & 0x02u ? 248 + ((seed >> 4) & 0x07u) : (seed >> 4) & 0x07u);
+        }
+
+        drawn->ctrl = (uint8_t) ((seed >> 20) & (PPU_CTRL_SPRITE_TABLE | PPU_CTRL_BG_TABLE | PPU_CTRL_SPRITE_16));
+        drawn->mask = (uint8_t) (PPU_MASK_BG | PPU_MASK_SPRITES | ((seed >> 24) & (PPU_MASK_BG_LEFT
+                                                                                  | PPU_MASK_SPRITES_LEFT)));
+        drawn->x = (seed >> 27) & 0x07u;
+        drawn->t = (uint16_t) ((seed >> 10) & 0x0c1fu);
+
+        memcpy(skipped->ram, drawn->ram, sizeof(drawn->ram));
+        memcpy(skipped->oam, drawn->oam, sizeof(drawn->oam));
+        skipped->ctrl = drawn->ctrl;
+        skipped->mask = drawn->mask;
+        skipped->x = drawn->x;
+        skipped->t = drawn->t;
+
+        for (int i = 0; i < PPU_DOTS_PER_FRAME; i++) {
+            ppu_tick(drawn);
+            ppu_tick(skipped);
+
+            if (drawn->sprite_0_hit != skipped->sprite_0_hit || drawn->sprite_overflow != skipped->sprite_overflow
+                || drawn->v != skipped->v) {
+                err = 0x10;
+                break;
+            }
+
+            if (drawn->scanline == PPU_VBLANK_SCANLINE && drawn->line_position == 0 && drawn->sprite_0_hit) {
+                hits++;
+            }
+        }
+    }
+
+    /* Enough of both outcomes for the comparison to mean something */
+    if (err == 0 && (hits < 20 || hits > 180)) {
+        err = 0x11;
+    }
+
+    mapper_free(mapper);
+    cartridge_free(cart);
+    free(rom);
+    ppu_free(drawn);
+    ppu_free(skipped);
+
+    /* Whole console: only the drawn frames touch the framebuffer, the emulation does not change */
+    for (int i = 0; i < 2; i++) {
+        cart = cartridge_load("tests/nestest.nes");
+        if (cart == NULL || (nes[i] = nes_init(cart)) == NULL) {
+            return 2;
+        }
+        nes[i]->frameskip = (uint32_t) i * 4;
+    }
+
+    for (int frame = 0; frame < 40; frame++) {
+        nes_step_frame(nes[0]);
+        memset(nes[1]->ppu->framebuffer, 0xff, PPU_FRAMEBUFFER_SIZE);
+        nes_step_frame(nes[1]);
+
+        if (nes[1]->ppu->skip_render != (frame % 4 != 3)
+            || (nes[1]->ppu->framebuffer[0] == 0xff) != nes[1]->ppu->skip_render) {
+            err = 0x20;
+        }
+    }
+
+    if (nes[0]->cpu->clock != nes[1]->cpu->clock || nes[0]->cpu->PC != nes[1]->cpu->PC
+        || memcmp(nes[0]->cpu->ram, nes[1]->cpu->ram, CPU_RAM_SIZE) != 0
+        || memcmp(nes[0]->ppu->framebuffer, nes[1]->ppu->framebuffer, PPU_FRAMEBUFFER_SIZE) != 0) {
+        err = 0x21;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        cart = nes[i]->cart;
+        nes_free(nes[i]);
+        cartridge_free(cart);
+    }
+
+    return err;
+}
+
+/* Embedding API: same frames as the console itself, batches, states */
+int test_17_library() {
+    static uint8_t rom[0x10000];
+    static uint8_t own_frame[ACIDNES_WIDTH * ACIDNES_HEIGHT], own_ram[ACIDNES_RAM_SIZE];
+    uint8_t inputs[3 * 20 * 2];
+    acidnes_t *consoles[3], *bad;
+    uint8_t *bad_rom;
+    cartridge_t *cart;
+    nes_t *nes;
+    const uint8_t *frame;
+    uint8_t *state;
+    size_t size;
+    FILE *fp;
+    int err = 0;
+
+    fp = fopen("tests/nestest.nes", "rb");
+    if (fp == NULL) {
+        return 1;
+    }
+    size = fread(rom, 1, sizeof(rom), fp);
+    fclose(fp);
+
+    if (acidnes_create(rom, 8) != NULL) {
+        err = 0x10;
+    }
+
+    for (int i = 0; i < 3; i++) {
+        consoles[i] = acidnes_create(rom, size);
+        if (consoles[i] == NULL) {
+            return 2;
+        }
+    }
+
+    /* Start pressed on the 10th frame of the second console only */
+    memset(inputs, 0, sizeof(inputs));
+    inputs[20 * 2 + 10 * 2] = 0x08;
+
+    cart = cartridge_load("tests/nestest.nes");
+    if (cart == NULL || (nes = nes_init(cart)) == NULL) {
+        return 3;
+    }
+
+    frame = acidnes_get_framebuffer(consoles[0]);
+    acidnes_step_frames_many(consoles, 3, 20, inputs);
+    if (acidnes_step_frames(consoles[2], 0, NULL) != 20 || acidnes_get_framebuffer(consoles[0]) != frame) {
+        err = 0x11;
+    }
+
+    for (int i = 0; i < 20; i++) {
+        nes_step_frame(nes);
+    }
+    if (memcmp(frame, nes->ppu->framebuffer, ACIDNES_WIDTH * ACIDNES_HEIGHT) != 0
+        || memcmp(acidnes_get_ram(consoles[0]), nes->cpu->ram, ACIDNES_RAM_SIZE) != 0
+        || memcmp(acidnes_get_ram(consoles[2]), nes->cpu->ram, ACIDNES_RAM_SIZE) != 0) {
+        err = 0x12;
+    }
+
+    /* The menu reacted to Start */
+    if (memcmp(acidnes_get_ram(consoles[1]), nes->cpu->ram, ACIDNES_RAM_SIZE) == 0) {
+        err = 0x13;
+    }
+
+    /* Console 0 loads the state of console 1 and follows it */
+    size = acidnes_state_size(consoles[1]);
+    state = malloc(size);
+    acidnes_save(consoles[1], state);
+    if (acidnes_load(consoles[0], state, size - 1) || !acidnes_load(consoles[0], state, size)) {
+        err = 0x14;
+    }
+
+    acidnes_step_frames(consoles[0], 5, NULL);
+    acidnes_step_frames(consoles[1], 5, NULL);
+    if (memcmp(acidnes_get_framebuffer(consoles[0]), acidnes_get_framebuffer(consoles[1]),
+               ACIDNES_WIDTH * ACIDNES_HEIGHT) != 0
+        || memcmp(acidnes_get_ram(consoles[0]), acidnes_get_ram(consoles[1]), ACIDNES_RAM_SIZE) != 0) {
+        err = 0x15;
+    }
+
+    /* A console the emulator can't run stops alone: the process and the other consoles carry on */
+    bad_rom = build_rom(0, 1, 1, &size);
+    bad_rom[16] = 0x02;
+    bad_rom[16 + 0x3ffc] = 0x00;
+    bad_rom[16 + 0x3ffd] = 0x80;
+    bad = acidnes_create(bad_rom, size);
+    free(bad_rom);
+    if (bad == NULL) {
+        return 4;
+    }
+    if (acidnes_error(bad) != NULL || acidnes_step_frames(bad, 10, NULL) != 0 || acidnes_error(bad) == NULL
+        || strstr(acidnes_error(bad), "Invalid OpCode: 0x02 (BAD) at $8000") == NULL
+        || acidnes_step_frames(bad, 10, NULL) != 0 || acidnes_error(consoles[0]) != NULL) {
+        err = 0x16;
+    }
+    acidnes_reset(bad);
+    if (acidnes_error(bad) != NULL) {
+        err = 0x17;
+    }
+    acidnes_destroy(bad);
+
+    /* Console 0 runs in buffers of ours from where it is, then back in its own */
+    acidnes_set_buffers(consoles[0], own_frame, own_ram);
+    if (acidnes_get_framebuffer(consoles[0]) != own_frame || acidnes_get_ram(consoles[0]) != own_ram
+        || memcmp(own_frame, acidnes_get_framebuffer(consoles[1]), sizeof(own_frame)) != 0
+        || memcmp(own_ram, acidnes_get_ram(consoles[1]), sizeof(own_ram)) != 0) {
+        err = 0x18;
+    }
+
+    acidnes_step_frames(consoles[0], 5, NULL);
+    acidnes_step_frames(consoles[1], 5, NULL);
+    if (memcmp(own_frame, acidnes_get_framebuffer(consoles[1]), sizeof(own_frame)) != 0
+        || memcmp(own_ram, acidnes_get_ram(consoles[1]), sizeof(own_ram)) != 0) {
+        err = 0x19;
+    }
+
+    acidnes_set_buffers(consoles[0], NULL, NULL);
+    memset(own_frame, 0, sizeof(own_frame));
+    memset(own_ram, 0, sizeof(own_ram));
+    if (acidnes_get_framebuffer(consoles[0]) == own_frame
+        || memcmp(acidnes_get_framebuffer(consoles[0]), acidnes_get_framebuffer(consoles[1]), sizeof(own_frame)) != 0
+        || memcmp(acidnes_get_ram(consoles[0]), acidnes_get_ram(consoles[1]), sizeof(own_ram)) != 0) {
+        err = 0x1a;
+    }
+
+    free(state);
+    nes_free(nes);
+    cartridge_free(cart);
+    for (int i = 0; i < 3; i++) {
+        acidnes_destroy(consoles[i]);
+    }
+
+    return err;
+}
+
+static void count_index(void *ctx, size_t index) {
+    __atomic_fetch_add(&((uint32_t *) ctx)[index], 1, __ATOMIC_RELAXED);
+}
+
+/* Every index exactly once per loop, loop after loop, whatever the number of threads */
+int test_18_threadpool() {
+    static uint32_t counts[10000];
+    threadpool_t *pool;
+    int err = 0;
+
+    for (uint32_t threads = 1; threads <= 4 && err == 0; threads += 3) {
+        pool = threadpool_init(threads);
+        if (pool == NULL || pool->nb_threads != threads - 1) {
+            return 1;
+        }
+
+        memset(counts, 0, sizeof(counts));
+        for (int run = 0; run < 100; run++) {
+            threadpool_run(pool, count_index, counts, run % 2 ? 10000 : 3);
+        }
+        threadpool_run(pool, count_index, counts, 0);
+
+        for (int i = 0; i < 10000; i++) {
+            if (counts[i] != (i < 3 ? 100u : 50u)) {
+                err = 0x10 + (int) threads;
+                break;
+            }
+        }
+
+        threadpool_free(pool);
+    }
+
+    return err;
+}
+
+/* Gathers match plain reads, at the edges of RAM and through mirrors, with and without change masks */
+int test_19_ram_gather() {
+    static const uint16_t addrs[] = {0x0000, 0x0001, 0x0002, 0x0003, 0x07ff, 0x0800, 0x1fff, 0x0010, 0x0075, 0x0100,
+                                     0x01fd, 0x0300, 0x0301, 0x0302, 0x0456, 0x07fe, 0x0002, 0x0555, 0x1234};
+    static uint8_t rams[37][RAM_GATHER_SIZE];
+    const size_t nb_addrs = sizeof(addrs) / sizeof(addrs[0]);
+    const uint8_t *ptrs[37];
+    static uint8_t out[37 * 19], changed[37 * 19], expected[37 * 19], expected_changed[37 * 19];
+    uint32_t seed = 0xcafe;
+    ram_gather_t *gather;
+    acidnes_t *consoles[2];
+    acidnes_gather_t *console_gather;
+    int err = 0;
+
+    if (ram_gather_init((const uint16_t[]) {0x2000}, 1) != NULL) {
+        err = 0x10;
+    }
+
+    gather = ram_gather_init(addrs, nb_addrs);
+    if (gather == NULL) {
+        return 1;
+    }
+
+    for (int round = 0; round < 3; round++) {
+        for (int r = 0; r < 37; r++) {
+            for (int i = 0; i < RAM_GATHER_SIZE; i++) {
+                seed = seed * 1103515245 + 12345;
+                /* Most bytes stay the same from one round to the next */
+                if (round == 0 || (seed >> 16) % 4 == 0) {
+                    rams[r][i] = (uint8_t) (seed >> 20);
+                }
+            }
+            ptrs[r] = rams[r];
+        }
+
+        memcpy(expected, out, sizeof(out));
+        ram_gather_run_generic(gather, ptrs, 37, expected, expected_changed);
+        ram_gather_run(gather, ptrs, 37, out, round > 0 ? changed : NULL);
+
+        for (int r = 0; r < 37; r++) {
+            for (size_t i = 0; i < nb_addrs; i++) {
+                if (out[r * nb_addrs + i] != rams[r][addrs[i] & 0x07ffu]) {
+                    err = 0x11;
+                }
+            }
+        }
+
+        if (memcmp(out, expected, sizeof(out)) != 0 || (round > 0 && memcmp(changed, expected_changed,
+                                                                            sizeof(changed)) != 0)) {
+            err = 0x12;
+        }
+    }
+    ram_gather_free(gather);
+
+    /* Through the library */
+    for (int i = 0; i < 2; i++) {
+        consoles[i] = library_console(10 + (uint32_t) i);
+        if (consoles[i] == NULL) {
+            return 3;
+        }
+    }
+
+    console_gather = acidnes_gather_create(addrs, nb_addrs);
+    acidnes_gather_ram(console_gather, consoles, 2, out, NULL);
+    for (int c = 0; c < 2; c++) {
+        for (size_t i = 0; i < nb_addrs; i++) {
+            if (out[c * nb_addrs + i] != acidnes_get_ram(consoles[c])[addrs[i] & 0x07ffu]) {
+                err = 0x13;
+            }
+        }
+    }
+
+    acidnes_gather_destroy(console_gather);
+    for (int i = 0; i < 2; i++) {
+        acidnes_destroy(consoles[i]);
+    }
+
+    return err;
+}
+
+/* The SIMD kernel matches the plain one, sizes that divide the frame give plain block averages, max pooling and the
+ * library's pooled frames */
+int test_20_luma() {
+    static const uint16_t sizes[][2] = {{84, 84}, {256, 240}, {128, 120}, {1, 1}, {100, 77}, {3, 5}, {255, 239}};
+    static uint8_t frames[2][PPU_WIDTH * PPU_HEIGHT], out[PPU_WIDTH * PPU_HEIGHT], expected[PPU_WIDTH * PPU_HEIGHT];
+    static uint8_t previous[PPU_WIDTH * PPU_HEIGHT], pooled[84 * 84];
+    uint8_t table[PALETTE_SIZE];
+    uint32_t seed = 0x5eed;
+    uint64_t total = 0;
+    acidnes_luma_t *console_luma;
+    acidnes_t *console;
+    cartridge_t *cart;
+    nes_t *nes;
+    luma_t *luma;
+    int err = 0;
+
+    if (luma_init(0, 84) != NULL || luma_init(257, 84) != NULL || luma_init(84, 241) != NULL) {
+        err = 0x10;
+    }
+
+    /* Large areas of one color, as on screen, and noise */
+    for (int f = 0; f < 2; f++) {
+        for (int i = 0; i < PPU_WIDTH * PPU_HEIGHT; i++) {
+            seed = seed * 1103515245 + 12345;
+            frames[f][i] = i % 64 < 40 ? (uint8_t) ((i / 2048 + f) & 0x3f) : (uint8_t) ((seed >> 16) & 0x3f);
+        }
+    }
+    palette_luma(table);
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        luma = luma_init(sizes[s][0], sizes[s][1]);
+        if (luma == NULL) {
+            return 1;
+        }
+
+        for (int pool = 0; pool < 2; pool++) {
+            luma_run(luma, frames[0], pool ? frames[1] : NULL, out);
+            luma_run_generic(luma, frames[0], pool ? frames[1] : NULL, expected);
+            if (memcmp(out, expected, (size_t) sizes[s][0] * sizes[s][1]) != 0) {
+                err = 0x11;
+            }
+        }
+        luma_free(luma);
+    }
+
+    /* Full size is the luma itself, half size the average of 2x2 blocks, 1x1 the average of the frame */
+    luma = luma_init(PPU_WIDTH, PPU_HEIGHT);
+    luma_run(luma, frames[0], NULL, out);
+    for (int i = 0; i < PPU_WIDTH * PPU_HEIGHT; i++) {
+        if (out[i] != table[frames[0][i]]) {
+            err = 0x12;
+        }
+        total += table[frames[0][i]];
+    }
+
+    luma_run(luma, frames[0], frames[1], out);
+    for (int i = 0; i < PPU_WIDTH * PPU_HEIGHT; i++) {
+        if (out[i] != (table[frames[0][i]] > table[frames[1][i]] ? table[frames[0][i]] : table[frames[1][i]])) {
+            err = 0x13;
+        }
+    }
+    luma_free(luma);
+
+    luma = luma_init(PPU_WIDTH / 2, PPU_HEIGHT / 2);
+    luma_run(luma, frames[0], NULL, out);
+    for (int y = 0; y < PPU_HEIGHT / 2; y++) {
+        for (int x = 0; x < PPU_WIDTH / 2; x++) {
+            const uint8_t *block = &frames[0][y * 2 * PPU_WIDTH + x * 2];
+            uint32_t sum = table[block[0]] + table[block[1]] + table[block[PPU_WIDTH]] + table[block[PPU_WIDTH + 1]];
+
+            if (out[y * PPU_WIDTH / 2 + x] != (sum + 2) / 4) {
+                err = 0x14;
+            }
+        }
+    }
+    luma_free(luma);
+
+    luma = luma_init(1, 1);
+    luma_run(luma, frames[0], NULL, out);
+    if (out[0] != (total + PPU_WIDTH * PPU_HEIGHT / 2) / (PPU_WIDTH * PPU_HEIGHT)) {
+        err = 0x15;
+    }
+    luma_free(luma);
+
+    /* The library pools the last two frames of each group of 4 */
+    cart = cartridge_load("tests/nestest.nes");
+    if (cart == NULL || (nes = nes_init(cart)) == NULL) {
+        return 2;
+    }
+    console = library_console(0);
+    console_luma = acidnes_luma_create(84, 84);
+    if (console == NULL || console_luma == NULL || !acidnes_set_max_pool(console, 1)) {
+        return 3;
+    }
+    acidnes_set_frameskip(console, 4);
+    acidnes_step_frames(console, 8, NULL);
+    acidnes_get_luma(console_luma, console, pooled);
+
+    for (int i = 0; i < 8; i++) {
+        if (i == 7) {
+            memcpy(previous, nes->ppu->framebuffer, sizeof(previous));
+        }
+        nes_step_frame(nes);
+    }
+    luma = luma_init(84, 84);
+    luma_run_generic(luma, nes->ppu->framebuffer, previous, expected);
+    if (memcmp(pooled, expected, sizeof(pooled)) != 0) {
+        err = 0x16;
+    }
+
+    /* A reset starts pooling over: nestest's frames 3 and 4 differ, the frame is pooled with itself after it */
+    acidnes_destroy(console);
+    console = library_console(0);
+    if (console == NULL || !acidnes_set_max_pool(console, 1)) {
+        return 4;
+    }
+    acidnes_step_frames(console, 4, NULL);
+    acidnes_get_luma(console_luma, console, pooled);
+    luma_run_generic(luma, acidnes_get_framebuffer(console), NULL, expected);
+    if (memcmp(pooled, expected, sizeof(pooled)) == 0) {
+        err = 0x18;
+    }
+    acidnes_reset(console);
+    acidnes_get_luma(console_luma, console, pooled);
+    if (memcmp(pooled, expected, sizeof(pooled)) != 0) {
+        err = 0x19;
+    }
+    luma_free(luma);
+
+    /* Drawn frames: the last two of each group */
+    nes->frameskip = 4;
+    nes->draw_previous = TRUE;
+    for (int i = 0; i < 8; i++) {
+        if (nes_draws_frame(nes) != (i % 4 >= 2)) {
+            err = 0x17;
+        }
+        nes_step_frame(nes);
+    }
+
+    acidnes_luma_destroy(console_luma);
+    acidnes_destroy(console);
+    nes_free(nes);
+    cartridge_free(cart);
+
+    return err;
+}
+
+/* Every SIMD kernel the CPU supports matches the plain one, for every format and emphasis, and a few known colors */
+int test_21_palette() {
+    static const palette_format_t formats[] = {PALETTE_RGBA, PALETTE_RGB565, PALETTE_YUYV};
+    static uint8_t frame[PPU_WIDTH * PPU_HEIGHT], emphasis[PPU_HEIGHT];
+    static uint8_t out[PPU_WIDTH * PPU_HEIGHT * 4], expected[PPU_WIDTH * PPU_HEIGHT * 4];
+    uint32_t seed = 0xc0105;
+    acidnes_palette_t *console_palette;
+    acidnes_t *console;
+    cartridge_t *cart;
+    nes_t *reference;
+    palette_t *palette;
+    int err = 0;
+
+    if (palette_init((palette_format_t) 7) != NULL || acidnes_palette_create(3) != NULL) {
+        err = 0x10;
+    }
+
+    for (int i = 0; i < PPU_WIDTH * PPU_HEIGHT; i++) {
+        seed = seed * 1103515245 + 12345;
+        frame[i] = (uint8_t) ((seed >> 16) & 0x3f);
+    }
+    for (int y = 0; y < PPU_HEIGHT; y++) {
+        emphasis[y] = (uint8_t) (y % 8);
+    }
+
+    for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+        size_t size = PPU_WIDTH * PPU_HEIGHT * palette_pixel_size(formats[f]);
+
+        palette = palette_init(formats[f]);
+        if (palette == NULL) {
+            return 1;
+        }
+
+        palette_convert_isa(palette, PALETTE_GENERIC, frame, emphasis, expected);
+        for (palette_isa_t isa = PALETTE_SSE41; isa <= PALETTE_AVX512; isa++) {
+            if (!palette_isa_supported(isa)) {
+                continue;
+            }
+
+            memset(out, 0, sizeof(out));
+            palette_convert_isa(palette, isa, frame, emphasis, out);
+            if (memcmp(out, expected, size) != 0) {
+                err = 0x11;
+            }
+        }
+        palette_free(palette);
+    }
+
+    /* Color 0x16 without emphasis, 0x30 with red emphasis, black in every format */
+    memset(frame, 0x16, PPU_WIDTH);
+    memset(frame + PPU_WIDTH, 0x30, PPU_WIDTH);
+    memset(frame + PPU_WIDTH * 2, 0x0f, PPU_WIDTH);
+    memset(emphasis, 0, sizeof(emphasis));
+    emphasis[1] = 0x01;
+
+    palette = palette_init(PALETTE_RGBA);
+    palette_convert(palette, frame, emphasis, out);
+    if (memcmp(out, (const uint8_t[]) {0xf8, 0x38, 0x00, 0xff}, 4) != 0
+        || memcmp(out + PPU_WIDTH * 4, (const uint8_t[]) {0xfc, 0xce, 0xce, 0xff}, 4) != 0) {
+        err = 0x12;
+    }
+    palette_free(palette);
+
+    palette = palette_init(PALETTE_RGB565);
+    palette_convert(palette, frame, emphasis, out);
+    if (out[0] != 0xc0 || out[1] != 0xf9 || out[PPU_WIDTH * 4] != 0 || out[PPU_WIDTH * 4 + 1] != 0) {
+        err = 0x13;
+    }
+    palette_free(palette);
+
+    palette = palette_init(PALETTE_YUYV);
+    palette_convert(palette, frame, emphasis, out);
+    if (memcmp(out + PPU_WIDTH * 4, (const uint8_t[]) {16, 128, 16, 128}, 4) != 0) {
+        err = 0x14;
+    }
+    palette_free(palette);
+
+    /* Through the library, with the console's emphasis */
+    console = emphasis_console(10, &cart, &reference);
+    console_palette = acidnes_palette_create(ACIDNES_RGBA);
+    if (console == NULL || console_palette == NULL) {
+        return 3;
+    }
+    acidnes_get_pixels(console_palette, console, out);
+
+    if (reference->ppu->emphasis[0] == reference->ppu->emphasis[PPU_HEIGHT / 2]) {
+        err = 0x16;
+    }
+    palette = palette_init(PALETTE_RGBA);
+    palette_convert_isa(palette, PALETTE_GENERIC, acidnes_get_framebuffer(console), reference->ppu->emphasis,
+                        expected);
+    if (memcmp(out, expected, PPU_WIDTH * PPU_HEIGHT * 4) != 0) {
+        err = 0x15;
+    }
+    palette_free(palette);
+
+    acidnes_palette_destroy(console_palette);
+    acidnes_destroy(console);
+    nes_free(reference);
+    cartridge_free(cart);
+
+    return err;
+}
+
+/* Flat colors decode to themselves, sharp edges crawl from one frame to the next, and bands of lines on a pool give
+ * the same picture as one thread */
+int test_22_ntsc() {
+    static uint8_t frame[PPU_WIDTH * PPU_HEIGHT], out[NTSC_WIDTH * NTSC_HEIGHT * 4];
+    static uint8_t expected[NTSC_WIDTH * NTSC_HEIGHT * 4];
+    const size_t size = NTSC_WIDTH * NTSC_HEIGHT * 4, pitch = NTSC_WIDTH * 4;
+    const uint8_t *center = out + (NTSC_HEIGHT / 2) * pitch + (NTSC_WIDTH / 2) * 4;
+    acidnes_ntsc_t *console_ntsc;
+    acidnes_t *console;
+    cartridge_t *cart;
+    nes_t *reference;
+    threadpool_t *pool;
+    ntsc_t *ntsc;
+    int err = 0;
+
+    ntsc = ntsc_init();
+    pool = threadpool_init(3);
+    if (ntsc == NULL || pool == NULL) {
+        return 1;
+    }
+
+    /* White, black, red */
+    memset(frame, 0x30, sizeof(frame));
+    ntsc_run(ntsc, NULL, frame, NULL, 0, out);
+    if (center[0] < 230 || center[1] < 230 || center[2] < 230 || center[3] != 0xff) {
+        err = 0x11;
+    }
+
+    memset(frame, 0x0f, sizeof(frame));
+    ntsc_run(ntsc, NULL, frame, NULL, 0, out);
+    if (center[0] != 0 || center[1] != 0 || center[2] != 0) {
+        err = 0x12;
+    }
+
+    memset(frame, 0x16, sizeof(frame));
+    ntsc_run(ntsc, NULL, frame, NULL, 0, out);
+    if (center[0] < 2 * center[1] || center[0] < 2 * center[2]) {
+        err = 0x13;
+    }
+
+    /* Stripes of one pixel, with emphasis on some lines */
+    for (int i = 0; i < PPU_WIDTH * PPU_HEIGHT; i++) {
+        frame[i] = (i / 2) % 2 ? 0x30 : (uint8_t) (i / PPU_WIDTH % 64);
+    }
+    for (int phase = 0; phase < 4; phase++) {
+        uint8_t emphasis[PPU_HEIGHT];
+
+        for (int y = 0; y < PPU_HEIGHT; y++) {
+            emphasis[y] = (uint8_t) (y / 30);
+        }
+
+        ntsc_run(ntsc, NULL, frame, emphasis, (uint32_t) phase, expected);
+        ntsc_run(ntsc, pool, frame, emphasis, (uint32_t) phase, out);
+        if (memcmp(out, expected, size) != 0) {
+            err = 0x14;
+        }
+
+        for (int y = 0; y < NTSC_HEIGHT; y += 2) {
+            if (memcmp(out + y * pitch, out + (y + 1) * pitch, pitch) != 0) {
+                err = 0x15;
+            }
+        }
+
+        if (phase == 0) {
+            memcpy(expected, out, size);
+            continue;
+        }
+
+        /* Dot crawl: a cycle of 3 frames */
+        ntsc_run(ntsc, NULL, frame, emphasis, 0, expected);
+        if ((memcmp(out, expected, size) == 0) != (phase == 3)) {
+            err = 0x16;
+        }
+    }
+
+    /* Through the library, at the console's frame phase and with its emphasis */
+    console = emphasis_console(10, &cart, &reference);
+    console_ntsc = acidnes_ntsc_create(2);
+    if (console == NULL || console_ntsc == NULL) {
+        return 3;
+    }
+    acidnes_get_ntsc(console_ntsc, console, out);
+    ntsc_run(ntsc, NULL, acidnes_get_framebuffer(console), reference->ppu->emphasis, 10 % NTSC_PHASES, expected);
+    if (memcmp(out, expected, size) != 0) {
+        err = 0x17;
+    }
+
+    acidnes_ntsc_destroy(console_ntsc);
+    acidnes_destroy(console);
+    nes_free(reference);
+    cartridge_free(cart);
+    threadpool_free(pool);
+    ntsc_free(ntsc);
+
+    return err;
+}
+
+/* The SSSE3 kernels on bands of a pool match the plain ones, at frame sizes with and without whole blocks, and a
+ * corner is rounded off as the reference does */
+int test_23_upscale() {
+    static const uint32_t sizes[][2] = {{256, 240}, {37, 5}, {17, 1}, {1, 1}, {18, 3}, {33, 17}};
+    static const uint8_t corner[9] = {1, 1, 0, 1, 0, 0, 0, 0, 0};
+    /* Far apart and close colours, for all kinds of HQx patterns and xBR distances */
+    static const uint8_t colours[8] = {0x0f, 0x16, 0x21, 0x31, 0x26, 0x27, 0x2a, 0x10};
+    static uint8_t src[PPU_WIDTH * PPU_HEIGHT], out[PPU_WIDTH * PPU_HEIGHT * 16];
+    static uint8_t expected[PPU_WIDTH * PPU_HEIGHT * 16], twice[PPU_WIDTH * PPU_HEIGHT * 4];
+    static uint8_t indexes[PPU_WIDTH * PPU_HEIGHT], emphasis[PPU_HEIGHT];
+    static uint32_t pixels[PPU_WIDTH * PPU_HEIGHT], mirrored[PPU_WIDTH * PPU_HEIGHT], edge[8 * 8], flat[4 * 8];
+    static uint32_t rgb_out[PPU_WIDTH * PPU_HEIGHT * 16], rgb_expected[PPU_WIDTH * PPU_HEIGHT * 16];
+    uint32_t seed = 0x5ca1e;
+    acidnes_upscale_t *console_upscale;
+    acidnes_palette_t *console_palette;
+    acidnes_t *console;
+    palette_t *palette;
+    threadpool_t *pool;
+    upscale_t *upscale, *scale2x;
+    int err = 0;
+
+    if (upscale_init((upscale_filter_t) 9, 16, 16) != NULL || acidnes_upscale_create(9, 1) != NULL) {
+        err = 0x10;
+    }
+
+    pool = threadpool_init(3);
+    palette = palette_init(PALETTE_RGBA);
+    if (pool == NULL || palette == NULL) {
+        return 1;
+    }
+
+    /* Few colors, for many equal neighbours */
+    for (int i = 0; i < PPU_WIDTH * PPU_HEIGHT; i++) {
+        seed = seed * 1103515245 + 12345;
+        src[i] = (uint8_t) ((seed >> 16) % 3);
+        indexes[i] = colours[(seed >> 20) % 8];
+    }
+    palette_convert(palette, indexes, emphasis, (uint8_t *) pixels);
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for (upscale_filter_t filter = UPSCALE_SCALE2X; filter <= UPSCALE_XBR4X; filter++) {
+            size_t size = (size_t) sizes[s][0] * sizes[s][1] * upscale_factor(filter) * upscale_factor(filter) *
+                          upscale_pixel_size(filter);
+            const uint8_t *in = upscale_pixel_size(filter) == 4 ? (const uint8_t *) pixels : src;
+            uint8_t *got = upscale_pixel_size(filter) == 4 ? (uint8_t *) rgb_out : out;
+            uint8_t *want = upscale_pixel_size(filter) == 4 ? (uint8_t *) rgb_expected : expected;
+
+            upscale = upscale_init(filter, sizes[s][0], sizes[s][1]);
+            if (upscale == NULL) {
+                return 2;
+            }
+
+            upscale_run_generic(upscale, in, want);
+            upscale_run(upscale, NULL, in, got);
+            if (memcmp(got, want, size) != 0) {
+                err = 0x11;
+            }
+
+            memset(got, 0xff, size);
+            upscale_run(upscale, pool, in, got);
+            if (memcmp(got, want, size) != 0) {
+                err = 0x11;
+            }
+            upscale_free(upscale);
+        }
+    }
+
+    /* Only the corner sub-pixel of the center takes the color of its two neighbours */
+    upscale = upscale_init(UPSCALE_SCALE2X, 3, 3);
+    upscale_run(upscale, NULL, corner, out);
+    if (out[2 * 6 + 2] != 1 || out[2 * 6 + 3] != 0 || out[3 * 6 + 2] != 0 || out[3 * 6 + 3] != 0) {
+        err = 0x12;
+    }
+    upscale_free(upscale);
+
+    upscale = upscale_init(UPSCALE_SCALE3X, 3, 3);
+    upscale_run(upscale, NULL, corner, out);
+    for (int y = 3; y < 6; y++) {
+        for (int x = 3; x < 6; x++) {
+            if (out[y * 9 + x] != (x == 3 && y == 3)) {
+                err = 0x13;
+            }
+        }
+    }
+    upscale_free(upscale);
+
+    /* Scale4x is Scale2x twice */
+    upscale = upscale_init(UPSCALE_SCALE4X, PPU_WIDTH, PPU_HEIGHT);
+    scale2x = upscale_init(UPSCALE_SCALE2X, PPU_WIDTH, PPU_HEIGHT);
+    upscale_run(upscale, pool, src, out);
+    upscale_run_generic(scale2x, src, twice);
+    upscale_free(scale2x);
+    scale2x = upscale_init(UPSCALE_SCALE2X, PPU_WIDTH * 2, PPU_HEIGHT * 2);
+    upscale_run_generic(scale2x, twice, expected);
+    if (memcmp(out, expected, PPU_WIDTH * PPU_HEIGHT * 16) != 0) {
+        err = 0x14;
+    }
+    upscale_free(scale2x);
+    upscale_free(upscale);
+
+    /* Through the library */
+    console = library_console(10);
+    console_upscale = acidnes_upscale_create(ACIDNES_SCALE3X, 2);
+    if (console == NULL || console_upscale == NULL) {
+        return 4;
+    }
+    acidnes_get_upscaled(console_upscale, console, out);
+
+    upscale = upscale_init(UPSCALE_SCALE3X, PPU_WIDTH, PPU_HEIGHT);
+    upscale_run_generic(upscale, acidnes_get_framebuffer(console), expected);
+    if (acidnes_upscale_factor(console_upscale) != 3 || acidnes_upscale_pixel_size(console_upscale) != 1 ||
+        memcmp(out, expected, PPU_WIDTH * PPU_HEIGHT * 9) != 0) {
+        err = 0x15;
+    }
+    upscale_free(upscale);
+    acidnes_upscale_destroy(console_upscale);
+
+    /* HQx and xBR start from the RGBA frame, emphasis included */
+    console_upscale = acidnes_upscale_create(ACIDNES_XBR4X, 2);
+    if (console_upscale == NULL) {
+        return 5;
+    }
+    acidnes_get_upscaled(console_upscale, console, (uint8_t *) rgb_out);
+
+    console_palette = acidnes_palette_create(ACIDNES_RGBA);
+    if (console_palette == NULL) {
+        return 6;
+    }
+    acidnes_get_pixels(console_palette, console, (uint8_t *) pixels);
+    acidnes_palette_destroy(console_palette);
+    upscale = upscale_init(UPSCALE_XBR4X, PPU_WIDTH, PPU_HEIGHT);
+    upscale_run_generic(upscale, (const uint8_t *) pixels, (uint8_t *) rgb_expected);
+    if (acidnes_upscale_factor(console_upscale) != 4 || acidnes_upscale_pixel_size(console_upscale) != 4 ||
+        memcmp(rgb_out, rgb_expected, PPU_WIDTH * PPU_HEIGHT * 16 * 4) != 0) {
+        err = 0x16;
+    }
+    upscale_free(upscale);
+    acidnes_upscale_destroy(console_upscale);
+
+    /* A flat frame stays flat, and straight edges stay sharp: left half red, right half blue */
+    for (int y = 0; y < 8; y++) {
+        for (int x = 0; x < 8; x++) {
+            indexes[y * PPU_WIDTH + x] = x < 4 ? 0x16 : 0x21;
+        }
+    }
+    palette_convert(palette, indexes, emphasis, (uint8_t *) pixels);
+    for (int y = 0; y < 8; y++) {
+        memcpy(edge + y * 8, pixels + y * PPU_WIDTH, sizeof(edge) / 8);
+    }
+    for (int i = 0; i < 4 * 8; i++) {
+        flat[i] = edge[0];
+    }
+    for (upscale_filter_t filter = UPSCALE_HQ2X; filter <= UPSCALE_XBR4X; filter++) {
+        uint32_t factor = upscale_factor(filter);
+
+        upscale = upscale_init(filter, 4, 8);
+        upscale_run(upscale, pool, (const uint8_t *) flat, (uint8_t *) rgb_out);
+        for (uint32_t i = 0; i < 4 * 8 * factor * factor; i++) {
+            if (rgb_out[i] != edge[0]) {
+                err = 0x17;
+            }
+        }
+        upscale_free(upscale);
+
+        upscale = upscale_init(filter, 8, 8);
+        upscale_run(upscale, pool, (const uint8_t *) edge, (uint8_t *) rgb_out);
+        for (uint32_t y = 0; y < 8 * factor; y++) {
+            for (uint32_t x = 0; x < 8 * factor; x++) {
+                if (rgb_out[y * 8 * factor + x] != edge[x < 4 * factor ? 0 : 7]) {
+                    err = 0x17;
+                }
+            }
+        }
+        upscale_free(upscale);
+    }
+
+    /* HQx treats the four corners alike: a mirrored frame gives the mirrored output */
+    palette_convert(palette, indexes, emphasis, (uint8_t *) pixels);
+    for (uint32_t y = 0; y < 17; y++) {
+        for (uint32_t x = 0; x < 33; x++) {
+            mirrored[y * 33 + x] = pixels[y * 33 + 32 - x];
+        }
+    }
+    for (upscale_filter_t filter = UPSCALE_HQ2X; filter <= UPSCALE_HQ4X; filter++) {
+        uint32_t factor = upscale_factor(filter), pitch = 33 * factor;
+
+        upscale = upscale_init(filter, 33, 17);
+        upscale_run(upscale, NULL, (const uint8_t *) pixels, (uint8_t *) rgb_expected);
+        upscale_run(upscale, NULL, (const uint8_t *) mirrored, (uint8_t *) rgb_out);
+        for (uint32_t y = 0; y < 17 * factor; y++) {
+            for (uint32_t x = 0; x < pitch; x++) {
+                if (rgb_out[y * pitch + x] != rgb_expected[y * pitch + pitch - 1 - x]) {
+                    err = 0x18;
+                }
+            }
+        }
+        upscale_free(upscale);
+    }
+
+    /* Close neighbours above and left of a grey pixel: HQ2x blends its top left corner as (2 C + T + L) / 4 */
+    for (int i = 0; i < 9; i++) {
+        pixels[i] = i == 1 || i == 3 ? 0xff888888U : 0xff808080U;
+    }
+    upscale = upscale_init(UPSCALE_HQ2X, 3, 3);
+    upscale_run(upscale, NULL, (const uint8_t *) pixels, (uint8_t *) rgb_out);
+    if (rgb_out[2 * 6 + 2] != 0xff848484U || rgb_out[2 * 6 + 3] != 0xff828282U) {
+        err = 0x19;
+    }
+    upscale_free(upscale);
+
+    /* xBR 2x on a black over white staircase, x + y <= 2 black: the two corners facing each other across the step
+     * get half of each */
+    for (int y = 0; y < 4; y++) {
+        for (int x = 0; x < 4; x++) {
+            indexes[y * PPU_WIDTH + x] = x + y <= 2 ? 0x0f : 0x30;
+        }
+    }
+    palette_convert(palette, indexes, emphasis, (uint8_t *) pixels);
+    for (int y = 0; y < 4; y++) {
+        memcpy(edge + y * 4, pixels + y * PPU_WIDTH, 4 * sizeof(uint32_t));
+    }
+    for (int k = 0; k < 4; k++) {
+        ((uint8_t *) &flat[0])[k] = (uint8_t) (((uint8_t *) &edge[0])[k] / 2 + ((uint8_t *) &edge[15])[k] / 2);
+    }
+    ((uint8_t *) &flat[0])[3] = 0xff;
+    upscale = upscale_init(UPSCALE_XBR2X, 4, 4);
+    upscale_run(upscale, NULL, (const uint8_t *) edge, (uint8_t *) rgb_out);
+    if (rgb_out[2 * 8 + 2] != edge[0] || rgb_out[2 * 8 + 3] != edge[0] || rgb_out[3 * 8 + 2] != edge[0] ||
+        rgb_out[3 * 8 + 3] != flat[0] || rgb_out[2 * 8 + 4] != flat[0] || rgb_out[2 * 8 + 5] != edge[15] ||
+        rgb_out[3 * 8 + 4] != edge[15] || rgb_out[3 * 8 + 5] != edge[15]) {
+        err = 0x1a;
+    }
+    upscale_free(upscale);
+
+    acidnes_destroy(console);
+    palette_free(palette);
+    threadpool_free(pool);
+
+    return err;
+}
+
+static uint32_t read_u32_be(const uint8_t *p) {
+    return (uint32_t) ((p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]);
+}
+
+/* Inflates a zlib stream of stored blocks, what level 0 writes, and checks its Adler-32. Returns the size, 0 on
+ * error. */
+static size_t inflate_stored(const uint8_t *data, size_t size, uint8_t *out, size_t out_size) {
+    size_t pos = 2, len = 0;
+    uint32_t a = 1, b = 0;
+    bool last = FALSE;
+
+    if (size < 6 || data[0] != 0x78 || ((data[0] << 8) | data[1]) % 31 != 0) {
+        return 0;
+    }
+
+    while (!last) {
+        uint16_t block;
+
+        if (pos + 5 > size || (data[pos] & 0x06) != 0) {
+            return 0;
+        }
+        last = data[pos] & 1;
+        block = (uint16_t) (data[pos + 1] | (data[pos + 2] << 8));
+        if ((uint32_t) (uint16_t) ~block != (uint32_t) (data[pos + 3] | (data[pos + 4] << 8)) || pos + 5 + block > size
+            || len + block > out_size) {
+            return 0;
+        }
+        memcpy(out + len, data + pos + 5, block);
+        pos += 5 + block;
+        len += block;
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        a = (a + out[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    if (pos + 4 != size || read_u32_be(data + pos) != ((b << 16) | a)) {
+        return 0;
+    }
+
+    return len;
+}
+
+/* Decodes a PNG of png_encode to RGBA pixels, checking its chunks on the way. Returns the number of palette entries,
+ * 0 if it isn't valid. */
+static int decode_png(const uint8_t *png, size_t size, uint32_t width, uint32_t height, uint8_t *rgba) {
+    static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    const uint8_t *plte = NULL, *idat = NULL;
+    size_t pos = 8, nb_colors = 0, idat_size = 0, rows_size = (size_t) height * (width + 1);
+    uint8_t *rows = malloc(rows_size);
+    int ok = 1;
+
+    if (rows == NULL || size < 8 || memcmp(png, signature, 8) != 0) {
+        free(rows);
+        return 0;
+    }
+
+    while (ok && pos + 12 <= size) {
+        uint32_t len = read_u32_be(png + pos);
+        const uint8_t *type = png + pos + 4;
+
+        if (pos + 12 + len > size || crc32_update(0, type, len + 4) != read_u32_be(png + pos + 8 + len)) {
+            ok = 0;
+        } else if (memcmp(type, "IHDR", 4) == 0) {
+            ok = len == 13 && read_u32_be(type + 4) == width && read_u32_be(type + 8) == height && type[12] == 8
+                 && type[13] == 3 && type[14] == 0 && type[15] == 0 && type[16] == 0;
+        } else if (memcmp(type, "PLTE", 4) == 0) {
+            plte = type + 4;
+            nb_colors = len / 3;
+        } else if (memcmp(type, "IDAT", 4) == 0) {
+            idat = type + 4;
+            idat_size = len;
+        } else if (memcmp(type, "IEND", 4) == 0) {
+            ok = len == 0 && pos + 12 == size;
+        }
+        pos += 12 + len;
+    }
+
+    if (ok && (plte == NULL || idat == NULL || nb_colors == 0 || nb_colors > 256)) {
+        ok = 0;
+    }
+
+    if (ok) {
+#ifdef HAVE_ZLIB
+        uLongf out_size = rows_size;
+
+        ok = (idat[1] == 0x01 && inflate_stored(idat, idat_size, rows, rows_size) == rows_size)
+             || (uncompress(rows, &out_size, idat, idat_size) == Z_OK && out_size == rows_size);
+#else
+        ok = inflate_stored(idat, idat_size, rows, rows_size) == rows_size;
+#endif
+    }
+
+    for (uint32_t y = 0; ok && y < height; y++) {
+        const uint8_t *row = rows + (size_t) y * (width + 1);
+
+        ok = row[0] == 0;
+        for (uint32_t x = 0; ok && x < width; x++) {
+            uint8_t *pixel = rgba + ((size_t) y * width + x) * 4;
+
+            ok = row[x + 1] < nb_colors;
+            if (ok) {
+                memcpy(pixel, plte + row[x + 1] * 3, 3);
+                pixel[3] = 0xff;
+            }
+        }
+    }
+    free(rows);
+
+    return ok ? (int) nb_colors : 0;
+}
+
+static uint8_t *read_file(const char *file, size_t *size) {
+    FILE *fp = fopen(file, "rb");
+    uint8_t *data = NULL;
+    long len;
+
+    if (fp == NULL) {
+        return NULL;
+    }
+
+    if (fseek(fp, 0, SEEK_END) == 0 && (len = ftell(fp)) > 0 && fseek(fp, 0, SEEK_SET) == 0) {
+        data = malloc((size_t) len);
+        if (data != NULL && fread(data, 1, (size_t) len, fp) != (size_t) len) {
+            free(data);
+            data = NULL;
+        }
+        *size = (size_t) len;
+    }
+    fclose(fp);
+
+    return data;
+}
+
+/* PNGs decode to what palette_convert gives, emphasis included, and a sink writes every frame, each to its file */
+int test_24_png() {
+    static const int levels[] = {0, 1, -1, 9};
+    static uint8_t frame[PPU_WIDTH * PPU_HEIGHT], emphasis[PPU_HEIGHT], shown[PPU_HEIGHT];
+    static uint8_t expected[PPU_WIDTH * PPU_HEIGHT * 4], rgba[PPU_WIDTH * PPU_HEIGHT * 4];
+    char dir[] = "/tmp/acidnes-png-XXXXXX";
+    char pattern[64], file[64];
+    uint32_t seed = 0x9e3779b9;
+    acidnes_png_sink_t *console_sink;
+    acidnes_t *console;
+    palette_t *palette;
+    png_sink_t *sink;
+    uint8_t *png, *data;
+    size_t size, data_size;
+    int err = 0;
+
+    if (png_sink_open("frames.png", 16, 16, 1, 1, 1) != NULL || png_sink_open("%u-%u.png", 16, 16, 1, 1, 1) != NULL
+        || png_sink_open("%s.png", 16, 16, 1, 1, 1) != NULL || png_sink_open("%%u.png", 16, 16, 1, 1, 1) != NULL
+        || png_sink_open("%u.png", 0, 16, 1, 1, 1) != NULL || png_encode(frame, NULL, 16, 16, 10, NULL) != 0) {
+        err = 0x10;
+    }
+
+    palette = palette_init(PALETTE_RGBA);
+    png = malloc(png_bound(PPU_WIDTH, PPU_HEIGHT));
+    if (palette == NULL || png == NULL || mkdtemp(dir) == NULL) {
+        return 1;
+    }
+
+    for (int i = 0; i < PPU_WIDTH * PPU_HEIGHT; i++) {
+        seed = seed * 1103515245 + 12345;
+        frame[i] = (uint8_t) ((seed >> 16) % 5 == 0 ? (seed >> 8) & 0x3f : 0x0f);
+    }
+
+    /* No emphasis, two values, then five: the fifth one takes the first line's */
+    for (int pass = 0; pass < 3; pass++) {
+        for (int y = 0; y < PPU_HEIGHT; y++) {
+            emphasis[y] = (uint8_t) (pass == 0 ? 0 : pass == 1 ? (y / 100) * 3 : y / 50 + 1);
+            shown[y] = pass == 2 && emphasis[y] == 5 ? emphasis[0] : emphasis[y];
+        }
+        palette_convert(palette, frame, shown, expected);
+
+        for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); l++) {
+            size = png_encode(frame, pass > 0 ? emphasis : NULL, PPU_WIDTH, PPU_HEIGHT, levels[l], png);
+            if (size == 0 || size > png_bound(PPU_WIDTH, PPU_HEIGHT)) {
+                return 2;
+            }
+
+            if (decode_png(png, size, PPU_WIDTH, PPU_HEIGHT, rgba) != (pass == 0 ? 64 : pass == 1 ? 192 : 256)
+                || memcmp(rgba, expected, sizeof(rgba)) != 0) {
+                err = 0x11;
+            }
+        }
+    }
+
+    /* 3 threads, a queue of 2: frames wait for room, and still come out in order */
+    snprintf(pattern, sizeof(pattern), "%s/%%03u.png", dir);
+    sink = png_sink_open(pattern, PPU_WIDTH, PPU_HEIGHT, 1, 3, 2);
+    if (sink == NULL) {
+        return 3;
+    }
+    for (int i = 0; i < 20; i++) {
+        memset(frame, i, sizeof(frame));
+        if (!png_sink_submit(sink, frame, NULL)) {
+            err = 0x12;
+        }
+    }
+    if (!png_sink_close(sink)) {
+        err = 0x12;
+    }
+
+    for (int i = 0; i < 20; i++) {
+        snprintf(file, sizeof(file), "%s/%03u.png", dir, i);
+        data = read_file(file, &data_size);
+        memset(frame, i, sizeof(frame));
+        palette_convert(palette, frame, NULL, expected);
+        if (data == NULL || decode_png(data, data_size, PPU_WIDTH, PPU_HEIGHT, rgba) != 64
+            || memcmp(rgba, expected, sizeof(rgba)) != 0) {
+            err = 0x13;
+        }
+        free(data);
+        unlink(file);
+    }
+
+    /* Where nothing can be written */
+    snprintf(pattern, sizeof(pattern), "%s/missing/%%u.png", dir);
+    sink = png_sink_open(pattern, 16, 16, 1, 1, 1);
+    if (sink == NULL) {
+        return 4;
+    }
+    png_sink_submit(sink, frame, NULL);
+    if (png_sink_flush(sink) || png_sink_submit(sink, frame, NULL) || png_sink_close(sink)) {
+        err = 0x14;
+    }
+
+    /* Through the library */
+    console = library_console(10);
+    snprintf(pattern, sizeof(pattern), "%s/%%u.png", dir);
+    console_sink = acidnes_png_sink_open(pattern, 6, 2, 0);
+    if (console == NULL || console_sink == NULL) {
+        return 6;
+    }
+    snprintf(file, sizeof(file), "%s/shot.png", dir);
+    if (!acidnes_save_png(console, file, 6) || !acidnes_png_sink_submit(console_sink, console)
+        || !acidnes_png_sink_close(console_sink)) {
+        err = 0x15;
+    }
+
+    /* nestest doesn't use emphasis */
+    size = png_encode(acidnes_get_framebuffer(console), NULL, PPU_WIDTH, PPU_HEIGHT, 6, png);
+    data = read_file(file, &data_size);
+    if (data == NULL || data_size != size || memcmp(data, png, size) != 0) {
+        err = 0x16;
+    }
+    free(data);
+    unlink(file);
+
+    snprintf(file, sizeof(file), "%s/0.png", dir);
+    data = read_file(file, &data_size);
+    if (data == NULL || data_size != size || memcmp(data, png, size) != 0) {
+        err = 0x16;
+    }
+    free(data);
+    unlink(file);
+    rmdir(dir);
+
+    acidnes_destroy(console);
+    free(png);
+    palette_free(palette);
+
+    return err;
+}
+
+uint8_t *build_rom(uint8_t mapper_type, uint8_t nb_16k_rom_banks, uint8_t nb_8k_vrom_banks, size_t *size) {
+    uint8_t *rom;
+    uint8_t *prg, *chr;
+
+    *size = 16 + nb_16k_rom_banks * 0x4000 + nb_8k_vrom_banks * 0x2000;
+    rom = calloc(*size, 1);
+
+    rom[0] = 'N';
+    rom[1] = 'E';
+    rom[2] = 'S';
+    rom[3] = 0x1a;
+    rom[4] = nb_16k_rom_banks;
+    rom[5] = nb_8k_vrom_banks;
+    rom[6] = (uint8_t) (mapper_type << 4u);
+    rom[7] = mapper_type & 0xf0u;
+
+    prg = rom + 16;
+    for (int i = 0; i < nb_16k_rom_banks * 2; i++) {
+        prg[i * 0x2000] = (uint8_t) i;
+    }
+
+    chr = prg + nb_16k_rom_banks * 0x4000;
+    for (int i = 0; i < nb_8k_vrom_banks * 8; i++) {
+        chr[i * 0x400] = (uint8_t) i;
+    }
+
+    return rom;
+}
+
+/* The console the library's outputs are checked on: nestest, frames frames in. NULL if it can't be created. */
+acidnes_t *library_console(uint32_t frames) {
+    cartridge_t *cart = cartridge_load("tests/nestest.nes");
+    acidnes_t *console;
+
+    if (cart == NULL) {
+        return NULL;
+    }
+
+    console = acidnes_create(cart->image, cart->image_size);
+    cartridge_free(cart);
+    if (console != NULL) {
+        acidnes_step_frames(console, frames, NULL);
+    }
+
+    return console;
+}
+
+/* A console showing emphasis, which nestest doesn't use, frames frames in, and the same program run on a bare nes_t
+ * for the emphasis the library keeps to itself. Free both with nes_free and cartridge_free. NULL if it can't be
+ * created.
+ *
+ * The program sets the backdrop color, then loops writing a counter's top 3 bits to PPUMASK's emphasis bits, with the
+ * background on: the emphasis changes every few lines. */
+acidnes_t *emphasis_console(uint32_t frames, cartridge_t **cart, nes_t **reference) {
+    static const uint8_t program[] = {
+        0xa9, 0x3f, 0x8d, 0x06, 0x20, /* LDA #$3F, STA $2006 */
+        0xa9, 0x00, 0x8d, 0x06, 0x20, /* LDA #$00, STA $2006 */
+        0xa9, 0x21, 0x8d, 0x07, 0x20, /* LDA #$21, STA $2007 */
+        0xe6, 0x01,                   /* $800F: INC $01 */
+        0xa5, 0x01,                   /* LDA $01 */
+        0x29, 0xe0,                   /* AND #$E0 */
+        0x09, 0x0a,                   /* ORA #$0A */
+        0x8d, 0x01, 0x20,             /* STA $2001 */
+        0x4c, 0x0f, 0x80              /* JMP $800F */
+    };
+    acidnes_t *console;
+    uint8_t *rom;
+    size_t size;
+
+    rom = build_rom(0, 1, 1, &size);
+    memcpy(rom + 16, program, sizeof(program));
+    rom[16 + 0x3ffc] = 0x00;
+    rom[16 + 0x3ffd] = 0x80;
+
+    console = acidnes_create(rom, size);
+    *cart = cartridge_load_mem(rom, size);
+    free(rom);
+    if (console == NULL || *cart == NULL || (*reference = nes_init(*cart)) == NULL) {
+        return NULL;
+    }
+
+    acidnes_step_frames(console, frames, NULL);
+    for (uint32_t i = 0; i < frames; i++) {
+        nes_step_frame(*reference);
+    }
 
-    printf("PC:%04X OP:%02X (%s) A:%02X X:%02X Y:%02X P:%02X SP:%02X CYC:%lu\n",
-           cpu->PC, op, OPCODES[op], cpu->A, cpu->X, cpu->Y, cpu->P, cpu->SP, cpu->clock);
+    return console;
 }
@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace_check.h"
+#include "trace.h"
+
+static bool trace_check_parse(const char *line, trace_check_entry_t *entry);
+static void trace_check_report(const trace_check_t *check, const trace_check_entry_t *actual);
+static void trace_check_print(const char *prefix, size_t number, const trace_check_entry_t *entry);
+
+trace_check_t *trace_check_load(const char *file) {
+    trace_check_t *check;
+    FILE *fp;
+    char *line = NULL;
+    size_t line_size = 0;
+    size_t capacity = 0;
+    size_t lineno = 0;
+
+    fp = fopen(file, "r");
+    if (fp == NULL) {
+        perror(file);
+        return NULL;
+    }
+
+    check = calloc(1, sizeof(trace_check_t));
+    if (check == NULL) {
+        fclose(fp);
+        return NULL;
+    }
+
+    while (getline(&line, &line_size, fp) > 0) {
+        lineno++;
+
+        if (line[strspn(line, " \r\n")] == '\0') {
+            continue;
+        }
+
+        if (check->count == capacity) {
+            trace_check_entry_t *entries;
+
+            capacity = capacity == 0 ? 0x4000 : capacity * 2;
+            entries = realloc(check->entries, capacity * sizeof(trace_check_entry_t));
+            if (entries == NULL) {
+                break;
+            }
+            check->entries = entries;
+        }
+
+        if (!trace_check_parse(line, &check->entries[check->count])) {
+            fprintf(stderr, "%s:%lu: not a trace line\n", file, (unsigned long) lineno);
+            break;
+        }
+
+        check->count++;
+    }
+
+    free(line);
+
+    if (!feof(fp) || check->count == 0) {
+        fclose(fp);
+        trace_check_free(check);
+
+        return NULL;
+    }
+
+    fclose(fp);
+
+    return check;
+}
+
+void trace_check_free(trace_check_t *check) {
+    free(check->entries);
+    free(check);
+}
+
+void trace_check_start(trace_check_t *check, cpu_t *cpu) {
+    check->index = 0;
+
+    cpu->PC = check->entries[0].pc;
+    cpu->clock = check->entries[0].cycle;
+}
+
+bool trace_check_step(trace_check_t *check, cpu_t *cpu) {
+    const trace_check_entry_t *expected = &check->entries[check->index];
+    trace_check_entry_t actual;
+
+    actual.cycle = cpu->clock;
+    actual.pc = cpu->PC;
+    actual.opcode = cpu_peek_u8(cpu, cpu->PC);
+    actual.a = cpu->A;
+    actual.x = cpu->X;
+    actual.y = cpu->Y;
+    actual.p = cpu->P;
+    actual.sp = cpu->SP;
+
+    if (actual.pc != expected->pc || actual.opcode != expected->opcode || actual.a != expected->a
+        || actual.x != expected->x || actual.y != expected->y || actual.p != expected->p || actual.sp != expected->sp
+        || actual.cycle != expected->cycle) {
+        trace_check_report(check, &actual);
+        return FALSE;
+    }
+
+    check->index++;
+
+    return TRUE;
+}
+
+size_t trace_check_run(trace_check_t *check, cpu_t *cpu) {
+    while (!trace_check_done(check) && trace_check_step(check, cpu)) {
+        cpu_tick(cpu);
+    }
+
+    return check->count - check->index;
+}
+
+/* "PC:C000 OP:4C ..." or "C000  4C F5 C5  JMP ...", then the registers and the cycle count further in the line */
+static bool trace_check_parse(const char *line, trace_check_entry_t *entry) {
+    unsigned int pc, opcode, a, x, y, p, sp;
+    unsigned long long cycle;
+    const char *regs, *cyc;
+
+    if (sscanf(line, "PC:%4x OP:%2x", &pc, &opcode) != 2 && sscanf(line, "%4x %2x", &pc, &opcode) != 2) {
+        return FALSE;
+    }
+
+    regs = strstr(line, " A:");
+    cyc = strstr(line, "CYC:");
+    if (regs == NULL || cyc == NULL) {
+        return FALSE;
+    }
+
+    if (sscanf(regs, " A:%2x X:%2x Y:%2x P:%2x SP:%2x", &a, &x, &y, &p, &sp) != 5
+        || sscanf(cyc, "CYC:%llu", &cycle) != 1) {
+        return FALSE;
+    }
+
+    entry->cycle = cycle;
+    entry->pc = (uint16_t) pc;
+    entry->opcode = (uint8_t) opcode;
+    entry->a = (uint8_t) a;
+    entry->x = (uint8_t) x;
+    entry->y = (uint8_t) y;
+    entry->p = (uint8_t) p;
+    entry->sp = (uint8_t) sp;
+
+    return TRUE;
+}
+
+static void trace_check_report(const trace_check_t *check, const trace_check_entry_t *actual) {
+    const trace_check_entry_t *expected = &check->entries[check->index];
+    size_t first = check->index > TRACE_CHECK_CONTEXT ? check->index - TRACE_CHECK_CONTEXT : 0;
+    size_t last = check->index + TRACE_CHECK_CONTEXT < check->count ? check->index + TRACE_CHECK_CONTEXT
+                                                                       : check->count - 1;
+
+    fprintf(stderr, "Trace diverges at instruction %lu:\n", (unsigned long) check->index + 1);
+
+    for (size_t i = first; i < check->index; i++) {
+        trace_check_print("    ", i + 1, &check->entries[i]);
+    }
+
+    trace_check_print("-   ", check->index + 1, expected);
+    trace_check_print("+   ", check->index + 1, actual);
+
+    for (size_t i = check->index + 1; i <= last; i++) {
+        trace_check_print("    ", i + 1, &check->entries[i]);
+    }
+
+#define DIFF(name, field, fmt) \
+    if (expected->field != actual->field) { \
+        fprintf(stderr, "  %-3s expected " fmt ", got " fmt "\n", name, expected->field, actual->field); \
+    }
+
+    DIFF("PC", pc, "%04X");
+    DIFF("OP", opcode, "%02X");
+    DIFF("A", a, "%02X");
+    DIFF("X", x, "%02X");
+    DIFF("Y", y, "%02X");
+    DIFF("SP", sp, "%02X");
+    DIFF("CYC", cycle, "%lu");
+
+#undef DIFF
+
+    if (expected->p != actual->p) {
+        static const char flags[] = "NVUBDIZC";
+        char changed[9];
+
+        for (int i = 0; i < 8; i++) {
+            uint8_t bit = (uint8_t) (0x80u >> i);
+
+            changed[i] = (uint8_t) (expected->p ^ actual->p) & bit ? (actual->p & bit ? flags[i] : '0') : '.';
+        }
+        changed[8] = '\0';
+
+        /* Each differing flag shows as its letter when set in the actual state, 0 when cleared */
+        fprintf(stderr, "  %-3s expected %02X, got %02X (%s)\n", "P", expected->p, actual->p, changed);
+    }
+}
+
+static void trace_check_print(const char *prefix, size_t number, const trace_check_entry_t *entry) {
+    trace_record_t record;
+    char buf[128];
+
+    memset(&record, 0, sizeof(record));
+    record.pc = entry->pc;
+    record.opcode = entry->opcode;
+    record.a = entry->a;
+    record.x = entry->x;
+    record.y = entry->y;
+    record.p = entry->p;
+    record.sp = entry->sp;
+
+    trace_format(&record, entry->cycle, buf, sizeof(buf));
+    fprintf(stderr, "%s%7lu  %s\n", prefix, (unsigned long) number, buf);
+}
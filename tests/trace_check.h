@@ -0,0 +1,64 @@
+#ifndef __TRACE_CHECK_H__
+#define __TRACE_CHECK_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+#include "types.h"
+#include "cpu.h"
+
+/* Instruction by instruction comparison of the CPU against a reference log.
+ *
+ * The log is parsed once into a compact array, then each instruction's state is checked against it as the CPU runs,
+ * so nothing is written out however long the trace is. Both the nestest-output.txt format
+ * ("PC:C000 OP:4C (JMP) A:00 X:00 Y:00 P:24 SP:FD CYC:7") and the Nintendulator format of nestest.log and most CPU
+ * test ROM logs ("C000  4C F5 C5  JMP $C5F5  A:00 X:00 Y:00 P:24 SP:FD PPU:  0, 21 CYC:7") are read; other columns
+ * are ignored. */
+#define TRACE_CHECK_CONTEXT 5
+
+struct trace_check_entry_s {
+    uint64_t cycle;
+    uint16_t pc;
+    uint8_t opcode;
+    uint8_t a;
+    uint8_t x;
+    uint8_t y;
+    uint8_t p;
+    uint8_t sp;
+};
+typedef struct trace_check_entry_s trace_check_entry_t;
+
+struct trace_check_s {
+    trace_check_entry_t *entries;
+    size_t count;
+    /* Next entry to compare */
+    size_t index;
+};
+typedef struct trace_check_s trace_check_t;
+
+/* Returns NULL if the file can't be read or has a line in neither format */
+trace_check_t *trace_check_load(const char *file);
+void trace_check_free(trace_check_t *check);
+
+/* Puts the CPU at the PC and cycle of the first entry, logs don't all start from the reset vector */
+void trace_check_start(trace_check_t *check, cpu_t *cpu);
+
+/* Compares the state of the CPU with the next entry. On a divergence, prints the entries before it, the registers
+ * that differ and the entries expected after it, and returns FALSE. */
+bool trace_check_step(trace_check_t *check, cpu_t *cpu);
+
+static inline bool trace_check_done(const trace_check_t *check) {
+    return check->index == check->count;
+}
+
+/* Runs the CPU until the end of the log or the first divergence. Returns the number of instructions left unchecked,
+ * 0 when the whole log matched. */
+size_t trace_check_run(trace_check_t *check, cpu_t *cpu);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __TRACE_CHECK_H__ */
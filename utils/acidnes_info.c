@@ -0,0 +1,731 @@
+/* acidnes-info: inspects NES ROMs and maintains an index of a ROM library.
+ *
+ *   acidnes-info info file.nes...              Prints the header of each file (like nes_info.py)
+ *   acidnes-info [-j jobs] [-i index] scan dir...   Scans directories in parallel and updates the index
+ *   acidnes-info [-i index] query crc...       Looks CRCs up in the index, without touching the ROM files
+ *
+ * The index is a flat file of fixed size entries sorted by CRC, followed by a string table holding the paths. It
+ * is mapped and binary searched by queries. Rescans reuse the entries of files whose size and mtime are unchanged.
+ *
+ * A scan replaces the entries under the directories it is given, files gone from them included, and keeps the others
+ * as they are: directories can be scanned one at a time. Paths are compared as given, scan a directory with the same
+ * path each time.
+ */
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cartridge.h"
+#include "crc32.h"
+
+#define INDEX_MAGIC "ACIDIDX"
+#define INDEX_VERSION 1
+#define INDEX_DEFAULT_PATH "acidnes.idx"
+
+enum index_flags {
+    INDEX_VERT_MIRROR = 0x01,
+    INDEX_BATTERY = 0x02,
+    INDEX_TRAINER = 0x04,
+    INDEX_FOUR_SCREEN = 0x08,
+    INDEX_VS_SYSTEM = 0x10,
+    INDEX_NES2 = 0x20
+};
+
+struct index_header_s {
+    char magic[8];
+    uint32_t version;
+    uint32_t nb_entries;
+    uint32_t strings_size;
+    uint32_t reserved;
+};
+typedef struct index_header_s index_header_t;
+
+struct index_entry_s {
+    uint32_t crc; /* PRG + CHR, same as the cartridge cache key */
+    uint32_t prg_crc;
+    uint32_t chr_crc;
+    uint32_t prg_rom_size;
+    uint32_t chr_rom_size;
+    uint32_t prg_ram_size; /* Volatile and battery backed */
+    uint16_t mapper;
+    uint8_t submapper;
+    uint8_t region;
+    uint8_t flags;
+    uint8_t padding[3];
+    int64_t mtime;
+    uint64_t file_size;
+    uint32_t path; /* Offset in the string table */
+    uint32_t reserved;
+};
+typedef struct index_entry_s index_entry_t;
+
+/* A mapped index file */
+struct index_s {
+    void *data;
+    size_t size;
+
+    const index_header_t *header;
+    const index_entry_t *entries;
+    const char *strings;
+};
+typedef struct index_s index_t;
+
+/* A file found while walking the directories */
+struct scan_item_s {
+    char *path;
+    index_entry_t entry;
+    bool valid;
+};
+typedef struct scan_item_s scan_item_t;
+
+struct scan_s {
+    scan_item_t *items;
+    size_t nb_items;
+    size_t capacity;
+
+    /* Next item to process, shared by the workers */
+    size_t next;
+
+    /* Previous index, sorted by path, to skip unchanged files */
+    const index_t *previous;
+    const index_entry_t **previous_by_path;
+
+    size_t nb_hashed;
+    /* Out of memory: the index is left as it is */
+    bool failed;
+};
+typedef struct scan_s scan_t;
+
+static const char *MAPPERS[] = {
+    "NROM",
+    "MMC1",
+    "UxROM",
+    "CNROM",
+    "MMC3",
+    "MMC5",
+    "FFE F4xxx",
+    "AxROM",
+    "FFE F3xxx",
+    "MMC2",
+    "MMC4",
+};
+
+static const char *REGIONS[] = {"NTSC", "PAL", "Multiple", "Dendy"};
+
+static scan_t _scan;
+
+static int cmd_info(int argc, char **argv);
+static int cmd_scan(const char *index_path, int jobs, int argc, char **argv);
+static int cmd_query(const char *index_path, int argc, char **argv);
+
+static bool rom_inspect(const char *path, index_entry_t *entry);
+static void entry_from_cartridge(index_entry_t *entry, const cartridge_t *cart);
+static void print_entry(const char *title, const char *fmt, ...);
+static void print_index_entry(const index_entry_t *entry, const char *path);
+static const char *mapper_name(uint16_t mapper);
+
+static bool index_open(index_t *index, const char *path);
+static void index_close(index_t *index);
+static bool index_write(const char *path, scan_item_t *items, size_t nb_items);
+
+static int scan_collect(const char *path, const struct stat *st, int type, struct FTW *ftw);
+static scan_item_t *scan_add(const char *path);
+static bool scan_covers(const char *path, int argc, char **argv);
+static int previous_path_cmp(const void *a, const void *b);
+static void *scan_worker(void *arg);
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s info file...\n", name);
+    fprintf(stderr, "       %s [-j jobs] [-i index] scan dir...   (replaces the entries under dir..., keeps the others)\n",
+            name);
+    fprintf(stderr, "       %s [-i index] query crc...\n", name);
+}
+
+int main(int argc, char **argv) {
+    const char *index_path = INDEX_DEFAULT_PATH;
+    int jobs = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:j:h")) != -1) {
+        switch (opt) {
+            case 'i':
+                index_path = optarg;
+                break;
+            case 'j':
+                jobs = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind >= argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (jobs < 1) {
+        jobs = 1;
+    }
+
+    if (strcmp(argv[optind], "info") == 0) {
+        return cmd_info(argc - optind - 1, argv + optind + 1);
+    } else if (strcmp(argv[optind], "scan") == 0) {
+        return cmd_scan(index_path, jobs, argc - optind - 1, argv + optind + 1);
+    } else if (strcmp(argv[optind], "query") == 0) {
+        return cmd_query(index_path, argc - optind - 1, argv + optind + 1);
+    }
+
+    usage(argv[0]);
+    return 1;
+}
+
+static int cmd_info(int argc, char **argv) {
+    index_entry_t entry;
+    int errors = 0;
+
+    for (int i = 0; i < argc; i++) {
+        if (!rom_inspect(argv[i], &entry)) {
+            errors++;
+            continue;
+        }
+
+        print_index_entry(&entry, argv[i]);
+
+        if (i < argc - 1) {
+            printf("\n");
+        }
+    }
+
+    return errors > 0 ? 1 : 0;
+}
+
+static int cmd_scan(const char *index_path, int jobs, int argc, char **argv) {
+    index_t previous;
+    bool has_previous;
+    pthread_t *threads;
+    size_t nb_valid = 0, nb_scanned, nb_kept;
+    int nb_threads = 0;
+    int ret = 0;
+
+    memset(&_scan, 0, sizeof(_scan));
+
+    has_previous = index_open(&previous, index_path);
+    if (has_previous) {
+        _scan.previous = &previous;
+        _scan.previous_by_path = malloc(previous.header->nb_entries * sizeof(index_entry_t *));
+        if (_scan.previous_by_path == NULL && previous.header->nb_entries > 0) {
+            fprintf(stderr, "Unable to allocate the previous index\n");
+            index_close(&previous);
+            return 1;
+        }
+
+        for (uint32_t i = 0; i < previous.header->nb_entries; i++) {
+            _scan.previous_by_path[i] = &previous.entries[i];
+        }
+
+        qsort(_scan.previous_by_path, previous.header->nb_entries, sizeof(index_entry_t *), previous_path_cmp);
+    }
+
+    for (int i = 0; i < argc; i++) {
+        if (nftw(argv[i], scan_collect, 64, FTW_PHYS) != 0) {
+            if (!_scan.failed) {
+                perror(argv[i]);
+            }
+            ret = 1;
+        }
+    }
+
+    threads = malloc(jobs * sizeof(pthread_t));
+    for (int i = 0; threads != NULL && i < jobs; i++) {
+        if (pthread_create(&threads[nb_threads], NULL, scan_worker, NULL) != 0) {
+            fprintf(stderr, "Unable to start scan thread %d, scanning with %d\n", i, nb_threads);
+            break;
+        }
+        nb_threads++;
+    }
+
+    /* Alone if no thread could be started */
+    if (nb_threads == 0) {
+        scan_worker(NULL);
+    }
+
+    for (int i = 0; i < nb_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    free(threads);
+
+    /* Entries of the directories not scanned this time */
+    nb_scanned = _scan.nb_items;
+    for (uint32_t i = 0; has_previous && i < previous.header->nb_entries; i++) {
+        const index_entry_t *entry = &previous.entries[i];
+        scan_item_t *item;
+
+        if (scan_covers(previous.strings + entry->path, argc, argv)) {
+            continue;
+        }
+
+        item = scan_add(previous.strings + entry->path);
+        if (item == NULL) {
+            break;
+        }
+        item->entry = *entry;
+        item->valid = TRUE;
+    }
+    nb_kept = _scan.nb_items - nb_scanned;
+
+    for (size_t i = 0; i < _scan.nb_items; i++) {
+        if (_scan.items[i].valid) {
+            nb_valid++;
+        }
+    }
+
+    if (_scan.failed || !index_write(index_path, _scan.items, _scan.nb_items)) {
+        ret = 1;
+    } else {
+        fprintf(stderr, "%s: %zu ROMs indexed (%zu hashed, %zu reused, %zu kept from other directories), "
+                "%zu files skipped\n", index_path, nb_valid, _scan.nb_hashed, nb_valid - nb_kept - _scan.nb_hashed,
+                nb_kept, nb_scanned - (nb_valid - nb_kept));
+    }
+
+    for (size_t i = 0; i < _scan.nb_items; i++) {
+        free(_scan.items[i].path);
+    }
+    free(_scan.items);
+
+    if (has_previous) {
+        free(_scan.previous_by_path);
+        index_close(&previous);
+    }
+
+    return ret;
+}
+
+static int cmd_query(const char *index_path, int argc, char **argv) {
+    index_t index;
+    int missing = 0;
+
+    if (!index_open(&index, index_path)) {
+        return 1;
+    }
+
+    for (int i = 0; i < argc; i++) {
+        uint32_t crc = (uint32_t) strtoul(argv[i], NULL, 16);
+        uint32_t lo = 0, hi = index.header->nb_entries;
+        bool found = FALSE;
+
+        /* Lower bound, several files can have the same contents */
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+
+            if (index.entries[mid].crc < crc) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+
+        for (; lo < index.header->nb_entries && index.entries[lo].crc == crc; lo++) {
+            if (found) {
+                printf("\n");
+            }
+
+            print_index_entry(&index.entries[lo], index.strings + index.entries[lo].path);
+            found = TRUE;
+        }
+
+        if (!found) {
+            fprintf(stderr, "%08x: not found\n", crc);
+            missing++;
+        }
+    }
+
+    index_close(&index);
+
+    return missing > 0 ? 1 : 0;
+}
+
+/* Parses the header and hashes the banks of a ROM file */
+static bool rom_inspect(const char *path, index_entry_t *entry) {
+    int fd;
+    struct stat st;
+    const uint8_t *image;
+    cartridge_t cart;
+    size_t offset;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return FALSE;
+    }
+
+    if (fstat(fd, &st) < 0 || st.st_size < 16) {
+        fprintf(stderr, "Not a valid NES file: %s\n", path);
+        close(fd);
+        return FALSE;
+    }
+
+    image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (image == MAP_FAILED) {
+        perror(path);
+        return FALSE;
+    }
+
+    madvise((void *) image, st.st_size, MADV_SEQUENTIAL);
+
+    memset(&cart, 0, sizeof(cart));
+    if (!cartridge_parse_header(&cart, image)) {
+        fprintf(stderr, "Not a valid NES file: %s\n", path);
+        munmap((void *) image, st.st_size);
+        return FALSE;
+    }
+
+    offset = 16 + (cart.trainer ? 512 : 0);
+    if (offset + cart.prg_rom_size + cart.chr_rom_size > (size_t) st.st_size) {
+        fprintf(stderr, "Truncated NES file: %s\n", path);
+        munmap((void *) image, st.st_size);
+        return FALSE;
+    }
+
+    entry_from_cartridge(entry, &cart);
+
+    entry->prg_crc = crc32_update(0, image + offset, cart.prg_rom_size);
+    entry->chr_crc = crc32_update(0, image + offset + cart.prg_rom_size, cart.chr_rom_size);
+    entry->crc = crc32_update(entry->prg_crc, image + offset + cart.prg_rom_size, cart.chr_rom_size);
+
+    entry->mtime = st.st_mtime;
+    entry->file_size = (uint64_t) st.st_size;
+
+    munmap((void *) image, st.st_size);
+
+    return TRUE;
+}
+
+static void entry_from_cartridge(index_entry_t *entry, const cartridge_t *cart) {
+    memset(entry, 0, sizeof(index_entry_t));
+
+    entry->prg_rom_size = cart->prg_rom_size;
+    entry->chr_rom_size = cart->chr_rom_size;
+    entry->prg_ram_size = cart->prg_ram_size + cart->prg_nvram_size;
+    entry->mapper = cart->mapper_type;
+    entry->submapper = cart->submapper;
+    entry->region = (uint8_t) cart->region;
+
+    entry->flags |= cart->vert_mirror ? INDEX_VERT_MIRROR : 0;
+    entry->flags |= cart->battery_ram ? INDEX_BATTERY : 0;
+    entry->flags |= cart->trainer ? INDEX_TRAINER : 0;
+    entry->flags |= cart->four_screen_vram ? INDEX_FOUR_SCREEN : 0;
+    entry->flags |= cart->vs_system ? INDEX_VS_SYSTEM : 0;
+    entry->flags |= cart->nes2 ? INDEX_NES2 : 0;
+}
+
+static void print_entry(const char *title, const char *fmt, ...) {
+    char label[64];
+    va_list args;
+
+    snprintf(label, sizeof(label), "%s:", title);
+    printf("%-40s", label);
+
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+
+    printf("\n");
+}
+
+static void print_index_entry(const index_entry_t *entry, const char *path) {
+    print_entry("File", "%s", path);
+    print_entry("Format", "%s", entry->flags & INDEX_NES2 ? "NES 2.0" : "iNES");
+    print_entry("PRG ROM", "%u KiB", entry->prg_rom_size / 1024);
+    print_entry("CHR ROM", "%u KiB", entry->chr_rom_size / 1024);
+    print_entry("PRG RAM", "%u KiB", entry->prg_ram_size / 1024);
+
+    if (entry->submapper) {
+        print_entry("Mapper", "%s (%u.%u)", mapper_name(entry->mapper), entry->mapper, entry->submapper);
+    } else {
+        print_entry("Mapper", "%s (%u)", mapper_name(entry->mapper), entry->mapper);
+    }
+
+    print_entry("Mirroring", "%s", entry->flags & INDEX_FOUR_SCREEN ? "Four screen"
+                                   : entry->flags & INDEX_VERT_MIRROR ? "Vertical" : "Horizontal");
+    print_entry("Battery", "%s", entry->flags & INDEX_BATTERY ? "Yes" : "No");
+    print_entry("Trainer", "%s", entry->flags & INDEX_TRAINER ? "Yes" : "No");
+    print_entry("VS-System cartridge", "%s", entry->flags & INDEX_VS_SYSTEM ? "Yes" : "No");
+    print_entry("Region", "%s", REGIONS[entry->region & 0x03]);
+    print_entry("PRG CRC32", "%08x", entry->prg_crc);
+    print_entry("CHR CRC32", "%08x", entry->chr_crc);
+    print_entry("CRC32", "%08x", entry->crc);
+}
+
+static const char *mapper_name(uint16_t mapper) {
+    if (mapper < sizeof(MAPPERS) / sizeof(MAPPERS[0])) {
+        return MAPPERS[mapper];
+    }
+
+    return "Unknown";
+}
+
+static bool index_open(index_t *index, const char *path) {
+    int fd;
+    struct stat st;
+
+    memset(index, 0, sizeof(index_t));
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            perror(path);
+        }
+
+        return FALSE;
+    }
+
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(index_header_t)) {
+        fprintf(stderr, "Not a valid index: %s\n", path);
+        close(fd);
+        return FALSE;
+    }
+
+    index->size = (size_t) st.st_size;
+    index->data = mmap(NULL, index->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (index->data == MAP_FAILED) {
+        perror(path);
+        return FALSE;
+    }
+
+    index->header = index->data;
+    index->entries = (const index_entry_t *) (index->header + 1);
+    index->strings = (const char *) (index->entries + index->header->nb_entries);
+
+    if (memcmp(index->header->magic, INDEX_MAGIC, sizeof(index->header->magic)) != 0
+        || index->header->version != INDEX_VERSION
+        || sizeof(index_header_t) + index->header->nb_entries * sizeof(index_entry_t)
+           + index->header->strings_size > index->size) {
+        fprintf(stderr, "Not a valid index: %s\n", path);
+        munmap(index->data, index->size);
+        return FALSE;
+    }
+
+    /* Every path within the string table, which ends with the last one's terminator */
+    for (uint32_t i = 0; i < index->header->nb_entries; i++) {
+        if (index->entries[i].path >= index->header->strings_size
+            || index->strings[index->header->strings_size - 1] != '\0') {
+            fprintf(stderr, "Not a valid index: %s\n", path);
+            munmap(index->data, index->size);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static void index_close(index_t *index) {
+    munmap(index->data, index->size);
+}
+
+static int index_entry_cmp(const void *a, const void *b) {
+    const scan_item_t *ia = a;
+    const scan_item_t *ib = b;
+
+    if (ia->entry.crc != ib->entry.crc) {
+        return ia->entry.crc < ib->entry.crc ? -1 : 1;
+    }
+
+    return strcmp(ia->path, ib->path);
+}
+
+/* Writes to a temporary file renamed over the index, so readers never see a partial index */
+static bool index_write(const char *path, scan_item_t *items, size_t nb_items) {
+    index_header_t header;
+    char tmp_path[4096];
+    uint32_t strings_size = 0;
+    size_t nb_valid = 0;
+    FILE *f;
+
+    qsort(items, nb_items, sizeof(scan_item_t), index_entry_cmp);
+
+    for (size_t i = 0; i < nb_items; i++) {
+        if (!items[i].valid) {
+            continue;
+        }
+
+        items[i].entry.path = strings_size;
+        strings_size += (uint32_t) strlen(items[i].path) + 1;
+        nb_valid++;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = INDEX_VERSION;
+    header.nb_entries = (uint32_t) nb_valid;
+    header.strings_size = strings_size;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    f = fopen(tmp_path, "wb");
+    if (f == NULL) {
+        perror(tmp_path);
+        return FALSE;
+    }
+
+    fwrite(&header, sizeof(header), 1, f);
+
+    for (size_t i = 0; i < nb_items; i++) {
+        if (items[i].valid) {
+            fwrite(&items[i].entry, sizeof(index_entry_t), 1, f);
+        }
+    }
+
+    for (size_t i = 0; i < nb_items; i++) {
+        if (items[i].valid) {
+            fwrite(items[i].path, strlen(items[i].path) + 1, 1, f);
+        }
+    }
+
+    if (fclose(f) != 0 || rename(tmp_path, path) != 0) {
+        perror(path);
+        unlink(tmp_path);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static int scan_collect(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    size_t len = strlen(path);
+
+    (void) st;
+    (void) ftw;
+
+    if (type != FTW_F || len < 4 || strcasecmp(path + len - 4, ".nes") != 0) {
+        return 0;
+    }
+
+    /* Stops the walk */
+    return scan_add(path) != NULL ? 0 : -1;
+}
+
+static scan_item_t *scan_add(const char *path) {
+    scan_item_t *item;
+
+    if (_scan.nb_items == _scan.capacity) {
+        size_t capacity = _scan.capacity ? _scan.capacity * 2 : 1024;
+        scan_item_t *items = realloc(_scan.items, capacity * sizeof(scan_item_t));
+
+        if (items == NULL) {
+            fprintf(stderr, "Unable to allocate the scan of %s\n", path);
+            _scan.failed = TRUE;
+            return NULL;
+        }
+
+        _scan.items = items;
+        _scan.capacity = capacity;
+    }
+
+    item = &_scan.items[_scan.nb_items];
+    memset(item, 0, sizeof(scan_item_t));
+    item->path = strdup(path);
+    if (item->path == NULL) {
+        fprintf(stderr, "Unable to allocate the scan of %s\n", path);
+        _scan.failed = TRUE;
+        return NULL;
+    }
+
+    _scan.nb_items++;
+    return item;
+}
+
+/* path is dir or under it, for one of the scanned directories */
+static bool scan_covers(const char *path, int argc, char **argv) {
+    for (int i = 0; i < argc; i++) {
+        size_t len = strlen(argv[i]);
+
+        while (len > 1 && argv[i][len - 1] == '/') {
+            len--;
+        }
+
+        if (strncmp(path, argv[i], len) == 0 && (path[len] == '\0' || path[len] == '/' || argv[i][len - 1] == '/')) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static int previous_path_cmp(const void *a, const void *b) {
+    const index_entry_t *ea = *(const index_entry_t **) a;
+    const index_entry_t *eb = *(const index_entry_t **) b;
+
+    return strcmp(_scan.previous->strings + ea->path, _scan.previous->strings + eb->path);
+}
+
+static const index_entry_t *scan_find_previous(const char *path) {
+    const index_t *previous = _scan.previous;
+    uint32_t lo = 0, hi;
+
+    if (previous == NULL) {
+        return NULL;
+    }
+
+    hi = previous->header->nb_entries;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(previous->strings + _scan.previous_by_path[mid]->path, path);
+
+        if (cmp == 0) {
+            return _scan.previous_by_path[mid];
+        } else if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return NULL;
+}
+
+static void *scan_worker(void *arg) {
+    size_t i;
+    struct stat st;
+    const index_entry_t *previous;
+
+    (void) arg;
+
+    while ((i = __atomic_fetch_add(&_scan.next, 1, __ATOMIC_RELAXED)) < _scan.nb_items) {
+        scan_item_t *item = &_scan.items[i];
+
+        previous = scan_find_previous(item->path);
+        if (previous != NULL && stat(item->path, &st) == 0 && previous->mtime == st.st_mtime
+            && previous->file_size == (uint64_t) st.st_size) {
+            item->entry = *previous;
+            item->valid = TRUE;
+            continue;
+        }
+
+        item->valid = rom_inspect(item->path, &item->entry);
+        if (item->valid) {
+            __atomic_fetch_add(&_scan.nb_hashed, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    return NULL;
+}
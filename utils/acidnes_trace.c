@@ -0,0 +1,37 @@
+/* Decodes a binary instruction trace (see src/trace.h) to the nestest log format.
+ *
+ *   acidnes-trace file.trace > file.log
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "trace.h"
+
+int main(int argc, char **argv) {
+    static char out[1 << 16];
+    trace_reader_t *reader;
+    trace_record_t record;
+    uint64_t cycle;
+    char line[96];
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s file.trace\n", argv[0]);
+        return 1;
+    }
+
+    reader = trace_reader_open(argv[1]);
+    if (reader == NULL) {
+        return 1;
+    }
+
+    setvbuf(stdout, out, _IOFBF, sizeof(out));
+
+    while (trace_reader_next(reader, &record, &cycle)) {
+        trace_format(&record, cycle, line, sizeof(line));
+        puts(line);
+    }
+
+    trace_reader_close(reader);
+
+    return 0;
+}
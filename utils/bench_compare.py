@@ -0,0 +1,274 @@
+#! /usr/bin/env python3
+"""Compares a bench run with a baseline run (both written by `bench -j`).
+
+For every workload and metric present in both files, the repetitions are compared with a two-sided Mann-Whitney U
+test. A metric regresses when its median is worse than the baseline's by more than the threshold and the difference
+is significant. Rates (*_per_s) are better higher, times (ns_per_*) lower.
+
+The baseline is recorded on the machine that runs the gate, pinned to a CPU with a fixed governor and no turbo
+(just bench-baseline), and is not committed: a baseline from another machine, or from a run whose clock moved,
+measures the machine and not the code. Runs that bench flagged unstable, or that don't say, fail the comparison
+unless --allow-unstable is given.
+
+Workloads and metrics of the current run missing from the baseline are listed as MISSING: record the baseline again
+when adding workloads.
+
+Exits with 1 if either run is unstable (unless --allow-unstable), if anything regressed, or if anything is missing
+from the baseline (unless --allow-missing).
+
+    bench_compare.py [-t threshold%] [-a alpha] [--allow-unstable] [--allow-missing] baseline.json current.json
+"""
+
+import argparse
+import json
+import math
+import sys
+from dataclasses import dataclass
+from pathlib import Path
+from statistics import median
+from typing import Any
+
+# Exact p-values up to this many repetitions per run, normal approximation above
+EXACT_MAX_SAMPLES = 50
+
+
+@dataclass
+class Comparison:
+    workload: str
+    metric: str
+    unit: str
+    baseline: float | None  # None when the baseline doesn't have it
+    current: float
+    delta: float  # Relative change of the median, positive when better (the gain column)
+    p_value: float
+    status: str
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Compares a bench run with a baseline")
+    parser.add_argument("baseline", type=Path)
+    parser.add_argument("current", type=Path)
+    parser.add_argument(
+        "-t",
+        "--threshold",
+        type=float,
+        default=5.0,
+        help="Change in percent below which nothing is flagged (default: 5)",
+    )
+    parser.add_argument(
+        "-a",
+        "--alpha",
+        type=float,
+        default=0.05,
+        help="Significance level of the test (default: 0.05)",
+    )
+    parser.add_argument(
+        "--allow-unstable",
+        action="store_true",
+        help="Only warn when either run saw the CPU clock change, instead of failing",
+    )
+    parser.add_argument(
+        "--allow-missing",
+        action="store_true",
+        help="Don't fail on workloads or metrics missing from the baseline",
+    )
+    args = parser.parse_args()
+
+    baseline = load(args.baseline)
+    current = load(args.current)
+
+    unstable = False
+    for name, run in (("baseline", baseline), ("current", current)):
+        env = run.get("environment", {})
+        if not env.get("stable", False):
+            unstable = True
+            print(
+                f"{'warning' if args.allow_unstable else 'error'}: {name} run is unstable, the CPU clock varied by "
+                f"{env.get('clock_spread', 0) * 100:.1f}% (turbo: no_turbo={env.get('no_turbo')}, "
+                f"boost={env.get('boost')}, governor: {env.get('governor')})",
+                file=sys.stderr,
+            )
+        if env.get("cpu", -1) < 0:
+            print(f"warning: {name} run was not pinned to a CPU (bench -c)", file=sys.stderr)
+
+    comparisons = compare(baseline, current, args.threshold / 100, args.alpha)
+    print_table(comparisons)
+
+    regressions = [c for c in comparisons if c.status == "REGRESSION"]
+    missing = [c for c in comparisons if c.status == "MISSING"]
+    if regressions:
+        print(f"\n{len(regressions)} regression(s)")
+    if missing:
+        print(f"\n{len(missing)} metric(s) missing from the baseline, record it again")
+    if unstable and not args.allow_unstable:
+        print("\nUnstable run(s): record them again on a pinned CPU with a fixed clock")
+    if regressions or (missing and not args.allow_missing) or (unstable and not args.allow_unstable):
+        sys.exit(1)
+
+
+def load(fp: Path) -> dict[str, Any]:
+    with fp.open() as f:
+        data = json.load(f)
+
+    if data.get("version") != 1:
+        raise ValueError(f"Unsupported bench results version in {fp}: {data.get('version')}")
+
+    return data
+
+
+def compare(
+    baseline: dict[str, Any], current: dict[str, Any], threshold: float, alpha: float
+) -> list[Comparison]:
+    base_results = {r["name"]: r for r in baseline["results"]}
+    comparisons = []
+
+    for result in current["results"]:
+        base = base_results.get(result["name"])
+
+        for metric, values in result["metrics"].items():
+            base_values = base["metrics"].get(metric) if base is not None else None
+            if base_values is None:
+                comparisons.append(
+                    Comparison(
+                        result["name"],
+                        metric,
+                        values["unit"],
+                        None,
+                        median(values["samples"]),
+                        0.0,
+                        1.0,
+                        "MISSING",
+                    )
+                )
+                continue
+
+            base_median = median(base_values["samples"])
+            cur_median = median(values["samples"])
+            higher_is_better = metric.endswith("_per_s")
+
+            delta = (cur_median - base_median) / base_median if base_median else 0.0
+            if not higher_is_better:
+                delta = -delta
+
+            p_value = mann_whitney_u(base_values["samples"], values["samples"])
+
+            status = "ok"
+            if p_value < alpha and abs(delta) > threshold:
+                status = "improved" if delta > 0 else "REGRESSION"
+
+            comparisons.append(
+                Comparison(
+                    result["name"],
+                    metric,
+                    values["unit"],
+                    base_median,
+                    cur_median,
+                    delta,
+                    p_value,
+                    status,
+                )
+            )
+
+    return comparisons
+
+
+def mann_whitney_u(a: list[float], b: list[float]) -> float:
+    """Two-sided p-value of the Mann-Whitney U test, exact for small samples without ties."""
+    n1, n2 = len(a), len(b)
+    if n1 == 0 or n2 == 0:
+        return 1.0
+
+    ranks = rank(a + b)
+    r1 = sum(ranks[:n1])
+    u1 = r1 - n1 * (n1 + 1) / 2
+    u = min(u1, n1 * n2 - u1)
+
+    ties = len(set(a + b)) != n1 + n2
+    if not ties and max(n1, n2) <= EXACT_MAX_SAMPLES:
+        return exact_p_value(n1, n2, u)
+
+    # Normal approximation with tie and continuity corrections
+    n = n1 + n2
+    counts: dict[float, int] = {}
+    for v in a + b:
+        counts[v] = counts.get(v, 0) + 1
+    tie_term = sum(t**3 - t for t in counts.values()) / (n * (n - 1))
+    sigma = math.sqrt(n1 * n2 / 12 * ((n + 1) - tie_term))
+    if sigma == 0:
+        return 1.0
+
+    z = (abs(u1 - n1 * n2 / 2) - 0.5) / sigma
+    return min(1.0, math.erfc(max(z, 0) / math.sqrt(2)))
+
+
+def rank(values: list[float]) -> list[float]:
+    """Ranks from 1, ties get the average of their ranks."""
+    order = sorted(range(len(values)), key=lambda i: values[i])
+    ranks = [0.0] * len(values)
+
+    i = 0
+    while i < len(order):
+        j = i
+        while j + 1 < len(order) and values[order[j + 1]] == values[order[i]]:
+            j += 1
+        for k in range(i, j + 1):
+            ranks[order[k]] = (i + j) / 2 + 1
+        i = j + 1
+
+    return ranks
+
+
+def exact_p_value(n1: int, n2: int, u: float) -> float:
+    """2 * P(U <= u), counting the rank sums of every choice of n1 ranks out of n1 + n2."""
+    n = n1 + n2
+    max_sum = n1 * n
+    # ways[k][s]: number of ways to pick k ranks summing to s
+    ways = [[0] * (max_sum + 1) for _ in range(n1 + 1)]
+    ways[0][0] = 1
+
+    for r in range(1, n + 1):
+        for k in range(min(r, n1), 0, -1):
+            row, prev = ways[k], ways[k - 1]
+            for s in range(max_sum, r - 1, -1):
+                row[s] += prev[s - r]
+
+    offset = n1 * (n1 + 1) // 2
+    total = math.comb(n, n1)
+    extreme = sum(
+        count
+        for s, count in enumerate(ways[n1])
+        if count and min(s - offset, n1 * n2 - (s - offset)) <= u
+    )
+
+    return min(1.0, extreme / total)
+
+
+def print_table(comparisons: list[Comparison]) -> None:
+    print(
+        f"{'workload':24} {'metric':20} {'baseline':>14} {'current':>14} {'gain':>8} {'p':>7}  status"
+    )
+
+    for c in comparisons:
+        if c.baseline is None:
+            print(
+                f"{c.workload:24} {c.metric:20} {'-':>14} {format_value(c.current):>14} {'-':>8} {'-':>7}  "
+                f"{c.status}"
+            )
+            continue
+
+        print(
+            f"{c.workload:24} {c.metric:20} {format_value(c.baseline):>14} {format_value(c.current):>14} "
+            f"{c.delta * 100:+7.1f}% {c.p_value:7.4f}  {c.status}"
+        )
+
+
+def format_value(value: float) -> str:
+    for factor, prefix in ((1e9, "G"), (1e6, "M"), (1e3, "k")):
+        if value >= factor:
+            return f"{value / factor:.2f} {prefix}"
+
+    return f"{value:.2f}"
+
+
+if __name__ == "__main__":
+    main()